@@ -0,0 +1,384 @@
+/*
+ * hf_bench: microbenchmarks for the core hosts file operations.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "../src/export.h"
+#include "../src/hostsfile.h"
+#include "corpus.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Measurements of a single benchmark at a single corpus size. */
+struct bench_result {
+    const char * name;
+    unsigned long long lines;
+    unsigned long long ops;
+    unsigned long long ns;
+    unsigned long long bytes;
+    unsigned long long allocs;
+    unsigned long long alloc_bytes;
+};
+
+/* Everything a benchmark needs to know about its inputs. */
+struct bench_context {
+    unsigned long long lines;
+    char base_path[256];
+    char other_path[256];
+    char subset_path[256];
+    double min_time;
+    unsigned long long max_ops;
+};
+
+typedef void (*bench_function)(struct bench_context *, struct bench_result *);
+
+// clang-format off
+static char * help_message =
+        "hf_bench: benchmark the hosts file operations, reports JSON on stdout.\n"
+        "\n"
+        "\t-n --lines <list>\tComma separated corpus sizes (1K,10K,100K).\n"
+        "\t-t --min-time <sec>\tMinimal measured time per benchmark (0.5).\n"
+        "\t-m --max-ops <count>\tUpper bound of single-entry operations (2000).\n"
+        "\t-f --filter <name>\tOnly run benchmarks containing this string.\n"
+        "\t-T --tmpdir <path>\tWhere to store generated corpora ($TMPDIR).\n";
+// clang-format on
+
+static unsigned long long bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Starts and stops a measured region, accumulating into a result. */
+static unsigned long long bench_start_ns, bench_start_allocs, bench_start_alloc_bytes;
+
+static void bench_start(void)
+{
+    bench_start_allocs = atomic_load(&hf_alloc_stats.count);
+    bench_start_alloc_bytes = atomic_load(&hf_alloc_stats.bytes);
+    bench_start_ns = bench_now();
+}
+
+static void bench_stop(struct bench_result * result, unsigned long long ops)
+{
+    result->ns += bench_now() - bench_start_ns;
+    result->allocs += atomic_load(&hf_alloc_stats.count) - bench_start_allocs;
+    result->alloc_bytes += atomic_load(&hf_alloc_stats.bytes) - bench_start_alloc_bytes;
+    result->ops += ops;
+}
+
+static int bench_done(struct bench_context * context, struct bench_result * result)
+{
+    return result->ns >= context->min_time * 1e9;
+}
+
+static unsigned long long bench_file_size(const char * path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+static void bench_parse(struct bench_context * context, struct bench_result * result)
+{
+    struct hosts_file hosts_file;
+
+    while (!bench_done(context, result)) {
+        bench_start();
+        hosts_file = hosts_file_init(context->base_path);
+        bench_stop(result, 1);
+        hosts_file_free(&hosts_file);
+        result->bytes += bench_file_size(context->base_path);
+    }
+}
+
+/**
+ * Shared body of both export benchmarks.
+ * @param export The exporter to measure.
+ */
+static void bench_export(struct bench_context * context, struct bench_result * result, void (*export)(FILE *, struct hosts_file *))
+{
+    struct hosts_file hosts_file = hosts_file_init(context->base_path);
+    FILE * sink = fopen("/dev/null", "w");
+    FILE * probe = tmpfile();
+    long size;
+
+    /* Determine the output size once, so MB/s reflects bytes produced. */
+    export(probe, &hosts_file);
+    size = ftell(probe);
+    fclose(probe);
+
+    while (!bench_done(context, result)) {
+        bench_start();
+        export(sink, &hosts_file);
+        fflush(sink);
+        bench_stop(result, 1);
+        result->bytes += size;
+    }
+
+    fclose(sink);
+    hosts_file_free(&hosts_file);
+}
+
+static void bench_raw_export(struct bench_context * context, struct bench_result * result)
+{
+    bench_export(context, result, hosts_file_raw_export);
+}
+
+static void bench_human_export(struct bench_context * context, struct bench_result * result)
+{
+    bench_export(context, result, hosts_file_human_export);
+}
+
+static void bench_json_stream(FILE * file, struct hosts_file * hosts_file)
+{
+    export_stream(file, hosts_file, EXPORT_FORMAT_JSON);
+}
+
+static void bench_json_export(struct bench_context * context, struct bench_result * result)
+{
+    bench_export(context, result, bench_json_stream);
+}
+
+static void bench_bin_stream(FILE * file, struct hosts_file * hosts_file)
+{
+    export_stream(file, hosts_file, EXPORT_FORMAT_BIN);
+}
+
+static void bench_bin_export(struct bench_context * context, struct bench_result * result)
+{
+    bench_export(context, result, bench_bin_stream);
+}
+
+static void bench_add(struct bench_context * context, struct bench_result * result)
+{
+    struct hosts_file hosts_file = hosts_file_init(context->base_path);
+    char domain[CORPUS_DOMAIN_MAX];
+    unsigned long long n = 0;
+
+    /*
+     * Every add introduces a new domain: an index probe that misses, then an
+     * append, including the occasional growth of the array and the index.
+     * The index is built by the first add, inside the timed region.
+     */
+    while (!bench_done(context, result) && n < context->max_ops) {
+        corpus_domain(domain, ~0ULL, n++);
+        bench_start();
+        hosts_file_add(&hosts_file, hf_strdup("192.0.2.1"), hf_strdup(domain));
+        bench_stop(result, 1);
+    }
+
+    hosts_file_free(&hosts_file);
+}
+
+static void bench_remove(struct bench_context * context, struct bench_result * result)
+{
+    struct hosts_file hosts_file = hosts_file_init(context->subset_path);
+    unsigned int i = hosts_file.index;
+
+    /* Every entry of the subset is unique, so each removal succeeds. */
+    while (!bench_done(context, result) && result->ops < context->max_ops && i > 0) {
+        if (hosts_file.entries[--i].type != UNION_ELEMENT) {
+            continue;
+        }
+        char * domain = hf_strdup(hosts_file.entries[i].value.map.domain);
+        bench_start();
+        hosts_file_remove(&hosts_file, domain, IP_KIND_NONE);
+        bench_stop(result, 1);
+        free(domain);
+    }
+
+    hosts_file_free(&hosts_file);
+}
+
+/**
+ * Shared body of both set operation benchmarks.
+ * @param path Path of the file whose entries are applied to the base.
+ * @param operation Set operation to measure.
+ */
+static void bench_set_operation(struct bench_context * context, struct bench_result * result, char * path, void (*operation)(struct hosts_file *, struct hosts_file *))
+{
+    struct hosts_file other = hosts_file_init(path);
+    struct hosts_file target;
+
+    while (!bench_done(context, result)) {
+        target = hosts_file_init(context->base_path);
+        bench_start();
+        operation(&target, &other);
+        bench_stop(result, 1);
+        hosts_file_free(&target);
+        result->bytes += bench_file_size(path);
+    }
+
+    hosts_file_free(&other);
+}
+
+static void bench_merge(struct bench_context * context, struct bench_result * result)
+{
+    bench_set_operation(context, result, context->other_path, hosts_file_merge);
+}
+
+static void bench_delete(struct bench_context * context, struct bench_result * result)
+{
+    /* The other file must be a subset, since deleting a missing entry is fatal. */
+    bench_set_operation(context, result, context->subset_path, hosts_file_delete);
+}
+
+// clang-format off
+static const struct {
+    const char * name;
+    bench_function function;
+} benchmarks[] = {
+    {"parse",        bench_parse       },
+    {"add",          bench_add         },
+    {"remove",       bench_remove      },
+    {"merge",        bench_merge       },
+    {"delete",       bench_delete      },
+    {"raw_export",   bench_raw_export  },
+    {"human_export", bench_human_export},
+    {"json_export",  bench_json_export },
+    {"bin_export",   bench_bin_export  },
+};
+// clang-format on
+
+/**
+ * Writes a corpus to disk.
+ * @param path Target path.
+ * @param params Shape of the corpus.
+ */
+static void bench_generate(const char * path, struct corpus_params * params)
+{
+    FILE * file = fopen(path, "w");
+
+    if (!file) {
+        perror("hf_bench");
+        exit(EXIT_FAILURE);
+    }
+
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    corpus_generate(file, params);
+    fclose(file);
+}
+
+static void bench_print(struct bench_result * result, int first)
+{
+    double ops = result->ops ? (double)result->ops : 1;
+
+    printf("%s\n    {\"name\": \"%s\", \"lines\": %llu, \"iterations\": %llu, \"ns_per_op\": %.1f, ",
+        first ? "" : ",", result->name, result->lines, result->ops, result->ns / ops);
+    if (result->bytes && result->ns) {
+        printf("\"mb_per_s\": %.2f, ", (result->bytes / 1e6) / (result->ns / 1e9));
+    } else {
+        printf("\"mb_per_s\": null, ");
+    }
+    printf("\"allocs_per_op\": %.2f, \"alloc_bytes_per_op\": %.1f}", result->allocs / ops, result->alloc_bytes / ops);
+}
+
+int main(int argc, char ** argv)
+{
+    struct bench_context context = { .min_time = 0.5, .max_ops = 2000 };
+    struct bench_result result;
+    struct corpus_params params = CORPUS_PARAMS_DEFAULT;
+    char * sizes = "1K,10K,100K";
+    char * filter = NULL;
+    char * tmpdir = getenv("TMPDIR");
+    char * size;
+    int c, first = 1;
+
+    // clang-format off
+    struct option long_options[] = {
+        {"lines",    required_argument, NULL, 'n'},
+        {"min-time", required_argument, NULL, 't'},
+        {"max-ops",  required_argument, NULL, 'm'},
+        {"filter",   required_argument, NULL, 'f'},
+        {"tmpdir",   required_argument, NULL, 'T'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL,       0,                 NULL, 0  }
+    };
+    // clang-format on
+
+    while ((c = getopt_long(argc, argv, "n:t:m:f:T:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'n':
+                sizes = optarg;
+                break;
+            case 't':
+                context.min_time = strtod(optarg, NULL);
+                break;
+            case 'm':
+                context.max_ops = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'T':
+                tmpdir = optarg;
+                break;
+            case 'h':
+                printf("%s", help_message);
+                return EXIT_SUCCESS;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (tmpdir == NULL) {
+        tmpdir = "/tmp";
+    }
+
+    printf("{\"program\": \"%s\", \"version\": \"%s\", \"results\": [", PROGRAM_NAME, PROGRAM_VERSION);
+
+    sizes = strdup(sizes);
+    for (size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+        context.lines = strtoull(size, &size, 10);
+        context.lines *= *size == 'K' || *size == 'k' ? 1000 : *size == 'M' || *size == 'm' ? 1000000 : 1;
+
+        snprintf(context.base_path, sizeof(context.base_path), "%s/hf_bench.%d.base", tmpdir, getpid());
+        snprintf(context.other_path, sizeof(context.other_path), "%s/hf_bench.%d.other", tmpdir, getpid());
+        snprintf(context.subset_path, sizeof(context.subset_path), "%s/hf_bench.%d.subset", tmpdir, getpid());
+
+        /*
+         * The subset shares its seed with the base and is free of duplicates,
+         * which makes it a prefix of the base that can be deleted without
+         * ever hitting a missing entry.
+         */
+        params.lines = context.lines;
+        params.duplicate_ratio = 0;
+        bench_generate(context.base_path, &params);
+        params.lines = context.lines / 10 ? context.lines / 10 : 1;
+        bench_generate(context.subset_path, &params);
+        params.seed = ~params.seed;
+        bench_generate(context.other_path, &params);
+        params = (struct corpus_params)CORPUS_PARAMS_DEFAULT;
+
+        for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+            if (filter && !strstr(benchmarks[i].name, filter)) {
+                continue;
+            }
+            memset(&result, 0, sizeof(result));
+            result.name = benchmarks[i].name;
+            result.lines = context.lines;
+            benchmarks[i].function(&context, &result);
+            bench_print(&result, first);
+            first = 0;
+            fflush(stdout);
+        }
+
+        unlink(context.base_path);
+        unlink(context.other_path);
+        unlink(context.subset_path);
+    }
+
+    printf("\n]}\n");
+    free(sizes);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/*
+ * Synthetic hosts file generator shared by hf-gen and hf_bench.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "corpus.h"
+
+#include <string.h>
+
+/* Building blocks for domains which look somewhat like the real thing. */
+static const char * prefixes[] = {
+    "ads", "track", "metrics", "cdn", "static", "api", "pixel", "stats",
+    "telemetry", "beacon", "img", "mail", "www", "login", "push", "sync",
+};
+
+static const char * syllables[] = {
+    "lo", "ra", "ven", "tik", "mo", "sa", "qu", "ell", "dor", "pix",
+    "an", "ko", "mi", "zu", "ber", "tal", "wo", "ne", "ix", "fa",
+};
+
+static const char * tlds[] = {
+    "com", "net", "org", "io", "de", "co.uk", "info", "biz", "xyz", "be",
+};
+
+/* Mimics the header shipped with most operating systems. */
+static const char * header[] = {
+    "##\n",
+    "# Host Database\n",
+    "#\n",
+    "# localhost is used to configure the loopback interface\n",
+    "# when the system is booting.  Do not change this entry.\n",
+    "##\n",
+    "127.0.0.1\tlocalhost\n",
+    "255.255.255.255\tbroadcasthost\n",
+    "::1             localhost\n",
+};
+
+#define LENGTH(x) (sizeof(x) / sizeof((x)[0]))
+
+/**
+ * SplitMix64, good enough for synthetic data and trivially seekable.
+ * @param state Generator state, advanced in place.
+ * @return The next pseudo-random number.
+ */
+static uint64_t corpus_next(uint64_t * state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double corpus_uniform(uint64_t * state)
+{
+    return (double)(corpus_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static char * corpus_append(char * cursor, const char * string)
+{
+    size_t length = strlen(string);
+    memcpy(cursor, string, length);
+    return cursor + length;
+}
+
+int corpus_domain(char * buffer, uint64_t seed, unsigned long long n)
+{
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    uint64_t state = seed ^ (n * 0xd1342543de82ef95ULL);
+    char * cursor = buffer;
+    char reversed[16];
+    int length = 0;
+
+    cursor = corpus_append(cursor, prefixes[corpus_next(&state) % LENGTH(prefixes)]);
+    *cursor++ = '-';
+
+    /* The entry number keeps every domain unique. */
+    do {
+        reversed[length++] = digits[n % 36];
+        n /= 36;
+    } while (n);
+    while (length) {
+        *cursor++ = reversed[--length];
+    }
+    *cursor++ = '.';
+
+    for (int i = 1 + (int)(corpus_next(&state) % 3); i > 0; --i) {
+        cursor = corpus_append(cursor, syllables[corpus_next(&state) % LENGTH(syllables)]);
+    }
+    *cursor++ = '.';
+
+    cursor = corpus_append(cursor, tlds[corpus_next(&state) % LENGTH(tlds)]);
+    *cursor = '\0';
+
+    return (int)(cursor - buffer);
+}
+
+/**
+ * Writes a random IP address of the given family.
+ * @param file Target stream.
+ * @param state Generator state.
+ * @param ipv6 Non-zero for an IPv6 address.
+ * @return The amount of bytes written.
+ */
+static int corpus_ip(FILE * file, uint64_t * state, int ipv6)
+{
+    uint64_t r = corpus_next(state);
+
+    /* Blocklists overwhelmingly map onto the unspecified address. */
+    if ((r & 0xff) < 192) {
+        return fputs(ipv6 ? "::" : "0.0.0.0", file) == EOF ? 0 : (ipv6 ? 2 : 7);
+    } else if (ipv6) {
+        return fprintf(file, "fd00::%x:%x", (unsigned)(r >> 16) & 0xffff, (unsigned)(r >> 32) & 0xffff);
+    } else {
+        return fprintf(file, "10.%u.%u.%u", (unsigned)(r >> 8) & 0xff, (unsigned)(r >> 16) & 0xff, (unsigned)(r >> 24) & 0xff);
+    }
+}
+
+unsigned long long corpus_generate(FILE * file, const struct corpus_params * params)
+{
+    char domain[CORPUS_DOMAIN_MAX];
+    unsigned long long written = 0, entries = 0, line = 0;
+    uint64_t state = params->seed, address, replay;
+    unsigned int aliases;
+    int length, ipv6;
+
+    for (; line < params->lines && line < LENGTH(header); ++line) {
+        written += fputs(header[line], file) == EOF ? 0 : strlen(header[line]);
+    }
+
+    for (; line < params->lines; ++line) {
+        if (corpus_uniform(&state) < params->comment_ratio) {
+            if (corpus_next(&state) & 1) {
+                written += fputs("\n", file) == EOF ? 0 : 1;
+            } else {
+                length = fprintf(file, "# Section %llu, imported from upstream list\n", line);
+                written += length > 0 ? length : 0;
+            }
+            continue;
+        }
+
+        /* Duplicates reuse the domain of an earlier entry, possibly under another address. */
+        if (entries && corpus_uniform(&state) < params->duplicate_ratio) {
+            length = corpus_domain(domain, params->seed, corpus_next(&state) % entries);
+        } else {
+            length = corpus_domain(domain, params->seed, entries++);
+        }
+
+        ipv6 = corpus_uniform(&state) < params->ipv6_ratio;
+        address = state;
+        written += corpus_ip(file, &state, ipv6);
+        written += fputs((corpus_next(&state) & 3) ? "\t" : " ", file) == EOF ? 0 : 1;
+        written += fputs(domain, file) == EOF ? 0 : length;
+        written += fputs("\n", file) == EOF ? 0 : 1;
+
+        /* hf reads a single domain per line, so aliases get lines of their own under the same address. */
+        if (params->max_aliases && corpus_uniform(&state) < params->alias_ratio) {
+            aliases = 1 + (unsigned int)(corpus_next(&state) % params->max_aliases);
+            for (unsigned int i = 0; i < aliases && line + 1 < params->lines; ++i, ++line) {
+                replay = address;
+                written += corpus_ip(file, &replay, ipv6);
+                length = fprintf(file, "\talias%u.%s\n", i, domain);
+                written += length > 0 ? length : 0;
+            }
+        }
+    }
+
+    return written;
+}
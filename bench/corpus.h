@@ -0,0 +1,54 @@
+/*
+ * Synthetic hosts file generator shared by hf-gen and hf_bench.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Knobs which shape the generated file. Ratios are in the range [0, 1]. */
+struct corpus_params {
+    unsigned long long lines;
+    double ipv6_ratio;
+    double comment_ratio;
+    double duplicate_ratio;
+    double alias_ratio;
+    unsigned int max_aliases;
+    uint64_t seed;
+};
+
+#define CORPUS_PARAMS_DEFAULT_SEED 0x5eed
+
+/* Defaults roughly matching a public blocklist with a hand-edited header. */
+#define CORPUS_PARAMS_DEFAULT                                                   \
+    {                                                                           \
+        .lines = 10000, .ipv6_ratio = 0.2, .comment_ratio = 0.05,               \
+        .duplicate_ratio = 0.02, .alias_ratio = 0.05, .max_aliases = 3,         \
+        .seed = CORPUS_PARAMS_DEFAULT_SEED                                      \
+    }
+
+/**
+ * Writes a hosts file with exactly params->lines lines to a stream.
+ * @param file Target stream.
+ * @param params Shape of the generated file.
+ * @return The amount of bytes written.
+ */
+unsigned long long corpus_generate(FILE * file, const struct corpus_params * params);
+
+/**
+ * Writes the domain which corpus_generate assigns to a given entry number.
+ * @param buffer Target buffer, at least CORPUS_DOMAIN_MAX bytes long.
+ * @param seed Seed of the corpus.
+ * @param n Entry number.
+ * @return The length of the domain.
+ */
+int corpus_domain(char * buffer, uint64_t seed, unsigned long long n);
+
+#define CORPUS_DOMAIN_MAX 96
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * hf-gen: writes realistic synthetic hosts files for benchmarking.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "corpus.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// clang-format off
+static char * help_message =
+        "hf-gen: generate synthetic hosts files.\n"
+        "\n"
+        "\t-n --lines <count>\t\tAmount of lines, accepts K and M suffixes (10K).\n"
+        "\t-6 --ipv6-ratio <ratio>\t\tFraction of IPv6 entries (0.2).\n"
+        "\t-c --comment-ratio <ratio>\tFraction of comment and blank lines (0.05).\n"
+        "\t-D --duplicate-ratio <ratio>\tFraction of entries reusing a domain (0.02).\n"
+        "\t-A --alias-ratio <ratio>\tFraction of entries followed by aliases (0.05).\n"
+        "\t-m --max-aliases <count>\tUpper bound of aliases per entry (3).\n"
+        "\t-s --seed <seed>\t\tSeed for the generator.\n"
+        "\t-o --output <path>\t\tWrite to a file instead of stdout.\n";
+// clang-format on
+
+/**
+ * Parses a count such as 1000, 10K or 100M.
+ * @param string The textual representation.
+ * @return The count, or exits on malformed input.
+ */
+static unsigned long long parse_count(const char * string)
+{
+    char * end;
+    unsigned long long count = strtoull(string, &end, 10);
+
+    switch (*end) {
+        case '\0':
+            return count;
+        case 'k':
+        case 'K':
+            return count * 1000;
+        case 'm':
+        case 'M':
+            return count * 1000000;
+        default:
+            fprintf(stderr, "hf-gen: invalid count '%s'.\n", string);
+            exit(EXIT_FAILURE);
+    }
+}
+
+static double parse_ratio(const char * string)
+{
+    char * end;
+    double ratio = strtod(string, &end);
+
+    if (*end != '\0' || ratio < 0 || ratio > 1) {
+        fprintf(stderr, "hf-gen: invalid ratio '%s'.\n", string);
+        exit(EXIT_FAILURE);
+    }
+
+    return ratio;
+}
+
+int main(int argc, char ** argv)
+{
+    struct corpus_params params = CORPUS_PARAMS_DEFAULT;
+    FILE * file = stdout;
+    int c;
+
+    // clang-format off
+    struct option long_options[] = {
+        {"lines",           required_argument, NULL, 'n'},
+        {"ipv6-ratio",      required_argument, NULL, '6'},
+        {"comment-ratio",   required_argument, NULL, 'c'},
+        {"duplicate-ratio", required_argument, NULL, 'D'},
+        {"alias-ratio",     required_argument, NULL, 'A'},
+        {"max-aliases",     required_argument, NULL, 'm'},
+        {"seed",            required_argument, NULL, 's'},
+        {"output",          required_argument, NULL, 'o'},
+        {"help",            no_argument,       NULL, 'h'},
+        {NULL,              0,                 NULL, 0  }
+    };
+    // clang-format on
+
+    while ((c = getopt_long(argc, argv, "n:6:c:D:A:m:s:o:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'n':
+                params.lines = parse_count(optarg);
+                break;
+            case '6':
+                params.ipv6_ratio = parse_ratio(optarg);
+                break;
+            case 'c':
+                params.comment_ratio = parse_ratio(optarg);
+                break;
+            case 'D':
+                params.duplicate_ratio = parse_ratio(optarg);
+                break;
+            case 'A':
+                params.alias_ratio = parse_ratio(optarg);
+                break;
+            case 'm':
+                params.max_aliases = (unsigned int)parse_count(optarg);
+                break;
+            case 's':
+                params.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'o':
+                if (!(file = fopen(optarg, "w"))) {
+                    perror("hf-gen");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                printf("%s", help_message);
+                return EXIT_SUCCESS;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    /* A large stdio buffer keeps multi-gigabyte corpora from being syscall bound. */
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    corpus_generate(file, &params);
+
+    if (fclose(file) != 0) {
+        perror("hf-gen");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
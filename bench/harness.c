@@ -0,0 +1,421 @@
+/*
+ * hf_harness: end-to-end latency and scaling measurements of the hf binary.
+ *
+ * Every scenario runs hf as a whole process against a generated corpus on a
+ * tmpfs, so the numbers include process start-up, parsing and the final
+ * write. Timed runs are untraced; a single additional run per scenario is
+ * traced with ptrace to count syscalls and bytes written.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "corpus.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HARNESS_MAX_SIZES 16
+#define HARNESS_MAX_ARGS 8
+
+/* A single hf invocation measured at every corpus size. */
+struct scenario {
+    const char * name;
+    int mutates;
+    const char * args[HARNESS_MAX_ARGS];
+};
+
+/* Placeholders substituted by harness_arguments. */
+#define ARG_FILE "{file}"
+#define ARG_OTHER "{other}"
+#define ARG_PRESENT "{present}"
+
+// clang-format off
+static const struct scenario scenarios[] = {
+    {"list",   0, {"-f", ARG_FILE, "-l", "--raw", NULL}},
+    {"add",    1, {"-f", ARG_FILE, "-a", "harness.example@192.0.2.1", NULL}},
+    {"remove", 1, {"-f", ARG_FILE, "-r", ARG_PRESENT, NULL}},
+    {"import", 1, {"-f", ARG_FILE, "-i", ARG_OTHER, NULL}},
+};
+// clang-format on
+
+/* Everything measured for one scenario at one size. */
+struct measurement {
+    unsigned long long lines;
+    double * wall;
+    long peak_rss_kb;
+    long syscalls;
+    long long bytes_written;
+    int status;
+};
+
+// clang-format off
+static char * help_message =
+        "hf_harness: time whole hf processes at growing file sizes, reports JSON.\n"
+        "\n"
+        "\t-b --binary <path>\tThe hf binary to run (next to this program).\n"
+        "\t-n --lines <list>\tComma separated corpus sizes (1K,10K,100K).\n"
+        "\t-r --repetitions <n>\tTimed runs per scenario and size (25).\n"
+        "\t-s --scenario <name>\tOnly run list, add, remove or import.\n"
+        "\t-T --tmpdir <path>\tWhere corpora live, should be a tmpfs (/dev/shm).\n";
+// clang-format on
+
+static double harness_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long harness_count(const char * string)
+{
+    char * end;
+    unsigned long long count = strtoull(string, &end, 10);
+    return count * (*end == 'K' || *end == 'k' ? 1000 : *end == 'M' || *end == 'm' ? 1000000 : 1);
+}
+
+static void harness_generate(const char * path, struct corpus_params * params)
+{
+    FILE * file = fopen(path, "w");
+
+    if (!file) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    corpus_generate(file, params);
+    fclose(file);
+}
+
+/**
+ * Copies a file, used to give every mutating run a pristine input.
+ * @param from Source path.
+ * @param to Destination path, truncated first.
+ */
+static void harness_copy(const char * from, const char * to)
+{
+    char buffer[1 << 16];
+    ssize_t n;
+    int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (in < 0 || out < 0) {
+        perror("hf_harness");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, n) != n) {
+            perror("hf_harness");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    close(in);
+    close(out);
+}
+
+/**
+ * Builds the argument vector of a scenario.
+ * @param argv Output vector, HARNESS_MAX_ARGS + 1 long.
+ */
+static void harness_arguments(const char ** argv, const char * binary, const struct scenario * scenario, const char * file, const char * other, const char * present)
+{
+    int i;
+
+    argv[0] = binary;
+    for (i = 0; scenario->args[i]; ++i) {
+        if (strcmp(scenario->args[i], ARG_FILE) == 0) {
+            argv[i + 1] = file;
+        } else if (strcmp(scenario->args[i], ARG_OTHER) == 0) {
+            argv[i + 1] = other;
+        } else if (strcmp(scenario->args[i], ARG_PRESENT) == 0) {
+            argv[i + 1] = present;
+        } else {
+            argv[i + 1] = scenario->args[i];
+        }
+    }
+    argv[i + 1] = NULL;
+}
+
+/**
+ * Forks and executes hf with stdout discarded.
+ * @param traced Non-zero to stop the child under ptrace before exec.
+ * @return The pid of the child.
+ */
+static pid_t harness_spawn(const char ** argv, int traced)
+{
+    pid_t pid = fork();
+    int null;
+
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execv(argv[0], (char * const *)argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+/**
+ * Reads the wchar counter of a process, which includes writes to pipes and
+ * /dev/null unlike write_bytes.
+ */
+static long long harness_bytes_written(pid_t pid)
+{
+    char path[64], line[128];
+    long long bytes = -1;
+    FILE * file;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if (!(file = fopen(path, "r"))) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "wchar: %lld", &bytes) == 1) {
+            break;
+        }
+    }
+
+    fclose(file);
+    return bytes;
+}
+
+/**
+ * Runs a process to completion under ptrace, counting syscall entries. The
+ * byte counter is sampled at the exit event, while /proc is still readable.
+ */
+static void harness_trace(const char ** argv, struct measurement * measurement)
+{
+    pid_t pid = harness_spawn(argv, 1);
+    int status, entering = 1, signal = 0;
+
+    measurement->syscalls = 0;
+    measurement->bytes_written = -1;
+
+    waitpid(pid, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXIT | PTRACE_O_EXITKILL));
+
+    while (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)signal) == 0) {
+        if (waitpid(pid, &status, 0) < 0 || WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+
+        signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            measurement->syscalls += entering;
+            entering = !entering;
+        } else if (status >> 8 == (SIGTRAP | (PTRACE_EVENT_EXIT << 8))) {
+            measurement->bytes_written = harness_bytes_written(pid);
+        } else if (WSTOPSIG(status) != SIGTRAP) {
+            signal = WSTOPSIG(status);
+        }
+    }
+
+    /* The traced run may still be winding down; reap it. */
+    while (waitpid(pid, &status, 0) > 0 && !WIFEXITED(status) && !WIFSIGNALED(status)) {
+        ptrace(PTRACE_CONT, pid, NULL, NULL);
+    }
+}
+
+static int harness_compare(const void * a, const void * b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double harness_percentile(double * sorted, int n, double p)
+{
+    int index = (int)ceil(p * n) - 1;
+    return sorted[index < 0 ? 0 : index >= n ? n - 1 : index];
+}
+
+/**
+ * Least squares slope of log(time) against log(lines). An exponent near one
+ * means linear scaling, near two means something is quadratic. It takes two
+ * distinct sizes; NAN otherwise.
+ */
+static double harness_exponent(struct measurement * measurements, int sizes, int repetitions)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, spread;
+
+    for (int i = 0; i < sizes; ++i) {
+        x = log((double)measurements[i].lines);
+        y = log(harness_percentile(measurements[i].wall, repetitions, 0.5));
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    spread = sizes * sxx - sx * sx;
+    return spread > 0 ? (sizes * sxy - sx * sy) / spread : NAN;
+}
+
+int main(int argc, char ** argv)
+{
+    char binary[PATH_MAX], base[PATH_MAX], work[PATH_MAX], other[PATH_MAX], present[CORPUS_DOMAIN_MAX];
+    const char * arguments[HARNESS_MAX_ARGS + 1];
+    struct measurement measurements[HARNESS_MAX_SIZES];
+    struct corpus_params params = CORPUS_PARAMS_DEFAULT;
+    struct rusage usage;
+    char *sizes = "1K,10K,100K", *list, *tmpdir = "/dev/shm", *only = NULL, *size;
+    int c, status, repetitions = 25, count = 0, first = 1;
+    double start, exponent;
+    pid_t pid;
+
+    // clang-format off
+    struct option long_options[] = {
+        {"binary",      required_argument, NULL, 'b'},
+        {"lines",       required_argument, NULL, 'n'},
+        {"repetitions", required_argument, NULL, 'r'},
+        {"scenario",    required_argument, NULL, 's'},
+        {"tmpdir",      required_argument, NULL, 'T'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL, 0  }
+    };
+    // clang-format on
+
+    snprintf(binary, sizeof(binary), "%s/hf", dirname(strdup(argv[0])));
+
+    while ((c = getopt_long(argc, argv, "b:n:r:s:T:h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'b':
+                snprintf(binary, sizeof(binary), "%s", optarg);
+                break;
+            case 'n':
+                sizes = optarg;
+                break;
+            case 'r':
+                repetitions = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 's':
+                only = optarg;
+                break;
+            case 'T':
+                tmpdir = optarg;
+                break;
+            case 'h':
+                printf("%s", help_message);
+                return EXIT_SUCCESS;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (access(binary, X_OK) != 0) {
+        fprintf(stderr, "hf_harness: cannot execute %s, pass --binary.\n", binary);
+        return EXIT_FAILURE;
+    }
+
+    snprintf(base, sizeof(base), "%s/hf_harness.%d.base", tmpdir, getpid());
+    snprintf(work, sizeof(work), "%s/hf_harness.%d.work", tmpdir, getpid());
+    snprintf(other, sizeof(other), "%s/hf_harness.%d.other", tmpdir, getpid());
+
+    /* The corpus is duplicate free, so its first entry is always removable. */
+    params.duplicate_ratio = 0;
+    corpus_domain(present, params.seed, 0);
+
+    printf("{\"binary\": \"%s\", \"repetitions\": %d, \"scenarios\": [", binary, repetitions);
+
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+        const struct scenario * scenario = &scenarios[s];
+
+        if (only && strcmp(only, scenario->name) != 0) {
+            continue;
+        }
+
+        count = 0;
+        list = strdup(sizes);
+        for (size = strtok(list, ","); size && count < HARNESS_MAX_SIZES; size = strtok(NULL, ","), ++count) {
+            struct measurement * m = &measurements[count];
+
+            m->lines = harness_count(size);
+            m->wall = calloc(repetitions, sizeof(double));
+            m->peak_rss_kb = 0;
+            m->status = 0;
+
+            params.lines = m->lines;
+            params.seed = CORPUS_PARAMS_DEFAULT_SEED;
+            harness_generate(base, &params);
+            params.lines = m->lines / 10 ? m->lines / 10 : 1;
+            params.seed = ~params.seed;
+            harness_generate(other, &params);
+
+            harness_arguments(arguments, binary, scenario, scenario->mutates ? work : base, other, present);
+
+            for (int r = 0; r < repetitions; ++r) {
+                if (scenario->mutates) {
+                    harness_copy(base, work);
+                }
+                start = harness_now();
+                pid = harness_spawn(arguments, 0);
+                wait4(pid, &status, 0, &usage);
+                m->wall[r] = harness_now() - start;
+                m->peak_rss_kb = usage.ru_maxrss > m->peak_rss_kb ? usage.ru_maxrss : m->peak_rss_kb;
+                m->status |= WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
+
+            if (scenario->mutates) {
+                harness_copy(base, work);
+            }
+            harness_trace(arguments, m);
+            qsort(m->wall, repetitions, sizeof(double), harness_compare);
+
+            fprintf(stderr, "%-8s %10llu lines  median %9.3f ms  p90 %9.3f ms  rss %8ld KiB  syscalls %7ld\n",
+                scenario->name, m->lines, harness_percentile(m->wall, repetitions, 0.5) * 1e3,
+                harness_percentile(m->wall, repetitions, 0.9) * 1e3, m->peak_rss_kb, m->syscalls);
+        }
+        free(list);
+
+        /* JSON has no NaN. */
+        exponent = harness_exponent(measurements, count, repetitions);
+        printf("%s\n  {\"name\": \"%s\", \"exponent\": ", first ? "" : ",", scenario->name);
+        if (isnan(exponent)) {
+            printf("null, \"points\": [");
+        } else {
+            printf("%.3f, \"points\": [", exponent);
+        }
+        for (int i = 0; i < count; ++i) {
+            struct measurement * m = &measurements[i];
+            printf("%s\n    {\"lines\": %llu, \"wall_ms\": {\"min\": %.3f, \"median\": %.3f, \"p90\": %.3f, \"max\": %.3f}, "
+                   "\"peak_rss_kb\": %ld, \"syscalls\": %ld, \"bytes_written\": %lld, \"exit_status\": %d}",
+                i ? "," : "", m->lines, m->wall[0] * 1e3, harness_percentile(m->wall, repetitions, 0.5) * 1e3,
+                harness_percentile(m->wall, repetitions, 0.9) * 1e3, m->wall[repetitions - 1] * 1e3,
+                m->peak_rss_kb, m->syscalls, m->bytes_written, m->status);
+            free(m->wall);
+        }
+        printf("\n  ]}");
+        first = 0;
+    }
+
+    printf("\n]}\n");
+
+    unlink(base);
+    unlink(work);
+    unlink(other);
+
+    return EXIT_SUCCESS;
+}
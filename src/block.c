@@ -0,0 +1,246 @@
+/*
+ * Managed blocks.
+ *
+ * Each automation owns a named block of the hosts file and regenerates it
+ * from a source of its own. Only the block is ever rewritten: the bytes
+ * before and after it are copied as they are, by hosts_file_splice, or not
+ * touched at all when the block sits at the end of the file. The fingerprint
+ * in the begin marker tells whether the regenerated block differs from the
+ * one in place, in which case the file isn't written at all. Blocks that
+ * were edited by hand no longer match their fingerprint and are regenerated.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "block.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Where a block is in its file; without one, it is appended at the end. */
+struct block_span {
+    size_t begin;
+    size_t content;
+    size_t end;
+    size_t after;
+    uint64_t recorded;
+    unsigned int lines;
+    int found;
+};
+
+/* The entries of the source, as the lines of a block. */
+struct block_content {
+    struct writer w;
+    unsigned int entries;
+};
+
+/**
+ * Checks whether a line is a marker of a block.
+ * @param line The line.
+ * @param length Its length, without newline.
+ * @param marker BLOCK_BEGIN or BLOCK_END.
+ * @param name Name of the block.
+ * @return What follows the name on the line, or NULL if it isn't the marker.
+ */
+static const char * block_marker(const char * line, size_t length, const char * marker, const char * name)
+{
+    size_t marker_length = strlen(marker), name_length = strlen(name);
+
+    if (length < marker_length + name_length || memcmp(line, marker, marker_length) != 0 || memcmp(line + marker_length, name, name_length) != 0) {
+        return NULL;
+    }
+    line += marker_length + name_length;
+    length -= marker_length + name_length;
+
+    return length == 0 || *line == ' ' || *line == '\t' || *line == '\r' ? line : NULL;
+}
+
+/**
+ * Locates a block and counts the lines outside of it.
+ * @param span Receives the location.
+ * @param data Contents of the file.
+ * @param size Size of the file.
+ * @param name Name of the block.
+ */
+static void block_find(struct block_span * span, const char * data, size_t size, const char * name)
+{
+    const char *line, *newline, *rest;
+    size_t offset, length;
+    char digits[17];
+    int inside = 0;
+
+    memset(span, 0, sizeof(*span));
+    for (offset = 0; offset < size; offset += length + (newline != NULL)) {
+        line = data + offset;
+        newline = memchr(line, '\n', size - offset);
+        length = newline ? (size_t)(newline - line) : size - offset;
+        span->lines += !inside;
+
+        if (*line != '#' || (span->found && !inside)) {
+            continue;
+        }
+        if (!span->found && (rest = block_marker(line, length, BLOCK_BEGIN, name))) {
+            span->found = 1;
+            inside = 1;
+            span->begin = offset;
+            span->content = offset + length + (newline != NULL);
+            --span->lines;
+
+            /* A missing or malformed fingerprint never matches. */
+            rest += strspn(rest, " \t");
+            if (line + length - rest >= 16) {
+                memcpy(digits, rest, 16);
+                digits[16] = '\0';
+                span->recorded = strtoull(digits, NULL, 16);
+            }
+        } else if (inside && block_marker(line, length, BLOCK_END, name)) {
+            inside = 0;
+            span->end = offset;
+            span->after = offset + length + (newline != NULL);
+        }
+    }
+
+    if (inside) {
+        fprintf(stderr, PROGRAM_NAME ": Block '%s' has no end marker.\n", name);
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    if (!span->found) {
+        span->begin = span->content = span->end = span->after = size;
+    }
+}
+
+static int block_collect(void * context, const struct hosts_file_token * token, unsigned long long line)
+{
+    struct block_content * content = context;
+
+    (void)line;
+    writer_bytes(&content->w, token->ip, token->ip_length);
+    writer_char(&content->w, '\t');
+    writer_bytes(&content->w, token->domain, token->domain_length);
+    writer_char(&content->w, '\n');
+    ++content->entries;
+
+    return 0;
+}
+
+/**
+ * Regenerates a block of a hosts file from the entries of a source, leaving
+ * the rest of the file untouched. A block that doesn't exist yet is appended.
+ * Nothing is written if the block already holds those entries. With the
+ * dry-run flag, the block is written to stdout instead.
+ * @param target_path The hosts file.
+ * @param name Name of the block.
+ * @param source_path The file holding the entries of the block.
+ * @param lines Receives the amount of lines of the result; may be NULL.
+ * @param fingerprint Receives the fingerprint of the result; may be NULL.
+ * @return The amount of entries written, zero if the write was skipped.
+ */
+unsigned long long block_reconcile(const char * target_path, const char * name, char * source_path, unsigned int * lines, uint64_t * fingerprint)
+{
+    struct block_content content;
+    struct block_span span;
+    struct fingerprint fp;
+    struct writer block, out;
+    struct stat st;
+    const char * data = NULL;
+    uint64_t generated;
+    int fd, separate;
+
+    for (const char * c = name; *c; ++c) {
+        if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_' && *c != '.') {
+            handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+        }
+    }
+    if (!*name) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    stats_phase_begin("block");
+    writer_init(&content.w, -1, 0);
+    content.entries = 0;
+    hosts_file_visit(source_path, block_collect, &content);
+    generated = fingerprint_bytes(content.w.buffer, content.w.length);
+
+    if ((fd = open(target_path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+    if (st.st_size && (data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    block_find(&span, data, (size_t)st.st_size, name);
+    stats.bytes_read += (size_t)st.st_size;
+
+    /* The new block, preceded by a newline if the file lacks its last one. */
+    separate = !span.found && span.begin && data[span.begin - 1] != '\n';
+    writer_init(&block, -1, 0);
+    if (separate) {
+        writer_char(&block, '\n');
+    }
+    writer_string(&block, BLOCK_BEGIN);
+    writer_string(&block, name);
+    writer_char(&block, ' ');
+    writer_hex64(&block, generated);
+    writer_char(&block, '\n');
+    writer_bytes(&block, content.w.buffer, content.w.length);
+    writer_string(&block, BLOCK_END);
+    writer_string(&block, name);
+    writer_char(&block, '\n');
+
+    /* Taken from the mapping before a rewrite truncates the file under it. */
+    if (lines) {
+        *lines = span.lines + content.entries + 2;
+    }
+    if (fingerprint) {
+        fingerprint_init(&fp);
+        fingerprint_update(&fp, data, span.begin);
+        fingerprint_update(&fp, block.buffer, block.length);
+        fingerprint_update(&fp, data + span.after, (size_t)st.st_size - span.after);
+        *fingerprint = fingerprint_final(&fp);
+    }
+
+    stats.write_skipped = span.found && span.recorded == generated && fingerprint_bytes(data + span.content, span.end - span.content) == generated;
+    if (dry_run_flag) {
+        writer_init(&out, STDOUT_FILENO, 0);
+        writer_bytes(&out, block.buffer + separate, block.length - separate);
+        if (writer_close(&out) != 0) {
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+    } else if (!stats.write_skipped) {
+        stats_phase_begin("write");
+        stats.entries_touched += content.entries;
+        if (!span.found) {
+            stats_phase_begin("append");
+            hosts_file_append(target_path, block.buffer, block.length);
+        } else if ((size_t)st.st_size - span.begin <= BLOCK_TAIL_SIZE) {
+            stats_phase_begin("rewrite");
+            writer_bytes(&block, data + span.after, (size_t)st.st_size - span.after);
+            hosts_file_rewrite_tail(target_path, span.begin, block.buffer, block.length);
+        } else {
+            stats_phase_begin("splice");
+            hosts_file_splice(target_path, fd, span.begin, block.buffer, block.length, span.after, (size_t)st.st_size);
+        }
+        stats_phase_end();
+        stats_phase_end();
+    }
+
+    if (data) {
+        munmap((void *)data, (size_t)st.st_size);
+    }
+    close(fd);
+    writer_close(&block);
+    writer_close(&content.w);
+    stats_phase_end();
+
+    return stats.write_skipped ? 0 : content.entries;
+}
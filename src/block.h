@@ -0,0 +1,30 @@
+/*
+ * Managed blocks: regions of a hosts file owned by one automation each.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+
+/*
+ * A block spans from its begin marker to its end marker, both included. The
+ * begin marker carries the fingerprint of the lines in between, as sixteen
+ * hexadecimal digits:
+ *
+ *     # BEGIN hf:<name> <fingerprint>
+ *     ...
+ *     # END hf:<name>
+ */
+#define BLOCK_BEGIN "# BEGIN hf:"
+#define BLOCK_END "# END hf:"
+
+/* Blocks ending this close to the end of the file are rewritten in place. */
+#define BLOCK_TAIL_SIZE (1 << 16)
+
+unsigned long long block_reconcile(const char * target_path, const char * name, char * source_path, unsigned int * lines, uint64_t * fingerprint);
+
+#endif
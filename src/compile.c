@@ -0,0 +1,384 @@
+/*
+ * Compiled lookup files.
+ *
+ * The domains of the hosts file are normalized and grouped with their
+ * addresses, then given a minimal perfect hash in the way of PTHash: domains
+ * are spread over buckets of a few, and buckets, largest first, get the
+ * smallest pilot that places all of their domains on free positions of the
+ * table. Positions past the amount of domains are remapped to the free ones
+ * before it, so that the slots are exactly as many as the domains. When some
+ * bucket can't be placed, everything is tried again with another seed. The
+ * seeds are fixed, so the same hosts file always compiles to the same bytes.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "compile.h"
+#include "hostsfile.h"
+#include "phf.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Records and their normalized domains, as collected by compile_collect. */
+struct compile_input {
+    struct compile_record * records;
+    size_t count;
+    size_t capacity;
+    char * strings;
+    size_t used;
+    size_t size;
+};
+
+/* Distinct domains, in sorted order, and where they end up. */
+struct compile_keys {
+    uint32_t count;
+    uint64_t * hashes;
+    uint32_t * domains;
+    uint32_t * values;
+    uint32_t * positions;
+};
+
+/* Strings of the records being sorted by compile_order. */
+static const char * compile_strings;
+
+/** Orders records by domain, then by line. */
+static int compile_order(const void * a, const void * b)
+{
+    const struct compile_record *x = a, *y = b;
+    int order = strcmp(compile_strings + x->domain, compile_strings + y->domain);
+
+    return order ? order : (x->line > y->line) - (x->line < y->line);
+}
+
+/**
+ * Keeps an entry whose address is a plain IPv4 or IPv6 address.
+ * @param context The compile_input.
+ * @param token The entry.
+ * @param line Its line number.
+ * @return Zero, to keep scanning.
+ */
+static int compile_collect(void * context, const struct hosts_file_token * token, unsigned long long line)
+{
+    struct compile_input * input = context;
+    struct compile_record * record;
+    size_t length = phf_length(token->domain, token->domain_length);
+    char ip[INET6_ADDRSTRLEN];
+
+    if (token->ip_length >= sizeof(ip)) {
+        return 0;
+    }
+    memcpy(ip, token->ip, token->ip_length);
+    ip[token->ip_length] = '\0';
+
+    if (input->count == input->capacity) {
+        input->capacity = input->capacity ? 2 * input->capacity : 1024;
+        input->records = hf_realloc(input->records, sizeof(struct compile_record) * input->capacity);
+    }
+    record = &input->records[input->count];
+    if (inet_pton(AF_INET, ip, record->address) == 1) {
+        record->family = 4;
+    } else if (inet_pton(AF_INET6, ip, record->address) == 1) {
+        record->family = 6;
+    } else {
+        return 0;
+    }
+
+    while (input->used + length + 1 > input->size) {
+        input->size = input->size ? 2 * input->size : 1 << 16;
+        input->strings = hf_realloc(input->strings, input->size);
+    }
+    for (size_t i = 0; i < length; ++i) {
+        input->strings[input->used + i] = (char)phf_lower((unsigned char)token->domain[i]);
+    }
+    input->strings[input->used + length] = '\0';
+    record->domain = input->used;
+    record->length = (unsigned int)length;
+    record->line = (unsigned int)line;
+    input->used += length + 1;
+    ++input->count;
+
+    return 0;
+}
+
+/**
+ * Groups the sorted records by domain into the strings and values sections.
+ * @param input The records.
+ * @param keys Receives the domains and their offsets.
+ * @param strings In-memory writer receiving the strings section.
+ * @param values In-memory writer receiving the values section.
+ */
+static void compile_group(const struct compile_input * input, struct compile_keys * keys, struct writer * strings, struct writer * values)
+{
+    const struct compile_record *first, *record;
+    size_t i = 0, j, k, end, count;
+
+    keys->count = 0;
+    keys->domains = hf_malloc(sizeof(uint32_t) * (input->count + 1));
+    keys->values = hf_malloc(sizeof(uint32_t) * (input->count + 1));
+    while (i < input->count) {
+        first = &input->records[i];
+        for (end = i + 1; end < input->count && strcmp(input->strings + input->records[end].domain, input->strings + first->domain) == 0; ++end) {
+        }
+        if (strings->length + first->length + 1 > UINT32_MAX || values->length + 1 + 17 * (end - i) > UINT32_MAX) {
+            fprintf(stderr, PROGRAM_NAME ": Too many entries to compile.\n");
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        keys->domains[keys->count] = (uint32_t)strings->length;
+        keys->values[keys->count] = (uint32_t)values->length;
+        writer_bytes(strings, input->strings + first->domain, first->length + 1);
+
+        /* The count is patched once the distinct addresses are known. */
+        writer_char(values, 0);
+        for (j = i, count = 0; j < end && count < UINT8_MAX; ++j) {
+            record = &input->records[j];
+            for (k = i; k < j; ++k) {
+                if (input->records[k].family == record->family && memcmp(input->records[k].address, record->address, record->family == 4 ? 4 : 16) == 0) {
+                    break;
+                }
+            }
+            if (k == j) {
+                writer_char(values, (char)record->family);
+                writer_bytes(values, record->address, record->family == 4 ? 4 : 16);
+                ++count;
+            }
+        }
+        values->buffer[keys->values[keys->count]] = (char)count;
+        ++keys->count;
+        i = end;
+    }
+}
+
+/**
+ * Tries to find pilots for every bucket with a seed.
+ * @param keys The domains, with their hashes under the seed.
+ * @param seed The seed.
+ * @param table_size Size of the table.
+ * @param bucket_count Amount of buckets.
+ * @param pilots Receives the pilot of each bucket.
+ * @return Zero, or -1 if some bucket couldn't be placed.
+ */
+static int compile_place(struct compile_keys * keys, uint64_t seed, uint32_t table_size, uint32_t bucket_count, uint16_t * pilots)
+{
+    uint32_t *starts = hf_calloc((size_t)bucket_count + 1, sizeof(uint32_t)), *members = hf_malloc(sizeof(uint32_t) * keys->count);
+    uint32_t *sizes = hf_calloc(UINT8_MAX + 2, sizeof(uint32_t)), *order = hf_malloc(sizeof(uint32_t) * bucket_count);
+    uint64_t * taken = hf_calloc(((size_t)table_size + 63) / 64, sizeof(uint64_t));
+    uint32_t bucket, size, placed, position, *fill = hf_malloc(sizeof(uint32_t) * ((size_t)bucket_count + 1));
+    unsigned int pilot = 0;
+    int result = 0;
+
+    /* Members of each bucket, then buckets by decreasing size. */
+    for (uint32_t i = 0; i < keys->count; ++i) {
+        ++starts[phf_bucket(keys->hashes[i], bucket_count) + 1];
+    }
+    for (uint32_t b = 0; b < bucket_count; ++b) {
+        starts[b + 1] += starts[b];
+        ++sizes[UINT8_MAX - (starts[b + 1] - starts[b] < UINT8_MAX ? starts[b + 1] - starts[b] : UINT8_MAX) + 1];
+    }
+    memcpy(fill, starts, sizeof(uint32_t) * ((size_t)bucket_count + 1));
+    for (uint32_t i = 0; i < keys->count; ++i) {
+        members[fill[phf_bucket(keys->hashes[i], bucket_count)]++] = i;
+    }
+    for (unsigned int s = 1; s <= UINT8_MAX + 1; ++s) {
+        sizes[s] += sizes[s - 1];
+    }
+    for (uint32_t b = 0; b < bucket_count; ++b) {
+        size = starts[b + 1] - starts[b];
+        order[sizes[UINT8_MAX - (size < UINT8_MAX ? size : UINT8_MAX)]++] = b;
+    }
+
+    for (uint32_t b = 0; b < bucket_count && result == 0; ++b) {
+        bucket = order[b];
+        size = starts[bucket + 1] - starts[bucket];
+        pilots[bucket] = 0;
+        if (!size) {
+            continue;
+        }
+        for (pilot = 0; pilot <= UINT16_MAX; ++pilot) {
+            for (placed = 0; placed < size; ++placed) {
+                position = phf_position(keys->hashes[members[starts[bucket] + placed]], (uint16_t)pilot, seed, table_size);
+                if (taken[position / 64] & (uint64_t)1 << position % 64) {
+                    break;
+                }
+                taken[position / 64] |= (uint64_t)1 << position % 64;
+                keys->positions[members[starts[bucket] + placed]] = position;
+            }
+            if (placed == size) {
+                pilots[bucket] = (uint16_t)pilot;
+                break;
+            }
+            while (placed--) {
+                position = keys->positions[members[starts[bucket] + placed]];
+                taken[position / 64] &= ~((uint64_t)1 << position % 64);
+            }
+        }
+        result = pilot > UINT16_MAX ? -1 : 0;
+    }
+
+    free(starts);
+    free(members);
+    free(sizes);
+    free(order);
+    free(taken);
+    free(fill);
+
+    return result;
+}
+
+/** Writes an integer of some bytes little-endian. */
+static void compile_integer(struct writer * w, uint64_t value, unsigned int bytes)
+{
+    unsigned char encoded[8];
+
+    for (unsigned int i = 0; i < bytes; ++i) {
+        encoded[i] = (unsigned char)(value >> 8 * i);
+    }
+    writer_bytes(w, encoded, bytes);
+}
+
+/** Pads a section to the alignment of the next one. */
+static void compile_pad(struct writer * w, uint64_t length)
+{
+    writer_repeat(w, '\0', (size_t)(-length & 7));
+}
+
+/**
+ * Compiles a hosts file into a lookup file, which is replaced atomically.
+ * @param hosts_path The hosts file.
+ * @param output_path The lookup file.
+ */
+void compile_file(char * hosts_path, const char * output_path)
+{
+    struct compile_input input = { 0 };
+    struct compile_keys keys = { 0 };
+    struct writer strings, values, w;
+    uint32_t table_size = 0, bucket_count = 0, free_position = 0, *remap = NULL, *slots = NULL;
+    uint64_t seed = 0, offsets[PHF_SECTIONS], sizes[PHF_SECTIONS], offset = PHF_HEADER_SIZE;
+    uint16_t * pilots = NULL;
+    char temporary[PATH_MAX + 16];
+    unsigned int attempt;
+    int fd;
+
+    hosts_file_visit(hosts_path, compile_collect, &input);
+
+    stats_phase_begin("build");
+    compile_strings = input.strings;
+    qsort(input.records, input.count, sizeof(struct compile_record), compile_order);
+    writer_init(&strings, -1, 0);
+    writer_init(&values, -1, 0);
+    compile_group(&input, &keys, &strings, &values);
+    free(input.records);
+    free(input.strings);
+
+    if (keys.count) {
+        table_size = keys.count + keys.count / 16 + 1;
+        bucket_count = keys.count / COMPILE_BUCKET_SIZE + 1;
+        keys.hashes = hf_malloc(sizeof(uint64_t) * keys.count);
+        keys.positions = hf_malloc(sizeof(uint32_t) * keys.count);
+        pilots = hf_malloc(sizeof(uint16_t) * bucket_count);
+        for (attempt = 0; attempt < COMPILE_MAX_ATTEMPTS; ++attempt) {
+            seed = phf_mix(0x9e3779b97f4a7c15ull * (attempt + 1));
+            for (uint32_t i = 0; i < keys.count; ++i) {
+                keys.hashes[i] = phf_hash(strings.buffer + keys.domains[i], strlen(strings.buffer + keys.domains[i]), seed);
+            }
+            if (compile_place(&keys, seed, table_size, bucket_count, pilots) == 0) {
+                break;
+            }
+        }
+        if (attempt == COMPILE_MAX_ATTEMPTS) {
+            fprintf(stderr, PROGRAM_NAME ": Could not find a perfect hash.\n");
+            handle_error(ERROR_CODE_LOGIC_ERROR);
+        }
+
+        /* Slots past the keys move to the free ones before them, in order. */
+        slots = hf_malloc(sizeof(uint32_t) * table_size);
+        memset(slots, 0xff, sizeof(uint32_t) * table_size);
+        for (uint32_t i = 0; i < keys.count; ++i) {
+            slots[keys.positions[i]] = i;
+        }
+        remap = hf_malloc(sizeof(uint32_t) * (table_size - keys.count));
+        for (uint32_t p = keys.count; p < table_size; ++p) {
+            remap[p - keys.count] = UINT32_MAX;
+            if (slots[p] != UINT32_MAX) {
+                while (slots[free_position] != UINT32_MAX) {
+                    ++free_position;
+                }
+                slots[free_position] = slots[p];
+                remap[p - keys.count] = free_position;
+            }
+        }
+    }
+    stats_phase_end();
+
+    sizes[PHF_PILOTS] = (uint64_t)bucket_count * 2;
+    sizes[PHF_REMAP] = (uint64_t)(table_size - keys.count) * 4;
+    sizes[PHF_SLOTS] = (uint64_t)keys.count * PHF_SLOT_SIZE;
+    sizes[PHF_VALUES] = values.length;
+    sizes[PHF_STRINGS] = strings.length;
+    for (int i = 0; i < PHF_SECTIONS; ++i) {
+        offsets[i] = offset;
+        offset += (sizes[i] + 7) & ~(uint64_t)7;
+    }
+
+    stats_phase_begin("write");
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", output_path);
+    if ((fd = mkstemp(temporary)) < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+    }
+    writer_init(&w, fd, 0);
+    writer_bytes(&w, PHF_MAGIC, 8);
+    compile_integer(&w, PHF_VERSION, 4);
+    compile_integer(&w, PHF_HEADER_SIZE, 4);
+    compile_integer(&w, seed, 8);
+    compile_integer(&w, keys.count, 4);
+    compile_integer(&w, table_size, 4);
+    compile_integer(&w, bucket_count, 4);
+    compile_integer(&w, 0, 4);
+    for (int i = 0; i < PHF_SECTIONS; ++i) {
+        compile_integer(&w, offsets[i], 8);
+        compile_integer(&w, sizes[i], 8);
+    }
+    for (uint32_t b = 0; b < bucket_count; ++b) {
+        compile_integer(&w, pilots[b], 2);
+    }
+    compile_pad(&w, sizes[PHF_PILOTS]);
+    for (uint32_t p = 0; p < table_size - keys.count; ++p) {
+        compile_integer(&w, remap[p], 4);
+    }
+    compile_pad(&w, sizes[PHF_REMAP]);
+    for (uint32_t p = 0; p < keys.count; ++p) {
+        compile_integer(&w, keys.hashes[slots[p]], 8);
+        compile_integer(&w, keys.domains[slots[p]], 4);
+        compile_integer(&w, keys.values[slots[p]], 4);
+    }
+    writer_bytes(&w, values.buffer, values.length);
+    compile_pad(&w, sizes[PHF_VALUES]);
+    writer_bytes(&w, strings.buffer, strings.length);
+    compile_pad(&w, sizes[PHF_STRINGS]);
+    stats.bytes_written += w.flushed + w.length;
+
+    if (writer_close(&w) != 0 || fsync(fd) != 0 || fchmod(fd, 0644) != 0 || rename(temporary, output_path) != 0) {
+        unlink(temporary);
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    close(fd);
+    stats_phase_end();
+
+    writer_close(&strings);
+    writer_close(&values);
+    free(keys.hashes);
+    free(keys.domains);
+    free(keys.values);
+    free(keys.positions);
+    free(pilots);
+    free(remap);
+    free(slots);
+}
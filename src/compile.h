@@ -0,0 +1,31 @@
+/*
+ * Compiles a hosts file into a minimal perfect hash lookup file, which is
+ * read by phf.h.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef COMPILE_H
+#define COMPILE_H
+
+#include <stddef.h>
+
+/* Seeds tried before giving up on finding pilots for every bucket. */
+#define COMPILE_MAX_ATTEMPTS 32
+
+/* Average amount of keys per bucket. */
+#define COMPILE_BUCKET_SIZE 4
+
+/* A domain of the hosts file and one of its addresses. */
+struct compile_record {
+    size_t domain;
+    unsigned int length;
+    unsigned int line;
+    unsigned char family;
+    unsigned char address[16];
+};
+
+void compile_file(char * hosts_path, const char * output_path);
+
+#endif
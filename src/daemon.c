@@ -0,0 +1,577 @@
+/*
+ * Long-running mode: keeps the hosts file in memory and serves requests on
+ * a Unix socket.
+ *
+ * The protocol is line based. Every request is answered by a single line
+ * starting with OK, NOTFOUND or ERROR, except METRICS which answers with the
+ * Prometheus text exposition and closes the connection:
+ *
+ *     LOOKUP <domain>         OK <ip> [<ip> ...]
+ *     ADD <domain>@<ip>       OK
+ *     REMOVE <domain>         OK <removed>
+ *     FLUSH                   OK <bytes>
+ *     RELOAD                  OK <entries>
+ *     METRICS                 <exposition>
+ *
+ * A plain "GET /metrics HTTP/1.1" is understood as well, so the socket can
+ * be scraped with curl --unix-socket or any HTTP client.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "daemon.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "journal.h"
+#include "metrics.h"
+#include "shared.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Upper bound of addresses returned by a single lookup. */
+#define DAEMON_MAX_MATCHES 16
+
+/*
+ * Lookups share the hosts file through the read lock. Writers are serialized
+ * by a mutex first, which also protects the global stats the core updates,
+ * and only take the lock exclusively for the moment they modify entries.
+ */
+static struct hosts_file daemon_hosts_file;
+static pthread_rwlock_t daemon_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t daemon_writer = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t daemon_stopping = 0;
+
+/*
+ * Edits made since the hosts file was loaded or flushed, kept to be applied
+ * again on top of whatever other writers did to the file meanwhile.
+ */
+static struct journal_batch daemon_edits;
+
+/* Entries held, kept up to date by every edit; comments and holes don't count. */
+static unsigned int daemon_entries;
+
+/* The shared index, if one is published; edits mark it stale. */
+static struct shared_segment daemon_segment;
+static int daemon_publishing = 0;
+static atomic_int daemon_stale = 0;
+
+static void daemon_stop(int signal)
+{
+    (void)signal;
+    daemon_stopping = 1;
+}
+
+/**
+ * Counts the entries of the hosts file, after it was loaded or replaced.
+ * Must hold the lock.
+ */
+static void daemon_count(void)
+{
+    daemon_entries = 0;
+    for (unsigned int i = 0; i < daemon_hosts_file.index; ++i) {
+        daemon_entries += daemon_hosts_file.entries[i].type == UNION_ELEMENT;
+    }
+}
+
+/**
+ * Publishes the size of the index. Must hold the lock.
+ */
+static void daemon_update_gauges(void)
+{
+    atomic_store(&metrics.index_entries, daemon_entries);
+    atomic_store(&metrics.index_slots, daemon_hosts_file.slot_count);
+}
+
+/**
+ * Brings the shared index up to date. Must hold the writer mutex, so the
+ * entries only need to be read.
+ */
+static void daemon_publish(void)
+{
+    pthread_rwlock_rdlock(&daemon_lock);
+    shared_publish(&daemon_segment, &daemon_hosts_file);
+    pthread_rwlock_unlock(&daemon_lock);
+    atomic_store(&daemon_stale, 0);
+}
+
+static int daemon_lookup(FILE * out, const char * domain)
+{
+    unsigned int matches[DAEMON_MAX_MATCHES], found;
+
+    pthread_rwlock_rdlock(&daemon_lock);
+    found = hosts_file_find(&daemon_hosts_file, domain, matches, DAEMON_MAX_MATCHES);
+    if (found) {
+        fprintf(out, "OK");
+        for (unsigned int i = 0; i < found && i < DAEMON_MAX_MATCHES; ++i) {
+            fprintf(out, " %s", daemon_hosts_file.entries[matches[i]].value.map.ip);
+        }
+        fprintf(out, "\n");
+    } else {
+        fprintf(out, "NOTFOUND\n");
+    }
+    pthread_rwlock_unlock(&daemon_lock);
+
+    return 0;
+}
+
+static int daemon_add(FILE * out, char * argument)
+{
+    char * at = strchr(argument, '@');
+    unsigned int index;
+    int failed = 0;
+
+    if (at == NULL || at == argument || at[1] == '\0') {
+        fprintf(out, "ERROR expected <domain>@<ip>\n");
+        return 1;
+    }
+    *at = '\0';
+
+    /* Anything the tokenizer wouldn't read back as one field is refused. */
+    if (argument[strcspn(argument, " \t#")] != '\0') {
+        fprintf(out, "ERROR invalid domain\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&daemon_writer);
+    pthread_rwlock_wrlock(&daemon_lock);
+    if (ip_address_kind(at + 1) == IP_KIND_NONE) {
+        failed = 1;
+    } else {
+        /* An entry is only appended if it doesn't replace the address of one. */
+        index = daemon_hosts_file.index;
+        hosts_file_add(&daemon_hosts_file, hf_strdup(at + 1), hf_strdup(argument));
+        daemon_entries += daemon_hosts_file.index - index;
+        journal_batch_add(&daemon_edits, JOURNAL_ADD, argument, strlen(argument), at + 1, strlen(at + 1));
+        daemon_update_gauges();
+        atomic_store(&daemon_stale, daemon_publishing);
+    }
+    pthread_rwlock_unlock(&daemon_lock);
+    pthread_mutex_unlock(&daemon_writer);
+
+    fprintf(out, failed ? "ERROR invalid address\n" : "OK\n");
+    return failed;
+}
+
+static int daemon_remove(FILE * out, const char * domain)
+{
+    unsigned int removed;
+
+    pthread_mutex_lock(&daemon_writer);
+    pthread_rwlock_wrlock(&daemon_lock);
+    removed = hosts_file_discard(&daemon_hosts_file, domain, IP_KIND_NONE);
+    daemon_entries -= removed;
+    daemon_update_gauges();
+    if (removed) {
+        journal_batch_add(&daemon_edits, JOURNAL_REMOVE, domain, strlen(domain), NULL, 0);
+        atomic_store(&daemon_stale, daemon_publishing);
+    }
+    pthread_rwlock_unlock(&daemon_lock);
+    pthread_mutex_unlock(&daemon_writer);
+
+    if (removed) {
+        fprintf(out, "OK %u\n", removed);
+    } else {
+        fprintf(out, "NOTFOUND\n");
+    }
+
+    return 0;
+}
+
+/**
+ * Describes why the hosts file could not be read or written.
+ */
+static const char * daemon_reason(enum error_code code)
+{
+    switch (code) {
+        case ERROR_CODE_FORBIDDEN:
+            return "permission denied";
+        case ERROR_CODE_FILE_NOT_FOUND:
+            return "file not found";
+        default:
+            return "write failed";
+    }
+}
+
+/**
+ * Tells whether the hosts file on disk is still the one that was loaded or
+ * last written. Must hold the writer mutex.
+ */
+static int daemon_unchanged(void)
+{
+    char buffer[1 << 16];
+    struct fingerprint fp;
+    struct stat st;
+    ssize_t got;
+    int fd;
+
+    if ((fd = open(hosts_file_path, O_RDONLY)) < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || (unsigned long long)st.st_size != daemon_hosts_file.source_length) {
+        close(fd);
+        return 0;
+    }
+
+    fingerprint_init(&fp);
+    while ((got = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (got < 0 && errno != EINTR) {
+            break;
+        }
+        if (got > 0) {
+            fingerprint_update(&fp, buffer, (size_t)got);
+            stats.bytes_read += (unsigned long long)got;
+        }
+    }
+    close(fd);
+
+    return got == 0 && fingerprint_final(&fp) == daemon_hosts_file.source_fingerprint;
+}
+
+/**
+ * Replaces the entries by a freshly loaded hosts file. Must hold the writer
+ * mutex; the stale entries are freed.
+ */
+static void daemon_swap(struct hosts_file * fresh)
+{
+    struct hosts_file stale;
+
+    pthread_rwlock_wrlock(&daemon_lock);
+    stale = daemon_hosts_file;
+    daemon_hosts_file = *fresh;
+    daemon_count();
+    daemon_update_gauges();
+    pthread_rwlock_unlock(&daemon_lock);
+
+    hosts_file_free(&stale);
+}
+
+/**
+ * Writes the entries to disk, taking its turn like any other writer: a file
+ * replaced by another writer meanwhile is loaded again and edits pending in
+ * the journal are taken along, with the edits made here on top. A failed
+ * write keeps serving the entries as they are.
+ */
+static int daemon_flush(FILE * out)
+{
+    unsigned long long before, bytes = 0;
+    struct hosts_file fresh;
+    enum error_code code = ERROR_CODE_SUCCESS;
+    int lock;
+
+    pthread_mutex_lock(&daemon_writer);
+    if ((code = journal_try_lock(hosts_file_path, &lock)) != ERROR_CODE_SUCCESS) {
+        pthread_mutex_unlock(&daemon_writer);
+        fprintf(out, "ERROR %s\n", daemon_reason(code));
+        return 1;
+    }
+    if (!daemon_unchanged()) {
+        if ((code = hosts_file_try_init(hosts_file_path, &fresh)) == ERROR_CODE_SUCCESS) {
+            hosts_file_index(&fresh);
+            daemon_swap(&fresh);
+        }
+    }
+
+    if (code == ERROR_CODE_SUCCESS) {
+        pthread_rwlock_wrlock(&daemon_lock);
+        code = journal_try_take(hosts_file_path, &daemon_hosts_file, NULL);
+        journal_batch_apply(&daemon_edits, &daemon_hosts_file);
+        daemon_count();
+        daemon_update_gauges();
+        pthread_rwlock_unlock(&daemon_lock);
+        atomic_store(&daemon_stale, daemon_publishing);
+    }
+
+    if (code == ERROR_CODE_SUCCESS) {
+        /* Serializing only reads the entries, so lookups carry on meanwhile. */
+        pthread_rwlock_rdlock(&daemon_lock);
+        before = stats.bytes_written;
+        code = hosts_file_try_write(&daemon_hosts_file);
+        bytes = stats.bytes_written - before;
+        pthread_rwlock_unlock(&daemon_lock);
+    }
+
+    /* The edits taken and made here are part of what was just written. */
+    if (code == ERROR_CODE_SUCCESS && (code = journal_try_commit(hosts_file_path)) == ERROR_CODE_SUCCESS) {
+        free(daemon_edits.data);
+        memset(&daemon_edits, 0, sizeof(daemon_edits));
+    }
+    journal_unlock(hosts_file_path, lock);
+    pthread_mutex_unlock(&daemon_writer);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        fprintf(out, "ERROR %s\n", daemon_reason(code));
+        return 1;
+    }
+
+    atomic_store(&metrics.file_bytes, bytes);
+    atomic_store(&metrics.last_flush_seconds, (unsigned long long)time(NULL));
+    fprintf(out, "OK %llu\n", bytes);
+
+    return 0;
+}
+
+/**
+ * Loads the hosts file from disk while lookups continue, then swaps it in.
+ * Edits pending in the journal are replayed, those made here and not flushed
+ * are dropped. If the file can't be read, the loaded one is kept.
+ */
+static int daemon_reload(FILE * out)
+{
+    unsigned long long before;
+    unsigned int entries;
+    struct hosts_file fresh;
+    enum error_code code;
+
+    pthread_mutex_lock(&daemon_writer);
+    before = stats.bytes_read;
+    if ((code = hosts_file_try_init(hosts_file_path, &fresh)) != ERROR_CODE_SUCCESS) {
+        pthread_mutex_unlock(&daemon_writer);
+        if (out) {
+            fprintf(out, "ERROR %s\n", daemon_reason(code));
+        }
+        return 1;
+    }
+    atomic_store(&metrics.file_bytes, stats.bytes_read - before);
+    if ((code = journal_try_replay(hosts_file_path, &fresh, NULL)) != ERROR_CODE_SUCCESS) {
+        pthread_mutex_unlock(&daemon_writer);
+        hosts_file_free(&fresh);
+        if (out) {
+            fprintf(out, "ERROR %s\n", daemon_reason(code));
+        }
+        return 1;
+    }
+    hosts_file_index(&fresh);
+    daemon_swap(&fresh);
+    free(daemon_edits.data);
+    memset(&daemon_edits, 0, sizeof(daemon_edits));
+
+    if (daemon_publishing) {
+        daemon_publish();
+    }
+    entries = daemon_entries;
+    pthread_mutex_unlock(&daemon_writer);
+    if (out) {
+        fprintf(out, "OK %u\n", entries);
+    }
+
+    return 0;
+}
+
+/**
+ * Answers an HTTP request for the metrics. Only the request line matters;
+ * the headers are skipped.
+ */
+static void daemon_http(FILE * in, FILE * out, const char * request)
+{
+    char line[DAEMON_MAX_REQUEST];
+
+    while (fgets(line, sizeof(line), in) && strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0) {
+    }
+
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strcmp(request, "GET /metrics") == 0) {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metrics_expose(out);
+    } else {
+        fprintf(out, "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+    }
+}
+
+/**
+ * Serves a single connection until the client hangs up.
+ * @param argument The connected socket, cast to a pointer.
+ */
+static void * daemon_serve(void * argument)
+{
+    int fd = (int)(intptr_t)argument;
+    FILE * in = fdopen(fd, "r");
+    FILE * out = fdopen(dup(fd), "w");
+    char line[DAEMON_MAX_REQUEST], *command, *rest;
+    enum metrics_operation operation;
+    unsigned long long start;
+    int failed;
+
+    while (in && out && fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (strncmp(line, "GET ", 4) == 0) {
+            daemon_http(in, out, line);
+            break;
+        }
+
+        command = strtok_r(line, " \t", &rest);
+        rest = rest ? rest + strspn(rest, " \t") : NULL;
+        if (command == NULL) {
+            continue;
+        }
+
+        if (strcasecmp(command, "METRICS") == 0) {
+            metrics_expose(out);
+            break;
+        }
+
+        start = stats_now();
+        if (strcasecmp(command, "LOOKUP") == 0 && rest && *rest) {
+            operation = METRICS_LOOKUP;
+            failed = daemon_lookup(out, rest);
+        } else if (strcasecmp(command, "ADD") == 0 && rest && *rest) {
+            operation = METRICS_ADD;
+            failed = daemon_add(out, rest);
+        } else if (strcasecmp(command, "REMOVE") == 0 && rest && *rest) {
+            operation = METRICS_REMOVE;
+            failed = daemon_remove(out, rest);
+        } else if (strcasecmp(command, "FLUSH") == 0) {
+            operation = METRICS_FLUSH;
+            failed = daemon_flush(out);
+        } else if (strcasecmp(command, "RELOAD") == 0) {
+            operation = METRICS_RELOAD;
+            failed = daemon_reload(out);
+        } else {
+            fprintf(out, "ERROR unknown request\n");
+            fflush(out);
+            continue;
+        }
+        metrics_record(operation, stats_now() - start, failed);
+        fflush(out);
+    }
+
+    if (out) {
+        fclose(out);
+    }
+    if (in) {
+        fclose(in);
+    } else {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * Binds the socket, replacing a stale one left behind by a previous run.
+ * @param path Filesystem path of the socket.
+ * @return The listening socket.
+ */
+static int daemon_listen(const char * path)
+{
+    struct sockaddr_un address;
+    int fd;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    strcpy(address.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        handle_error(ERROR_CODE_LOGIC_ERROR);
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    return fd;
+}
+
+/**
+ * Runs until SIGINT or SIGTERM.
+ * @param socket_path Where to listen.
+ * @param textfile If not NULL, metrics are also written here periodically.
+ * @param publish_name If not NULL, the index is published in the shared
+ * memory segment of that name.
+ */
+void daemon_run(const char * socket_path, const char * textfile, const char * publish_name)
+{
+    struct pollfd listener;
+    struct sigaction action;
+    pthread_attr_t attributes;
+    pthread_t thread;
+    time_t last_textfile = 0, last_publish = 0;
+    int fd;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = daemon_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    atomic_store(&metrics.start_seconds, (unsigned long long)time(NULL));
+    daemon_hosts_file = hosts_file_init(hosts_file_path);
+    atomic_store(&metrics.file_bytes, stats.bytes_read);
+    journal_replay(hosts_file_path, &daemon_hosts_file);
+    hosts_file_index(&daemon_hosts_file);
+    daemon_count();
+    daemon_update_gauges();
+    if (publish_name) {
+        shared_publish_open(&daemon_segment, publish_name);
+        daemon_publishing = 1;
+        daemon_publish();
+        last_publish = time(NULL);
+    }
+
+    listener.fd = daemon_listen(socket_path);
+    listener.events = POLLIN;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    while (!daemon_stopping) {
+        if (textfile && time(NULL) - last_textfile >= DAEMON_TEXTFILE_INTERVAL) {
+            metrics_write_textfile(textfile);
+            last_textfile = time(NULL);
+        }
+
+        /* Bursts of edits are published together. */
+        if (atomic_load(&daemon_stale) && time(NULL) - last_publish >= DAEMON_PUBLISH_INTERVAL) {
+            pthread_mutex_lock(&daemon_writer);
+            daemon_publish();
+            pthread_mutex_unlock(&daemon_writer);
+            last_publish = time(NULL);
+        }
+
+        if (poll(&listener, 1, (daemon_publishing ? DAEMON_PUBLISH_INTERVAL : DAEMON_TEXTFILE_INTERVAL) * 1000) <= 0) {
+            continue;
+        }
+
+        if ((fd = accept(listener.fd, NULL, NULL)) < 0) {
+            continue;
+        }
+
+        if (pthread_create(&thread, &attributes, daemon_serve, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+    }
+
+    if (textfile) {
+        metrics_write_textfile(textfile);
+    }
+
+    if (daemon_publishing) {
+        pthread_mutex_lock(&daemon_writer);
+        if (atomic_load(&daemon_stale)) {
+            daemon_publish();
+        }
+        shared_publish_close(&daemon_segment);
+        pthread_mutex_unlock(&daemon_writer);
+    }
+
+    pthread_attr_destroy(&attributes);
+    close(listener.fd);
+    unlink(socket_path);
+}
@@ -0,0 +1,23 @@
+/*
+ * Long-running mode: keeps the hosts file in memory and serves requests on
+ * a Unix socket.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/* How often the node_exporter textfile is refreshed, in seconds. */
+#define DAEMON_TEXTFILE_INTERVAL 15
+
+/* Edits are published to the shared index at most this often, in seconds. */
+#define DAEMON_PUBLISH_INTERVAL 1
+
+/* Longest request line that is accepted. */
+#define DAEMON_MAX_REQUEST 4096
+
+void daemon_run(const char * socket_path, const char * textfile, const char * publish_name);
+
+#endif
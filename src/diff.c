@@ -0,0 +1,1560 @@
+/*
+ * Structural comparison of two hosts files.
+ *
+ * Entries are keyed by their normalized domain (lowercase, without trailing
+ * dot) and address family. Both files are tokenized in place and entries the
+ * files share in the same order are settled in one sequential pass. The rest
+ * is partitioned by the hash of its key, and the partitions are joined by a
+ * pool of threads, so nothing is allocated per entry and reordering a file
+ * doesn't produce any changes.
+ *
+ * The summary lists one change per line:
+ *
+ *     - <domain>\t<ip>                 removed
+ *     + <domain>\t<ip>                 added
+ *     ~ <domain>\t<old ip> -> <new ip> changed
+ *
+ * The patch format shows the affected lines of both files, with their line
+ * numbers, for review.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "diff.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "merkle.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIFF_NONE 0xffffffffu
+
+/* Partitions hold about this many records, so their tables stay in cache. */
+#define DIFF_PARTITION_SIZE 4096
+
+/* Largest tail of a file that is rewritten in place when reconciling. */
+#define DIFF_TAIL_SIZE (1 << 16)
+
+/* How far the sequential pass looks ahead to get back in step. */
+#define DIFF_WINDOW 32
+
+/* An entry of either file, pointing into the file's buffer. */
+struct diff_record {
+    const char * ip;
+    const char * domain;
+    unsigned int ip_length;
+    unsigned int domain_length;
+    unsigned int text_length;
+    unsigned int line;
+    unsigned int hash;
+    unsigned int ip_hash;
+};
+
+/* The part of a record the join works on, copied into its partition. */
+struct diff_item {
+    unsigned int hash;
+    unsigned int ip_hash;
+    unsigned int record;
+};
+
+struct diff_side {
+    const char * path;
+    char * data;
+    size_t size;
+    struct diff_record * records;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int lines;
+    unsigned char * settled;
+    struct diff_item * items;
+    unsigned int * offsets;
+};
+
+/* A single difference; either index may be DIFF_NONE. */
+struct diff_change {
+    char type;
+    unsigned int old_record;
+    unsigned int new_record;
+};
+
+/* A line of the target that has to change when reconciling. */
+struct diff_edit {
+    const char * start;
+    const char * end;
+    const struct diff_record * old_record;
+    const struct diff_record * new_record;
+};
+
+/* Shared by the threads, which take partitions one at a time. */
+struct diff_job {
+    struct diff_side * old_side;
+    struct diff_side * new_side;
+    unsigned int partitions;
+    atomic_uint next;
+};
+
+/* A thread, its scratch space and the changes it found. */
+struct diff_worker {
+    struct diff_job * job;
+    unsigned int * slots;
+    unsigned int * chain;
+    unsigned char * matched;
+    unsigned int capacity;
+    struct diff_change * changes;
+    unsigned int change_count;
+    unsigned int change_capacity;
+    pthread_t thread;
+    int threaded;
+};
+
+static inline char diff_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? (char)(c + 'a' - 'A') : c;
+}
+
+/**
+ * Tells the address families apart without parsing: IPv6 addresses contain
+ * at least two colons, IPv4 addresses at most one, before a port.
+ * @param r The record.
+ * @return Non-zero for IPv6.
+ */
+static inline int diff_is_ipv6(const struct diff_record * r)
+{
+    const char * colon = memchr(r->ip, ':', r->ip_length);
+
+    return colon && memchr(colon + 1, ':', r->ip_length - (colon + 1 - r->ip)) != NULL;
+}
+
+/**
+ * FNV-1a over the normalized key of a record.
+ * @param r The record, with its domain already stripped of a trailing dot.
+ * @return 32-bit hash.
+ */
+static unsigned int diff_hash(const struct diff_record * r)
+{
+    unsigned int hash = 2166136261u;
+
+    for (unsigned int i = 0; i < r->domain_length; ++i) {
+        hash = (hash ^ (unsigned char)diff_lower(r->domain[i])) * 16777619u;
+    }
+
+    return (hash ^ (unsigned int)diff_is_ipv6(r)) * 16777619u;
+}
+
+static unsigned int diff_hash_ip(const struct diff_record * r)
+{
+    unsigned int hash = 2166136261u;
+
+    for (unsigned int i = 0; i < r->ip_length; ++i) {
+        hash = (hash ^ (unsigned char)r->ip[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static int diff_same_key(const struct diff_record * a, const struct diff_record * b)
+{
+    if (a->hash != b->hash || a->domain_length != b->domain_length || diff_is_ipv6(a) != diff_is_ipv6(b)) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < a->domain_length; ++i) {
+        if (diff_lower(a->domain[i]) != diff_lower(b->domain[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int diff_same_ip(const struct diff_record * a, const struct diff_record * b)
+{
+    return a->ip_length == b->ip_length && memcmp(a->ip, b->ip, a->ip_length) == 0;
+}
+
+/**
+ * Reads a file completely and tokenizes it in place.
+ * @param argument The diff_side, with its path set.
+ */
+static void * diff_load(void * argument)
+{
+    struct diff_side * side = argument;
+    struct hosts_file_token token;
+    struct diff_record * r;
+    struct stat st;
+    char * cursor, *end, *next;
+    unsigned int line = 0;
+    ssize_t got;
+    size_t size = 0;
+    int fd;
+
+    if ((fd = open(side->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    side->data = hf_malloc((size_t)st.st_size + 1);
+    while (size < (size_t)st.st_size && (got = read(fd, side->data + size, (size_t)st.st_size - size)) != 0) {
+        if (got < 0 && errno != EINTR) {
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        size += got > 0 ? (size_t)got : 0;
+    }
+    side->data[size] = '\0';
+    side->size = size;
+    close(fd);
+
+    side->capacity = 1024;
+    side->records = hf_malloc(sizeof(struct diff_record) * side->capacity);
+    for (cursor = side->data, end = side->data + size; cursor < end; cursor = next) {
+        next = memchr(cursor, '\n', end - cursor);
+        next = next ? next + 1 : end;
+        ++line;
+        if (!hosts_file_tokenize(cursor, &token)) {
+            continue;
+        }
+
+        if (side->count == side->capacity) {
+            side->capacity *= 2;
+            side->records = hf_realloc(side->records, sizeof(struct diff_record) * side->capacity);
+        }
+        r = &side->records[side->count++];
+        r->ip = token.ip;
+        r->ip_length = (unsigned int)token.ip_length;
+        r->domain = token.domain;
+        r->domain_length = (unsigned int)token.domain_length;
+        r->text_length = (unsigned int)(token.domain + token.domain_length - token.ip);
+        if (r->domain_length > 1 && r->domain[r->domain_length - 1] == '.') {
+            --r->domain_length;
+        }
+        r->line = line;
+        r->hash = diff_hash(r);
+        r->ip_hash = diff_hash_ip(r);
+    }
+    side->lines = line;
+
+    return NULL;
+}
+
+static void diff_change(struct diff_worker * worker, char type, unsigned int old_record, unsigned int new_record)
+{
+    if (worker->change_count == worker->change_capacity) {
+        worker->change_capacity = worker->change_capacity ? worker->change_capacity * 2 : 64;
+        worker->changes = hf_realloc(worker->changes, sizeof(struct diff_change) * worker->change_capacity);
+    }
+
+    worker->changes[worker->change_count].type = type;
+    worker->changes[worker->change_count].old_record = old_record;
+    worker->changes[worker->change_count].new_record = new_record;
+    ++worker->change_count;
+}
+
+/**
+ * Joins the old and new records of one partition. Entries are first paired
+ * on key and address; what remains of a key in both files is reported as
+ * changed, pairwise in file order. Hashes are compared first, so records
+ * themselves are only touched to confirm a match.
+ * @param worker The thread doing the work.
+ * @param partition The partition.
+ */
+static void diff_join_partition(struct diff_worker * worker, unsigned int partition)
+{
+    struct diff_side * old_side = worker->job->old_side, *new_side = worker->job->new_side;
+    struct diff_item * old_items = old_side->items + old_side->offsets[partition];
+    struct diff_item * new_items = new_side->items + new_side->offsets[partition];
+    unsigned int old_count = old_side->offsets[partition + 1] - old_side->offsets[partition];
+    unsigned int new_count = new_side->offsets[partition + 1] - new_side->offsets[partition];
+    unsigned int slot_count = 16, mask, i, j, k;
+    unsigned char * old_matched, *new_matched;
+    struct diff_record * o, *n;
+
+    while (slot_count < old_count * 2) {
+        slot_count *= 2;
+    }
+    if (worker->capacity < slot_count + old_count + new_count) {
+        worker->capacity = (slot_count + old_count + new_count) * 2;
+        worker->slots = hf_realloc(worker->slots, sizeof(unsigned int) * worker->capacity);
+        worker->chain = hf_realloc(worker->chain, sizeof(unsigned int) * worker->capacity);
+        worker->matched = hf_realloc(worker->matched, worker->capacity);
+    }
+    mask = slot_count - 1;
+    memset(worker->slots, 0xff, sizeof(unsigned int) * slot_count);
+    memset(worker->matched, 0, old_count + new_count);
+    old_matched = worker->matched;
+    new_matched = worker->matched + old_count;
+
+    /* Slots hold the first old item of each hash, chains link the rest. */
+    for (i = old_count; i-- > 0;) {
+        for (j = old_items[i].hash & mask; worker->slots[j] != DIFF_NONE; j = (j + 1) & mask) {
+            if (old_items[worker->slots[j]].hash == old_items[i].hash) {
+                break;
+            }
+        }
+        worker->chain[i] = worker->slots[j];
+        worker->slots[j] = i;
+    }
+
+    /* First pass: identical mappings. Second pass: changed or added ones. */
+    for (int pass = 0; pass < 2; ++pass) {
+        for (i = 0; i < new_count; ++i) {
+            if (new_matched[i]) {
+                continue;
+            }
+            n = &new_side->records[new_items[i].record];
+            for (j = new_items[i].hash & mask; worker->slots[j] != DIFF_NONE; j = (j + 1) & mask) {
+                if (old_items[worker->slots[j]].hash == new_items[i].hash) {
+                    break;
+                }
+            }
+            for (k = worker->slots[j]; k != DIFF_NONE; k = worker->chain[k]) {
+                if (old_matched[k] || (pass == 0 && old_items[k].ip_hash != new_items[i].ip_hash)) {
+                    continue;
+                }
+                o = &old_side->records[old_items[k].record];
+                if (diff_same_key(o, n) && (pass == 1 || diff_same_ip(o, n))) {
+                    old_matched[k] = new_matched[i] = 1;
+                    if (pass == 1) {
+                        diff_change(worker, '~', old_items[k].record, new_items[i].record);
+                    }
+                    break;
+                }
+            }
+            if (pass == 1 && !new_matched[i]) {
+                diff_change(worker, '+', DIFF_NONE, new_items[i].record);
+            }
+        }
+    }
+
+    for (i = 0; i < old_count; ++i) {
+        if (!old_matched[i]) {
+            diff_change(worker, '-', old_items[i].record, DIFF_NONE);
+        }
+    }
+}
+
+static void * diff_work(void * argument)
+{
+    struct diff_worker * worker = argument;
+    unsigned int partition;
+
+    while ((partition = atomic_fetch_add(&worker->job->next, 1)) < worker->job->partitions) {
+        diff_join_partition(worker, partition);
+    }
+
+    return NULL;
+}
+
+static inline int diff_same(const struct diff_record * a, const struct diff_record * b)
+{
+    return a->hash == b->hash && a->ip_hash == b->ip_hash && diff_same_key(a, b) && diff_same_ip(a, b);
+}
+
+/**
+ * Settles the identical entries both files have in the same order, walking
+ * them side by side and looking a little ahead when they get out of step.
+ * Revisions of a file are mostly the same, so this leaves little for the
+ * join, and it reads both files sequentially.
+ * @param old_side The old file.
+ * @param new_side The new file.
+ * @return The amount of old records left for the join.
+ */
+static unsigned int diff_settle(struct diff_side * old_side, struct diff_side * new_side)
+{
+    unsigned int i = 0, j = 0, k, settled = 0;
+
+    old_side->settled = hf_calloc(old_side->count ? old_side->count : 1, 1);
+    new_side->settled = hf_calloc(new_side->count ? new_side->count : 1, 1);
+
+    while (i < old_side->count && j < new_side->count) {
+        if (diff_same(&old_side->records[i], &new_side->records[j])) {
+            old_side->settled[i++] = new_side->settled[j++] = 1;
+            ++settled;
+            continue;
+        }
+
+        for (k = 1; k < DIFF_WINDOW && j + k < new_side->count; ++k) {
+            if (diff_same(&old_side->records[i], &new_side->records[j + k])) {
+                break;
+            }
+        }
+        if (k < DIFF_WINDOW && j + k < new_side->count) {
+            j += k;
+            continue;
+        }
+
+        for (k = 1; k < DIFF_WINDOW && i + k < old_side->count; ++k) {
+            if (diff_same(&old_side->records[i + k], &new_side->records[j])) {
+                break;
+            }
+        }
+        if (k < DIFF_WINDOW && i + k < old_side->count) {
+            i += k;
+        } else {
+            ++i;
+            ++j;
+        }
+    }
+
+    return old_side->count - settled;
+}
+
+/**
+ * Copies the unsettled records of a side into partitions by the top bits
+ * of their hash, keeping file order within each partition.
+ * @param side The side.
+ * @param bits Log2 of the amount of partitions.
+ */
+static void diff_partition(struct diff_side * side, unsigned int bits)
+{
+    unsigned int partitions = 1u << bits, target;
+    unsigned int * fill = hf_calloc(partitions, sizeof(unsigned int));
+    struct diff_record * r;
+
+    side->offsets = hf_calloc(partitions + 1, sizeof(unsigned int));
+    side->items = hf_malloc(sizeof(struct diff_item) * (side->count ? side->count : 1));
+
+    for (unsigned int i = 0; i < side->count; ++i) {
+        if (!side->settled[i]) {
+            ++side->offsets[(bits ? side->records[i].hash >> (32 - bits) : 0) + 1];
+        }
+    }
+    for (unsigned int i = 0; i < partitions; ++i) {
+        side->offsets[i + 1] += side->offsets[i];
+    }
+
+    for (unsigned int i = 0; i < side->count; ++i) {
+        if (side->settled[i]) {
+            continue;
+        }
+        r = &side->records[i];
+        target = bits ? r->hash >> (32 - bits) : 0;
+        side->items[side->offsets[target] + fill[target]].hash = r->hash;
+        side->items[side->offsets[target] + fill[target]].ip_hash = r->ip_hash;
+        side->items[side->offsets[target] + fill[target]].record = i;
+        ++fill[target];
+    }
+
+    free(fill);
+}
+
+/* Orders removals by their old line, everything else by the new line. */
+static struct diff_side * diff_sort_sides[2];
+
+static int diff_compare(const void * a, const void * b)
+{
+    const struct diff_change * x = a, *y = b;
+    unsigned int lx, ly;
+
+    if ((x->type == '-') != (y->type == '-')) {
+        return x->type == '-' ? -1 : 1;
+    }
+
+    lx = x->type == '-' ? diff_sort_sides[0]->records[x->old_record].line : diff_sort_sides[1]->records[x->new_record].line;
+    ly = y->type == '-' ? diff_sort_sides[0]->records[y->old_record].line : diff_sort_sides[1]->records[y->new_record].line;
+    return (lx > ly) - (lx < ly);
+}
+
+/**
+ * Writes the original text of an entry.
+ * @param w Target writer.
+ * @param r The record.
+ */
+static void diff_write_line(struct writer * w, const struct diff_record * r)
+{
+    writer_bytes(w, r->ip, r->text_length);
+    writer_char(w, '\n');
+}
+
+static void diff_write_summary(struct writer * w, struct diff_change * c, struct diff_side * old_side, struct diff_side * new_side)
+{
+    struct diff_record * o = c->old_record != DIFF_NONE ? &old_side->records[c->old_record] : NULL;
+    struct diff_record * n = c->new_record != DIFF_NONE ? &new_side->records[c->new_record] : NULL;
+    struct diff_record * r = n ? n : o;
+
+    writer_char(w, c->type);
+    writer_char(w, ' ');
+    writer_bytes(w, r->domain, r->domain_length);
+    writer_char(w, '\t');
+    if (o && n) {
+        writer_bytes(w, o->ip, o->ip_length);
+        writer_string(w, " -> ");
+    }
+    writer_bytes(w, r->ip, r->ip_length);
+    writer_char(w, '\n');
+}
+
+static void diff_write_patch(struct writer * w, struct diff_change * c, struct diff_side * old_side, struct diff_side * new_side)
+{
+    struct diff_record * o = c->old_record != DIFF_NONE ? &old_side->records[c->old_record] : NULL;
+    struct diff_record * n = c->new_record != DIFF_NONE ? &new_side->records[c->new_record] : NULL;
+
+    writer_string(w, "@@ -");
+    writer_unsigned(w, o ? o->line : 0);
+    writer_string(w, o ? ",1 +" : ",0 +");
+    writer_unsigned(w, n ? n->line : 0);
+    writer_string(w, n ? ",1 @@\n" : ",0 @@\n");
+    if (o) {
+        writer_char(w, '-');
+        diff_write_line(w, o);
+    }
+    if (n) {
+        writer_char(w, '+');
+        diff_write_line(w, n);
+    }
+}
+
+/**
+ * Loads two files and finds their differences: removals ordered by their
+ * line in the old file, followed by the other changes ordered by their line
+ * in the new file.
+ * @param sides The old and new file, with their paths set.
+ * @param total Receives the amount of differences.
+ * @return The differences.
+ */
+static struct diff_change * diff_compute(struct diff_side * sides, unsigned long long * total)
+{
+    struct diff_worker * workers;
+    struct diff_job job;
+    struct diff_change * changes;
+    unsigned int count, left, bits = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t loader;
+    int threaded;
+
+    /* Both files are read and tokenized concurrently. */
+    stats_phase_begin("load");
+    threaded = pthread_create(&loader, NULL, diff_load, &sides[1]) == 0;
+    diff_load(&sides[0]);
+    if (threaded) {
+        pthread_join(loader, NULL);
+    } else {
+        diff_load(&sides[1]);
+    }
+    stats.bytes_read += sides[0].size + sides[1].size;
+    stats.entries_parsed += sides[0].count + sides[1].count;
+    stats_phase_end();
+
+    stats_phase_begin("join");
+    left = diff_settle(&sides[0], &sides[1]);
+    while (bits < 16 && (left >> bits) > DIFF_PARTITION_SIZE) {
+        ++bits;
+    }
+    diff_partition(&sides[0], bits);
+    diff_partition(&sides[1], bits);
+
+    job.old_side = &sides[0];
+    job.new_side = &sides[1];
+    job.partitions = 1u << bits;
+    atomic_init(&job.next, 0);
+    count = cpus < 1 ? 1 : cpus > DIFF_MAX_THREADS ? DIFF_MAX_THREADS : (unsigned int)cpus;
+    workers = hf_calloc(count, sizeof(struct diff_worker));
+    for (unsigned int i = 0; i < count; ++i) {
+        workers[i].job = &job;
+        workers[i].threaded = i > 0 && pthread_create(&workers[i].thread, NULL, diff_work, &workers[i]) == 0;
+    }
+    diff_work(&workers[0]);
+    for (unsigned int i = 0; i < count; ++i) {
+        if (workers[i].threaded) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        *total += workers[i].change_count;
+    }
+    stats_phase_end();
+
+    changes = hf_malloc(sizeof(struct diff_change) * (*total ? *total : 1));
+    *total = 0;
+    for (unsigned int i = 0; i < count; ++i) {
+        memcpy(changes + *total, workers[i].changes, sizeof(struct diff_change) * workers[i].change_count);
+        *total += workers[i].change_count;
+        free(workers[i].changes);
+        free(workers[i].slots);
+        free(workers[i].chain);
+        free(workers[i].matched);
+    }
+    free(workers);
+
+    diff_sort_sides[0] = &sides[0];
+    diff_sort_sides[1] = &sides[1];
+    qsort(changes, *total, sizeof(struct diff_change), diff_compare);
+
+    return changes;
+}
+
+static void diff_release(struct diff_side * sides, struct diff_change * changes)
+{
+    for (int i = 0; i < 2; ++i) {
+        free(sides[i].data);
+        free(sides[i].records);
+        free(sides[i].settled);
+        free(sides[i].items);
+        free(sides[i].offsets);
+    }
+    free(changes);
+}
+
+/**
+ * Compares two hosts files and writes their differences.
+ * @param old_path The original file.
+ * @param new_path The changed file.
+ * @param format Summary or patch.
+ * @param out Target file descriptor.
+ * @return The amount of differences.
+ */
+unsigned long long diff_files(const char * old_path, const char * new_path, enum diff_format format, int out)
+{
+    struct diff_side sides[2] = { { .path = old_path }, { .path = new_path } };
+    struct diff_change * changes;
+    unsigned long long total = 0;
+    struct writer w;
+
+    stats_phase_begin("diff");
+    changes = diff_compute(sides, &total);
+
+    stats_phase_begin("report");
+    writer_init(&w, out, 0);
+    if (format == DIFF_FORMAT_PATCH) {
+        writer_string(&w, "--- ");
+        writer_string(&w, old_path);
+        writer_string(&w, "\n+++ ");
+        writer_string(&w, new_path);
+        writer_char(&w, '\n');
+    }
+    for (unsigned long long i = 0; i < total; ++i) {
+        if (format == DIFF_FORMAT_PATCH) {
+            diff_write_patch(&w, &changes[i], &sides[0], &sides[1]);
+        } else {
+            diff_write_summary(&w, &changes[i], &sides[0], &sides[1]);
+        }
+    }
+    stats.bytes_written += w.flushed + w.length;
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats_phase_end();
+
+    diff_release(sides, changes);
+    stats_phase_end();
+
+    return total;
+}
+
+static int diff_compare_edits(const void * a, const void * b)
+{
+    const struct diff_edit * x = a, *y = b;
+
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+/**
+ * Applies changes to the loaded target, changing as little as possible.
+ * Removed lines are cut out, changed addresses are replaced within their
+ * line and new entries are appended, so comments and formatting of the
+ * target survive. The write is done the cheapest way possible: nothing at
+ * all if there are no changes, an append if entries are only added, an
+ * in-place rewrite if only the last DIFF_TAIL_SIZE bytes change and an
+ * atomic replacement otherwise. With the dry-run flag, the changes are
+ * listed instead.
+ * @param target_path The file to change.
+ * @param sides The target and the side the new records come from.
+ * @param changes The changes, removals and changes pointing into the target.
+ * @param total The amount of changes.
+ * @param lines Receives the amount of lines of the result.
+ * @param fingerprint Receives the fingerprint of the result.
+ */
+static void diff_rewrite(const char * target_path, struct diff_side * sides, struct diff_change * changes, unsigned long long total, unsigned int * lines, uint64_t * fingerprint)
+{
+    struct diff_side * target = &sides[0];
+    struct diff_edit * edits;
+    const struct diff_record * r;
+    const char * cursor, *end;
+    char * buffer;
+    unsigned long long count = 0;
+    struct fingerprint fp;
+    struct writer w;
+    size_t first;
+
+    stats.entries_touched += total;
+    if (dry_run_flag) {
+        writer_init(&w, STDOUT_FILENO, 0);
+        for (unsigned long long i = 0; i < total; ++i) {
+            diff_write_summary(&w, &changes[i], &sides[0], &sides[1]);
+        }
+        stats.bytes_written += w.flushed + w.length;
+        if (writer_close(&w) != 0) {
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+    }
+
+    /* Lines of the target that are removed or changed, in file order. */
+    edits = hf_malloc(sizeof(struct diff_edit) * (total ? total : 1));
+    *lines = target->lines;
+    for (unsigned long long i = 0; i < total; ++i) {
+        if (changes[i].type == '+') {
+            ++*lines;
+            continue;
+        }
+        r = &target->records[changes[i].old_record];
+        for (cursor = r->ip; cursor > target->data && cursor[-1] != '\n'; --cursor) {
+        }
+        end = memchr(r->ip + r->text_length, '\n', target->data + target->size - (r->ip + r->text_length));
+        edits[count].start = cursor;
+        edits[count].end = end ? end + 1 : target->data + target->size;
+        edits[count].old_record = r;
+        edits[count].new_record = changes[i].type == '~' ? &sides[1].records[changes[i].new_record] : NULL;
+        *lines -= edits[count].new_record == NULL;
+        ++count;
+    }
+    qsort(edits, count, sizeof(struct diff_edit), diff_compare_edits);
+
+    /* Everything before the first edit stays as it is. */
+    first = count ? (size_t)(edits[0].start - target->data) : target->size;
+    writer_init(&w, -1, 0);
+    cursor = target->data + first;
+    for (unsigned long long i = 0; i < count; ++i) {
+        writer_bytes(&w, cursor, edits[i].start - cursor);
+        if (edits[i].new_record) {
+            r = edits[i].old_record;
+            writer_bytes(&w, edits[i].start, r->ip - edits[i].start);
+            writer_bytes(&w, edits[i].new_record->ip, edits[i].new_record->ip_length);
+            writer_bytes(&w, r->ip + r->ip_length, edits[i].end - (r->ip + r->ip_length));
+        }
+        cursor = edits[i].end;
+    }
+    writer_bytes(&w, cursor, target->data + target->size - cursor);
+    for (unsigned long long i = 0; i < total; ++i) {
+        if (changes[i].type != '+') {
+            continue;
+        }
+        if (w.length ? w.buffer[w.length - 1] != '\n' : first && target->data[first - 1] != '\n') {
+            writer_char(&w, '\n');
+        }
+        diff_write_line(&w, &sides[1].records[changes[i].new_record]);
+    }
+
+    fingerprint_init(&fp);
+    fingerprint_update(&fp, target->data, first);
+    fingerprint_update(&fp, w.buffer, w.length);
+    *fingerprint = fingerprint_final(&fp);
+
+    stats.write_skipped = total == 0;
+    if (!dry_run_flag && total) {
+        stats_phase_begin("write");
+        if (count == 0) {
+            stats_phase_begin("append");
+            hosts_file_append(target_path, w.buffer, w.length);
+        } else if (target->size - first <= DIFF_TAIL_SIZE && w.length <= DIFF_TAIL_SIZE) {
+            stats_phase_begin("rewrite");
+            hosts_file_rewrite_tail(target_path, first, w.buffer, w.length);
+        } else {
+            stats_phase_begin("replace");
+            /* The untouched head goes in front of the new tail. */
+            buffer = hf_malloc(first + w.length + 1);
+            memcpy(buffer, target->data, first);
+            memcpy(buffer + first, w.buffer, w.length);
+            hosts_file_replace(target_path, buffer, first + w.length);
+            free(buffer);
+        }
+        stats_phase_end();
+        stats_phase_end();
+    }
+
+    writer_close(&w);
+    free(edits);
+}
+
+/**
+ * Makes a hosts file hold exactly the entries of another, like diff_rewrite.
+ * @param target_path The file to change.
+ * @param desired_path The file holding the desired entries.
+ * @param lines Receives the amount of lines of the result.
+ * @param fingerprint Receives the fingerprint of the result.
+ * @return The amount of entries that changed.
+ */
+unsigned long long diff_reconcile(const char * target_path, const char * desired_path, unsigned int * lines, uint64_t * fingerprint)
+{
+    struct diff_side sides[2] = { { .path = target_path }, { .path = desired_path } };
+    struct diff_change * changes;
+    unsigned long long total = 0;
+
+    stats_phase_begin("reconcile");
+    changes = diff_compute(sides, &total);
+    diff_rewrite(target_path, sides, changes, total, lines, fingerprint);
+    diff_release(sides, changes);
+    stats_phase_end();
+
+    return total;
+}
+
+/* An address as matched when applying a delta: in binary if it parses. */
+struct diff_address {
+    unsigned int family;
+    unsigned char binary[16];
+    const char * text;
+    size_t length;
+};
+
+/* A change read from a delta, and the record of the target it applies to. */
+struct diff_delta_change {
+    char type;
+    size_t domain;
+    size_t domain_length;
+    struct diff_address old_address;
+    unsigned int hash;
+    unsigned int new_record;
+    unsigned int target;
+};
+
+/**
+ * Parses an address the way merkle_hash_entry does.
+ * @param a Receives the address; its family is zero if it doesn't parse.
+ * @param ip The text of the address.
+ * @param length Its length.
+ * @return Non-zero if the text is the canonical form of the address.
+ */
+static int diff_address_of(struct diff_address * a, const char * ip, size_t length)
+{
+    char text[INET6_ADDRSTRLEN], canonical[INET6_ADDRSTRLEN];
+    int family;
+
+    a->family = 0;
+    a->text = ip;
+    a->length = length;
+    if (length >= sizeof(text)) {
+        return 0;
+    }
+    memcpy(text, ip, length);
+    text[length] = '\0';
+    family = memchr(text, ':', length) ? AF_INET6 : AF_INET;
+    if (inet_pton(family, text, a->binary) != 1) {
+        return 0;
+    }
+    a->family = family == AF_INET6 ? 6 : 4;
+
+    return inet_ntop(family, a->binary, canonical, sizeof(canonical)) && strcmp(canonical, text) == 0;
+}
+
+static int diff_same_address(const struct diff_address * a, const struct diff_address * b)
+{
+    if (a->family != b->family) {
+        return 0;
+    }
+
+    return a->family ? memcmp(a->binary, b->binary, a->family == 4 ? 4 : 16) == 0 : a->length == b->length && memcmp(a->text, b->text, a->length) == 0;
+}
+
+/**
+ * FNV-1a over a domain, lowercase, by which deltas are matched.
+ * @return 32-bit hash.
+ */
+static unsigned int diff_hash_domain(const char * domain, size_t length)
+{
+    unsigned int hash = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)diff_lower(domain[i])) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* The record a change of a delta is filed under, for diff_compare_delta. */
+static const struct diff_record * diff_delta_record(const struct diff_change * c)
+{
+    return c->new_record != DIFF_NONE ? &diff_sort_sides[1]->records[c->new_record] : &diff_sort_sides[0]->records[c->old_record];
+}
+
+/* Orders changes by normalized domain, then by family, type and line. */
+static int diff_compare_delta(const void * a, const void * b)
+{
+    const struct diff_change * x = a, *y = b;
+    const struct diff_record * p = diff_delta_record(x), *q = diff_delta_record(y);
+    unsigned int length = p->domain_length < q->domain_length ? p->domain_length : q->domain_length;
+    unsigned char cp, cq;
+
+    for (unsigned int i = 0; i < length; ++i) {
+        cp = (unsigned char)diff_lower(p->domain[i]);
+        cq = (unsigned char)diff_lower(q->domain[i]);
+        if (cp != cq) {
+            return cp < cq ? -1 : 1;
+        }
+    }
+    if (p->domain_length != q->domain_length) {
+        return p->domain_length < q->domain_length ? -1 : 1;
+    }
+    if (diff_is_ipv6(p) != diff_is_ipv6(q)) {
+        return diff_is_ipv6(p) - diff_is_ipv6(q);
+    }
+    if (x->type != y->type) {
+        return x->type < y->type ? -1 : 1;
+    }
+
+    return (p->line > q->line) - (p->line < q->line);
+}
+
+static void diff_write_varint(struct writer * w, uint64_t value)
+{
+    unsigned char bytes[10];
+    size_t length = 0;
+
+    do {
+        bytes[length++] = (unsigned char)((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while (value);
+    writer_bytes(w, bytes, length);
+}
+
+static void diff_write_u64le(struct writer * w, uint64_t value)
+{
+    writer_u32le(w, (uint32_t)value);
+    writer_u32le(w, (uint32_t)(value >> 32));
+}
+
+/**
+ * Writes an address of a delta: in binary if that gives back the same text.
+ * @param w Target writer.
+ * @param r The record holding the address.
+ */
+static void diff_write_address(struct writer * w, const struct diff_record * r)
+{
+    struct diff_address a;
+
+    if (diff_address_of(&a, r->ip, r->ip_length)) {
+        writer_char(w, (char)a.family);
+        writer_bytes(w, a.binary, a.family == 4 ? 4 : 16);
+    } else {
+        writer_char(w, 0);
+        diff_write_varint(w, r->ip_length);
+        writer_bytes(w, r->ip, r->ip_length);
+    }
+}
+
+/**
+ * Writes a delta turning the entries of one file into those of another,
+ * as described in diff.h.
+ * @param old_path The original file.
+ * @param new_path The changed file.
+ * @param out Target file descriptor.
+ * @return The amount of changes.
+ */
+unsigned long long diff_delta(const char * old_path, const char * new_path, int out)
+{
+    struct diff_side sides[2] = { { .path = old_path }, { .path = new_path } };
+    struct merkle_tree * tree = hf_malloc(sizeof(struct merkle_tree));
+    struct diff_change * changes;
+    const struct diff_record * r;
+    unsigned long long total = 0;
+    unsigned int shared, previous_length = 0;
+    char * previous = hf_malloc(1), *domain = hf_malloc(1), *swap;
+    struct writer w, output;
+
+    stats_phase_begin("delta");
+    changes = diff_compute(sides, &total);
+    qsort(changes, total, sizeof(struct diff_change), diff_compare_delta);
+
+    writer_init(&w, -1, 0);
+    writer_bytes(&w, DIFF_DELTA_MAGIC, 8);
+    writer_u32le(&w, DIFF_DELTA_VERSION);
+    writer_u32le(&w, DIFF_DELTA_HEADER_SIZE);
+    merkle_build(tree, (char *)old_path, 0);
+    diff_write_u64le(&w, tree->nodes[0]);
+    merkle_build(tree, (char *)new_path, 0);
+    diff_write_u64le(&w, tree->nodes[0]);
+    diff_write_u64le(&w, total);
+
+    stats_phase_begin("encode");
+    for (unsigned long long i = 0; i < total; ++i) {
+        r = diff_delta_record(&changes[i]);
+        domain = hf_realloc(domain, r->domain_length + 1);
+        for (unsigned int j = 0; j < r->domain_length; ++j) {
+            domain[j] = diff_lower(r->domain[j]);
+        }
+        for (shared = 0; shared < previous_length && shared < r->domain_length && previous[shared] == domain[shared]; ++shared) {
+        }
+        diff_write_varint(&w, shared);
+        diff_write_varint(&w, r->domain_length - shared);
+        writer_bytes(&w, domain + shared, r->domain_length - shared);
+        writer_char(&w, changes[i].type);
+        if (changes[i].type != '+') {
+            diff_write_address(&w, &sides[0].records[changes[i].old_record]);
+        }
+        if (changes[i].type != '-') {
+            diff_write_address(&w, &sides[1].records[changes[i].new_record]);
+        }
+        swap = previous;
+        previous = domain;
+        domain = swap;
+        previous_length = r->domain_length;
+    }
+    diff_write_u64le(&w, fingerprint_bytes(w.buffer, w.length));
+    stats_phase_end();
+
+    writer_init(&output, out, 0);
+    writer_bytes(&output, w.buffer, w.length);
+    stats.bytes_written += output.flushed + output.length;
+    if (writer_close(&output) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+
+    writer_close(&w);
+    free(previous);
+    free(domain);
+    free(tree);
+    diff_release(sides, changes);
+    stats_phase_end();
+
+    return total;
+}
+
+static int diff_read_varint(const unsigned char ** cursor, const unsigned char * end, uint64_t * value)
+{
+    unsigned char byte;
+
+    *value = 0;
+    for (unsigned int shift = 0; *cursor < end && shift < 64; shift += 7) {
+        byte = *(*cursor)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static uint64_t diff_read_u64le(const unsigned char * p)
+{
+    uint64_t value = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        value = value << 8 | p[i];
+    }
+
+    return value;
+}
+
+/**
+ * Reads an address of a delta.
+ * @param a Receives the address; text ones point into the delta.
+ * @param text Receives the text of the address, unless NULL.
+ * @param cursor Position in the delta, moved past the address.
+ * @param end End of the changes.
+ * @return Zero, or -1 if the delta is corrupt.
+ */
+static int diff_read_address(struct diff_address * a, struct writer * text, const unsigned char ** cursor, const unsigned char * end)
+{
+    char buffer[INET6_ADDRSTRLEN];
+    uint64_t length;
+    unsigned int family;
+
+    if (*cursor >= end) {
+        return -1;
+    }
+    family = *(*cursor)++;
+    if (family == 4 || family == 6) {
+        if ((size_t)(end - *cursor) < (family == 4 ? 4u : 16u)) {
+            return -1;
+        }
+        a->family = family;
+        memcpy(a->binary, *cursor, family == 4 ? 4 : 16);
+        *cursor += family == 4 ? 4 : 16;
+        if (text) {
+            inet_ntop(family == 4 ? AF_INET : AF_INET6, a->binary, buffer, sizeof(buffer));
+            writer_string(text, buffer);
+        }
+        return 0;
+    }
+    if (family != 0 || diff_read_varint(cursor, end, &length) != 0 || length == 0 || length > (uint64_t)(end - *cursor)) {
+        return -1;
+    }
+    diff_address_of(a, (const char *)*cursor, (size_t)length);
+    if (text) {
+        writer_bytes(text, *cursor, (size_t)length);
+    }
+    *cursor += length;
+
+    return 0;
+}
+
+/**
+ * Reads a delta into memory and checks its header and trailer.
+ * @param path The delta.
+ * @param size Receives its size.
+ * @return Its contents.
+ */
+static unsigned char * diff_read_delta(const char * path, size_t * size)
+{
+    unsigned char * data;
+    struct stat st;
+    ssize_t got;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+    data = hf_malloc((size_t)st.st_size + 1);
+    for (*size = 0; *size < (size_t)st.st_size && (got = read(fd, data + *size, (size_t)st.st_size - *size)) != 0;) {
+        if (got < 0 && errno != EINTR) {
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        *size += got > 0 ? (size_t)got : 0;
+    }
+    close(fd);
+    stats.bytes_read += *size;
+
+    if (*size < DIFF_DELTA_HEADER_SIZE + 8 || memcmp(data, DIFF_DELTA_MAGIC, 8) != 0 || diff_read_u64le(data + 8) != ((uint64_t)DIFF_DELTA_HEADER_SIZE << 32 | DIFF_DELTA_VERSION) || diff_read_u64le(data + *size - 8) != fingerprint_bytes(data, *size - 8)) {
+        fprintf(stderr, PROGRAM_NAME ": %s is not a valid delta.\n", path);
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+
+    return data;
+}
+
+/**
+ * Applies a delta written by diff_delta. The target must hold the entries
+ * of the file the delta was made from, as told by their Merkle roots, and
+ * every removed or changed entry is matched to a line of the target before
+ * anything is written, the way diff_rewrite does. A target that already
+ * holds the entries of the new file is left alone.
+ * @param target_path The file to change.
+ * @param delta_path The delta.
+ * @param lines Receives the amount of lines of the result.
+ * @param fingerprint Receives the fingerprint of the result.
+ * @return ERROR_CODE_SUCCESS, or ERROR_CODE_DELTA_MISMATCH if the target
+ * doesn't hold the entries the delta was made from; it is left alone then.
+ */
+enum error_code diff_apply_delta(const char * target_path, const char * delta_path, unsigned int * lines, uint64_t * fingerprint)
+{
+    struct diff_side sides[2] = { { .path = target_path }, { .path = delta_path } };
+    struct diff_side * target = &sides[0], *added = &sides[1];
+    struct merkle_tree * tree = hf_malloc(sizeof(struct merkle_tree));
+    struct diff_delta_change * deltas, *d;
+    struct diff_change * changes;
+    struct diff_record * r;
+    struct diff_address a;
+    struct writer names, text;
+    const unsigned char * cursor, *end;
+    unsigned char * data;
+    char * domain = hf_malloc(1);
+    uint64_t count, shared, rest, root;
+    unsigned int * slots, slot_count = 16, mask, hash, j, previous_length = 0, unmatched = 0;
+    int parsed;
+    size_t size, * starts;
+    enum error_code code = ERROR_CODE_SUCCESS;
+
+    stats_phase_begin("apply");
+    data = diff_read_delta(delta_path, &size);
+    count = diff_read_u64le(data + 32);
+    merkle_build(tree, (char *)target_path, 0);
+    root = tree->nodes[0];
+    free(tree);
+    if (root == diff_read_u64le(data + 24) && root != diff_read_u64le(data + 16)) {
+        count = 0;
+    } else if (root != diff_read_u64le(data + 16)) {
+        free(domain);
+        free(data);
+        stats_phase_end();
+        return ERROR_CODE_DELTA_MISMATCH;
+    }
+    if (count > size) {
+        fprintf(stderr, PROGRAM_NAME ": %s is not a valid delta.\n", delta_path);
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+
+    /* Domains go to one buffer, the lines of added and changed entries to another. */
+    stats_phase_begin("decode");
+    deltas = hf_malloc(sizeof(struct diff_delta_change) * (count ? count : 1));
+    added->records = hf_malloc(sizeof(struct diff_record) * (count ? count : 1));
+    starts = hf_malloc(sizeof(size_t) * (count ? count : 1));
+    writer_init(&names, -1, 0);
+    writer_init(&text, -1, 0);
+    cursor = data + DIFF_DELTA_HEADER_SIZE;
+    end = data + size - 8;
+    for (uint64_t i = 0; i < count; ++i) {
+        d = &deltas[i];
+        if (diff_read_varint(&cursor, end, &shared) != 0 || diff_read_varint(&cursor, end, &rest) != 0 || shared > previous_length || rest >= (uint64_t)(end - cursor)) {
+            fprintf(stderr, PROGRAM_NAME ": %s is not a valid delta.\n", delta_path);
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        domain = hf_realloc(domain, shared + rest + 1);
+        memcpy(domain + shared, cursor, rest);
+        cursor += rest;
+        previous_length = (unsigned int)(shared + rest);
+        d->domain = names.length;
+        d->domain_length = previous_length;
+        writer_bytes(&names, domain, previous_length);
+        writer_char(&names, '\0');
+
+        d->type = (char)*cursor++;
+        d->target = DIFF_NONE;
+        d->new_record = DIFF_NONE;
+        if (d->type != '-' && d->type != '+' && d->type != '~') {
+            fprintf(stderr, PROGRAM_NAME ": %s is not a valid delta.\n", delta_path);
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        if (d->type != '+') {
+            if (diff_read_address(&d->old_address, NULL, &cursor, end) != 0) {
+                fprintf(stderr, PROGRAM_NAME ": %s is not a valid delta.\n", delta_path);
+                handle_error(ERROR_CODE_INVALID_FILE);
+            }
+            ++unmatched;
+        }
+        if (d->type != '-') {
+            r = &added->records[added->count];
+            starts[added->count] = text.length;
+            if (diff_read_address(&a, &text, &cursor, end) != 0) {
+                fprintf(stderr, PROGRAM_NAME ": %s is not a valid delta.\n", delta_path);
+                handle_error(ERROR_CODE_INVALID_FILE);
+            }
+            r->ip_length = (unsigned int)(text.length - starts[added->count]);
+            r->domain_length = previous_length;
+            r->text_length = r->ip_length + 1 + r->domain_length;
+            r->line = 0;
+            writer_char(&text, '\t');
+            writer_bytes(&text, domain, previous_length);
+            d->new_record = added->count++;
+        }
+    }
+    for (unsigned int i = 0; i < added->count; ++i) {
+        added->records[i].ip = text.buffer + starts[i];
+        added->records[i].domain = added->records[i].ip + added->records[i].ip_length + 1;
+    }
+    added->data = text.buffer;
+    free(starts);
+    free(domain);
+    stats_phase_end();
+
+    /* Removed and changed entries are looked up by domain and address. */
+    stats_phase_begin("match");
+    while (slot_count < unmatched * 2) {
+        slot_count *= 2;
+    }
+    mask = slot_count - 1;
+    slots = hf_malloc(sizeof(unsigned int) * slot_count);
+    memset(slots, 0xff, sizeof(unsigned int) * slot_count);
+    for (uint64_t i = 0; i < count; ++i) {
+        d = &deltas[i];
+        if (d->type == '+') {
+            continue;
+        }
+        d->hash = diff_hash_domain(names.buffer + d->domain, d->domain_length);
+        for (j = d->hash & mask; slots[j] != DIFF_NONE; j = (j + 1) & mask) {
+        }
+        slots[j] = (unsigned int)i;
+    }
+
+    if (unmatched) {
+        diff_load(target);
+    }
+    /* Addresses are only parsed for lines whose domain has changes. */
+    for (unsigned int i = 0; i < target->count && unmatched; ++i) {
+        r = &target->records[i];
+        hash = diff_hash_domain(r->domain, r->domain_length);
+        parsed = 0;
+        for (j = hash & mask; slots[j] != DIFF_NONE; j = (j + 1) & mask) {
+            d = &deltas[slots[j]];
+            if (d->hash != hash || d->target != DIFF_NONE || d->domain_length != r->domain_length) {
+                continue;
+            }
+            for (shared = 0; shared < r->domain_length && names.buffer[d->domain + shared] == diff_lower(r->domain[shared]); ++shared) {
+            }
+            if (shared < r->domain_length) {
+                continue;
+            }
+            if (!parsed) {
+                diff_address_of(&a, r->ip, r->ip_length);
+                parsed = 1;
+            }
+            if (diff_same_address(&d->old_address, &a)) {
+                d->target = i;
+                --unmatched;
+                break;
+            }
+        }
+    }
+    if (!target->data) {
+        diff_load(target);
+    }
+    stats.bytes_read += target->size;
+    stats.entries_parsed += target->count;
+    stats_phase_end();
+
+    changes = NULL;
+    if (unmatched) {
+        code = ERROR_CODE_DELTA_MISMATCH;
+    } else {
+        changes = hf_malloc(sizeof(struct diff_change) * (count ? count : 1));
+        for (uint64_t i = 0; i < count; ++i) {
+            changes[i].type = deltas[i].type;
+            changes[i].old_record = deltas[i].target;
+            changes[i].new_record = deltas[i].new_record;
+        }
+        diff_rewrite(target_path, sides, changes, count, lines, fingerprint);
+    }
+
+    writer_close(&names);
+    free(slots);
+    free(deltas);
+    free(data);
+    diff_release(sides, changes);
+    stats_phase_end();
+
+    return code;
+}
+
+/* A key of a three-way merge, with the entries each file has for it. */
+struct diff_key {
+    const struct diff_record * record;
+    unsigned int first[3];
+    unsigned int last[3];
+    char resolution;
+    char emitted;
+};
+
+/* The three files of a merge and their keys. */
+struct diff_merge {
+    struct diff_side sides[3];
+    unsigned int * next[3];
+    unsigned int * key_of[3];
+    struct diff_key * keys;
+    unsigned int key_count;
+    unsigned int * slots;
+    unsigned int mask;
+};
+
+static void diff_merge_insert(struct diff_merge * m, int side, unsigned int record)
+{
+    const struct diff_record * r = &m->sides[side].records[record];
+    struct diff_key * k;
+    unsigned int j;
+
+    for (j = r->hash & m->mask; m->slots[j] != DIFF_NONE; j = (j + 1) & m->mask) {
+        if (diff_same_key(m->keys[m->slots[j]].record, r)) {
+            break;
+        }
+    }
+    if (m->slots[j] == DIFF_NONE) {
+        m->slots[j] = m->key_count;
+        k = &m->keys[m->key_count++];
+        k->record = r;
+        memset(k->first, 0xff, sizeof(k->first));
+        k->resolution = 0;
+        k->emitted = 0;
+    }
+
+    /* Entries are chained in file order. */
+    k = &m->keys[m->slots[j]];
+    m->key_of[side][record] = m->slots[j];
+    m->next[side][record] = DIFF_NONE;
+    if (k->first[side] == DIFF_NONE) {
+        k->first[side] = record;
+    } else {
+        m->next[side][k->last[side]] = record;
+    }
+    k->last[side] = record;
+}
+
+/**
+ * Tells whether every address one file maps a key to is also mapped by
+ * another. Keys have a handful of addresses at most.
+ * @param m The merge.
+ * @param k The key.
+ * @param a One file.
+ * @param b Another file.
+ * @return Non-zero if so.
+ */
+static int diff_merge_subset(const struct diff_merge * m, const struct diff_key * k, int a, int b)
+{
+    unsigned int j;
+
+    for (unsigned int i = k->first[a]; i != DIFF_NONE; i = m->next[a][i]) {
+        for (j = k->first[b]; j != DIFF_NONE; j = m->next[b][j]) {
+            if (diff_same_ip(&m->sides[a].records[i], &m->sides[b].records[j])) {
+                break;
+            }
+        }
+        if (j == DIFF_NONE) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static inline int diff_merge_same(const struct diff_merge * m, const struct diff_key * k, int a, int b)
+{
+    return diff_merge_subset(m, k, a, b) && diff_merge_subset(m, k, b, a);
+}
+
+/* Copies a line of a file, completing a last line that has no newline. */
+static void diff_write_text(struct writer * w, const char * start, const char * end)
+{
+    writer_bytes(w, start, end - start);
+    if (end[-1] != '\n') {
+        writer_char(w, '\n');
+    }
+}
+
+static void diff_merge_addresses(struct writer * w, const struct diff_merge * m, const struct diff_key * k, int side)
+{
+    const struct diff_record * r;
+
+    writer_char(w, '[');
+    for (unsigned int i = k->first[side]; i != DIFF_NONE; i = m->next[side][i]) {
+        r = &m->sides[side].records[i];
+        if (i != k->first[side]) {
+            writer_char(w, ',');
+        }
+        writer_json_bytes(w, r->ip, r->ip_length);
+    }
+    writer_char(w, ']');
+}
+
+/**
+ * Merges the changes two files made to a common base. Entries are matched on
+ * their key through a single hash table, so the merge is linear in the size
+ * of the files. Per key, a side that left the addresses of the base alone
+ * takes the other side's; if both changed them differently, the key is in
+ * conflict and ours is kept.
+ *
+ * The result is ours, with its comments and order, where keys taken from
+ * theirs replace the first line of the key and keys only theirs has are
+ * appended. Conflicts are reported as one JSON object per line:
+ *
+ *     {"domain":"foo.lan","family":4,"base":["10.0.0.1"],"ours":[...],"theirs":[...]}
+ *
+ * @param base_path The common ancestor.
+ * @param ours_path The local version.
+ * @param theirs_path The upstream version.
+ * @param out Receives the merged file.
+ * @param conflicts Receives the conflicts.
+ * @return The amount of conflicts.
+ */
+unsigned long long diff_merge3(const char * base_path, const char * ours_path, const char * theirs_path, int out, int conflicts)
+{
+    struct diff_merge m = { .sides = { { .path = base_path }, { .path = ours_path }, { .path = theirs_path } } };
+    struct diff_side * ours = &m.sides[1], *theirs = &m.sides[2];
+    unsigned long long conflict_count = 0;
+    unsigned int slot_count = 16, total, record = 0, line = 0;
+    const char * cursor, *end, *next;
+    pthread_t loaders[2];
+    int threaded[2];
+    struct diff_key * k;
+    struct writer w;
+
+    stats_phase_begin("merge3");
+    stats_phase_begin("load");
+    for (int i = 0; i < 2; ++i) {
+        threaded[i] = pthread_create(&loaders[i], NULL, diff_load, &m.sides[i + 1]) == 0;
+    }
+    diff_load(&m.sides[0]);
+    for (int i = 0; i < 2; ++i) {
+        if (threaded[i]) {
+            pthread_join(loaders[i], NULL);
+        } else {
+            diff_load(&m.sides[i + 1]);
+        }
+    }
+    stats_phase_end();
+
+    stats_phase_begin("join");
+    total = m.sides[0].count + ours->count + theirs->count;
+    while (slot_count < total * 2) {
+        slot_count *= 2;
+    }
+    m.mask = slot_count - 1;
+    m.slots = hf_malloc(sizeof(unsigned int) * slot_count);
+    memset(m.slots, 0xff, sizeof(unsigned int) * slot_count);
+    m.keys = hf_malloc(sizeof(struct diff_key) * (total ? total : 1));
+    for (int side = 0; side < 3; ++side) {
+        stats.bytes_read += m.sides[side].size;
+        stats.entries_parsed += m.sides[side].count;
+        m.next[side] = hf_malloc(sizeof(unsigned int) * (m.sides[side].count ? m.sides[side].count : 1));
+        m.key_of[side] = hf_malloc(sizeof(unsigned int) * (m.sides[side].count ? m.sides[side].count : 1));
+        for (unsigned int i = 0; i < m.sides[side].count; ++i) {
+            diff_merge_insert(&m, side, i);
+        }
+    }
+
+    writer_init(&w, conflicts, 0);
+    for (unsigned int i = 0; i < m.key_count; ++i) {
+        k = &m.keys[i];
+        if (diff_merge_same(&m, k, 1, 2) || diff_merge_same(&m, k, 0, 2)) {
+            k->resolution = 'o';
+        } else if (diff_merge_same(&m, k, 0, 1)) {
+            k->resolution = 't';
+            ++stats.entries_touched;
+        } else {
+            k->resolution = 'o';
+            ++conflict_count;
+            writer_string(&w, "{\"domain\":");
+            writer_json_bytes(&w, k->record->domain, k->record->domain_length);
+            writer_string(&w, diff_is_ipv6(k->record) ? ",\"family\":6,\"base\":" : ",\"family\":4,\"base\":");
+            diff_merge_addresses(&w, &m, k, 0);
+            writer_string(&w, ",\"ours\":");
+            diff_merge_addresses(&w, &m, k, 1);
+            writer_string(&w, ",\"theirs\":");
+            diff_merge_addresses(&w, &m, k, 2);
+            writer_string(&w, "}\n");
+        }
+    }
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats_phase_end();
+
+    /* Ours, line by line, with the keys theirs changed swapped in. */
+    stats_phase_begin("report");
+    writer_init(&w, out, 0);
+    for (cursor = ours->data, end = ours->data + ours->size; cursor < end; cursor = next) {
+        next = memchr(cursor, '\n', end - cursor);
+        next = next ? next + 1 : end;
+        ++line;
+        if (record == ours->count || ours->records[record].line != line) {
+            diff_write_text(&w, cursor, next);
+            continue;
+        }
+
+        k = &m.keys[m.key_of[1][record++]];
+        if (k->resolution == 'o') {
+            diff_write_text(&w, cursor, next);
+        } else if (!k->emitted) {
+            for (unsigned int i = k->first[2]; i != DIFF_NONE; i = m.next[2][i]) {
+                diff_write_line(&w, &theirs->records[i]);
+            }
+        }
+        k->emitted = 1;
+    }
+    for (unsigned int i = 0; i < theirs->count; ++i) {
+        k = &m.keys[m.key_of[2][i]];
+        if (k->resolution == 't' && k->first[1] == DIFF_NONE) {
+            diff_write_line(&w, &theirs->records[i]);
+        }
+    }
+    stats.bytes_written += w.flushed + w.length;
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats_phase_end();
+
+    for (int side = 0; side < 3; ++side) {
+        free(m.sides[side].data);
+        free(m.sides[side].records);
+        free(m.next[side]);
+        free(m.key_of[side]);
+    }
+    free(m.keys);
+    free(m.slots);
+    stats_phase_end();
+
+    return conflict_count;
+}
@@ -0,0 +1,49 @@
+/*
+ * Structural comparison of two hosts files.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "hostsfile.h"
+
+#include <stdint.h>
+
+/* Upper bound of threads comparing partitions. */
+#define DIFF_MAX_THREADS 16
+
+/*
+ * Layout of a delta, all integers little-endian:
+ *
+ *     header   magic "HFDELTA\0", u32 version, u32 header size, u64 Merkle
+ *              root of the old file, u64 root of the new one, u64 change count
+ *     change   varint length of the prefix shared with the previous domain,
+ *              varint length of the rest, the rest, type '-', '+' or '~',
+ *              the old address unless added, the new one unless removed
+ *     address  u8 4 or 6 and the address in binary if that is its canonical
+ *              form, else u8 zero, varint length and the text
+ *     trailer  u64 fingerprint of everything before it
+ *
+ * Changes are sorted by domain, lowercase and without trailing dot, which
+ * is what makes the prefixes long. Varints hold seven bits per byte, the
+ * lowest first, with the high bit set on all but the last.
+ */
+#define DIFF_DELTA_MAGIC "HFDELTA\0"
+#define DIFF_DELTA_VERSION 1
+#define DIFF_DELTA_HEADER_SIZE 40
+
+enum diff_format {
+    DIFF_FORMAT_SUMMARY,
+    DIFF_FORMAT_PATCH,
+};
+
+unsigned long long diff_files(const char * old_path, const char * new_path, enum diff_format format, int out);
+unsigned long long diff_merge3(const char * base_path, const char * ours_path, const char * theirs_path, int out, int conflicts);
+unsigned long long diff_reconcile(const char * target_path, const char * desired_path, unsigned int * lines, uint64_t * fingerprint);
+unsigned long long diff_delta(const char * old_path, const char * new_path, int out);
+enum error_code diff_apply_delta(const char * target_path, const char * delta_path, unsigned int * lines, uint64_t * fingerprint);
+
+#endif
@@ -0,0 +1,513 @@
+/*
+ * Structured export formats for tooling that consumes hosts files, and
+ * configuration for resolvers that should serve the same entries.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "export.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Upper bound of addresses considered per domain by resolver exporters. */
+#define EXPORT_MAX_MATCHES 16
+
+/* Set by CLI arguments. */
+enum export_format export_format = EXPORT_FORMAT_NONE;
+
+typedef void (*export_function)(struct writer *, struct hosts_file *);
+
+/**
+ * Writes the fields of an entry as JSON object members.
+ * @param w Target writer.
+ * @param map The entry.
+ * @param line Position of the entry in the hosts file.
+ */
+static void export_json_members(struct writer * w, struct map * map, unsigned int line)
+{
+    writer_string(w, "{\"line\":");
+    writer_unsigned(w, line);
+    writer_string(w, ",\"ip\":");
+    writer_json_string(w, map->ip);
+    writer_string(w, ",\"domain\":");
+    writer_json_string(w, map->domain);
+    writer_string(w, map->kind == IP_KIND_IPv4 ? ",\"kind\":4}" : ",\"kind\":6}");
+}
+
+static void export_json(struct writer * w, struct hosts_file * hosts_file)
+{
+    int first = 1;
+
+    writer_char(w, '[');
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type == UNION_ELEMENT) {
+            if (!first) {
+                writer_char(w, ',');
+            }
+            export_json_members(w, &hosts_file->entries[i].value.map, hosts_file_line(hosts_file, i));
+            first = 0;
+        }
+    }
+    writer_string(w, "]\n");
+}
+
+static void export_ndjson(struct writer * w, struct hosts_file * hosts_file)
+{
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type == UNION_ELEMENT) {
+            export_json_members(w, &hosts_file->entries[i].value.map, hosts_file_line(hosts_file, i));
+            writer_char(w, '\n');
+        }
+    }
+}
+
+static void export_csv(struct writer * w, struct hosts_file * hosts_file)
+{
+    struct map * map;
+
+    writer_string(w, "line,ip,domain,kind\r\n");
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type == UNION_ELEMENT) {
+            map = &hosts_file->entries[i].value.map;
+            writer_unsigned(w, hosts_file_line(hosts_file, i));
+            writer_char(w, ',');
+            writer_csv_string(w, map->ip);
+            writer_char(w, ',');
+            writer_csv_string(w, map->domain);
+            writer_string(w, map->kind == IP_KIND_IPv4 ? ",4\r\n" : ",6\r\n");
+        }
+    }
+}
+
+static void export_bin(struct writer * w, struct hosts_file * hosts_file)
+{
+    static const char padding[4] = { 0 };
+    size_t ip_length, domain_length, size;
+    unsigned int count = 0;
+    struct map * map;
+
+    /* The count goes in front, so streaming needs one pass to find it. */
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        count += hosts_file->entries[i].type == UNION_ELEMENT;
+    }
+
+    writer_bytes(w, EXPORT_BIN_MAGIC, 4);
+    writer_u32le(w, EXPORT_BIN_VERSION);
+    writer_u32le(w, count);
+    writer_u32le(w, EXPORT_BIN_HEADER_SIZE);
+
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type != UNION_ELEMENT) {
+            continue;
+        }
+        map = &hosts_file->entries[i].value.map;
+        ip_length = strlen(map->ip);
+        domain_length = strlen(map->domain);
+        size = EXPORT_BIN_RECORD_SIZE + ip_length + 1 + domain_length + 1;
+        writer_u32le(w, (uint32_t)((size + 3) & ~(size_t)3));
+        writer_u32le(w, (uint32_t)ip_length);
+        writer_u32le(w, (uint32_t)domain_length);
+        writer_u32le(w, map->kind == IP_KIND_IPv4 ? 4 : 6);
+        writer_bytes(w, map->ip, ip_length + 1);
+        writer_bytes(w, map->domain, domain_length + 1);
+        writer_bytes(w, padding, -size & 3);
+    }
+}
+
+static void export_hosts(struct writer * w, struct hosts_file * hosts_file)
+{
+    hosts_file_serialize(w, hosts_file);
+}
+
+/**
+ * Blocklists map domains onto the unspecified address; resolvers should
+ * answer those with NXDOMAIN rather than the address itself.
+ * @param ip An IP address.
+ * @return Non-zero if it's the unspecified address.
+ */
+static int export_is_sink(const char * ip)
+{
+    return strcmp(ip, "0.0.0.0") == 0 || strcmp(ip, "::") == 0 || strcmp(ip, "::0") == 0;
+}
+
+/**
+ * Resolvers can't mix a blocked domain with addresses for it, so a domain
+ * with any sink address is blocked as a whole, by the first of its entries.
+ * @param hosts_file The hosts file, with its index built.
+ * @param entry Position of an entry.
+ * @param blocked Set to non-zero if the domain of the entry is blocked.
+ * @return Non-zero if an earlier entry has the same domain.
+ */
+static int export_domain_seen(struct hosts_file * hosts_file, unsigned int entry, int * blocked)
+{
+    unsigned int matches[EXPORT_MAX_MATCHES], found;
+    int earlier = 0;
+
+    found = hosts_file_find(hosts_file, hosts_file->entries[entry].value.map.domain, matches, EXPORT_MAX_MATCHES);
+    found = found < EXPORT_MAX_MATCHES ? found : EXPORT_MAX_MATCHES;
+
+    *blocked = 0;
+    for (unsigned int i = 0; i < found; ++i) {
+        *blocked |= export_is_sink(hosts_file->entries[matches[i]].value.map.ip);
+        earlier |= matches[i] < entry;
+    }
+
+    return earlier;
+}
+
+static void export_dnsmasq(struct writer * w, struct hosts_file * hosts_file)
+{
+    struct map * map;
+    int blocked, earlier;
+
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type != UNION_ELEMENT) {
+            continue;
+        }
+        map = &hosts_file->entries[i].value.map;
+        earlier = export_domain_seen(hosts_file, i, &blocked);
+        /* address= would answer for every subdomain, hosts entries don't. */
+        if (!blocked) {
+            writer_string(w, "host-record=");
+            writer_string(w, map->domain);
+            writer_char(w, ',');
+            writer_string(w, map->ip);
+            writer_char(w, '\n');
+        } else if (!earlier) {
+            writer_string(w, "address=/");
+            writer_string(w, map->domain);
+            writer_string(w, "/\n");
+        }
+    }
+}
+
+static void export_unbound(struct writer * w, struct hosts_file * hosts_file)
+{
+    struct map * map;
+    int blocked, earlier;
+
+    writer_string(w, "server:\n");
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type != UNION_ELEMENT) {
+            continue;
+        }
+        map = &hosts_file->entries[i].value.map;
+        earlier = export_domain_seen(hosts_file, i, &blocked);
+        if (!blocked) {
+            writer_string(w, "    local-data: \"");
+            writer_string(w, map->domain);
+            writer_string(w, map->kind == IP_KIND_IPv4 ? ". A " : ". AAAA ");
+            writer_string(w, map->ip);
+            writer_string(w, "\"\n");
+        } else if (!earlier) {
+            writer_string(w, "    local-zone: \"");
+            writer_string(w, map->domain);
+            writer_string(w, ".\" always_nxdomain\n");
+        }
+    }
+}
+
+static void export_rpz(struct writer * w, struct hosts_file * hosts_file)
+{
+    struct map * map;
+    int blocked, earlier;
+
+    writer_string(w, "$TTL 300\n@ IN SOA localhost. root.localhost. ");
+    writer_unsigned(w, (unsigned long long)time(NULL));
+    writer_string(w, " 3600 600 86400 300\n  IN NS localhost.\n");
+
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type != UNION_ELEMENT) {
+            continue;
+        }
+        map = &hosts_file->entries[i].value.map;
+        earlier = export_domain_seen(hosts_file, i, &blocked);
+        if (!blocked) {
+            writer_string(w, map->domain);
+            writer_string(w, map->kind == IP_KIND_IPv4 ? " A " : " AAAA ");
+            writer_string(w, map->ip);
+            writer_char(w, '\n');
+        } else if (!earlier) {
+            writer_string(w, map->domain);
+            writer_string(w, " CNAME .\n");
+        }
+    }
+}
+
+/**
+ * Writes a table cell, padded up to the start of the next column.
+ * @param w Target writer.
+ * @param text Contents of the cell.
+ * @param width Width of the column, or zero for the last one.
+ */
+static void export_table_cell(struct writer * w, const char * text, size_t width)
+{
+    size_t length = strlen(text);
+
+    writer_bytes(w, text, length);
+    if (width) {
+        writer_repeat(w, ' ', width - length + 2);
+    }
+}
+
+/**
+ * Renders the entries as aligned columns. The column widths are determined
+ * in a first pass; the header is only styled on a terminal.
+ * @param w Target writer.
+ * @param hosts_file The hosts file to export.
+ */
+static void export_table(struct writer * w, struct hosts_file * hosts_file)
+{
+    size_t ip_width = strlen("ADDRESS"), domain_width = strlen("DOMAIN");
+    int color = w->fd >= 0 && isatty(w->fd);
+    struct map * map;
+
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type == UNION_ELEMENT) {
+            map = &hosts_file->entries[i].value.map;
+            ip_width = MAX(ip_width, strlen(map->ip));
+            domain_width = MAX(domain_width, strlen(map->domain));
+        }
+    }
+
+    if (color) {
+        writer_string(w, ANSI_STYLE_BOLD ANSI_COLOR_MAGENTA);
+    }
+    export_table_cell(w, "ADDRESS", ip_width);
+    export_table_cell(w, "DOMAIN", verbose_flag ? domain_width : 0);
+    if (verbose_flag) {
+        export_table_cell(w, "KIND", 4);
+        export_table_cell(w, "LINE", 0);
+    }
+    if (color) {
+        writer_string(w, ANSI_COLOR_RESET ANSI_STYLE_RESET);
+    }
+    writer_char(w, '\n');
+
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        if (hosts_file->entries[i].type != UNION_ELEMENT) {
+            continue;
+        }
+        map = &hosts_file->entries[i].value.map;
+        export_table_cell(w, map->ip, ip_width);
+        export_table_cell(w, map->domain, verbose_flag ? domain_width : 0);
+        if (verbose_flag) {
+            export_table_cell(w, map->kind == IP_KIND_IPv4 ? "IPv4" : "IPv6", 4);
+            writer_unsigned(w, hosts_file_line(hosts_file, i));
+        }
+        writer_char(w, '\n');
+    }
+}
+
+// clang-format off
+static const struct {
+    const char * name;
+    const char * extension;
+    export_function function;
+} exporters[EXPORT_FORMATS] = {
+    [EXPORT_FORMAT_HOSTS]   = {"hosts",   "hosts",        export_hosts  },
+    [EXPORT_FORMAT_JSON]    = {"json",    "json",         export_json   },
+    [EXPORT_FORMAT_NDJSON]  = {"ndjson",  "ndjson",       export_ndjson },
+    [EXPORT_FORMAT_CSV]     = {"csv",     "csv",          export_csv    },
+    [EXPORT_FORMAT_BIN]     = {"bin",     "bin",          export_bin    },
+    [EXPORT_FORMAT_DNSMASQ] = {"dnsmasq", "dnsmasq.conf", export_dnsmasq},
+    [EXPORT_FORMAT_UNBOUND] = {"unbound", "unbound.conf", export_unbound},
+    [EXPORT_FORMAT_RPZ]     = {"rpz",     "rpz.zone",     export_rpz    },
+    [EXPORT_FORMAT_TABLE]   = {"table",   "txt",          export_table  },
+};
+// clang-format on
+
+/* A single output of export_files, written by its own thread. */
+struct export_job {
+    struct hosts_file * hosts_file;
+    enum export_format format;
+    char path[PATH_MAX];
+    unsigned long long bytes;
+    int failed;
+    int threaded;
+    pthread_t thread;
+};
+
+/**
+ * Looks up a format by the name used on the command line.
+ * @param name Name of the format.
+ * @return The format, or EXPORT_FORMAT_NONE if it is unknown.
+ */
+enum export_format export_format_parse(const char * name)
+{
+    for (unsigned int i = 0; i < EXPORT_FORMATS; ++i) {
+        if (exporters[i].name && strcmp(exporters[i].name, name) == 0) {
+            return (enum export_format)i;
+        }
+    }
+
+    return EXPORT_FORMAT_NONE;
+}
+
+/**
+ * Parses a comma separated list of formats.
+ * @param names For example "dnsmasq,unbound,rpz".
+ * @return Bit mask with a bit set for each format, zero if any is unknown.
+ */
+unsigned int export_format_parse_list(const char * names)
+{
+    char name[32];
+    size_t length;
+    unsigned int formats = 0;
+    enum export_format format;
+
+    while (*names) {
+        length = strcspn(names, ",");
+        if (length == 0 || length >= sizeof(name)) {
+            return 0;
+        }
+        memcpy(name, names, length);
+        name[length] = '\0';
+        if ((format = export_format_parse(name)) == EXPORT_FORMAT_NONE) {
+            return 0;
+        }
+        formats |= 1u << format;
+        names += length + (names[length] == ',');
+    }
+
+    return formats;
+}
+
+/**
+ * Renders the entries of a hosts file in a given format.
+ * @param w Target writer.
+ * @param hosts_file The hosts file to export.
+ * @param format Anything but EXPORT_FORMAT_NONE.
+ */
+void export_serialize(struct writer * w, struct hosts_file * hosts_file, enum export_format format)
+{
+    if (format <= EXPORT_FORMAT_NONE || format >= EXPORT_FORMATS) {
+        handle_error(ERROR_CODE_NON_EXHAUSTIVE_CASE);
+    }
+
+    /* Resolver exporters look up all addresses of a domain. */
+    if (format == EXPORT_FORMAT_DNSMASQ || format == EXPORT_FORMAT_UNBOUND || format == EXPORT_FORMAT_RPZ) {
+        hosts_file_index(hosts_file);
+    }
+
+    exporters[format].function(w, hosts_file);
+}
+
+/**
+ * Exports to a stream. Streams backed by a file descriptor are written to
+ * directly, bypassing stdio's buffer.
+ * @param file Target stream.
+ * @param hosts_file The hosts file to export.
+ * @param format Anything but EXPORT_FORMAT_NONE.
+ */
+void export_stream(FILE * file, struct hosts_file * hosts_file, enum export_format format)
+{
+    struct writer w;
+    int fd;
+
+    fflush(file);
+    fd = fileno(file);
+    writer_init(&w, fd, EXPORT_BUFFER_SIZE);
+    export_serialize(&w, hosts_file, format);
+    if (fd < 0) {
+        fwrite(w.buffer, 1, w.length, file);
+    }
+    writer_close(&w);
+}
+
+/**
+ * Writes one output file, renamed into place once complete.
+ * @param argument The export_job.
+ */
+static void * export_file(void * argument)
+{
+    struct export_job * job = argument;
+    char temporary[PATH_MAX + 32];
+    struct writer w;
+    int fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", job->path, (int)getpid());
+    if ((fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        job->failed = errno;
+        return NULL;
+    }
+
+    writer_init(&w, fd, 0);
+    exporters[job->format].function(&w, job->hosts_file);
+    job->failed = writer_close(&w) != 0 ? EIO : 0;
+    job->bytes = w.flushed;
+
+    if (close(fd) != 0 && !job->failed) {
+        job->failed = errno;
+    }
+    if (job->failed || rename(temporary, job->path) != 0) {
+        job->failed = job->failed ? job->failed : errno;
+        unlink(temporary);
+    }
+
+    return NULL;
+}
+
+/**
+ * Writes several formats at once, to <prefix>.<extension>, each from its own
+ * thread. The exporters only read the hosts file, so they share it as is.
+ * @param hosts_file The hosts file to export.
+ * @param formats Bit mask of formats, as returned by export_format_parse_list.
+ * @param prefix Path prefix of the output files.
+ */
+void export_files(struct hosts_file * hosts_file, unsigned int formats, const char * prefix)
+{
+    struct export_job jobs[EXPORT_FORMATS];
+    unsigned int count = 0;
+    int failed = 0;
+
+    stats_phase_begin("export");
+
+    /* Anything that mutates the hosts file has to happen before the threads. */
+    if (formats & (1u << EXPORT_FORMAT_DNSMASQ | 1u << EXPORT_FORMAT_UNBOUND | 1u << EXPORT_FORMAT_RPZ)) {
+        hosts_file_index(hosts_file);
+    }
+
+    for (unsigned int format = EXPORT_FORMAT_NONE + 1; format < EXPORT_FORMATS; ++format) {
+        if (!(formats & (1u << format))) {
+            continue;
+        }
+        jobs[count].hosts_file = hosts_file;
+        jobs[count].format = (enum export_format)format;
+        jobs[count].bytes = 0;
+        jobs[count].failed = 0;
+        snprintf(jobs[count].path, sizeof(jobs[count].path), "%s.%s", prefix, exporters[format].extension);
+        jobs[count].threaded = pthread_create(&jobs[count].thread, NULL, export_file, &jobs[count]) == 0;
+        if (!jobs[count].threaded) {
+            export_file(&jobs[count]);
+        }
+        ++count;
+    }
+
+    for (unsigned int i = 0; i < count; ++i) {
+        if (jobs[i].threaded) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+        stats.bytes_written += jobs[i].bytes;
+        if (jobs[i].failed) {
+            fprintf(stderr, PROGRAM_NAME ": Could not write %s: %s.\n", jobs[i].path, strerror(jobs[i].failed));
+            failed = jobs[i].failed;
+        }
+    }
+
+    stats_phase_end();
+
+    if (failed) {
+        handle_error(failed == EACCES || failed == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * Structured export formats for tooling that consumes hosts files, and
+ * configuration for resolvers that should serve the same entries.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "hostsfile.h"
+#include "writer.h"
+
+#include <stdio.h>
+
+/*
+ * Layout of the binary format, all integers little-endian:
+ *
+ *     header   magic "HFBN", u32 version, u32 record count, u32 header size
+ *     record   u32 record size, u32 ip length, u32 domain length, u32 kind,
+ *              ip, NUL, domain, NUL, zero padding up to a multiple of four
+ *
+ * Record sizes include the size field itself, so a reader can walk an
+ * mmap'ed file without parsing the strings, which are usable in place.
+ */
+#define EXPORT_BIN_MAGIC "HFBN"
+#define EXPORT_BIN_VERSION 1
+#define EXPORT_BIN_HEADER_SIZE 16
+#define EXPORT_BIN_RECORD_SIZE 16
+
+/* Streams are written in large chunks, a terminal is slow enough as is. */
+#define EXPORT_BUFFER_SIZE (1 << 20)
+
+/* Selected by --format. */
+enum export_format {
+    EXPORT_FORMAT_NONE,
+    EXPORT_FORMAT_HOSTS,
+    EXPORT_FORMAT_JSON,
+    EXPORT_FORMAT_NDJSON,
+    EXPORT_FORMAT_CSV,
+    EXPORT_FORMAT_BIN,
+    EXPORT_FORMAT_DNSMASQ,
+    EXPORT_FORMAT_UNBOUND,
+    EXPORT_FORMAT_RPZ,
+    EXPORT_FORMAT_TABLE,
+    EXPORT_FORMATS,
+};
+
+/* The format printed by --list and --dry-run. */
+extern enum export_format export_format;
+
+enum export_format export_format_parse(const char * name);
+unsigned int export_format_parse_list(const char * names);
+void export_serialize(struct writer * w, struct hosts_file * hosts_file, enum export_format format);
+void export_stream(FILE * file, struct hosts_file * hosts_file, enum export_format format);
+void export_files(struct hosts_file * hosts_file, unsigned int formats, const char * prefix);
+
+#endif
@@ -0,0 +1,869 @@
+/*
+ * External-memory set operations.
+ *
+ * Imports, deletions, deduplication and sorting normally load the hosts file
+ * and every other file involved. With a memory budget they are done in two
+ * external sorts instead. The first brings together, for every domain and
+ * address family, its lines in the hosts file and in the other files, in
+ * command line order, so that the outcome of the edits can be decided one
+ * key at a time. The second puts the resulting lines back in the order of
+ * the hosts file, or in sorted order, and streams them to a replacement.
+ * Neither ever holds more than its share of the budget; whatever doesn't fit
+ * is spilled to temporary files in $TMPDIR as sorted runs and merged back.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "external.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Every record starts with the lengths of its key and payload. */
+#define EXTERNAL_HEADER_SIZE (2 * sizeof(uint32_t))
+
+/* Where a line ends up: its file, in command line order, and line number. */
+#define EXTERNAL_POSITION_SIZE 10
+
+/* Arena being sorted by external_spill, for its comparison function. */
+static const unsigned char * external_arena;
+
+/**
+ * Orders two keys bytewise, a key before those it is a prefix of.
+ * @return Negative, zero or positive, like memcmp.
+ */
+static int external_compare(const unsigned char * a, size_t a_length, const unsigned char * b, size_t b_length)
+{
+    int order = memcmp(a, b, a_length < b_length ? a_length : b_length);
+
+    return order ? order : (a_length > b_length) - (a_length < b_length);
+}
+
+/**
+ * Reads a record from its encoding.
+ * @param record Receives the record.
+ * @param data The encoding, starting with its header.
+ * @return Length of the encoding.
+ */
+static size_t external_decode(struct external_record * record, const unsigned char * data)
+{
+    uint32_t lengths[2];
+
+    memcpy(lengths, data, sizeof(lengths));
+    record->key = data + EXTERNAL_HEADER_SIZE;
+    record->key_length = lengths[0];
+    record->payload = record->key + lengths[0];
+    record->payload_length = lengths[1];
+
+    return EXTERNAL_HEADER_SIZE + lengths[0] + lengths[1];
+}
+
+static int external_order(const void * a, const void * b)
+{
+    struct external_record x, y;
+
+    external_decode(&x, external_arena + *(const size_t *)a);
+    external_decode(&y, external_arena + *(const size_t *)b);
+
+    return external_compare(x.key, x.key_length, y.key, y.key_length);
+}
+
+/**
+ * Creates a temporary file which disappears once closed.
+ * @return Its file descriptor.
+ */
+static int external_temporary(void)
+{
+    char path[PATH_MAX];
+    const char * directory = getenv("TMPDIR");
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/hf-sort-XXXXXX", directory && *directory ? directory : "/tmp");
+    if ((fd = mkstemp(path)) < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+    }
+    unlink(path);
+
+    return fd;
+}
+
+/**
+ * Adds a run to a sort.
+ * @param s The sort.
+ * @param fd The run, positioned at its end.
+ */
+static void external_run_add(struct external_sort * s, int fd)
+{
+    struct external_run * run;
+
+    if (s->run_count == s->run_capacity) {
+        s->run_capacity = s->run_capacity ? s->run_capacity * 2 : 16;
+        s->runs = hf_realloc(s->runs, sizeof(struct external_run) * s->run_capacity);
+    }
+    run = &s->runs[s->run_count++];
+    memset(run, 0, sizeof(*run));
+    run->fd = fd;
+}
+
+/**
+ * Sorts the records in memory and writes them to a new run.
+ * @param s The sort.
+ */
+static void external_spill(struct external_sort * s)
+{
+    struct writer w;
+    struct external_record record;
+    int fd = external_temporary();
+
+    external_arena = s->arena;
+    qsort(s->records, s->count, sizeof(size_t), external_order);
+
+    writer_init(&w, fd, EXTERNAL_READ_SIZE);
+    for (size_t i = 0; i < s->count; ++i) {
+        writer_bytes(&w, s->arena + s->records[i], external_decode(&record, s->arena + s->records[i]));
+    }
+    if (writer_flush(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    free(w.buffer);
+
+    external_run_add(s, fd);
+    s->used = 0;
+    s->count = 0;
+}
+
+/**
+ * Makes sure the buffer of a run holds a number of bytes, reading on.
+ * @param run The run.
+ * @param length Amount of bytes needed.
+ * @return Non-zero if they could be read, zero at the end of the run.
+ */
+static int external_run_fill(struct external_run * run, size_t length)
+{
+    ssize_t got;
+
+    if (run->end - run->start >= length) {
+        return 1;
+    }
+
+    memmove(run->buffer, run->buffer + run->start, run->end - run->start);
+    run->end -= run->start;
+    run->start = 0;
+    if (run->capacity < length) {
+        run->capacity = length;
+        run->buffer = hf_realloc(run->buffer, run->capacity);
+    }
+
+    while (run->end < length) {
+        if ((got = read(run->fd, run->buffer + run->end, run->capacity - run->end)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        if (got == 0) {
+            break;
+        }
+        run->end += got;
+    }
+
+    return run->end >= length;
+}
+
+/**
+ * Moves a run to its next record.
+ * @param run The run.
+ * @return Non-zero if there was one.
+ */
+static int external_run_next(struct external_run * run)
+{
+    uint32_t lengths[2];
+
+    if (!external_run_fill(run, EXTERNAL_HEADER_SIZE)) {
+        /* Runs only ever end between records. */
+        if (run->end != run->start) {
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        return 0;
+    }
+
+    memcpy(lengths, run->buffer + run->start, sizeof(lengths));
+    if (!external_run_fill(run, EXTERNAL_HEADER_SIZE + lengths[0] + lengths[1])) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    run->start += external_decode(&run->record, run->buffer + run->start);
+
+    return 1;
+}
+
+static void external_run_close(struct external_run * run)
+{
+    close(run->fd);
+    free(run->buffer);
+    run->fd = -1;
+    run->buffer = NULL;
+}
+
+static int external_heap_less(const struct external_sort * s, unsigned int a, unsigned int b)
+{
+    const struct external_record *x = &s->runs[a].record, *y = &s->runs[b].record;
+    int order = external_compare(x->key, x->key_length, y->key, y->key_length);
+
+    return order ? order < 0 : a < b;
+}
+
+/**
+ * Restores the heap property below a position.
+ * @param s The sort.
+ * @param i The position.
+ */
+static void external_heap_down(struct external_sort * s, unsigned int i)
+{
+    unsigned int child, run;
+
+    while ((child = 2 * i + 1) < s->heap_size) {
+        if (child + 1 < s->heap_size && external_heap_less(s, s->heap[child + 1], s->heap[child])) {
+            ++child;
+        }
+        if (!external_heap_less(s, s->heap[child], s->heap[i])) {
+            break;
+        }
+        run = s->heap[i];
+        s->heap[i] = s->heap[child];
+        s->heap[child] = run;
+        i = child;
+    }
+}
+
+/**
+ * Starts merging a range of runs: each is read from its beginning.
+ * @param s The sort.
+ * @param first The first run.
+ * @param count Amount of runs.
+ */
+static void external_heap_build(struct external_sort * s, unsigned int first, unsigned int count)
+{
+    struct external_run * run;
+
+    s->heap = hf_realloc(s->heap, sizeof(unsigned int) * (count + 1));
+    s->heap_size = 0;
+    s->pending = 0;
+    for (unsigned int i = first; i < first + count; ++i) {
+        run = &s->runs[i];
+        if (lseek(run->fd, 0, SEEK_SET) < 0) {
+            handle_error(ERROR_CODE_INVALID_FILE);
+        }
+        run->capacity = EXTERNAL_READ_SIZE;
+        run->buffer = hf_malloc(run->capacity);
+        run->start = run->end = 0;
+        if (external_run_next(run)) {
+            s->heap[s->heap_size++] = i;
+        }
+    }
+    for (unsigned int i = s->heap_size / 2; i-- > 0;) {
+        external_heap_down(s, i);
+    }
+}
+
+/**
+ * Takes the smallest record of the runs being merged.
+ * @param s The sort.
+ * @param record Receives the record, valid until the next call.
+ * @return Non-zero if there was one.
+ */
+static int external_heap_next(struct external_sort * s, struct external_record * record)
+{
+    /* The previous record is only now done with, so its run may move on. */
+    if (s->pending && s->heap_size) {
+        if (!external_run_next(&s->runs[s->heap[0]])) {
+            s->heap[0] = s->heap[--s->heap_size];
+        }
+        external_heap_down(s, 0);
+    }
+
+    s->pending = s->heap_size != 0;
+    if (!s->heap_size) {
+        return 0;
+    }
+    *record = s->runs[s->heap[0]].record;
+
+    return 1;
+}
+
+/**
+ * Merges runs until few enough remain to be merged at once.
+ * @param s The sort.
+ * @param fan_in How many runs may be merged at once.
+ */
+static void external_merge_passes(struct external_sort * s, unsigned int fan_in)
+{
+    struct external_record record;
+    struct writer w;
+    int fd;
+
+    while (s->run_count > fan_in) {
+        fd = external_temporary();
+        writer_init(&w, fd, EXTERNAL_READ_SIZE);
+        external_heap_build(s, 0, fan_in);
+        while (external_heap_next(s, &record)) {
+            writer_bytes(&w, record.key - EXTERNAL_HEADER_SIZE, EXTERNAL_HEADER_SIZE + record.key_length + record.payload_length);
+        }
+        if (writer_flush(&w) != 0) {
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+        free(w.buffer);
+
+        for (unsigned int i = 0; i < fan_in; ++i) {
+            external_run_close(&s->runs[i]);
+        }
+        memmove(s->runs, s->runs + fan_in, sizeof(struct external_run) * (s->run_count - fan_in));
+        s->run_count -= fan_in;
+        external_run_add(s, fd);
+    }
+}
+
+/**
+ * Starts a sort.
+ * @param s The sort.
+ * @param budget Memory it may use, in bytes.
+ */
+void external_sort_init(struct external_sort * s, size_t budget)
+{
+    memset(s, 0, sizeof(*s));
+    s->budget = budget;
+}
+
+/**
+ * Adds a record to a sort. Records with equal keys come out in no particular
+ * order.
+ * @param s The sort.
+ * @param key The key.
+ * @param key_length Length of the key.
+ * @param payload Data coming along with the key.
+ * @param payload_length Length of the data.
+ */
+void external_sort_add(struct external_sort * s, const void * key, size_t key_length, const void * payload, size_t payload_length)
+{
+    size_t length = EXTERNAL_HEADER_SIZE + key_length + payload_length;
+    uint32_t lengths[2] = { (uint32_t)key_length, (uint32_t)payload_length };
+
+    if (key_length > UINT32_MAX || payload_length > UINT32_MAX) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+
+    /* The arena and the positions of its records share the budget. */
+    if (s->count && s->used + length + (s->count + 1) * sizeof(size_t) > s->budget) {
+        external_spill(s);
+    }
+
+    if (s->used + length > s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : EXTERNAL_READ_SIZE;
+        s->capacity = MIN(s->capacity, s->budget);
+        s->capacity = MAX(s->capacity, s->used + length);
+        s->arena = hf_realloc(s->arena, s->capacity);
+    }
+    if (s->count == s->record_capacity) {
+        s->record_capacity = s->record_capacity ? s->record_capacity * 2 : 1024;
+        s->records = hf_realloc(s->records, sizeof(size_t) * s->record_capacity);
+    }
+
+    s->records[s->count++] = s->used;
+    memcpy(s->arena + s->used, lengths, sizeof(lengths));
+    memcpy(s->arena + s->used + EXTERNAL_HEADER_SIZE, key, key_length);
+    memcpy(s->arena + s->used + EXTERNAL_HEADER_SIZE + key_length, payload, payload_length);
+    s->used += length;
+}
+
+/**
+ * Ends adding records to a sort. What is still in memory is sorted there if
+ * nothing was spilled, and spilled as the last run otherwise.
+ * @param s The sort.
+ */
+void external_sort_finish(struct external_sort * s)
+{
+    unsigned int fan_in = (unsigned int)MIN(MAX(s->budget / EXTERNAL_READ_SIZE, 2), EXTERNAL_MAX_FAN_IN);
+
+    if (!s->run_count) {
+        external_arena = s->arena;
+        qsort(s->records, s->count, sizeof(size_t), external_order);
+        s->next = 0;
+        return;
+    }
+
+    if (s->count) {
+        external_spill(s);
+    }
+    free(s->arena);
+    free(s->records);
+    s->arena = NULL;
+    s->records = NULL;
+    s->capacity = s->record_capacity = 0;
+
+    external_merge_passes(s, fan_in);
+    external_heap_build(s, 0, s->run_count);
+}
+
+/**
+ * Takes the next record of a finished sort.
+ * @param s The sort.
+ * @param record Receives the record, valid until the next call.
+ * @return Non-zero if there was one.
+ */
+int external_sort_next(struct external_sort * s, struct external_record * record)
+{
+    if (s->run_count) {
+        return external_heap_next(s, record);
+    }
+    if (s->next == s->count) {
+        return 0;
+    }
+    external_decode(record, s->arena + s->records[s->next++]);
+
+    return 1;
+}
+
+/**
+ * Releases a sort and its temporary files.
+ * @param s The sort.
+ */
+void external_sort_free(struct external_sort * s)
+{
+    for (unsigned int i = 0; i < s->run_count; ++i) {
+        external_run_close(&s->runs[i]);
+    }
+    free(s->runs);
+    free(s->heap);
+    free(s->arena);
+    free(s->records);
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * Encodes where a line ends up, so that positions sort like the lines would
+ * be added to a loaded hosts file.
+ * @param out Receives the position.
+ * @param source Zero for the hosts file, one on for the files of the edits.
+ * @param line Line number within the file.
+ */
+static void external_position(unsigned char * out, unsigned int source, unsigned long long line)
+{
+    out[0] = (unsigned char)(source >> 8);
+    out[1] = (unsigned char)source;
+    for (int i = 0; i < 8; ++i) {
+        out[2 + i] = (unsigned char)(line >> (56 - 8 * i));
+    }
+}
+
+/**
+ * Builds the key under which the lines of an entry are brought together: its
+ * domain and address family, followed by its position.
+ * @param key Receives the key; its previous contents are dropped.
+ * @param domain The domain.
+ * @param length Length of the domain.
+ * @param kind The address family.
+ * @param source File of the line.
+ * @param line Line number of the line.
+ */
+static void external_entry_key(struct writer * key, const char * domain, size_t length, enum ip_kind kind, unsigned int source, unsigned long long line)
+{
+    unsigned char position[EXTERNAL_POSITION_SIZE];
+
+    key->length = 0;
+    writer_bytes(key, domain, length);
+    writer_char(key, '\0');
+    writer_char(key, (char)kind);
+    external_position(position, source, line);
+    writer_bytes(key, position, sizeof(position));
+}
+
+/**
+ * Builds the key under which a line of the result is written: its position,
+ * or with sorting, its domain and address family first. Comments sort first.
+ * @param key Receives the key; its previous contents are dropped.
+ * @param entry Domain and address family as in an entry key, or NULL for comments.
+ * @param length Length of those.
+ * @param position Position of the line.
+ * @param sort Whether the result is sorted.
+ */
+static void external_line_key(struct writer * key, const unsigned char * entry, size_t length, const unsigned char * position, int sort)
+{
+    key->length = 0;
+    if (sort) {
+        writer_char(key, entry ? 1 : 0);
+        if (entry) {
+            writer_bytes(key, entry, length);
+        }
+    }
+    writer_bytes(key, position, EXTERNAL_POSITION_SIZE);
+}
+
+/* Feeds the entries of the file of an edit to the first sort. */
+struct external_collector {
+    struct external_sort * entries;
+    struct writer key;
+    unsigned int source;
+};
+
+static int external_collect(void * context, const struct hosts_file_token * token, unsigned long long line)
+{
+    struct external_collector * collector = context;
+    char * ip = hf_strndup(token->ip, token->ip_length);
+
+    external_entry_key(&collector->key, token->domain, token->domain_length, parse_ip_address(ip), collector->source, line);
+    external_sort_add(collector->entries, collector->key.buffer, collector->key.length, token->ip, token->ip_length);
+    free(ip);
+
+    return 0;
+}
+
+/**
+ * Splits the hosts file: entries go to the first sort, comments straight to
+ * the second.
+ * @param hosts_path The hosts file.
+ * @param collector Collector for the hosts file itself.
+ * @param lines The second sort.
+ * @param sort Whether the result is sorted.
+ * @param source Receives the fingerprint of the hosts file.
+ */
+static void external_scan(const char * hosts_path, struct external_collector * collector, struct external_sort * lines, int sort, struct fingerprint * source)
+{
+    FILE * file;
+    size_t length = 0;
+    ssize_t read;
+    char * line = NULL;
+    struct hosts_file_token token;
+    unsigned char position[EXTERNAL_POSITION_SIZE];
+    unsigned long long line_number = 0;
+
+    if (!(file = fopen(hosts_path, "r"))) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    stats_phase_begin("scan");
+    fingerprint_init(source);
+    while ((read = getline(&line, &length, file)) != -1) {
+        stats.bytes_read += read;
+        fingerprint_update(source, line, read);
+        ++line_number;
+        if (hosts_file_tokenize(line, &token)) {
+            ++stats.entries_parsed;
+            external_collect(collector, &token, line_number);
+        } else {
+            external_position(position, 0, line_number);
+            external_line_key(&collector->key, NULL, 0, position, sort);
+            external_sort_add(lines, collector->key.buffer, collector->key.length, line, read);
+        }
+    }
+    stats_phase_end();
+
+    free(line);
+    fclose(file);
+}
+
+/*
+ * The fate of one domain and address family, decided from its lines in the
+ * order the edits would apply them. The first line of the hosts file is the
+ * one imports update; further lines of the hosts file are kept as they are,
+ * unless deduplicating. Deletions remove all of them.
+ */
+struct external_group {
+    struct writer entry;
+    struct writer ip;
+    struct writer duplicates;
+    unsigned int duplicate_count;
+    unsigned char position[EXTERNAL_POSITION_SIZE];
+    int present;
+};
+
+/**
+ * Adds a line of the result to the second sort.
+ * @param lines The second sort.
+ * @param group Group of the line.
+ * @param key Scratch space for the key.
+ * @param line Scratch space for the line.
+ * @param position Position of the line.
+ * @param ip Its address.
+ * @param length Length of the address.
+ * @param sort Whether the result is sorted.
+ */
+static void external_emit(struct external_sort * lines, const struct external_group * group, struct writer * key, struct writer * line, const unsigned char * position, const void * ip, size_t length, int sort)
+{
+    external_line_key(key, (const unsigned char *)group->entry.buffer, group->entry.length, position, sort);
+    line->length = 0;
+    writer_bytes(line, ip, length);
+    writer_char(line, '\t');
+    writer_bytes(line, group->entry.buffer, group->entry.length - 2);
+    writer_char(line, '\n');
+    external_sort_add(lines, key->buffer, key->length, line->buffer, line->length);
+}
+
+/**
+ * Writes out the lines that remain of a group.
+ * @param lines The second sort.
+ * @param group The group, which is emptied.
+ * @param key Scratch space for keys.
+ * @param line Scratch space for lines.
+ * @param dedup Whether duplicates are dropped.
+ * @param sort Whether the result is sorted.
+ */
+static void external_group_end(struct external_sort * lines, struct external_group * group, struct writer * key, struct writer * line, int dedup, int sort)
+{
+    struct external_record duplicate;
+    size_t offset = 0;
+
+    if (group->present) {
+        external_emit(lines, group, key, line, group->position, group->ip.buffer, group->ip.length, sort);
+    }
+    while (offset < group->duplicates.length) {
+        offset += external_decode(&duplicate, (const unsigned char *)group->duplicates.buffer + offset);
+        if (dedup) {
+            ++stats.entries_touched;
+        } else {
+            external_emit(lines, group, key, line, duplicate.key, duplicate.payload, duplicate.payload_length, sort);
+        }
+    }
+
+    group->present = 0;
+    group->ip.length = 0;
+    group->duplicates.length = 0;
+    group->duplicate_count = 0;
+}
+
+/**
+ * Applies a line to the group of its domain and address family.
+ * @param group The group.
+ * @param record The line, as sorted.
+ * @param operations The edits.
+ */
+static void external_group_apply(struct external_group * group, const struct external_record * record, const struct external_operation * operations)
+{
+    const unsigned char * position = record->key + record->key_length - EXTERNAL_POSITION_SIZE;
+    unsigned int source = (unsigned int)position[0] << 8 | position[1];
+    uint32_t lengths[2] = { EXTERNAL_POSITION_SIZE, (uint32_t)record->payload_length };
+
+    if (source == 0 && group->present) {
+        writer_bytes(&group->duplicates, lengths, sizeof(lengths));
+        writer_bytes(&group->duplicates, position, EXTERNAL_POSITION_SIZE);
+        writer_bytes(&group->duplicates, record->payload, record->payload_length);
+        ++group->duplicate_count;
+    } else if (source == 0 || operations[source - 1].operation == 'i') {
+        if (!group->present) {
+            group->present = 1;
+            memcpy(group->position, position, EXTERNAL_POSITION_SIZE);
+            stats.entries_touched += source != 0;
+        } else {
+            stats.entries_touched += group->ip.length != record->payload_length || memcmp(group->ip.buffer, record->payload, record->payload_length) != 0;
+        }
+        group->ip.length = 0;
+        writer_bytes(&group->ip, record->payload, record->payload_length);
+    } else {
+        /* Like hosts_file_remove, deleting what isn't there is an error. */
+        if (!group->present) {
+            handle_error(ERROR_CODE_ENTRY_DOES_NOT_EXIST);
+        }
+        stats.entries_touched += 1 + group->duplicate_count;
+        group->present = 0;
+        group->duplicates.length = 0;
+        group->duplicate_count = 0;
+    }
+}
+
+/**
+ * Opens the file the result is written to: a sibling of the hosts file to be
+ * renamed over it, or where the directory is read-only, a temporary file to
+ * be copied over it.
+ * @param target Receives the resolved path of the hosts file.
+ * @param temporary Receives the path of the sibling, empty if there is none.
+ * @param hosts_path The hosts file.
+ * @return The file descriptor.
+ */
+static int external_output(char * target, char * temporary, const char * hosts_path)
+{
+    struct stat st;
+    int fd;
+
+    if (!realpath(hosts_path, target)) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    snprintf(temporary, PATH_MAX + 16, "%s.hf-XXXXXX", target);
+    if ((fd = mkstemp(temporary)) < 0) {
+        *temporary = '\0';
+        return external_temporary();
+    }
+
+    /* Keep the permissions and ownership of the file being replaced. */
+    if (stat(target, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+            /* Only root may give files away; the current owner is fine then. */
+        }
+    }
+
+    return fd;
+}
+
+/**
+ * Puts the result in place of the hosts file.
+ * @param target The hosts file.
+ * @param temporary The sibling holding the result, or empty.
+ * @param fd The file holding the result.
+ * @param length Length of the result.
+ */
+static void external_install(const char * target, const char * temporary, int fd, size_t length)
+{
+    int out;
+
+    if (*temporary) {
+        stats_phase_begin("fsync");
+        if (fsync(fd) != 0) {
+            unlink(temporary);
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+        stats_phase_end();
+        stats_phase_begin("rename");
+        if (rename(temporary, target) == 0) {
+            stats_phase_end();
+            return;
+        }
+        stats_phase_end();
+        unlink(temporary);
+    }
+
+    /* The directory may be read-only while the file itself is not. */
+    if ((out = open(target, O_WRONLY | O_TRUNC)) < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+    stats.bytes_written -= length;
+    if (hosts_file_copy(out, fd, 0, length) != 0 || fsync(out) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    close(out);
+}
+
+/**
+ * Imports and deletes the entries of other files, then optionally drops
+ * duplicates and sorts, using a bounded amount of memory. The outcome is that
+ * of the in-memory operations, as far as entries are concerned. With the
+ * dry-run flag, the result is written to stdout in the hosts file format.
+ * @param hosts_path The hosts file.
+ * @param operations The imports and deletions, in command line order.
+ * @param count Amount of operations.
+ * @param dedup Whether to drop duplicate entries.
+ * @param sort Whether to sort the entries, like hosts_file_sort.
+ * @param budget Memory that may be used, in bytes.
+ * @param lines Receives the amount of lines of the result; may be NULL.
+ * @param fingerprint Receives the fingerprint of the result; may be NULL.
+ */
+void external_apply(const char * hosts_path, const struct external_operation * operations, unsigned int count, int dedup, int sort, size_t budget, unsigned int * lines, uint64_t * fingerprint)
+{
+    char target[PATH_MAX], temporary[PATH_MAX + 16];
+    struct external_sort entries, result;
+    struct external_collector collector;
+    struct external_group group;
+    struct external_record record;
+    struct fingerprint source, written;
+    struct writer key, line, out;
+    unsigned int written_lines = 0;
+    int fd, terminated = 1;
+
+    if (count >= 1u << 16) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Each sort gets half; the second fills while the first is merged. */
+    external_sort_init(&entries, budget / 2);
+    external_sort_init(&result, budget / 2);
+    writer_init(&collector.key, -1, 0);
+    collector.entries = &entries;
+    collector.source = 0;
+
+    stats_phase_begin("runs");
+    external_scan(hosts_path, &collector, &result, sort, &source);
+    for (unsigned int i = 0; i < count; ++i) {
+        collector.source = i + 1;
+        hosts_file_visit(operations[i].path, external_collect, &collector);
+    }
+    stats_phase_end();
+
+    stats_phase_begin("merge");
+    memset(&group, 0, sizeof(group));
+    writer_init(&group.entry, -1, 0);
+    writer_init(&group.ip, -1, 0);
+    writer_init(&group.duplicates, -1, 0);
+    writer_init(&key, -1, 0);
+    writer_init(&line, -1, 0);
+    external_sort_finish(&entries);
+    while (external_sort_next(&entries, &record)) {
+        if (group.entry.length != record.key_length - EXTERNAL_POSITION_SIZE || memcmp(group.entry.buffer, record.key, group.entry.length) != 0) {
+            external_group_end(&result, &group, &key, &line, dedup, sort);
+            group.entry.length = 0;
+            writer_bytes(&group.entry, record.key, record.key_length - EXTERNAL_POSITION_SIZE);
+        }
+        external_group_apply(&group, &record, operations);
+    }
+    external_group_end(&result, &group, &key, &line, dedup, sort);
+    external_sort_free(&entries);
+    stats_phase_end();
+
+    stats_phase_begin("write");
+    fd = dry_run_flag ? STDOUT_FILENO : external_output(target, temporary, hosts_path);
+    writer_init(&out, fd, 0);
+    fingerprint_init(&written);
+    external_sort_finish(&result);
+    while (external_sort_next(&result, &record)) {
+        /* The last line of the hosts file may lack its newline and not be last anymore. */
+        if (!terminated) {
+            writer_char(&out, '\n');
+            fingerprint_update(&written, "\n", 1);
+        }
+        writer_bytes(&out, record.payload, record.payload_length);
+        fingerprint_update(&written, record.payload, record.payload_length);
+        terminated = record.payload_length && record.payload[record.payload_length - 1] == '\n';
+        ++written_lines;
+    }
+    if (writer_flush(&out) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    free(out.buffer);
+    external_sort_free(&result);
+
+    if (!dry_run_flag) {
+        stats.write_skipped = written.length == source.length && fingerprint_final(&written) == fingerprint_final(&source);
+        if (stats.write_skipped) {
+            if (*temporary) {
+                unlink(temporary);
+            }
+        } else {
+            stats.bytes_written += written.length;
+            external_install(target, temporary, fd, written.length);
+        }
+        close(fd);
+    }
+    stats_phase_end();
+
+    if (lines) {
+        *lines = written_lines;
+    }
+    if (fingerprint) {
+        *fingerprint = fingerprint_final(&written);
+    }
+
+    writer_close(&collector.key);
+    writer_close(&group.entry);
+    writer_close(&group.ip);
+    writer_close(&group.duplicates);
+    writer_close(&key);
+    writer_close(&line);
+}
@@ -0,0 +1,78 @@
+/*
+ * External-memory set operations, for hosts files larger than the memory
+ * they may use.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef EXTERNAL_H
+#define EXTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Smallest budget accepted by --max-memory. */
+#define EXTERNAL_MIN_MEMORY (1 << 20)
+
+/* Runs are read back through buffers of this size while merging. */
+#define EXTERNAL_READ_SIZE (1 << 16)
+
+/* At most this many runs are merged at once. */
+#define EXTERNAL_MAX_FAN_IN 64
+
+/* A record of a sort; key and payload are only valid until the next one. */
+struct external_record {
+    const unsigned char * key;
+    size_t key_length;
+    const unsigned char * payload;
+    size_t payload_length;
+};
+
+/* A run spilled to a temporary file, and the record it is at when merging. */
+struct external_run {
+    int fd;
+    unsigned char * buffer;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    struct external_record record;
+};
+
+/*
+ * Records sorted by key, using at most a given amount of memory. Records are
+ * collected in an arena; whenever it fills up, it is sorted and spilled to a
+ * temporary file as a run. The runs are merged through a heap once all
+ * records are in, in several passes if there are too many of them.
+ */
+struct external_sort {
+    size_t budget;
+    unsigned char * arena;
+    size_t used;
+    size_t capacity;
+    size_t * records;
+    size_t count;
+    size_t record_capacity;
+    size_t next;
+    struct external_run * runs;
+    unsigned int run_count;
+    unsigned int run_capacity;
+    unsigned int * heap;
+    unsigned int heap_size;
+    int pending;
+};
+
+/* A bulk edit, in command line order: 'i' for --import, 'd' for --delete. */
+struct external_operation {
+    int operation;
+    char * path;
+};
+
+void external_sort_init(struct external_sort * s, size_t budget);
+void external_sort_add(struct external_sort * s, const void * key, size_t key_length, const void * payload, size_t payload_length);
+void external_sort_finish(struct external_sort * s);
+int external_sort_next(struct external_sort * s, struct external_record * record);
+void external_sort_free(struct external_sort * s);
+void external_apply(const char * hosts_path, const struct external_operation * operations, unsigned int count, int dedup, int sort, size_t budget, unsigned int * lines, uint64_t * fingerprint);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * The --where filter language, compiled into a predicate that runs on the
+ * tokens of the parser before any entry is materialized.
+ *
+ * An expression is a comma separated list of terms, all of which must hold:
+ *
+ *     kind=v4 | kind=v6           address family
+ *     domain=<domain>             exact domain
+ *     domain~<suffix>             domain ends in suffix
+ *     ip in <address>[/<prefix>]  address lies in a network
+ *     line <first>[-[<last>]]     line number, or an inclusive range
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "filter.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Room for the longest IPv6 address with a port and a prefix length. */
+#define FILTER_ADDRESS_MAX 64
+
+void filter_init(struct filter * filter)
+{
+    filter->count = 0;
+    filter->last_line = ULLONG_MAX;
+}
+
+/**
+ * Checks whether a term starts with a keyword, followed by a separator.
+ * @param term Remaining text of the term.
+ * @param keyword The keyword.
+ * @param separators Characters allowed after the keyword.
+ * @return Text after the keyword and separator, or NULL.
+ */
+static const char * filter_keyword(const char * term, const char * keyword, const char * separators)
+{
+    size_t length = strlen(keyword);
+
+    if (strncmp(term, keyword, length) != 0 || term[length] == '\0' || !strchr(separators, term[length])) {
+        return NULL;
+    }
+
+    term += length + 1;
+    while (*term == ' ') {
+        ++term;
+    }
+    return term;
+}
+
+/**
+ * Parses an address, without port, into network byte order.
+ * @param text The address, not necessarily null-terminated.
+ * @param length Length of the address.
+ * @param address Receives 4 or 16 bytes.
+ * @return The kind of address, IP_KIND_NONE if it isn't one.
+ */
+static enum ip_kind filter_address(const char * text, size_t length, unsigned char * address)
+{
+    char buffer[FILTER_ADDRESS_MAX];
+
+    if (length >= sizeof(buffer)) {
+        return IP_KIND_NONE;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+
+    if (inet_pton(AF_INET, buffer, address) == 1) {
+        return IP_KIND_IPv4;
+    } else if (inet_pton(AF_INET6, buffer, address) == 1) {
+        return IP_KIND_IPv6;
+    }
+
+    return IP_KIND_NONE;
+}
+
+/**
+ * Parses an unsigned decimal number.
+ * @param cursor Start of the number, advanced past it.
+ * @param value Receives the number.
+ * @return Non-zero if there were any digits. Numbers that overflow leave the
+ * cursor where it was, as if there were none.
+ */
+static int filter_number(const char ** cursor, unsigned long long * value)
+{
+    const char * start = *cursor;
+    unsigned long long digit;
+
+    *value = 0;
+    while (isdigit((unsigned char)**cursor)) {
+        digit = (unsigned long long)(*(*cursor)++ - '0');
+        if (*value > (ULLONG_MAX - digit) / 10) {
+            *cursor = start;
+            return 0;
+        }
+        *value = *value * 10 + digit;
+    }
+
+    return *cursor != start;
+}
+
+/**
+ * Compiles a single term.
+ * @param term Receives the compiled term.
+ * @param text The term, not null-terminated.
+ * @param length Length of the term, without surrounding blanks.
+ * @return Zero on success.
+ */
+static int filter_term(struct filter_term * term, const char * text, size_t length)
+{
+    char source[FILTER_ADDRESS_MAX + 16];
+    const char * value, *slash, *cursor;
+    unsigned long long number;
+
+    /* Domains may be long, so they are kept as a span of the expression. */
+    if (length >= 7 && (strncmp(text, "domain=", 7) == 0 || strncmp(text, "domain~", 7) == 0)) {
+        term->field = text[6] == '=' ? FILTER_DOMAIN_EXACT : FILTER_DOMAIN_SUFFIX;
+        term->text = text + 7;
+        term->length = length - 7;
+        return term->length ? 0 : -1;
+    }
+
+    if (length >= sizeof(source)) {
+        return -1;
+    }
+
+    memcpy(source, text, length);
+    source[length] = '\0';
+
+    if ((value = filter_keyword(source, "kind", "="))) {
+        term->field = FILTER_KIND;
+        if (strcmp(value, "v4") == 0 || strcmp(value, "ipv4") == 0) {
+            term->kind = IP_KIND_IPv4;
+        } else if (strcmp(value, "v6") == 0 || strcmp(value, "ipv6") == 0) {
+            term->kind = IP_KIND_IPv6;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((value = filter_keyword(source, "ip", " ")) && (value = filter_keyword(value, "in", " "))) {
+        term->field = FILTER_IP_CIDR;
+        slash = strchr(value, '/');
+        term->kind = filter_address(value, slash ? (size_t)(slash - value) : strlen(value), term->network);
+        if (term->kind == IP_KIND_NONE) {
+            return -1;
+        }
+        term->prefix = term->kind == IP_KIND_IPv4 ? 32 : 128;
+        if (slash) {
+            cursor = slash + 1;
+            if (!filter_number(&cursor, &number) || *cursor != '\0' || number > term->prefix) {
+                return -1;
+            }
+            term->prefix = (unsigned int)number;
+        }
+        return 0;
+    }
+
+    if ((value = filter_keyword(source, "line", " ="))) {
+        term->field = FILTER_LINE;
+        cursor = value;
+        term->first = filter_number(&cursor, &number) ? number : 1;
+        term->last = term->first;
+        if (*cursor == '-') {
+            ++cursor;
+            term->last = filter_number(&cursor, &number) ? number : ULLONG_MAX;
+        } else if (cursor == value) {
+            return -1;
+        }
+        return *cursor == '\0' && term->first <= term->last ? 0 : -1;
+    }
+
+    return -1;
+}
+
+/**
+ * Adds the terms of an expression to a filter.
+ * @param filter The filter, initialized by filter_init.
+ * @param expression Comma separated terms; must outlive the filter.
+ * @return Zero on success, -1 if the expression is invalid.
+ */
+int filter_compile(struct filter * filter, const char * expression)
+{
+    const char * end;
+    size_t length;
+    struct filter_term * term;
+
+    while (*expression) {
+        while (*expression == ' ') {
+            ++expression;
+        }
+        end = expression + strcspn(expression, ",");
+        length = end - expression;
+        while (length && expression[length - 1] == ' ') {
+            --length;
+        }
+
+        if (filter->count == FILTER_MAX_TERMS) {
+            return -1;
+        }
+        term = &filter->terms[filter->count];
+        if (length == 0 || filter_term(term, expression, length) != 0) {
+            return -1;
+        }
+        ++filter->count;
+
+        if (term->field == FILTER_LINE && term->last < filter->last_line) {
+            filter->last_line = term->last;
+        }
+        expression = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+/**
+ * Checks whether an address lies within a network.
+ * @param term A FILTER_IP_CIDR term.
+ * @param address Address of the same kind as the network.
+ */
+static int filter_network_contains(const struct filter_term * term, const unsigned char * address)
+{
+    unsigned int bytes = term->prefix / 8, bits = term->prefix % 8;
+
+    if (memcmp(term->network, address, bytes) != 0) {
+        return 0;
+    }
+
+    return bits == 0 || ((term->network[bytes] ^ address[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+/**
+ * Evaluates a filter on a tokenized line, without allocating.
+ * @param filter The compiled filter.
+ * @param token The fields of the line.
+ * @param line One-based line number.
+ * @return Non-zero if all terms hold.
+ */
+int filter_match(const struct filter * filter, const struct hosts_file_token * token, unsigned long long line)
+{
+    unsigned char address[16];
+    enum ip_kind kind = IP_KIND_NONE;
+    const struct filter_term * term;
+    int parsed = 0;
+
+    for (unsigned int i = 0; i < filter->count; ++i) {
+        term = &filter->terms[i];
+        switch (term->field) {
+            case FILTER_LINE:
+                if (line < term->first || line > term->last) {
+                    return 0;
+                }
+                break;
+
+            case FILTER_DOMAIN_EXACT:
+                if (token->domain_length != term->length || memcmp(token->domain, term->text, term->length) != 0) {
+                    return 0;
+                }
+                break;
+
+            case FILTER_DOMAIN_SUFFIX:
+                if (token->domain_length < term->length
+                    || memcmp(token->domain + token->domain_length - term->length, term->text, term->length) != 0) {
+                    return 0;
+                }
+                break;
+
+            case FILTER_KIND:
+            case FILTER_IP_CIDR:
+                /* The address is only parsed once, and only if it matters. */
+                if (!parsed) {
+                    kind = filter_address(token->ip, token->ip_length, address);
+                    parsed = 1;
+                }
+                if (kind != term->kind) {
+                    return 0;
+                }
+                if (term->field == FILTER_IP_CIDR && !filter_network_contains(term, address)) {
+                    return 0;
+                }
+                break;
+
+            default:
+                handle_error(ERROR_CODE_NON_EXHAUSTIVE_CASE);
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,53 @@
+/*
+ * The --where filter language, compiled into a predicate that runs on the
+ * tokens of the parser before any entry is materialized.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "hostsfile.h"
+
+#include <stddef.h>
+
+/* Upper bound of terms in all --where expressions together. */
+#define FILTER_MAX_TERMS 16
+
+enum filter_field {
+    FILTER_KIND,
+    FILTER_DOMAIN_EXACT,
+    FILTER_DOMAIN_SUFFIX,
+    FILTER_IP_CIDR,
+    FILTER_LINE,
+};
+
+/* A single condition. Strings point into the expression they came from. */
+struct filter_term {
+    enum filter_field field;
+    enum ip_kind kind;
+    const char * text;
+    size_t length;
+    unsigned char network[16];
+    unsigned int prefix;
+    unsigned long long first;
+    unsigned long long last;
+};
+
+/*
+ * A conjunction of terms. last_line is the highest line any entry can match
+ * on, which lets the parser stop reading early.
+ */
+struct filter {
+    struct filter_term terms[FILTER_MAX_TERMS];
+    unsigned int count;
+    unsigned long long last_line;
+};
+
+void filter_init(struct filter * filter);
+int filter_compile(struct filter * filter, const char * expression);
+int filter_match(const struct filter * filter, const struct hosts_file_token * token, unsigned long long line);
+
+#endif
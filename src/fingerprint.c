@@ -0,0 +1,107 @@
+/*
+ * Non-cryptographic 64-bit content fingerprints, used to detect whether a
+ * hosts file changed at all.
+ *
+ * The block function and finalizer follow MurmurHash3's 64-bit mixing; only
+ * a single lane is used, which keeps the streaming state small.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "fingerprint.h"
+
+#include <string.h>
+
+#define FINGERPRINT_SEED 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t fingerprint_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fingerprint_block(uint64_t state, uint64_t k)
+{
+    k *= 0x87c37b91114253d5ULL;
+    k = fingerprint_rotl(k, 31);
+    k *= 0x4cf5ad432745937fULL;
+    state ^= k;
+    return fingerprint_rotl(state, 27) * 5 + 0x52dce729;
+}
+
+void fingerprint_init(struct fingerprint * fp)
+{
+    fp->state = FINGERPRINT_SEED;
+    fp->pending = 0;
+    fp->pending_bytes = 0;
+    fp->length = 0;
+}
+
+/**
+ * Feeds more data into a fingerprint.
+ * @param fp The running fingerprint.
+ * @param data Next part of the input.
+ * @param length Amount of bytes.
+ */
+void fingerprint_update(struct fingerprint * fp, const void * data, size_t length)
+{
+    const unsigned char * cursor = data;
+    uint64_t k;
+
+    fp->length += length;
+
+    /* Top up a partial block from a previous call first. */
+    while (fp->pending_bytes && length) {
+        fp->pending |= (uint64_t)*cursor++ << (8 * fp->pending_bytes);
+        --length;
+        if (++fp->pending_bytes == 8) {
+            fp->state = fingerprint_block(fp->state, fp->pending);
+            fp->pending = 0;
+            fp->pending_bytes = 0;
+        }
+    }
+
+    for (; length >= 8; cursor += 8, length -= 8) {
+        memcpy(&k, cursor, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        k = __builtin_bswap64(k);
+#endif
+        fp->state = fingerprint_block(fp->state, k);
+    }
+
+    while (length--) {
+        fp->pending |= (uint64_t)*cursor++ << (8 * fp->pending_bytes++);
+    }
+}
+
+/**
+ * Computes the fingerprint of everything fed so far, leaving the state as is.
+ * @param fp The running fingerprint.
+ * @return 64-bit fingerprint.
+ */
+uint64_t fingerprint_final(const struct fingerprint * fp)
+{
+    uint64_t h = fp->state;
+
+    if (fp->pending_bytes) {
+        h = fingerprint_block(h, fp->pending);
+    }
+
+    h ^= fp->length;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+uint64_t fingerprint_bytes(const void * data, size_t length)
+{
+    struct fingerprint fp;
+
+    fingerprint_init(&fp);
+    fingerprint_update(&fp, data, length);
+    return fingerprint_final(&fp);
+}
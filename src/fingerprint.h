@@ -0,0 +1,31 @@
+/*
+ * Non-cryptographic 64-bit content fingerprints, used to detect whether a
+ * hosts file changed at all.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Incremental state. Input is consumed eight bytes at a time; the result does
+ * not depend on how the input is split over calls to fingerprint_update.
+ */
+struct fingerprint {
+    uint64_t state;
+    uint64_t pending;
+    unsigned int pending_bytes;
+    unsigned long long length;
+};
+
+void fingerprint_init(struct fingerprint * fp);
+void fingerprint_update(struct fingerprint * fp, const void * data, size_t length);
+uint64_t fingerprint_final(const struct fingerprint * fp);
+uint64_t fingerprint_bytes(const void * data, size_t length);
+
+#endif
@@ -1,128 +1,56 @@
 /*
- * Command line interface to interact with the hosts file.
+ * Core operations on hosts files: parsing, editing and exporting.
  *
  * Copyright (C) 2022 Jens Pots.
  * License: AGPL-3.0-only.
  */
 
+#include "hostsfile.h"
+#include "export.h"
+#include "filter.h"
+#include "fingerprint.h"
+#include "probes.h"
+#include "stats.h"
+#include "writer.h"
+
 #include <arpa/inet.h>
 #include <assert.h>
-#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <regex.h>
-#include <stdio.h>
 #include <stdlib.h>
-#include <stdnoreturn.h>
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/param.h>
-
-/* Information about the program. */
-#define PROGRAM_NAME "hostsfile"
-#define PROGRAM_VERSION "0.0.1"
-
-/*
- * Text transformations using simple color/style codes.
- * Based on https://stackoverflow.com/a/3219471/13197584.
- */
-#define ANSI_COLOR_RED "\x1b[31m"
-#define ANSI_COLOR_GREEN "\x1b[32m"
-#define ANSI_COLOR_YELLOW "\x1b[33m"
-#define ANSI_COLOR_BLUE "\x1b[34m"
-#define ANSI_COLOR_MAGENTA "\x1b[35m"
-#define ANSI_COLOR_CYAN "\x1b[36m"
-#define ANSI_COLOR_RESET "\x1b[0m"
-#define ANSI_STYLE_BOLD "\033[1m"
-#define ANSI_STYLE_RESET "\033[22m"
-#define MAGENTA(x) ANSI_COLOR_MAGENTA "" x "" ANSI_COLOR_RESET
-#define BOLD(x) ANSI_STYLE_BOLD "" x "" ANSI_STYLE_RESET
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 /* Memory management parameters. */
 #define INITIAL_ARRAY_SIZE 16
+#define INITIAL_INDEX_SIZE 64
 
-/* We're not too concerned about the correctness of the hosts file just yet. */
-#define REGEX_HOST_FILE_ENTRY "^([^\t \n]+)[\t ]+([^\t \n]+)\n?$"
+/* Special values of hosts_file_slot.entry. */
+#define SLOT_FREE 0xffffffffu
+#define SLOT_TOMBSTONE 0xfffffffeu
+
+/* Addresses may carry a port, which is stripped before validation. */
 #define REGEX_IPv4_PORT "^([0-9.]*):[0-9]+$"
 #define REGEX_IPv6_PORT "^\\[(.*)\\]:[0-9]+$"
 
 /* Set by CLI arguments. */
 char * hosts_file_path = "/etc/hosts";
-static int verbose_flag = 0;
-static int raw_flag = 0;
-static int dry_run_flag = 0;
-static int modified_flag = 0;
+int verbose_flag = 0;
+int raw_flag = 0;
+int dry_run_flag = 0;
 
 /* Prevents regexes from having to be recompiled every function call. */
 static int regex_compiled = 0;
 static regex_t regex_ipv4, regex_ipv6;
 
-/* Help message. */
-// clang-format off
-static char* help_message =
-        "HOSTFILE: command line interface for editing hosts files easily.\n"
-        "Copyright (c) by Jens Pots\n"
-        "Licensed under AGPL-3.0-only\n"
-        "\n"
-        BOLD("IMPORTANT\n")
-        "\tWriting to /etc/hosts requires root privileges.\n"
-        "\n"
-        BOLD("FLAGS\n")
-        "\t--verbose\t\tTurn up verbosity.\n"
-        "\t--raw\t\t\tDon't humanize output.\n"
-        "\t--dry-run\t\tSend changes to stdout.\n"
-        "\n"
-        BOLD("OPTIONS\n")
-        "\t-a --add <domain>@<ip>\tAdd a new entry.\n"
-        "\t-l --list\t\tList all current entries.\n"
-        "\t-r --remove <domain>\tRemove an entry.\n"
-        "\t-i --import <path>\tTake union with using file.\n"
-        "\t-d --delete <path>\tMinus set operation using file.\n";
-// clang-format on
-
-/* Various status codes used throughout. */
-enum error_code {
-    ERROR_CODE_SUCCESS,
-    ERROR_CODE_FILE_NOT_FOUND,
-    ERROR_CODE_LOGIC_ERROR,
-    ERROR_CODE_REGEX_INVALID,
-    ERROR_CODE_INVALID_ARGUMENTS,
-    ERROR_CODE_NON_EXHAUSTIVE_CASE,
-    ERROR_CODE_MEM_ALLOCATION,
-    ERROR_CODE_INVALID_FILE,
-    ERROR_CODE_INVALID_IP,
-    ERROR_CODE_FORBIDDEN,
-    ERROR_CODE_ENTRY_DOES_NOT_EXIST,
-};
-
-/* Keeps track of the IP protocol version. */
-enum ip_kind {
-    IP_KIND_NONE,
-    IP_KIND_IPv4,
-    IP_KIND_IPv6,
-};
-
-/* Wraps the union in a struct to keep track of its type. */
-struct hosts_file_entry {
-    enum {
-        UNION_EMPTY,
-        UNION_ELEMENT,
-        UNION_COMMENT,
-    } type;
-    union {
-        struct map {
-            enum ip_kind kind;
-            char * ip;
-            char * domain;
-        } map;
-        char * comment;
-    } value;
-};
-
-/* Simple abstraction of a hosts file. Essentially a vector. */
-struct hosts_file {
-    struct hosts_file_entry * entries;
-    unsigned int size;
-    unsigned int index;
-};
+struct hf_alloc_stats hf_alloc_stats;
 
 /* Error handler. */
 noreturn void handle_error(enum error_code error_code)
@@ -159,6 +87,15 @@ noreturn void handle_error(enum error_code error_code)
         case ERROR_CODE_ENTRY_DOES_NOT_EXIST:
             fprintf(stderr, PROGRAM_NAME ": The supplied entry was not found.\n");
             break;
+        case ERROR_CODE_WRITE_FAILED:
+            fprintf(stderr, PROGRAM_NAME ": The hosts file could not be written.\n");
+            break;
+        case ERROR_CODE_MERGE_CONFLICT:
+            fprintf(stderr, PROGRAM_NAME ": The files could not be merged without conflicts.\n");
+            break;
+        case ERROR_CODE_DELTA_MISMATCH:
+            fprintf(stderr, PROGRAM_NAME ": The hosts file doesn't hold the entries the delta was made from.\n");
+            break;
         default:
         case ERROR_CODE_NON_EXHAUSTIVE_CASE:
             fprintf(stderr, "DEVELOPER WARNING: A switch was not exhaustive.\n");
@@ -169,16 +106,62 @@ noreturn void handle_error(enum error_code error_code)
 }
 
 /**
- * Checks whether or not an IP address is IPv4 or IPv6.
+ * Records a successful allocation of a given size.
+ * @param pointer The pointer returned by the allocator.
+ * @param size The amount of bytes requested.
+ * @return The pointer itself.
+ */
+static void * hf_alloc_record(void * pointer, size_t size)
+{
+    if (pointer == NULL && size != 0) {
+        handle_error(ERROR_CODE_MEM_ALLOCATION);
+    }
+
+    atomic_fetch_add_explicit(&hf_alloc_stats.count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hf_alloc_stats.bytes, size, memory_order_relaxed);
+    return pointer;
+}
+
+void * hf_malloc(size_t size)
+{
+    return hf_alloc_record(malloc(size), size);
+}
+
+void * hf_calloc(size_t count, size_t size)
+{
+    return hf_alloc_record(calloc(count, size), count * size);
+}
+
+void * hf_realloc(void * pointer, size_t size)
+{
+    return hf_alloc_record(realloc(pointer, size), size);
+}
+
+char * hf_strdup(const char * string)
+{
+    return hf_strndup(string, strlen(string));
+}
+
+char * hf_strndup(const char * string, size_t length)
+{
+    char * copy = hf_malloc(length + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/**
+ * Checks whether or not an IP address is IPv4 or IPv6, without failing.
  * @param ip A pointer to the IP address.
- * @return An instance of the ip_kind enum.
+ * @return An instance of the ip_kind enum, IP_KIND_NONE if it's not valid.
  */
-enum ip_kind parse_ip_address(char * ip)
+enum ip_kind ip_address_kind(const char * ip)
 {
     regmatch_t capture_groups[2];
     long long ip_start, ip_end;
     unsigned char buffer[MAX(sizeof(struct in_addr), sizeof(struct in6_addr))];
-    char * tmp = ip;
+    char * tmp = (char *)ip;
+    enum ip_kind kind = IP_KIND_NONE;
     int status_code;
 
     if (!regex_compiled) {
@@ -189,60 +172,74 @@ enum ip_kind parse_ip_address(char * ip)
         regex_compiled = 1;
     }
 
+    /* Plain addresses never match the port expressions, so try them first. */
+    if (inet_pton(AF_INET, ip, &buffer)) {
+        return IP_KIND_IPv4;
+    } else if (inet_pton(AF_INET6, ip, &buffer)) {
+        return IP_KIND_IPv6;
+    }
+
     /* If a port is given, retrieve the IP address. */
     if (regexec(&regex_ipv4, ip, 2, capture_groups, 0) == 0 || regexec(&regex_ipv6, ip, 2, capture_groups, 0) == 0) {
         ip_start = capture_groups[1].rm_so;
         ip_end = capture_groups[1].rm_eo;
-        tmp = calloc(sizeof(char), ip_end - ip_start + 1);
-        strncpy(tmp, &ip[ip_start], ip_end - ip_start);
+        tmp = hf_strndup(&ip[ip_start], ip_end - ip_start);
     }
 
     /* Check validity using built-in library. */
     if (inet_pton(AF_INET, tmp, &buffer)) {
-        return IP_KIND_IPv4;
+        kind = IP_KIND_IPv4;
     } else if (inet_pton(AF_INET6, tmp, &buffer)) {
-        return IP_KIND_IPv6;
-    } else {
+        kind = IP_KIND_IPv6;
+    }
+
+    if (tmp != ip) {
+        free(tmp);
+    }
+
+    return kind;
+}
+
+/**
+ * Checks whether or not an IP address is IPv4 or IPv6.
+ * @param ip A pointer to the IP address.
+ * @return An instance of the ip_kind enum.
+ */
+enum ip_kind parse_ip_address(char * ip)
+{
+    enum ip_kind kind = ip_address_kind(ip);
+
+    if (kind == IP_KIND_NONE) {
         handle_error(ERROR_CODE_INVALID_IP);
     }
+
+    return kind;
 }
 
 /**
  * Make sure the array of a given hosts file allows for one more element.
  * @param hosts_file The hosts file struct that will be grown.
  */
-void hosts_file_grow(struct hosts_file hosts_file)
+static void hosts_file_grow(struct hosts_file * hosts_file)
 {
-    if (hosts_file.index == hosts_file.size) {
-        hosts_file.size *= 2;
-        hosts_file.entries = realloc(hosts_file.entries, sizeof(struct map) * hosts_file.size);
+    if (hosts_file->index == hosts_file->size) {
+        hosts_file->size *= 2;
+        hosts_file->entries = hf_realloc(hosts_file->entries, sizeof(struct hosts_file_entry) * hosts_file->size);
+        if (hosts_file->lines) {
+            hosts_file->lines = hf_realloc(hosts_file->lines, sizeof(unsigned int) * hosts_file->size);
+        }
     }
 }
 
-/***
- * Parses a file and returns the contents as a hosts_file struct.
- * @param pathname Absolute path of the file to be parsed.
- * @return hosts_file instance.
- * @warning The returned hosts_file_element's array must be freed manually.
+/**
+ * Opens a hosts file for reading, failing like the parser does.
+ * @param pathname Path of the file.
+ * @return The opened stream.
  */
-struct hosts_file hosts_file_init(char * pathname)
+static FILE * hosts_file_open(const char * pathname)
 {
     FILE * file;
-    int index;
-    long long ip_start, ip_end, dom_start, dom_end;
-    size_t length;
-    char * line = NULL; // Makes `getline` initialize buffer
-    regex_t regex;
-    regmatch_t capture_groups[3];
-    struct hosts_file hosts_file;
-    struct hosts_file_entry entry;
 
-    /* Compiles regular expression. */
-    if (regcomp(&regex, REGEX_HOST_FILE_ENTRY, REG_EXTENDED)) {
-        handle_error(ERROR_CODE_REGEX_INVALID);
-    }
-
-    /* Open file. */
     if (!(file = fopen(pathname, "r"))) {
         if (errno == EACCES) {
             handle_error(ERROR_CODE_FORBIDDEN);
@@ -251,51 +248,234 @@ struct hosts_file hosts_file_init(char * pathname)
         }
     }
 
+    return file;
+}
+
+static inline int hosts_file_is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static inline int hosts_file_is_field(char c)
+{
+    return c != ' ' && c != '\t' && c != '\n' && c != '\0';
+}
+
+/**
+ * Splits a line into an address and a domain. Lines that consist of anything
+ * else than exactly these two fields are treated as comments.
+ * @param line Line ending in a newline or null character.
+ * @param token Receives the spans of both fields.
+ * @return Non-zero if the line is an entry.
+ */
+int hosts_file_tokenize(const char * line, struct hosts_file_token * token)
+{
+    const char * cursor = line;
+
+    if (*cursor == '#') {
+        return 0;
+    }
+
+    while (hosts_file_is_field(*cursor)) {
+        ++cursor;
+    }
+    token->ip = line;
+    token->ip_length = cursor - line;
+    if (token->ip_length == 0 || !hosts_file_is_blank(*cursor)) {
+        return 0;
+    }
+
+    while (hosts_file_is_blank(*cursor)) {
+        ++cursor;
+    }
+    token->domain = cursor;
+    while (hosts_file_is_field(*cursor)) {
+        ++cursor;
+    }
+    token->domain_length = cursor - token->domain;
+    if (token->domain_length == 0) {
+        return 0;
+    }
+
+    /* The line may be followed by others when tokenizing a whole buffer. */
+    return *cursor == '\n' || *cursor == '\0';
+}
+
+/**
+ * Parses an opened file, see hosts_file_parse.
+ * @param file The file, closed when done.
+ * @param pathname Its path.
+ * @param scan Lines to keep, or NULL to keep the complete file.
+ * @return hosts_file instance, partial if a scan was given.
+ */
+static struct hosts_file hosts_file_read(FILE * file, char * pathname, const struct hosts_file_scan * scan)
+{
+    size_t length = 0;
+    ssize_t read;
+    char * line = NULL; // Makes `getline` initialize buffer
+    struct hosts_file hosts_file;
+    struct hosts_file_entry entry;
+    struct hosts_file_token token;
+    struct fingerprint fingerprint;
+    const struct filter * filter = scan ? scan->filter : NULL;
+    unsigned long long skipped = 0, line_number = 0, before = stats.bytes_read;
+
+    stats_phase_begin("parse");
+    PROBE1(init_entry, pathname);
+
     /* Initialize array. */
     hosts_file.size = INITIAL_ARRAY_SIZE;
-    hosts_file.entries = calloc(sizeof(struct hosts_file_entry), INITIAL_ARRAY_SIZE);
-
-    /* Read file line-by-line. */
-    for (index = 0; getline(&line, &length, file) != -1; ++index) {
-        if (line[0] != '#' && regexec(&regex, line, 3, capture_groups, 0) == 0) {
-            dom_start = capture_groups[2].rm_so;
-            dom_end = capture_groups[2].rm_eo;
-            ip_start = capture_groups[1].rm_so;
-            ip_end = capture_groups[1].rm_eo;
+    hosts_file.index = 0;
+    hosts_file.entries = hf_calloc(sizeof(struct hosts_file_entry), INITIAL_ARRAY_SIZE);
+    hosts_file.slots = NULL;
+    hosts_file.slot_count = 0;
+    hosts_file.slot_used = 0;
+    hosts_file.lines = scan ? hf_malloc(sizeof(unsigned int) * INITIAL_ARRAY_SIZE) : NULL;
+    hosts_file.partial = scan != NULL;
+    fingerprint_init(&fingerprint);
+
+    /* Read file line-by-line, reusing a single line buffer. */
+    while ((!scan || hosts_file.index < scan->limit) && (read = getline(&line, &length, file)) != -1) {
+        stats.bytes_read += read;
+        if (!scan) {
+            fingerprint_update(&fingerprint, line, read);
+        }
+        ++line_number;
+        if (filter && line_number > filter->last_line) {
+            break;
+        }
+
+        if (hosts_file_tokenize(line, &token)) {
+            /* Rejected and skipped entries are dropped before anything is allocated. */
+            if (filter && !filter_match(filter, &token, line_number)) {
+                continue;
+            }
+            if (scan && skipped < scan->offset) {
+                ++skipped;
+                continue;
+            }
             entry.type = UNION_ELEMENT;
-            entry.value.map.ip = calloc(sizeof(char), ip_end - ip_start + 1);
-            entry.value.map.domain = calloc(sizeof(char), dom_end - dom_start + 1);
-            strncpy(entry.value.map.ip, &line[ip_start], ip_end - ip_start);
-            strncpy(entry.value.map.domain, &line[dom_start], dom_end - dom_start);
+            entry.value.map.ip = hf_strndup(token.ip, token.ip_length);
+            entry.value.map.domain = hf_strndup(token.domain, token.domain_length);
             entry.value.map.kind = parse_ip_address(entry.value.map.ip);
-            free(line);
+            ++stats.entries_parsed;
+        } else if (scan) {
+            continue;
         } else {
-            /* We don't free the read line since we keep it as a comment! */
             entry.type = UNION_COMMENT;
-            entry.value.comment = line;
+            entry.value.comment = hf_strndup(line, read);
         }
 
-        hosts_file_grow(hosts_file);
-        hosts_file.entries[index] = entry;
-        line = NULL;
+        hosts_file_grow(&hosts_file);
+        if (hosts_file.lines) {
+            hosts_file.lines[hosts_file.index] = (unsigned int)line_number;
+        }
+        hosts_file.entries[hosts_file.index++] = entry;
     }
 
+    /* A read that failed midway would be written back truncated. */
+    if (ferror(file)) {
+        fprintf(stderr, PROGRAM_NAME ": Could not read %s.\n", pathname);
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+
+    /* Only a complete read identifies the file. */
+    hosts_file.source_length = scan ? 0 : fingerprint.length;
+    hosts_file.source_fingerprint = scan ? 0 : fingerprint_final(&fingerprint);
+    hosts_file.source_lines = scan ? 0 : (unsigned int)line_number;
+
+    free(line);
     fclose(file);
-    hosts_file.index = index;
+    PROBE3(init_return, pathname, hosts_file.index, stats.bytes_read - before);
+    stats_phase_end();
 
     return hosts_file;
 }
 
+/***
+ * Parses a file and returns the contents as a hosts_file struct.
+ * @param pathname Absolute path of the file to be parsed.
+ * @return hosts_file instance.
+ * @warning The returned hosts_file_element's array must be freed manually.
+ */
+struct hosts_file hosts_file_init(char * pathname)
+{
+    return hosts_file_parse(pathname, NULL);
+}
+
+/**
+ * Parses a complete file like hosts_file_init, but reports a file that can't
+ * be opened instead of exiting.
+ * @param pathname Path of the file to be parsed.
+ * @param hosts_file Receives the contents on success.
+ * @return ERROR_CODE_SUCCESS, ERROR_CODE_FORBIDDEN or ERROR_CODE_FILE_NOT_FOUND.
+ */
+enum error_code hosts_file_try_init(char * pathname, struct hosts_file * hosts_file)
+{
+    FILE * file = fopen(pathname, "r");
+
+    if (!file) {
+        return errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND;
+    }
+
+    *hosts_file = hosts_file_read(file, pathname, NULL);
+    return ERROR_CODE_SUCCESS;
+}
+
+/***
+ * Parses a file, or only a selection of its lines.
+ * @param pathname Absolute path of the file to be parsed.
+ * @param scan Lines to keep, or NULL to keep the complete file.
+ * @return hosts_file instance, partial if a scan was given.
+ */
+struct hosts_file hosts_file_parse(char * pathname, const struct hosts_file_scan * scan)
+{
+    return hosts_file_read(hosts_file_open(pathname), pathname, scan);
+}
+
+/**
+ * Streams the entries of a file to a visitor, without materializing them.
+ * The token is only valid during the call.
+ * @param pathname Path of the file.
+ * @param visitor Called for every entry, in file order.
+ * @param context Passed to the visitor.
+ */
+void hosts_file_visit(char * pathname, hosts_file_visitor visitor, void * context)
+{
+    FILE * file = hosts_file_open(pathname);
+    size_t length = 0;
+    ssize_t read;
+    char * line = NULL;
+    struct hosts_file_token token;
+    unsigned long long line_number = 0;
+
+    stats_phase_begin("scan");
+    while ((read = getline(&line, &length, file)) != -1) {
+        stats.bytes_read += read;
+        ++line_number;
+        if (hosts_file_tokenize(line, &token)) {
+            ++stats.entries_parsed;
+            if (visitor(context, &token, line_number)) {
+                break;
+            }
+        }
+    }
+    stats_phase_end();
+
+    free(line);
+    fclose(file);
+}
+
 /**
  * Frees a hosts_file struct and it's elements from memory.
  * @param hosts_file The struct to be deleted.
  */
-void hosts_file_free(struct hosts_file hosts_file)
+void hosts_file_free(struct hosts_file * hosts_file)
 {
     struct hosts_file_entry entry;
 
-    for (int i = 0; i < hosts_file.size; ++i) {
-        entry = hosts_file.entries[i];
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        entry = hosts_file->entries[i];
         switch (entry.type) {
             case UNION_EMPTY:
                 break;
@@ -311,30 +491,144 @@ void hosts_file_free(struct hosts_file hosts_file)
         }
     }
 
-    free(hosts_file.entries);
+    free(hosts_file->entries);
+    free(hosts_file->slots);
+    free(hosts_file->lines);
+    hosts_file->entries = NULL;
+    hosts_file->lines = NULL;
+    hosts_file->partial = 0;
+    hosts_file->size = 0;
+    hosts_file->index = 0;
+    hosts_file->slots = NULL;
+    hosts_file->slot_count = 0;
+    hosts_file->slot_used = 0;
+    hosts_file->source_length = 0;
+    hosts_file->source_fingerprint = 0;
+    hosts_file->source_lines = 0;
 }
 
 /**
- * Prints out a hosts_file struct to the console.
- * @param hosts_file The struct to be printed.
+ * The line an entry was read from.
+ * @param f The hosts file.
+ * @param entry Position of the entry in the entries array.
+ * @return One-based line number, zero for entries that were added since.
  */
-void hosts_file_human_export(FILE * file, struct hosts_file hosts_file)
+unsigned int hosts_file_line(const struct hosts_file * f, unsigned int entry)
 {
-    struct hosts_file_entry entry;
-    int first_print = 1;
-
-    for (int i = 0; i < hosts_file.size; ++i) {
-        entry = hosts_file.entries[i];
-        if (entry.type == UNION_ELEMENT) {
-            first_print ? first_print = 0 : printf("\n");
-            fprintf(file, MAGENTA(BOLD("Address")) "\t%s\n", entry.value.map.ip);
-            fprintf(file, MAGENTA(BOLD("Domain")) "\t%s\n", entry.value.map.domain);
-            if (verbose_flag) {
-                fprintf(file, MAGENTA(BOLD("Kind")) "\tIPv%d\n", entry.value.map.kind == IP_KIND_IPv4 ? 4 : 6);
-                fprintf(file, MAGENTA(BOLD("Line")) "\t%d\n", i);
-            }
+    if (f->lines == NULL) {
+        return entry + 1;
+    }
+
+    return entry < f->index ? f->lines[entry] : 0;
+}
+
+/**
+ * FNV-1a over a domain.
+ * @param domain Null-terminated domain.
+ * @return 32-bit hash.
+ */
+static unsigned int hosts_file_hash(const char * domain)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*domain) {
+        hash = (hash ^ (unsigned char)*domain++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Places an entry in the first free slot of its probe sequence.
+ * @param f Hosts file with an index of sufficient size.
+ * @param entry Position of the entry in the entries array.
+ * @param hash Hash of the entry's domain.
+ */
+static void hosts_file_index_insert(struct hosts_file * f, unsigned int entry, unsigned int hash)
+{
+    unsigned int mask = f->slot_count - 1;
+    unsigned int i = hash & mask;
+
+    while (f->slots[i].entry != SLOT_FREE) {
+        i = (i + 1) & mask;
+    }
+
+    f->slots[i].entry = entry;
+    f->slots[i].hash = hash;
+    ++(f->slot_used);
+}
+
+/**
+ * (Re)builds the domain index so that it can accommodate at least one more
+ * entry. Rebuilding also drops all tombstones.
+ * @param f The hosts file to index.
+ */
+static void hosts_file_index_reserve(struct hosts_file * f)
+{
+    unsigned int count = INITIAL_INDEX_SIZE;
+    unsigned int elements = 0;
+
+    /* Keep the load factor, tombstones included, below three quarters. */
+    if (f->slots && (f->slot_used + 1) * 4 < f->slot_count * 3) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < f->index; ++i) {
+        elements += f->entries[i].type == UNION_ELEMENT;
+    }
+    while (count < (elements + 1) * 2) {
+        count *= 2;
+    }
+
+    stats_phase_begin("index");
+    free(f->slots);
+    f->slots = hf_malloc(sizeof(struct hosts_file_slot) * count);
+    memset(f->slots, 0xff, sizeof(struct hosts_file_slot) * count);
+    f->slot_count = count;
+    f->slot_used = 0;
+    ++stats.index_rebuilds;
+
+    for (unsigned int i = 0; i < f->index; ++i) {
+        if (f->entries[i].type == UNION_ELEMENT) {
+            hosts_file_index_insert(f, i, hosts_file_hash(f->entries[i].value.map.domain));
         }
     }
+    stats_phase_end();
+}
+
+/**
+ * Makes sure the domain index is built, e.g. before sharing the hosts file
+ * with readers that only call hosts_file_find.
+ * @param f The hosts file to index.
+ */
+void hosts_file_index(struct hosts_file * f)
+{
+    if (f->slots == NULL) {
+        hosts_file_index_reserve(f);
+    }
+}
+
+/**
+ * Books the length of a probe sequence.
+ * @param probes Amount of slots inspected.
+ */
+static void hosts_file_index_record(unsigned long long probes)
+{
+    ++stats.index_lookups;
+    stats.index_probes += probes;
+    if (probes > stats.index_max_probe) {
+        stats.index_max_probe = probes;
+    }
+}
+
+/**
+ * Prints out a hosts_file struct as a table.
+ * @param file Target stream, colored if it's a terminal.
+ * @param hosts_file The struct to be printed.
+ */
+void hosts_file_human_export(FILE * file, struct hosts_file * hosts_file)
+{
+    export_stream(file, hosts_file, EXPORT_FORMAT_TABLE);
 }
 
 /**
@@ -343,91 +637,213 @@ void hosts_file_human_export(FILE * file, struct hosts_file hosts_file)
  * @param ip The IP address of the new entry.
  * @param domain The domain of the new entry.
  */
-void hosts_file_add(struct hosts_file f, char * ip, char * domain)
+void hosts_file_add(struct hosts_file * f, char * ip, char * domain)
 {
     enum ip_kind kind;
+    struct hosts_file_slot * slot;
+    struct map * map;
+    unsigned int hash, mask, i, probes = 1;
 
     if (domain == NULL || ip == NULL) {
         handle_error(ERROR_CODE_LOGIC_ERROR);
     }
 
+    PROBE2(add_entry, domain, ip);
     kind = parse_ip_address(ip);
+    hosts_file_index_reserve(f);
+    hash = hosts_file_hash(domain);
+    mask = f->slot_count - 1;
 
     /* OPTION A: An existing record will be overwritten. */
-    for (int i = 0; i < f.index; ++i) {
-        if (f.entries[i].type == UNION_ELEMENT) {
-            if (f.entries[i].value.map.kind == kind) {
-                if (strcmp(domain, f.entries[i].value.map.domain) == 0) {
-                    free(f.entries[i].value.map.ip);
-                    free(domain);
-                    f.entries[i].value.map.ip = ip;
-                    return;
-                }
-            }
+    for (i = hash & mask; f->slots[i].entry != SLOT_FREE; i = (i + 1) & mask, ++probes) {
+        slot = &f->slots[i];
+        if (slot->entry == SLOT_TOMBSTONE || slot->hash != hash) {
+            continue;
+        }
+        map = &f->entries[slot->entry].value.map;
+        if (map->kind == kind && strcmp(domain, map->domain) == 0) {
+            hosts_file_index_record(probes);
+            stats.entries_touched += strcmp(ip, map->ip) != 0;
+            free(map->ip);
+            map->ip = ip;
+            PROBE2(add_return, domain, f->index);
+            free(domain);
+            return;
         }
     }
 
+    hosts_file_index_record(probes);
+
     /* OPTION B: A new record is given. */
     hosts_file_grow(f);
-    f.entries[f.index].type = UNION_ELEMENT;
-    f.entries[f.index].value.map.ip = ip;
-    f.entries[f.index].value.map.domain = domain;
-    f.entries[f.index].value.map.kind = kind;
-    ++(f.index);
+    hosts_file_index_insert(f, f->index, hash);
+    f->entries[f->index].type = UNION_ELEMENT;
+    f->entries[f->index].value.map.ip = ip;
+    f->entries[f->index].value.map.domain = domain;
+    f->entries[f->index].value.map.kind = kind;
+    if (f->lines) {
+        f->lines[f->index] = 0;
+    }
+    ++(f->index);
+    ++stats.entries_touched;
+    PROBE2(add_return, domain, f->index);
 }
 
 /**
- * Adds/modifies an entry to/in the hosts file.
+ * Looks up all entries of a domain. Doesn't modify the hosts file, so it can
+ * run concurrently with other readers once the index has been built.
+ * @param f The hosts file, with its index built.
+ * @param domain The domain to look for.
+ * @param matches Receives the positions of matching entries.
+ * @param max Capacity of matches.
+ * @return The amount of matching entries, which may exceed max.
+ */
+unsigned int hosts_file_find(struct hosts_file * f, const char * domain, unsigned int * matches, unsigned int max)
+{
+    unsigned int hash = hosts_file_hash(domain), mask = f->slot_count - 1, found = 0;
+    struct hosts_file_slot * slot;
+
+    if (f->slots == NULL) {
+        handle_error(ERROR_CODE_LOGIC_ERROR);
+    }
+
+    for (unsigned int i = hash & mask; f->slots[i].entry != SLOT_FREE; i = (i + 1) & mask) {
+        slot = &f->slots[i];
+        if (slot->entry == SLOT_TOMBSTONE || slot->hash != hash) {
+            continue;
+        }
+        if (strcmp(domain, f->entries[slot->entry].value.map.domain) == 0) {
+            if (found < max) {
+                matches[found] = slot->entry;
+            }
+            ++found;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Appends a comment line to the hosts file.
  * @param f The hosts file that will be modified.
- * @param ip The IP address of the new entry.
- * @param domain The domain of the new entry.
+ * @param comment The line, including its newline; taken over by the file.
+ */
+void hosts_file_comment(struct hosts_file * f, char * comment)
+{
+    hosts_file_grow(f);
+    f->entries[f->index].type = UNION_COMMENT;
+    f->entries[f->index].value.comment = comment;
+    if (f->lines) {
+        f->lines[f->index] = 0;
+    }
+    ++f->index;
+}
+
+/**
+ * Removes all entries of a domain, if there are any.
+ * @param f The hosts file that will be modified.
+ * @param domain The domain of the entries to remove.
  * @param kind If set to non-zero, only matching entries will be deleted.
+ * @return The amount of removed entries.
  */
-void hosts_file_remove(struct hosts_file f, char * domain, enum ip_kind kind)
+unsigned int hosts_file_discard(struct hosts_file * f, const char * domain, enum ip_kind kind)
 {
-    unsigned int removed_something = 0;
+    unsigned int removed = 0;
+    struct hosts_file_slot * slot;
+    struct hosts_file_entry * entry;
+    unsigned int hash, mask, i, probes = 1;
 
     if (domain == NULL) {
         handle_error(ERROR_CODE_LOGIC_ERROR);
     }
 
-    for (int i = 0; i < f.index; ++i) {
-        if (f.entries[i].type == UNION_ELEMENT) {
-            if (strcmp(domain, f.entries[i].value.map.domain) == 0) {
-                if (kind == IP_KIND_NONE || f.entries[i].value.map.kind == kind) {
-                    free(f.entries[i].value.map.ip);
-                    free(f.entries[i].value.map.domain);
-                    f.entries[i].type = UNION_EMPTY;
-                    removed_something = 1;
-                }
+    PROBE1(remove_entry, domain);
+    hosts_file_index_reserve(f);
+    hash = hosts_file_hash(domain);
+    mask = f->slot_count - 1;
+
+    /* A domain may be mapped more than once, so walk the whole probe sequence. */
+    for (i = hash & mask; f->slots[i].entry != SLOT_FREE; i = (i + 1) & mask, ++probes) {
+        slot = &f->slots[i];
+        if (slot->entry == SLOT_TOMBSTONE || slot->hash != hash) {
+            continue;
+        }
+        entry = &f->entries[slot->entry];
+        if (strcmp(domain, entry->value.map.domain) == 0) {
+            if (kind == IP_KIND_NONE || entry->value.map.kind == kind) {
+                free(entry->value.map.ip);
+                free(entry->value.map.domain);
+                entry->type = UNION_EMPTY;
+                slot->entry = SLOT_TOMBSTONE;
+                ++removed;
             }
         }
     }
 
-    if (!removed_something) {
+    hosts_file_index_record(probes);
+    stats.entries_touched += removed;
+    PROBE2(remove_return, domain, removed);
+
+    return removed;
+}
+
+/**
+ * Removes all entries of a domain, failing when there are none.
+ * @param f The hosts file that will be modified.
+ * @param domain The domain of the entries to remove.
+ * @param kind If set to non-zero, only matching entries will be deleted.
+ */
+void hosts_file_remove(struct hosts_file * f, char * domain, enum ip_kind kind)
+{
+    if (!hosts_file_discard(f, domain, kind)) {
         handle_error(ERROR_CODE_ENTRY_DOES_NOT_EXIST);
     }
 }
 
-/***
- * Exports a hosts file struct to a file.
- * @param f Target file.
- * @param hosts_file Hosts file that will be written to the file.
+/**
+ * Checks whether any line is written after an entry.
+ * @param f The hosts file.
+ * @param entry Position of the entry.
  */
-void hosts_file_raw_export(FILE * f, struct hosts_file hosts_file)
+static int hosts_file_followed(const struct hosts_file * f, unsigned int entry)
 {
-    struct hosts_file_entry entry;
+    while (++entry < f->index) {
+        if (f->entries[entry].type != UNION_EMPTY) {
+            return 1;
+        }
+    }
 
-    for (int i = 0; i < hosts_file.size; ++i) {
-        entry = hosts_file.entries[i];
-        switch (entry.type) {
+    return 0;
+}
+
+/**
+ * Renders a hosts file in its on-disk format.
+ * @param w Target writer.
+ * @param hosts_file Hosts file that will be serialized.
+ */
+void hosts_file_serialize(struct writer * w, struct hosts_file * hosts_file)
+{
+    struct hosts_file_entry * entry;
+    size_t length;
+
+    for (unsigned int i = 0; i < hosts_file->index; ++i) {
+        entry = &hosts_file->entries[i];
+        switch (entry->type) {
             case UNION_EMPTY:
                 break;
             case UNION_ELEMENT:
-                fprintf(f, "%s\t%s\n", entry.value.map.ip, entry.value.map.domain);
+                writer_string(w, entry->value.map.ip);
+                writer_char(w, '\t');
+                writer_string(w, entry->value.map.domain);
+                writer_char(w, '\n');
                 break;
             case UNION_COMMENT:
-                fprintf(f, "%s", entry.value.comment);
+                writer_string(w, entry->value.comment);
+                /* The last line of the file may lack its newline and not be last anymore. */
+                length = strlen(entry->value.comment);
+                if (length && entry->value.comment[length - 1] != '\n' && hosts_file_followed(hosts_file, i)) {
+                    writer_char(w, '\n');
+                }
                 break;
             default:
                 handle_error(ERROR_CODE_NON_EXHAUSTIVE_CASE);
@@ -435,26 +851,375 @@ void hosts_file_raw_export(FILE * f, struct hosts_file hosts_file)
     }
 }
 
+/***
+ * Exports a hosts file struct to a file.
+ * @param f Target file.
+ * @param hosts_file Hosts file that will be written to the file.
+ */
+void hosts_file_raw_export(FILE * f, struct hosts_file * hosts_file)
+{
+    export_stream(f, hosts_file, EXPORT_FORMAT_HOSTS);
+}
+
+/**
+ * Writes a buffer in full, retrying on short writes.
+ * @param fd Target file descriptor.
+ * @param buffer Data to be written.
+ * @param length Amount of bytes in the buffer.
+ * @return Zero on success, -1 with errno set otherwise.
+ */
+static int hosts_file_write_all(int fd, const char * buffer, size_t length)
+{
+    ssize_t written;
+
+    while (length) {
+        if ((written = write(fd, buffer, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+        stats.bytes_written += written;
+    }
+
+    return 0;
+}
+
+static int hosts_file_fsync(int fd, size_t length)
+{
+    int result;
+
+    stats_phase_begin("fsync");
+    PROBE2(fsync_entry, fd, length);
+    result = fsync(fd);
+    PROBE2(fsync_return, fd, result);
+    stats_phase_end();
+
+    return result;
+}
+
+/**
+ * Truncates and rewrites a file in place. Used when an atomic replacement is
+ * impossible, e.g. when /etc/hosts is a bind mount inside a container.
+ * @param path The file to overwrite.
+ * @param buffer New contents.
+ * @param length Length of the new contents.
+ * @return ERROR_CODE_SUCCESS, or why the file could not be written.
+ */
+static enum error_code hosts_file_overwrite(const char * path, const char * buffer, size_t length)
+{
+    int fd = open(path, O_WRONLY | O_TRUNC);
+
+    if (fd < 0) {
+        return errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND;
+    }
+
+    if (hosts_file_write_all(fd, buffer, length) != 0 || hosts_file_fsync(fd, length) != 0) {
+        close(fd);
+        return ERROR_CODE_WRITE_FAILED;
+    }
+
+    close(fd);
+    return ERROR_CODE_SUCCESS;
+}
+
+/**
+ * Appends to a file in place, for changes that only add lines.
+ * @param path The file to append to.
+ * @param buffer Data to be appended.
+ * @param length Amount of bytes in the buffer.
+ */
+void hosts_file_append(const char * path, const char * buffer, size_t length)
+{
+    int fd = open(path, O_WRONLY | O_APPEND);
+
+    if (fd < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    if (hosts_file_write_all(fd, buffer, length) != 0 || hosts_file_fsync(fd, length) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+
+    close(fd);
+}
+
+/**
+ * Rewrites the end of a file in place and cuts off whatever remains of the
+ * old contents. Meant for small tails; anything else should be replaced.
+ * @param path The file to rewrite.
+ * @param offset Where the new tail starts.
+ * @param buffer The new tail.
+ * @param length Length of the new tail.
+ */
+void hosts_file_rewrite_tail(const char * path, size_t offset, const char * buffer, size_t length)
+{
+    int fd = open(path, O_WRONLY);
+
+    if (fd < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    if (lseek(fd, (off_t)offset, SEEK_SET) < 0 || hosts_file_write_all(fd, buffer, length) != 0 || ftruncate(fd, (off_t)(offset + length)) != 0 || hosts_file_fsync(fd, length) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+
+    close(fd);
+}
+
+/**
+ * Replaces a file by writing a sibling temporary file and renaming it over
+ * the original, so readers never observe a half written hosts file.
+ * @param path The file to replace; symbolic links are resolved first.
+ * @param buffer New contents.
+ * @param length Length of the new contents.
+ * @return ERROR_CODE_SUCCESS, or why the file could not be written.
+ */
+enum error_code hosts_file_try_replace(const char * path, const char * buffer, size_t length)
+{
+    char target[PATH_MAX], temporary[PATH_MAX + 16];
+    struct stat st;
+    int fd, result;
+
+    if (!realpath(path, target)) {
+        return errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND;
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.hf-XXXXXX", target);
+    if ((fd = mkstemp(temporary)) < 0) {
+        /* The directory may be read-only while the file itself is not. */
+        return hosts_file_overwrite(target, buffer, length);
+    }
+
+    /* Keep the permissions and ownership of the file being replaced. */
+    if (stat(target, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+            /* Only root may give files away; the current owner is fine then. */
+        }
+    }
+
+    if (hosts_file_write_all(fd, buffer, length) != 0 || hosts_file_fsync(fd, length) != 0) {
+        close(fd);
+        unlink(temporary);
+        return ERROR_CODE_WRITE_FAILED;
+    }
+    close(fd);
+
+    stats_phase_begin("rename");
+    PROBE2(rename_entry, temporary, target);
+    result = rename(temporary, target);
+    PROBE1(rename_return, result);
+    stats_phase_end();
+
+    if (result != 0) {
+        unlink(temporary);
+        return hosts_file_overwrite(target, buffer, length);
+    }
+
+    return ERROR_CODE_SUCCESS;
+}
+
+/**
+ * Like hosts_file_try_replace, but exits when the file can't be written.
+ * @param path The file to replace.
+ * @param buffer New contents.
+ * @param length Length of the new contents.
+ */
+void hosts_file_replace(const char * path, const char * buffer, size_t length)
+{
+    enum error_code code = hosts_file_try_replace(path, buffer, length);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+}
+
+/**
+ * Copies a range of one file to another, without passing through user space
+ * where the system allows.
+ * @param out Target file descriptor, written at its current position.
+ * @param in Source file descriptor, which keeps its position.
+ * @param offset Start of the range in the source.
+ * @param length Length of the range.
+ * @return Zero on success, -1 with errno set otherwise.
+ */
+int hosts_file_copy(int out, int in, off_t offset, size_t length)
+{
+    char buffer[WRITER_BUFFER_SIZE];
+    ssize_t got;
+
+#ifdef __linux__
+    while (length && (got = sendfile(out, in, &offset, length)) > 0) {
+        stats.bytes_written += got;
+        length -= got;
+    }
+#endif
+    while (length) {
+        if ((got = pread(in, buffer, MIN(length, sizeof(buffer)), offset)) <= 0) {
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            errno = got == 0 ? EIO : errno;
+            return -1;
+        }
+        if (hosts_file_write_all(out, buffer, got) != 0) {
+            return -1;
+        }
+        offset += got;
+        length -= got;
+    }
+
+    return 0;
+}
+
+/**
+ * Replaces the middle of a file. What comes before head and from tail on is
+ * copied from the original file by hosts_file_copy; buffer takes the place of
+ * what was in between. Like hosts_file_replace, the result is renamed over
+ * the original.
+ * @param path The file to change.
+ * @param original The file, opened for reading.
+ * @param head Length of the part before the change.
+ * @param buffer The new middle part.
+ * @param length Length of the new middle part.
+ * @param tail Offset of the part after the change.
+ * @param size Size of the original.
+ */
+void hosts_file_splice(const char * path, int original, size_t head, const char * buffer, size_t length, size_t tail, size_t size)
+{
+    char target[PATH_MAX], temporary[PATH_MAX + 16];
+    char * contents;
+    struct stat st;
+    enum error_code code;
+    int fd;
+
+    if (!realpath(path, target)) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.hf-XXXXXX", target);
+    if ((fd = mkstemp(temporary)) >= 0) {
+        if (fstat(original, &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+            if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+                /* Only root may give files away; the current owner is fine then. */
+            }
+        }
+        if (hosts_file_copy(fd, original, 0, head) != 0 || hosts_file_write_all(fd, buffer, length) != 0 || hosts_file_copy(fd, original, (off_t)tail, size - tail) != 0 || hosts_file_fsync(fd, head + length + size - tail) != 0) {
+            close(fd);
+            unlink(temporary);
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+        close(fd);
+
+        stats_phase_begin("rename");
+        if (rename(temporary, target) == 0) {
+            stats_phase_end();
+            return;
+        }
+        stats_phase_end();
+        unlink(temporary);
+    }
+
+    /* The directory may be read-only while the file itself is not. */
+    contents = hf_malloc(head + length + size - tail + 1);
+    if (pread(original, contents, head, 0) != (ssize_t)head || pread(original, contents + head + length, size - tail, (off_t)tail) != (ssize_t)(size - tail)) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    memcpy(contents + head, buffer, length);
+    if ((code = hosts_file_overwrite(target, contents, head + length + size - tail)) != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+    free(contents);
+}
+
 /**
- * Write the hosts file as specified by the various flags.
+ * Counts the lines of a buffer, including an unterminated last one.
+ * @param buffer The contents.
+ * @param length Their length.
+ * @return Amount of lines.
+ */
+static unsigned int hosts_file_count_lines(const char * buffer, size_t length)
+{
+    const char *cursor = buffer, *end = buffer + length, *next;
+    unsigned int lines = 0;
+
+    for (; cursor < end; cursor = next + 1, ++lines) {
+        if (!(next = memchr(cursor, '\n', end - cursor))) {
+            next = end;
+        }
+    }
+
+    return lines;
+}
+
+/**
+ * Write the hosts file as specified by the various flags. Writes that would
+ * leave the file byte-for-byte identical are skipped.
  * @param hosts_file The host file to be written.
+ * @return ERROR_CODE_SUCCESS, or why the file could not be written.
  */
-void hosts_file_write(struct hosts_file hosts_file)
+enum error_code hosts_file_try_write(struct hosts_file * hosts_file)
 {
+    enum error_code code = ERROR_CODE_SUCCESS;
+    struct writer w;
+    uint64_t fingerprint;
+
     if (!dry_run_flag) {
-        FILE * file = fopen(hosts_file_path, "w");
-        if (file) {
-            hosts_file_raw_export(file, hosts_file);
-        } else if (errno == EACCES) {
-            handle_error(ERROR_CODE_FORBIDDEN);
-        } else {
-            handle_error(ERROR_CODE_FILE_NOT_FOUND);
+        if (hosts_file->partial) {
+            return ERROR_CODE_LOGIC_ERROR;
+        }
+
+        /* Serialize in memory first, so both steps can be timed separately. */
+        stats_phase_begin("serialize");
+        PROBE1(serialize_entry, hosts_file->index);
+        writer_init(&w, -1, 0);
+        hosts_file_serialize(&w, hosts_file);
+        fingerprint = fingerprint_bytes(w.buffer, w.length);
+        PROBE1(serialize_return, w.length);
+        stats_phase_end();
+
+        stats.write_skipped = w.length == hosts_file->source_length && fingerprint == hosts_file->source_fingerprint;
+        if (!stats.write_skipped) {
+            stats_phase_begin("write");
+            code = hosts_file_try_replace(hosts_file_path, w.buffer, w.length);
+            stats_phase_end();
+            if (code == ERROR_CODE_SUCCESS) {
+                hosts_file->source_length = w.length;
+                hosts_file->source_fingerprint = fingerprint;
+                hosts_file->source_lines = hosts_file_count_lines(w.buffer, w.length);
+            }
         }
-        fclose(file);
-    } else if (raw_flag) {
-        hosts_file_raw_export(stdout, hosts_file);
+        writer_close(&w);
     } else {
-        hosts_file_human_export(stdout, hosts_file);
+        stats_phase_begin("export");
+        if (export_format != EXPORT_FORMAT_NONE) {
+            export_stream(stdout, hosts_file, export_format);
+        } else if (raw_flag) {
+            hosts_file_raw_export(stdout, hosts_file);
+        } else {
+            hosts_file_human_export(stdout, hosts_file);
+        }
+        fflush(stdout);
+        stats_phase_end();
+    }
+
+    return code;
+}
+
+/**
+ * Like hosts_file_try_write, but exits when the file can't be written.
+ * @param hosts_file The host file to be written.
+ */
+void hosts_file_write(struct hosts_file * hosts_file)
+{
+    enum error_code code = hosts_file_try_write(hosts_file);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        handle_error(code);
     }
 }
 
@@ -463,16 +1228,21 @@ void hosts_file_write(struct hosts_file hosts_file)
  * @param target Target file.
  * @param other Hosts file whose entries are used for merging.
  */
-void hosts_file_merge(struct hosts_file target, struct hosts_file other)
+void hosts_file_merge(struct hosts_file * target, struct hosts_file * other)
 {
     struct hosts_file_entry * entry;
 
-    for (int i = 0; i < other.size; ++i) {
-        entry = other.entries + i;
+    stats_phase_begin("merge");
+    PROBE2(merge_entry, target->index, other->index);
+    for (unsigned int i = 0; i < other->index; ++i) {
+        entry = other->entries + i;
         if (entry->type == UNION_ELEMENT) {
-            hosts_file_add(target, entry->value.map.ip, entry->value.map.domain);
+            /* The target takes ownership, so hand it copies. */
+            hosts_file_add(target, hf_strdup(entry->value.map.ip), hf_strdup(entry->value.map.domain));
         }
     }
+    PROBE1(merge_return, target->index);
+    stats_phase_end();
 }
 
 /**
@@ -481,129 +1251,123 @@ void hosts_file_merge(struct hosts_file target, struct hosts_file other)
  * @param target Target file.
  * @param other Entries in this file get deleted from the target.
  */
-void hosts_file_delete(struct hosts_file target, struct hosts_file other)
+void hosts_file_delete(struct hosts_file * target, struct hosts_file * other)
 {
     struct hosts_file_entry * entry;
 
-    for (int i = 0; i < other.size; ++i) {
-        entry = other.entries + i;
+    stats_phase_begin("subtract");
+    PROBE2(delete_entry, target->index, other->index);
+    for (unsigned int i = 0; i < other->index; ++i) {
+        entry = other->entries + i;
         if (entry->type == UNION_ELEMENT) {
             hosts_file_remove(target, entry->value.map.domain, entry->value.map.kind);
         }
     }
+    PROBE1(delete_return, target->index);
+    stats_phase_end();
 }
 
-int main(int argc, char ** argv)
-{
-    char *ip, *domain;
-    int c, tmp, break_free;
-    struct hosts_file hosts_file, other;
-    hosts_file = hosts_file_init(hosts_file_path);
-
-    /* Flags + parameters available. */
-    char options[] = "hlr:a:i:d:";
-    // clang-format off
-    struct option long_options[] = {
-        {"verbose", no_argument,       &verbose_flag, 1 },
-        {"brief",   no_argument,       &verbose_flag, 0 },
-        {"raw",     no_argument,       &raw_flag,     1 },
-        {"human",   no_argument,       &raw_flag,     0 },
-        {"dry-run", no_argument,       &dry_run_flag, 1 },
-        {"list",    no_argument,       NULL, 'l'},
-        {"help",    no_argument,       NULL, 'h'},
-        {"remove",  required_argument, NULL, 'r'},
-        {"add",     required_argument, NULL, 'a'},
-        {"import",  required_argument, NULL, 'i'},
-        {"delete",  required_argument, NULL, 'd'},
-        {"version", no_argument,       NULL, 'V'},
-        {NULL,      0,                 NULL, 0  }
-    };
-    // clang-format on
-
-    /* First, we check for any set flags. */
-    while (1) {
-        c = getopt_long(argc, argv, options, long_options, NULL);
-        if (c == -1) {
-            break;
-        } else if (c == '?') {
-            handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+/**
+ * Removes entries whose domain and address family already appeared on an
+ * earlier line, keeping the first of each.
+ * @param f The hosts file that will be modified.
+ */
+void hosts_file_dedup(struct hosts_file * f)
+{
+    struct hosts_file_slot * slot;
+    struct hosts_file_entry *entry, *other;
+    unsigned int hash, mask, i, j;
+
+    stats_phase_begin("dedup");
+    hosts_file_index_reserve(f);
+    mask = f->slot_count - 1;
+    for (i = 0; i < f->index; ++i) {
+        entry = &f->entries[i];
+        if (entry->type != UNION_ELEMENT) {
+            continue;
         }
-    };
-
-    /* Reset the getopt_long function internally. */
-    optind = 1;
-
-    /* Secondly, we go over the arguments. */
-    break_free = 0;
-    while (!break_free) {
-        switch (getopt_long(argc, argv, options, long_options, NULL)) {
-            case -1:
-                break_free = 1;
-                break;
-
-            case 'a':
-                domain = strdup(strtok(optarg, "@"));
-                ip = strdup(strtok(NULL, "@"));
-                hosts_file_add(hosts_file, ip, domain);
-                modified_flag = 1;
-                break;
-
-            case 'l':
-                // TODO: The list option should not be used with other args
-                /* Temporarily set the dry run flag to print to the console. */
-                tmp = dry_run_flag;
-                dry_run_flag = 1;
-                hosts_file_write(hosts_file);
-                dry_run_flag = tmp;
-                break;
+        hash = hosts_file_hash(entry->value.map.domain);
+        for (j = hash & mask; f->slots[j].entry != SLOT_FREE; j = (j + 1) & mask) {
+            slot = &f->slots[j];
+            if (slot->entry == SLOT_TOMBSTONE || slot->entry <= i || slot->hash != hash) {
+                continue;
+            }
+            other = &f->entries[slot->entry];
+            if (other->value.map.kind == entry->value.map.kind && strcmp(other->value.map.domain, entry->value.map.domain) == 0) {
+                free(other->value.map.ip);
+                free(other->value.map.domain);
+                other->type = UNION_EMPTY;
+                slot->entry = SLOT_TOMBSTONE;
+                ++stats.entries_touched;
+            }
+        }
+    }
+    stats_phase_end();
+}
 
-            case 'r':
-                hosts_file_remove(hosts_file, strdup(optarg), IP_KIND_NONE);
-                modified_flag = 1;
-                break;
+/* Entries being sorted by hosts_file_sort, for its comparison function. */
+static const struct hosts_file_entry * hosts_file_sorting;
 
-            case 'i':
-                other = hosts_file_init(optarg);
-                hosts_file_merge(hosts_file, other);
-                modified_flag = 1;
-                // TODO: free other
-                break;
+static int hosts_file_order(const void * a, const void * b)
+{
+    unsigned int i = *(const unsigned int *)a, j = *(const unsigned int *)b;
+    const struct hosts_file_entry *x = &hosts_file_sorting[i], *y = &hosts_file_sorting[j];
+    int order;
 
-            case 'd':
-                other = hosts_file_init(optarg);
-                hosts_file_delete(hosts_file, other);
-                modified_flag = 1;
-                // TODO: free other
-                break;
+    /* Comments go first, entries follow by domain and address family. */
+    if (x->type != y->type) {
+        return x->type == UNION_COMMENT ? -1 : 1;
+    }
+    if (x->type == UNION_ELEMENT) {
+        if ((order = strcmp(x->value.map.domain, y->value.map.domain)) != 0) {
+            return order;
+        }
+        if (x->value.map.kind != y->value.map.kind) {
+            return x->value.map.kind < y->value.map.kind ? -1 : 1;
+        }
+    }
 
-            case 'V':
-                printf("Version %s\n", PROGRAM_VERSION);
-                return ERROR_CODE_SUCCESS;
+    /* Otherwise the original order is kept. */
+    return i < j ? -1 : i > j;
+}
 
-            case 'h':
-                printf("%s", help_message);
-                return ERROR_CODE_SUCCESS;
+/**
+ * Orders the entries of a hosts file by domain, then by address family. The
+ * comments are kept, in their original order, above the entries.
+ * @param f The hosts file that will be modified.
+ */
+void hosts_file_sort(struct hosts_file * f)
+{
+    struct hosts_file_entry * sorted;
+    unsigned int *order, count = 0;
 
-            case 0:
-            default:
-                break;
-        }
+    if (f->partial) {
+        handle_error(ERROR_CODE_LOGIC_ERROR);
     }
 
-    /* No argument given; just write the hostsfile to stdout. */
-    if (argc == 1) {
-        dry_run_flag = 1;
-        hosts_file_write(hosts_file);
+    stats_phase_begin("sort");
+    order = hf_malloc(sizeof(unsigned int) * (f->index + 1));
+    for (unsigned int i = 0; i < f->index; ++i) {
+        if (f->entries[i].type != UNION_EMPTY) {
+            order[count++] = i;
+        }
     }
+    hosts_file_sorting = f->entries;
+    qsort(order, count, sizeof(unsigned int), hosts_file_order);
 
-    /* If the hostsfile is modified, write it to file. */
-    else if (modified_flag) {
-        hosts_file_write(hosts_file);
+    sorted = hf_malloc(sizeof(struct hosts_file_entry) * f->size);
+    for (unsigned int i = 0; i < count; ++i) {
+        sorted[i] = f->entries[order[i]];
     }
-
-    /* Free memory. Debatable whether this is good practice. */
-    hosts_file_free(hosts_file);
-
-    /* Success! */
-    return ERROR_CODE_SUCCESS;
+    free(f->entries);
+    free(order);
+    f->entries = sorted;
+    f->index = count;
+
+    /* Positions changed, so the index is rebuilt on next use. */
+    free(f->slots);
+    f->slots = NULL;
+    f->slot_count = 0;
+    f->slot_used = 0;
+    stats_phase_end();
 }
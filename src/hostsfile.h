@@ -0,0 +1,191 @@
+/*
+ * Core data structures and operations on hosts files.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef HOSTSFILE_H
+#define HOSTSFILE_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+#include <sys/types.h>
+
+/* Information about the program. */
+#define PROGRAM_NAME "hostsfile"
+#define PROGRAM_VERSION "0.0.1"
+
+/*
+ * Text transformations using simple color/style codes.
+ * Based on https://stackoverflow.com/a/3219471/13197584.
+ */
+#define ANSI_COLOR_RED "\x1b[31m"
+#define ANSI_COLOR_GREEN "\x1b[32m"
+#define ANSI_COLOR_YELLOW "\x1b[33m"
+#define ANSI_COLOR_BLUE "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_CYAN "\x1b[36m"
+#define ANSI_COLOR_RESET "\x1b[0m"
+#define ANSI_STYLE_BOLD "\033[1m"
+#define ANSI_STYLE_RESET "\033[22m"
+#define MAGENTA(x) ANSI_COLOR_MAGENTA "" x "" ANSI_COLOR_RESET
+#define BOLD(x) ANSI_STYLE_BOLD "" x "" ANSI_STYLE_RESET
+
+/* Set by CLI arguments. */
+extern char * hosts_file_path;
+extern int verbose_flag;
+extern int raw_flag;
+extern int dry_run_flag;
+
+/* Various status codes used throughout. */
+enum error_code {
+    ERROR_CODE_SUCCESS,
+    ERROR_CODE_FILE_NOT_FOUND,
+    ERROR_CODE_LOGIC_ERROR,
+    ERROR_CODE_REGEX_INVALID,
+    ERROR_CODE_INVALID_ARGUMENTS,
+    ERROR_CODE_NON_EXHAUSTIVE_CASE,
+    ERROR_CODE_MEM_ALLOCATION,
+    ERROR_CODE_INVALID_FILE,
+    ERROR_CODE_INVALID_IP,
+    ERROR_CODE_FORBIDDEN,
+    ERROR_CODE_ENTRY_DOES_NOT_EXIST,
+    ERROR_CODE_WRITE_FAILED,
+    ERROR_CODE_MERGE_CONFLICT,
+    ERROR_CODE_DELTA_MISMATCH,
+};
+
+/* Keeps track of the IP protocol version. */
+enum ip_kind {
+    IP_KIND_NONE,
+    IP_KIND_IPv4,
+    IP_KIND_IPv6,
+};
+
+/* Wraps the union in a struct to keep track of its type. */
+struct hosts_file_entry {
+    enum {
+        UNION_EMPTY,
+        UNION_ELEMENT,
+        UNION_COMMENT,
+    } type;
+    union {
+        struct map {
+            enum ip_kind kind;
+            char * ip;
+            char * domain;
+        } map;
+        char * comment;
+    } value;
+};
+
+/* A slot of the domain index, pointing into the entries array. */
+struct hosts_file_slot {
+    unsigned int entry;
+    unsigned int hash;
+};
+
+/*
+ * Simple abstraction of a hosts file. Essentially a vector, with an open
+ * addressing index over the domains which is built on first use. The length
+ * and fingerprint of the parsed file allow skipping writes that change nothing;
+ * they, and its amount of lines, follow the file on disk as it is written.
+ * Partial hosts files hold a selection of the lines only, their original line
+ * numbers are kept in lines; they can't be written back.
+ */
+struct hosts_file {
+    struct hosts_file_entry * entries;
+    unsigned int size;
+    unsigned int index;
+    struct hosts_file_slot * slots;
+    unsigned int slot_count;
+    unsigned int slot_used;
+    unsigned long long source_length;
+    uint64_t source_fingerprint;
+    unsigned int source_lines;
+    unsigned int * lines;
+    int partial;
+};
+
+struct filter;
+
+/*
+ * Selects which lines hosts_file_parse keeps: comments are dropped, entries
+ * rejected by the filter (if any) are dropped, the first offset of the
+ * remaining entries are skipped and parsing stops after limit entries.
+ */
+struct hosts_file_scan {
+    unsigned long long offset;
+    unsigned long long limit;
+    const struct filter * filter;
+};
+
+/* Fields of an entry as found by the tokenizer, pointing into the line. */
+struct hosts_file_token {
+    const char * ip;
+    size_t ip_length;
+    const char * domain;
+    size_t domain_length;
+};
+
+struct writer;
+
+/*
+ * Running totals of every allocation made through the hf_* wrappers. These
+ * are never reset by the program itself, so callers that want per-operation
+ * figures should take a snapshot before and after.
+ */
+struct hf_alloc_stats {
+    atomic_ullong count;
+    atomic_ullong bytes;
+};
+
+extern struct hf_alloc_stats hf_alloc_stats;
+
+/* Allocation wrappers which count usage and bail out when memory runs out. */
+void * hf_malloc(size_t size);
+void * hf_calloc(size_t count, size_t size);
+void * hf_realloc(void * pointer, size_t size);
+char * hf_strdup(const char * string);
+char * hf_strndup(const char * string, size_t length);
+
+noreturn void handle_error(enum error_code error_code);
+enum ip_kind ip_address_kind(const char * ip);
+enum ip_kind parse_ip_address(char * ip);
+
+/* Called for every entry by hosts_file_visit; returning non-zero stops the scan. */
+typedef int (*hosts_file_visitor)(void * context, const struct hosts_file_token * token, unsigned long long line);
+
+int hosts_file_tokenize(const char * line, struct hosts_file_token * token);
+void hosts_file_visit(char * pathname, hosts_file_visitor visitor, void * context);
+struct hosts_file hosts_file_init(char * pathname);
+enum error_code hosts_file_try_init(char * pathname, struct hosts_file * hosts_file);
+struct hosts_file hosts_file_parse(char * pathname, const struct hosts_file_scan * scan);
+unsigned int hosts_file_line(const struct hosts_file * f, unsigned int entry);
+void hosts_file_free(struct hosts_file * hosts_file);
+void hosts_file_add(struct hosts_file * f, char * ip, char * domain);
+void hosts_file_comment(struct hosts_file * f, char * comment);
+void hosts_file_remove(struct hosts_file * f, char * domain, enum ip_kind kind);
+unsigned int hosts_file_discard(struct hosts_file * f, const char * domain, enum ip_kind kind);
+void hosts_file_index(struct hosts_file * f);
+unsigned int hosts_file_find(struct hosts_file * f, const char * domain, unsigned int * matches, unsigned int max);
+void hosts_file_merge(struct hosts_file * target, struct hosts_file * other);
+void hosts_file_delete(struct hosts_file * target, struct hosts_file * other);
+void hosts_file_dedup(struct hosts_file * f);
+void hosts_file_sort(struct hosts_file * f);
+void hosts_file_serialize(struct writer * w, struct hosts_file * hosts_file);
+void hosts_file_raw_export(FILE * f, struct hosts_file * hosts_file);
+void hosts_file_human_export(FILE * file, struct hosts_file * hosts_file);
+enum error_code hosts_file_try_replace(const char * path, const char * buffer, size_t length);
+void hosts_file_replace(const char * path, const char * buffer, size_t length);
+void hosts_file_append(const char * path, const char * buffer, size_t length);
+void hosts_file_rewrite_tail(const char * path, size_t offset, const char * buffer, size_t length);
+int hosts_file_copy(int out, int in, off_t offset, size_t length);
+void hosts_file_splice(const char * path, int original, size_t head, const char * buffer, size_t length, size_t tail, size_t size);
+enum error_code hosts_file_try_write(struct hosts_file * hosts_file);
+void hosts_file_write(struct hosts_file * hosts_file);
+
+#endif
@@ -0,0 +1,635 @@
+/*
+ * Change journal: edits appended to a log next to the hosts file.
+ *
+ * A journaled edit costs a single append, regardless of the size of the
+ * hosts file, which is never read. Loading the hosts file replays the
+ * journal on top of it, so listings, edits and the daemon see every
+ * journaled edit. Commands that stream the file, like --diff and
+ * --fingerprint, see the file as it is on disk. The next full write of the
+ * hosts file materializes the journal, after which it is removed.
+ *
+ * Replaying is idempotent: every record sets or clears the entries of one
+ * domain, so a crash between writing the hosts file and removing the journal
+ * merely replays edits that are already there.
+ *
+ * The journal also coordinates concurrent writers. Edits are appended under
+ * a shared lock on the journal itself, so they never wait for a write of the
+ * hosts file. Writers of the hosts file take turns through an exclusive lock
+ * on a separate lock file. The writer whose turn it is loads the hosts file,
+ * then takes every edit appended so far by moving the journal aside, under
+ * an exclusive lock on the journal, and applies them all in a single
+ * rewrite. Writers still waiting for their turn find their edits committed
+ * and leave without writing: a group commit, in which N concurrent edits
+ * cost one rewrite instead of N. The moved journal is removed once the
+ * hosts file is written; should a writer crash before, the next one finds
+ * and applies it.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "journal.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The journal_try_* functions report failures to the caller, for the daemon,
+ * which must keep running; the others exit through handle_error.
+ */
+
+static enum error_code journal_try_path(char * path, const char * hosts_path, const char * suffix)
+{
+    return snprintf(path, PATH_MAX, "%s%s", hosts_path, suffix) >= PATH_MAX ? ERROR_CODE_INVALID_ARGUMENTS : ERROR_CODE_SUCCESS;
+}
+
+static void journal_path(char * path, const char * hosts_path, const char * suffix)
+{
+    enum error_code code = journal_try_path(path, hosts_path, suffix);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+}
+
+static enum error_code journal_try_flock(int fd, int operation)
+{
+    while (flock(fd, operation) != 0) {
+        if (errno != EINTR) {
+            return ERROR_CODE_WRITE_FAILED;
+        }
+    }
+
+    return ERROR_CODE_SUCCESS;
+}
+
+static void journal_flock(int fd, int operation)
+{
+    if (journal_try_flock(fd, operation) != ERROR_CODE_SUCCESS) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+}
+
+static enum error_code journal_try_write_all(int fd, const unsigned char * data, size_t length)
+{
+    ssize_t written;
+
+    while (length) {
+        if ((written = write(fd, data, length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return ERROR_CODE_WRITE_FAILED;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return ERROR_CODE_SUCCESS;
+}
+
+static void journal_write_all(int fd, const unsigned char * data, size_t length)
+{
+    if (journal_try_write_all(fd, data, length) != ERROR_CODE_SUCCESS) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+}
+
+/**
+ * Reads a file completely.
+ * @param path The file.
+ * @param data Receives its contents, or NULL if it doesn't exist or is empty.
+ * @param size Receives its size.
+ * @return ERROR_CODE_SUCCESS, or why the file could not be read.
+ */
+static enum error_code journal_try_read(const char * path, unsigned char ** data, size_t * size)
+{
+    struct stat st;
+    ssize_t got;
+    int fd;
+
+    *data = NULL;
+    *size = 0;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno == ENOENT) {
+            return ERROR_CODE_SUCCESS;
+        }
+        return errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return ERROR_CODE_SUCCESS;
+    }
+
+    *data = hf_malloc((size_t)st.st_size);
+    while (*size < (size_t)st.st_size && (got = read(fd, *data + *size, (size_t)st.st_size - *size)) != 0) {
+        if (got < 0 && errno != EINTR) {
+            close(fd);
+            free(*data);
+            *data = NULL;
+            *size = 0;
+            return ERROR_CODE_INVALID_FILE;
+        }
+        *size += got > 0 ? (size_t)got : 0;
+    }
+    close(fd);
+    stats.bytes_read += *size;
+
+    return ERROR_CODE_SUCCESS;
+}
+
+static uint64_t journal_checksum(const unsigned char * record, size_t payload)
+{
+    struct fingerprint fp;
+
+    fingerprint_init(&fp);
+    fingerprint_update(&fp, record, 8);
+    fingerprint_update(&fp, record + JOURNAL_HEADER_SIZE, payload);
+    return fingerprint_final(&fp);
+}
+
+static inline unsigned int journal_u16(const unsigned char * bytes)
+{
+    return bytes[0] | (unsigned int)bytes[1] << 8;
+}
+
+/**
+ * Adds a record to a batch of edits.
+ * @param batch The batch.
+ * @param operation The edit.
+ * @param domain The domain.
+ * @param domain_length Length of the domain.
+ * @param ip The address; for removals, only entries of its kind are removed.
+ * May be NULL for removals, which then remove every entry of the domain.
+ * @param ip_length Length of the address.
+ */
+void journal_batch_add(struct journal_batch * batch, enum journal_operation operation, const char * domain, size_t domain_length, const char * ip, size_t ip_length)
+{
+    unsigned char * record;
+    uint64_t checksum;
+    size_t length = JOURNAL_HEADER_SIZE + domain_length + ip_length;
+
+    if (domain_length == 0 || domain_length > 0xffff || ip_length > 0xffff) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    if (batch->length + length > batch->capacity) {
+        batch->capacity = batch->capacity * 2 > batch->length + length ? batch->capacity * 2 : batch->length + length;
+        batch->data = hf_realloc(batch->data, batch->capacity);
+    }
+
+    record = batch->data + batch->length;
+    memset(record, 0, JOURNAL_HEADER_SIZE);
+    record[0] = (unsigned char)operation;
+    record[1] = JOURNAL_VERSION;
+    record[2] = (unsigned char)domain_length;
+    record[3] = (unsigned char)(domain_length >> 8);
+    record[4] = (unsigned char)ip_length;
+    record[5] = (unsigned char)(ip_length >> 8);
+    memcpy(record + JOURNAL_HEADER_SIZE, domain, domain_length);
+    if (ip_length) {
+        memcpy(record + JOURNAL_HEADER_SIZE + domain_length, ip, ip_length);
+    }
+    checksum = journal_checksum(record, domain_length + ip_length);
+    for (int i = 0; i < 8; ++i) {
+        record[8 + i] = (unsigned char)(checksum >> (8 * i));
+    }
+
+    batch->length += length;
+    ++batch->records;
+}
+
+/**
+ * Appends a batch of edits to the journal of a hosts file, in a single write
+ * so concurrent appends don't interleave. The journal may be moved aside by a
+ * writer while it is being opened, in which case the append is retried on a
+ * new journal. The batch is emptied.
+ * @param hosts_path Path of the hosts file.
+ * @param batch The edits.
+ * @param sync Whether to wait for the records to reach the disk.
+ * @param appended Receives the status of the journal that was appended to,
+ * for journal_pending; may be NULL.
+ * @return Size of the journal afterwards.
+ */
+unsigned long long journal_append_batch(const char * hosts_path, struct journal_batch * batch, enum journal_sync sync, struct stat * appended)
+{
+    char path[PATH_MAX];
+    struct stat st, current;
+    int fd;
+
+    stats_phase_begin("journal");
+    journal_path(path, hosts_path, JOURNAL_SUFFIX);
+    while (1) {
+        if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+            handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+        }
+        journal_flock(fd, LOCK_SH);
+        if (fstat(fd, &st) == 0 && stat(path, &current) == 0 && st.st_dev == current.st_dev && st.st_ino == current.st_ino) {
+            break;
+        }
+        close(fd);
+    }
+
+    journal_write_all(fd, batch->data, batch->length);
+    stats.bytes_written += batch->length;
+    if (sync == JOURNAL_SYNC_ALWAYS && fsync(fd) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats.entries_touched += batch->records;
+    stats_phase_end();
+
+    if (fstat(fd, &st) != 0) {
+        st.st_size = 0;
+    }
+    if (appended) {
+        *appended = st;
+    }
+    close(fd);
+
+    free(batch->data);
+    memset(batch, 0, sizeof(*batch));
+    return (unsigned long long)st.st_size;
+}
+
+/**
+ * Appends an edit to the journal of a hosts file.
+ * @param hosts_path Path of the hosts file.
+ * @param operation The edit.
+ * @param domain The domain.
+ * @param ip The address for additions, NULL for removals.
+ * @param sync Whether to wait for the record to reach the disk.
+ * @param appended Receives the status of the journal that was appended to,
+ * for journal_pending; may be NULL.
+ * @return Size of the journal afterwards.
+ */
+unsigned long long journal_append(const char * hosts_path, enum journal_operation operation, const char * domain, const char * ip, enum journal_sync sync, struct stat * appended)
+{
+    struct journal_batch batch = { 0 };
+
+    journal_batch_add(&batch, operation, domain, strlen(domain), ip, ip ? strlen(ip) : 0);
+    return journal_append_batch(hosts_path, &batch, sync, appended);
+}
+
+/**
+ * Applies records to a loaded hosts file. Replay stops at the first
+ * incomplete or damaged record, which can only be the last one.
+ * @param data The records.
+ * @param size Their size.
+ * @param f The hosts file.
+ * @return The amount of records applied.
+ */
+static unsigned long long journal_apply_records(const unsigned char * data, size_t size, struct hosts_file * f)
+{
+    const unsigned char * record;
+    unsigned int domain_length, ip_length;
+    unsigned long long applied = 0, touched = stats.entries_touched;
+    uint64_t checksum;
+    size_t offset;
+    char *domain, *ip;
+
+    for (offset = 0; offset + JOURNAL_HEADER_SIZE <= size; offset += JOURNAL_HEADER_SIZE + domain_length + ip_length) {
+        record = data + offset;
+        domain_length = journal_u16(record + 2);
+        ip_length = journal_u16(record + 4);
+        if (record[1] != JOURNAL_VERSION || domain_length == 0 || offset + JOURNAL_HEADER_SIZE + domain_length + ip_length > size) {
+            break;
+        }
+
+        checksum = 0;
+        for (int i = 7; i >= 0; --i) {
+            checksum = checksum << 8 | record[8 + i];
+        }
+        if (checksum != journal_checksum(record, domain_length + ip_length)) {
+            break;
+        }
+
+        domain = hf_strndup((const char *)record + JOURNAL_HEADER_SIZE, domain_length);
+        ip = ip_length ? hf_strndup((const char *)record + JOURNAL_HEADER_SIZE + domain_length, ip_length) : NULL;
+        if (record[0] == JOURNAL_ADD && ip) {
+            hosts_file_add(f, ip, domain);
+        } else if (record[0] == JOURNAL_REMOVE) {
+            hosts_file_discard(f, domain, ip ? ip_address_kind(ip) : IP_KIND_NONE);
+            free(domain);
+            free(ip);
+        } else {
+            free(ip);
+            free(domain);
+            break;
+        }
+        ++applied;
+    }
+
+    /* The entries were counted when the edits were appended. */
+    stats.entries_touched = touched;
+    return applied;
+}
+
+/**
+ * Applies the records of a journal to a loaded hosts file.
+ * @param path The journal.
+ * @param f The hosts file.
+ * @param applied Incremented by the amount of records applied.
+ * @return ERROR_CODE_SUCCESS, or why the journal could not be read.
+ */
+static enum error_code journal_try_apply(const char * path, struct hosts_file * f, unsigned long long * applied)
+{
+    unsigned char * data;
+    enum error_code code;
+    size_t size;
+
+    if ((code = journal_try_read(path, &data, &size)) != ERROR_CODE_SUCCESS || !data) {
+        return code;
+    }
+    *applied += journal_apply_records(data, size, f);
+    free(data);
+
+    return ERROR_CODE_SUCCESS;
+}
+
+/**
+ * Applies a batch of edits to a loaded hosts file, without appending it
+ * anywhere. The batch is kept.
+ * @param batch The edits.
+ * @param f The hosts file.
+ * @return The amount of records applied.
+ */
+unsigned long long journal_batch_apply(const struct journal_batch * batch, struct hosts_file * f)
+{
+    return batch->length ? journal_apply_records(batch->data, batch->length, f) : 0;
+}
+
+/**
+ * Applies every pending edit to a loaded hosts file, for readers: those
+ * taken by a writer that didn't finish, then the journal.
+ * @param hosts_path Path of the hosts file.
+ * @param f The hosts file, as loaded from disk.
+ * @param applied Receives the amount of records applied; may be NULL.
+ * @return ERROR_CODE_SUCCESS, or why the journal could not be read.
+ */
+enum error_code journal_try_replay(const char * hosts_path, struct hosts_file * f, unsigned long long * applied)
+{
+    char path[PATH_MAX];
+    unsigned long long count = 0;
+    enum error_code code;
+
+    stats_phase_begin("replay");
+    if ((code = journal_try_path(path, hosts_path, JOURNAL_TAKEN_SUFFIX)) == ERROR_CODE_SUCCESS && (code = journal_try_apply(path, f, &count)) == ERROR_CODE_SUCCESS && (code = journal_try_path(path, hosts_path, JOURNAL_SUFFIX)) == ERROR_CODE_SUCCESS) {
+        code = journal_try_apply(path, f, &count);
+    }
+    stats_phase_end();
+
+    if (applied) {
+        *applied = count;
+    }
+    return code;
+}
+
+/**
+ * Like journal_try_replay, but exits when the journal can't be read.
+ * @return The amount of records applied.
+ */
+unsigned long long journal_replay(const char * hosts_path, struct hosts_file * f)
+{
+    unsigned long long applied;
+    enum error_code code = journal_try_replay(hosts_path, f, &applied);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+
+    return applied;
+}
+
+/**
+ * Takes every edit appended so far for the caller to commit, and applies
+ * them to the loaded hosts file. The journal is moved aside under its
+ * exclusive lock, which waits for appends in progress; later appends start
+ * a new journal. Edits left by a writer that crashed are taken as well.
+ * @param hosts_path Path of the hosts file.
+ * @param f The hosts file, as loaded from disk.
+ * @param applied Receives the amount of records applied; may be NULL.
+ * @return ERROR_CODE_SUCCESS, or why the journal could not be taken.
+ */
+enum error_code journal_try_take(const char * hosts_path, struct hosts_file * f, unsigned long long * applied)
+{
+    char path[PATH_MAX], taken[PATH_MAX];
+    unsigned char * data;
+    unsigned long long count = 0;
+    enum error_code code;
+    size_t size;
+    int fd, target;
+
+    if ((code = journal_try_path(path, hosts_path, JOURNAL_SUFFIX)) != ERROR_CODE_SUCCESS || (code = journal_try_path(taken, hosts_path, JOURNAL_TAKEN_SUFFIX)) != ERROR_CODE_SUCCESS) {
+        return code;
+    }
+
+    stats_phase_begin("replay");
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        code = journal_try_flock(fd, LOCK_EX);
+        if (code == ERROR_CODE_SUCCESS && access(taken, F_OK) != 0) {
+            if (rename(path, taken) != 0) {
+                code = ERROR_CODE_WRITE_FAILED;
+            }
+        } else if (code == ERROR_CODE_SUCCESS && (code = journal_try_read(path, &data, &size)) == ERROR_CODE_SUCCESS) {
+            /* Left behind by a crash; this journal joins it, unless that fails. */
+            if (data) {
+                if ((target = open(taken, O_WRONLY | O_APPEND)) < 0) {
+                    code = ERROR_CODE_WRITE_FAILED;
+                } else {
+                    if ((code = journal_try_write_all(target, data, size)) == ERROR_CODE_SUCCESS && fsync(target) != 0) {
+                        code = ERROR_CODE_WRITE_FAILED;
+                    }
+                    close(target);
+                }
+                free(data);
+            }
+            if (code == ERROR_CODE_SUCCESS) {
+                unlink(path);
+            }
+        }
+        close(fd);
+    }
+
+    if (code == ERROR_CODE_SUCCESS) {
+        code = journal_try_apply(taken, f, &count);
+    }
+    stats_phase_end();
+
+    if (applied) {
+        *applied = count;
+    }
+    return code;
+}
+
+/**
+ * Like journal_try_take, but exits when the journal can't be taken.
+ * @return The amount of records applied.
+ */
+unsigned long long journal_take(const char * hosts_path, struct hosts_file * f)
+{
+    unsigned long long applied;
+    enum error_code code = journal_try_take(hosts_path, f, &applied);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+
+    return applied;
+}
+
+/**
+ * Tells whether an edit is still waiting to be committed.
+ * @param hosts_path Path of the hosts file.
+ * @param appended Status of the journal it was appended to.
+ * @return Non-zero if the edit may not be in the hosts file yet.
+ */
+int journal_pending(const char * hosts_path, const struct stat * appended)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    journal_path(path, hosts_path, JOURNAL_TAKEN_SUFFIX);
+    if (access(path, F_OK) == 0) {
+        return 1;
+    }
+
+    journal_path(path, hosts_path, JOURNAL_SUFFIX);
+    return stat(path, &st) == 0 && st.st_dev == appended->st_dev && st.st_ino == appended->st_ino;
+}
+
+/**
+ * Tells whether any edits are waiting to be committed.
+ * @param hosts_path Path of the hosts file.
+ * @return Non-zero if the journal holds edits.
+ */
+int journal_waiting(const char * hosts_path)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    journal_path(path, hosts_path, JOURNAL_TAKEN_SUFFIX);
+    if (access(path, F_OK) == 0) {
+        return 1;
+    }
+
+    journal_path(path, hosts_path, JOURNAL_SUFFIX);
+    return stat(path, &st) == 0 && st.st_size > 0;
+}
+
+/**
+ * Takes the turn to write the hosts file, waiting as long as needed. The
+ * turn is an exclusive lock on a lock file, as the hosts file itself is
+ * replaced on every write. The lock file is removed by journal_unlock, so a
+ * lock taken on one that was removed meanwhile is retried on its successor.
+ * @param hosts_path Path of the hosts file.
+ * @param fd Receives the file descriptor of the lock file.
+ * @return ERROR_CODE_SUCCESS, or why the turn could not be taken.
+ */
+enum error_code journal_try_lock(const char * hosts_path, int * fd)
+{
+    char path[PATH_MAX];
+    struct stat st, current;
+    enum error_code code;
+
+    if ((code = journal_try_path(path, hosts_path, JOURNAL_LOCK_SUFFIX)) != ERROR_CODE_SUCCESS) {
+        return code;
+    }
+
+    stats_phase_begin("lock");
+    while (1) {
+        if ((*fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+            code = errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND;
+            break;
+        }
+        if ((code = journal_try_flock(*fd, LOCK_EX)) != ERROR_CODE_SUCCESS) {
+            close(*fd);
+            *fd = -1;
+            break;
+        }
+        if (fstat(*fd, &st) == 0 && stat(path, &current) == 0 && st.st_dev == current.st_dev && st.st_ino == current.st_ino) {
+            break;
+        }
+        close(*fd);
+    }
+    stats_phase_end();
+
+    return code;
+}
+
+/**
+ * Like journal_try_lock, but exits when the turn can't be taken.
+ * @param hosts_path Path of the hosts file.
+ * @return File descriptor of the lock file.
+ */
+int journal_lock(const char * hosts_path)
+{
+    enum error_code code;
+    int fd;
+
+    if ((code = journal_try_lock(hosts_path, &fd)) != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+
+    return fd;
+}
+
+/**
+ * Ends the turn taken by journal_lock, removing the lock file while it is
+ * still held so none is left next to the hosts file.
+ * @param hosts_path Path of the hosts file.
+ * @param fd The lock file, or -1 if no turn was taken.
+ */
+void journal_unlock(const char * hosts_path, int fd)
+{
+    char path[PATH_MAX];
+
+    if (fd < 0) {
+        return;
+    }
+    journal_path(path, hosts_path, JOURNAL_LOCK_SUFFIX);
+    unlink(path);
+    close(fd);
+}
+
+/**
+ * Removes the edits taken by journal_take, once they are written.
+ * @param hosts_path Path of the hosts file.
+ * @return ERROR_CODE_SUCCESS, or why they could not be removed.
+ */
+enum error_code journal_try_commit(const char * hosts_path)
+{
+    char path[PATH_MAX];
+    enum error_code code;
+
+    if ((code = journal_try_path(path, hosts_path, JOURNAL_TAKEN_SUFFIX)) != ERROR_CODE_SUCCESS) {
+        return code;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        return errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED;
+    }
+
+    return ERROR_CODE_SUCCESS;
+}
+
+/**
+ * Like journal_try_commit, but exits when the edits can't be removed.
+ * @param hosts_path Path of the hosts file.
+ */
+void journal_commit(const char * hosts_path)
+{
+    enum error_code code = journal_try_commit(hosts_path);
+
+    if (code != ERROR_CODE_SUCCESS) {
+        handle_error(code);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Change journal: edits appended to a log next to the hosts file, which is
+ * folded into the hosts file itself by the next full write.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "hostsfile.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Appended to the path of a hosts file to name its journal. */
+#define JOURNAL_SUFFIX ".hf-journal"
+
+/* Journal that a writer took to commit. */
+#define JOURNAL_TAKEN_SUFFIX ".hf-journal.taken"
+
+/* Appended to the path of a hosts file to name its lock file. */
+#define JOURNAL_LOCK_SUFFIX ".hf-lock"
+
+/* Journaled edits fold the journal into the hosts file beyond this size. */
+#define JOURNAL_COMPACT_SIZE (1 << 20)
+
+/*
+ * Records are a fixed 16-byte header followed by the domain and address,
+ * without terminators. The checksum is a fingerprint of the first eight
+ * header bytes and the payload, so a record torn by a crash is recognized
+ * and ends the replay. All integers are little-endian.
+ *
+ *     offset  size  field
+ *     0       1     operation (journal_operation)
+ *     1       1     version (JOURNAL_VERSION)
+ *     2       2     domain length
+ *     4       2     address length; removals without one apply to both
+ *                   address families
+ *     6       2     reserved, 0
+ *     8       8     checksum
+ *     16            domain, address
+ */
+#define JOURNAL_HEADER_SIZE 16
+#define JOURNAL_VERSION 1
+
+enum journal_operation {
+    JOURNAL_ADD = 1,
+    JOURNAL_REMOVE = 2,
+};
+
+/* When appends are made durable. */
+enum journal_sync {
+    JOURNAL_SYNC_ALWAYS,
+    JOURNAL_SYNC_NEVER,
+};
+
+/* Edits encoded as records, to be appended together. */
+struct journal_batch {
+    unsigned char * data;
+    size_t length;
+    size_t capacity;
+    unsigned long long records;
+};
+
+struct stat;
+
+void journal_batch_add(struct journal_batch * batch, enum journal_operation operation, const char * domain, size_t domain_length, const char * ip, size_t ip_length);
+unsigned long long journal_batch_apply(const struct journal_batch * batch, struct hosts_file * f);
+unsigned long long journal_append_batch(const char * hosts_path, struct journal_batch * batch, enum journal_sync sync, struct stat * appended);
+unsigned long long journal_append(const char * hosts_path, enum journal_operation operation, const char * domain, const char * ip, enum journal_sync sync, struct stat * appended);
+unsigned long long journal_replay(const char * hosts_path, struct hosts_file * f);
+enum error_code journal_try_replay(const char * hosts_path, struct hosts_file * f, unsigned long long * applied);
+unsigned long long journal_take(const char * hosts_path, struct hosts_file * f);
+enum error_code journal_try_take(const char * hosts_path, struct hosts_file * f, unsigned long long * applied);
+int journal_pending(const char * hosts_path, const struct stat * appended);
+int journal_waiting(const char * hosts_path);
+int journal_lock(const char * hosts_path);
+enum error_code journal_try_lock(const char * hosts_path, int * fd);
+void journal_unlock(const char * hosts_path, int fd);
+void journal_commit(const char * hosts_path);
+enum error_code journal_try_commit(const char * hosts_path);
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Batch lookups: resolves a list of names against a hosts file at once.
+ *
+ * Every name is answered by a single line, in input order:
+ *
+ *     <name>\t<ip> [<ip> ...]
+ *     <name>\tNOTFOUND
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "lookup.h"
+#include "hostsfile.h"
+#include "journal.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOOKUP_INITIAL_SIZE 64
+#define LOOKUP_FREE 0xffffffffu
+
+/* A distinct name of the batch, with the addresses found so far. */
+struct lookup_key {
+    char * name;
+    size_t length;
+    unsigned int hash;
+    char * answers;
+    size_t answers_length;
+    size_t answers_capacity;
+};
+
+/*
+ * The names of a batch. Queries refer to keys, so names that are asked for
+ * more than once are only resolved once. Slots form an open addressing
+ * table over the keys.
+ */
+struct lookup {
+    struct lookup_key * keys;
+    unsigned int key_count;
+    unsigned int key_capacity;
+    unsigned int * queries;
+    unsigned int query_count;
+    unsigned int query_capacity;
+    unsigned int * slots;
+    unsigned int slot_count;
+};
+
+static unsigned int lookup_hash(const char * name, size_t length)
+{
+    unsigned int hash = 2166136261u;
+
+    while (length--) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Finds the slot of a name, which is either free or holds its key.
+ * @param l The batch.
+ * @param name The name, not necessarily null-terminated.
+ * @param length Length of the name.
+ * @param hash Its hash.
+ * @return Position in the slots array.
+ */
+static unsigned int lookup_probe(const struct lookup * l, const char * name, size_t length, unsigned int hash)
+{
+    unsigned int mask = l->slot_count - 1, i = hash & mask;
+    struct lookup_key * key;
+
+    for (; l->slots[i] != LOOKUP_FREE; i = (i + 1) & mask) {
+        key = &l->keys[l->slots[i]];
+        if (key->hash == hash && key->length == length && memcmp(key->name, name, length) == 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/**
+ * Doubles the slots once they are half full.
+ * @param l The batch.
+ */
+static void lookup_reserve(struct lookup * l)
+{
+    if (l->slot_count && (l->key_count + 1) * 2 <= l->slot_count) {
+        return;
+    }
+
+    free(l->slots);
+    l->slot_count = l->slot_count ? l->slot_count * 2 : LOOKUP_INITIAL_SIZE;
+    l->slots = hf_malloc(sizeof(unsigned int) * l->slot_count);
+    memset(l->slots, 0xff, sizeof(unsigned int) * l->slot_count);
+
+    for (unsigned int i = 0; i < l->key_count; ++i) {
+        l->slots[lookup_probe(l, l->keys[i].name, l->keys[i].length, l->keys[i].hash)] = i;
+    }
+}
+
+/**
+ * Adds a name to the batch.
+ * @param l The batch.
+ * @param name The name, not necessarily null-terminated.
+ * @param length Length of the name.
+ */
+static void lookup_add(struct lookup * l, const char * name, size_t length)
+{
+    unsigned int hash = lookup_hash(name, length), slot;
+    struct lookup_key * key;
+
+    lookup_reserve(l);
+    slot = lookup_probe(l, name, length, hash);
+
+    if (l->slots[slot] == LOOKUP_FREE) {
+        if (l->key_count == l->key_capacity) {
+            l->key_capacity = l->key_capacity ? l->key_capacity * 2 : LOOKUP_INITIAL_SIZE;
+            l->keys = hf_realloc(l->keys, sizeof(struct lookup_key) * l->key_capacity);
+        }
+        key = &l->keys[l->key_count];
+        key->name = hf_strndup(name, length);
+        key->length = length;
+        key->hash = hash;
+        key->answers = NULL;
+        key->answers_length = 0;
+        key->answers_capacity = 0;
+        l->slots[slot] = l->key_count++;
+    }
+
+    if (l->query_count == l->query_capacity) {
+        l->query_capacity = l->query_capacity ? l->query_capacity * 2 : LOOKUP_INITIAL_SIZE;
+        l->queries = hf_realloc(l->queries, sizeof(unsigned int) * l->query_capacity);
+    }
+    l->queries[l->query_count++] = l->slots[slot];
+}
+
+/**
+ * Appends an address to the answer of a key.
+ * @param key The key.
+ * @param ip The address, not necessarily null-terminated.
+ * @param length Length of the address.
+ */
+static void lookup_answer(struct lookup_key * key, const char * ip, size_t length)
+{
+    size_t needed = key->answers_length + length + 1;
+
+    if (needed > key->answers_capacity) {
+        key->answers_capacity = needed * 2;
+        key->answers = hf_realloc(key->answers, key->answers_capacity);
+    }
+
+    if (key->answers_length) {
+        key->answers[key->answers_length++] = ' ';
+    }
+    memcpy(key->answers + key->answers_length, ip, length);
+    key->answers_length += length;
+}
+
+/**
+ * Reads the names of a batch, one per line. Surrounding blanks and empty
+ * lines are ignored.
+ * @param l The batch.
+ * @param names Input stream.
+ */
+static void lookup_read(struct lookup * l, FILE * names)
+{
+    size_t capacity = 0, length;
+    ssize_t read;
+    char * line = NULL, *name;
+
+    while ((read = getline(&line, &capacity, names)) != -1) {
+        name = line + strspn(line, " \t");
+        length = strcspn(name, " \t\r\n");
+        if (length) {
+            lookup_add(l, name, length);
+        }
+    }
+
+    free(line);
+}
+
+static int lookup_join_visit(void * context, const struct hosts_file_token * token, unsigned long long line)
+{
+    struct lookup * l = context;
+    unsigned int slot;
+
+    (void)line;
+    slot = lookup_probe(l, token->domain, token->domain_length, lookup_hash(token->domain, token->domain_length));
+    if (l->slots[slot] != LOOKUP_FREE) {
+        lookup_answer(&l->keys[l->slots[slot]], token->ip, token->ip_length);
+    }
+
+    return 0;
+}
+
+static int lookup_compare(const void * a, const void * b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Answers all keys from the domain index of the loaded hosts file, with
+ * pending journal edits applied.
+ * @param l The batch.
+ * @param pathname Path of the hosts file.
+ */
+static void lookup_index(struct lookup * l, char * pathname)
+{
+    struct hosts_file hosts_file = hosts_file_init(pathname);
+    unsigned int capacity = 16, found;
+    unsigned int * matches = hf_malloc(sizeof(unsigned int) * capacity);
+    const char * ip;
+
+    journal_replay(pathname, &hosts_file);
+    hosts_file_index(&hosts_file);
+    for (unsigned int i = 0; i < l->key_count; ++i) {
+        while ((found = hosts_file_find(&hosts_file, l->keys[i].name, matches, capacity)) > capacity) {
+            capacity = found;
+            matches = hf_realloc(matches, sizeof(unsigned int) * capacity);
+        }
+
+        /* Probe order is arbitrary, answers follow the file. */
+        qsort(matches, found, sizeof(unsigned int), lookup_compare);
+        for (unsigned int j = 0; j < found; ++j) {
+            ip = hosts_file.entries[matches[j]].value.map.ip;
+            lookup_answer(&l->keys[i], ip, strlen(ip));
+        }
+    }
+
+    free(matches);
+    hosts_file_free(&hosts_file);
+}
+
+/**
+ * Resolves a batch of names and writes the answers in input order.
+ * @param pathname Path of the hosts file.
+ * @param names One name per line.
+ * @param out Target file descriptor.
+ * @return The amount of names that were not found.
+ */
+unsigned int lookup_batch(char * pathname, FILE * names, int out)
+{
+    struct lookup l = { 0 };
+    struct lookup_key * key;
+    struct writer w;
+    unsigned int missing = 0;
+
+    stats_phase_begin("lookup");
+    lookup_read(&l, names);
+
+    /* Pending journal edits only apply to a loaded file. */
+    if (l.key_count > LOOKUP_JOIN_THRESHOLD && !journal_waiting(pathname)) {
+        hosts_file_visit(pathname, lookup_join_visit, &l);
+    } else if (l.key_count) {
+        lookup_index(&l, pathname);
+    }
+
+    writer_init(&w, out, 0);
+    for (unsigned int i = 0; i < l.query_count; ++i) {
+        key = &l.keys[l.queries[i]];
+        writer_bytes(&w, key->name, key->length);
+        writer_char(&w, '\t');
+        if (key->answers_length) {
+            writer_bytes(&w, key->answers, key->answers_length);
+        } else {
+            writer_string(&w, "NOTFOUND");
+            ++missing;
+        }
+        writer_char(&w, '\n');
+    }
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+
+    for (unsigned int i = 0; i < l.key_count; ++i) {
+        free(l.keys[i].name);
+        free(l.keys[i].answers);
+    }
+    free(l.keys);
+    free(l.queries);
+    free(l.slots);
+    stats_phase_end();
+
+    return missing;
+}
@@ -0,0 +1,22 @@
+/*
+ * Batch lookups: resolves a list of names against a hosts file at once.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <stdio.h>
+
+/*
+ * Batches up to this many distinct names are answered from a loaded index;
+ * larger ones are hash-joined against a single scan of the hosts file,
+ * which never materializes its entries.
+ */
+#define LOOKUP_JOIN_THRESHOLD 256
+
+unsigned int lookup_batch(char * pathname, FILE * names, int out);
+
+#endif
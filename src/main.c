@@ -0,0 +1,903 @@
+/*
+ * Command line interface to interact with the hosts file.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "block.h"
+#include "compile.h"
+#include "daemon.h"
+#include "diff.h"
+#include "export.h"
+#include "external.h"
+#include "filter.h"
+#include "hostsfile.h"
+#include "journal.h"
+#include "lookup.h"
+#include "merkle.h"
+#include "overlay.h"
+#include "perf.h"
+#include "shared.h"
+#include "sources.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Set by CLI arguments. */
+static int modified_flag = 0;
+static enum stats_format stats_format = STATS_FORMAT_NONE;
+static int perf_counters_flag = 0;
+static char * daemon_socket = NULL;
+static char * lookup_path = NULL;
+static char * publish_name = NULL;
+static char * attach_name = NULL;
+static char * diff_old = NULL;
+static char * diff_new = NULL;
+static int patch_flag = 0;
+static char * delta_old = NULL;
+static char * delta_new = NULL;
+static char * delta_path = NULL;
+static char * reconcile_path = NULL;
+static char * sources_directory = NULL;
+static char * block_name = NULL;
+static char * base_path = NULL;
+static char * materialize_path = NULL;
+static char * compile_path = NULL;
+static char * merge_paths[3] = { NULL };
+static int fingerprint_flag = 0;
+static int journal_flag = 0;
+static int compact_flag = 0;
+static int dedup_flag = 0;
+static int sort_flag = 0;
+static size_t max_memory = 0;
+static enum journal_sync journal_sync = JOURNAL_SYNC_ALWAYS;
+static unsigned int fingerprint_level = 0;
+static char * metrics_textfile = NULL;
+static char * log_json_path = NULL;
+static char * output_prefix = NULL;
+static unsigned int output_formats = 0;
+static int paginate_flag = 0;
+static struct hosts_file_scan scan = { 0, ULLONG_MAX, NULL };
+static struct filter filter;
+
+/* Help message. */
+// clang-format off
+static char* help_message =
+        "HOSTFILE: command line interface for editing hosts files easily.\n"
+        "Copyright (c) by Jens Pots\n"
+        "Licensed under AGPL-3.0-only\n"
+        "\n"
+        BOLD("IMPORTANT\n")
+        "\tWriting to /etc/hosts requires root privileges.\n"
+        "\n"
+        BOLD("FLAGS\n")
+        "\t--verbose\t\tTurn up verbosity.\n"
+        "\t--raw\t\t\tDon't humanize output.\n"
+        "\t--format <formats>\tOutput as hosts, json, ndjson, csv, bin,\n"
+        "\t\t\t\tdnsmasq, unbound or rpz; comma separated\n"
+        "\t\t\t\twith --output.\n"
+        "\t-o --output <prefix>\tWrite each format to <prefix>.<ext>.\n"
+        "\t--dry-run\t\tSend changes to stdout.\n"
+        "\t-f --file <path>\tOperate on another hosts file.\n"
+        "\t--stats[=json]\t\tReport timings and counters on stderr.\n"
+        "\t--perf-counters\t\tAdd hardware counters to the stats.\n"
+        "\t--metrics-textfile <path>\tDaemon metrics for node_exporter.\n"
+        "\t--log-json <path>\tAppend an NDJSON record of this run.\n"
+        "\n"
+        BOLD("OPTIONS\n")
+        "\t-a --add <domain>@<ip>\tAdd a new entry.\n"
+        "\t-l --list\t\tList all current entries.\n"
+        "\t--offset <n>\t\tSkip the first n entries of a listing.\n"
+        "\t--limit <n>\t\tList at most n entries.\n"
+        "\t--where <filter>\tList matching entries only, e.g.\n"
+        "\t\t\t\t'kind=v6,domain~.lan,ip in fd00::/8,line 1-99'.\n"
+        "\t-r --remove <domain>\tRemove an entry.\n"
+        "\t-i --import <path>\tTake union with using file.\n"
+        "\t-d --delete <path>\tMinus set operation using file.\n"
+        "\t--dedup\t\t\tDrop entries repeating a domain and family.\n"
+        "\t--sort\t\t\tOrder the entries by domain.\n"
+        "\t--max-memory <size>\tBound the memory of --import, --delete,\n"
+        "\t\t\t\t--dedup and --sort, e.g. 256M.\n"
+        "\t-D --daemon <socket>\tServe lookups and edits on a Unix socket.\n"
+        "\t--publish <name>\tWith --daemon, share the index in memory.\n"
+        "\t--lookup <path>\t\tResolve the names in a file, - for stdin.\n"
+        "\t--attach <name>\t\tWith --lookup, use a shared index instead.\n"
+        "\t--diff <old> <new>\tList added, removed and changed entries.\n"
+        "\t--patch\t\t\tShow the differing lines instead.\n"
+        "\t--delta <old> <new>\tWrite a binary delta between two files.\n"
+        "\t--apply-delta <path>\tApply a delta made from the same entries.\n"
+        "\t--reconcile <path>\tMake the entries match those of another file.\n"
+        "\t--block <name>\t\tReconcile only the managed block of that name.\n"
+        "\t--sources <dir>\t\tTake the entries of the files in a directory,\n"
+        "\t\t\t\tapplying only what changed since last time.\n"
+        "\t--merge3 <base> <ours> <theirs>\n"
+        "\t\t\t\tMerge two descendants of a file to stdout.\n"
+        "\t--journal\t\tAppend --add and --remove to a journal.\n"
+        "\t--fsync <policy>\tSync journal appends: always or never.\n"
+        "\t--compact\t\tFold the journal into the hosts file.\n"
+        "\t--base <path>\t\tTreat the hosts file as an overlay on a shared\n"
+        "\t\t\t\tbase file, which is never modified.\n"
+        "\t--materialize <path>\tWrite the overlay and its base to a file.\n"
+        "\t--compile <path>\tWrite a perfect hash lookup file, see phf.h.\n"
+        "\t--fingerprint\t\tPrint the Merkle root of the entries.\n"
+        "\t--level <n>\t\tPrint the nodes of level n (1-4) instead.\n";
+// clang-format on
+
+/**
+ * Parses a non-negative count given on the command line.
+ * @param argument The argument.
+ * @return Its value.
+ */
+static unsigned long long parse_count(const char * argument)
+{
+    char * end;
+    unsigned long long value;
+
+    errno = 0;
+    value = strtoull(argument, &end, 10);
+    if (errno || end == argument || *end != '\0' || argument[0] == '-') {
+        fprintf(stderr, PROGRAM_NAME ": '%s' is not a valid count.\n", argument);
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    return value;
+}
+
+/**
+ * Parses an amount of bytes given on the command line, optionally followed
+ * by K, M or G.
+ * @param argument The argument.
+ * @return Its value.
+ */
+static size_t parse_size(const char * argument)
+{
+    char * end;
+    unsigned long long value;
+    int shift = 0;
+
+    errno = 0;
+    value = strtoull(argument, &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    end += shift != 0;
+    if (errno || end == argument || *end != '\0' || argument[0] == '-' || value > (SIZE_MAX >> shift)) {
+        fprintf(stderr, PROGRAM_NAME ": '%s' is not a valid size.\n", argument);
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    return (size_t)value << shift;
+}
+
+int main(int argc, char ** argv)
+{
+    char *ip, *domain;
+    int c, tmp, break_free, listing = 0, editing = 0, bulk = 0, single = 0, removing = 0, leveled = 0, journaled, lock = -1;
+    unsigned long long journal_size = 0, appends = 0, touched;
+    unsigned int missing, lines;
+    uint64_t fingerprint;
+    enum error_code code;
+    struct merkle_tree * tree;
+    struct stat appended;
+    FILE * names;
+    struct hosts_file hosts_file, other;
+    struct overlay_base base;
+    struct external_operation * operations;
+    unsigned int operation_count = 0;
+
+    /* Flags + parameters available. */
+    char options[] = "hlr:a:i:d:f:D:o:";
+    // clang-format off
+    struct option long_options[] = {
+        {"verbose", no_argument,       &verbose_flag, 1 },
+        {"brief",   no_argument,       &verbose_flag, 0 },
+        {"raw",     no_argument,       &raw_flag,     1 },
+        {"human",   no_argument,       &raw_flag,     0 },
+        {"format",  required_argument, NULL, 'F'},
+        {"output",  required_argument, NULL, 'o'},
+        {"offset",  required_argument, NULL, 'O'},
+        {"limit",   required_argument, NULL, 'L'},
+        {"where",   required_argument, NULL, 'W'},
+        {"dry-run", no_argument,       &dry_run_flag, 1 },
+        {"list",    no_argument,       NULL, 'l'},
+        {"help",    no_argument,       NULL, 'h'},
+        {"remove",  required_argument, NULL, 'r'},
+        {"add",     required_argument, NULL, 'a'},
+        {"import",  required_argument, NULL, 'i'},
+        {"delete",  required_argument, NULL, 'd'},
+        {"version", no_argument,       NULL, 'V'},
+        {"file",    required_argument, NULL, 'f'},
+        {"stats",   optional_argument, NULL, 'S'},
+        {"perf-counters", no_argument, &perf_counters_flag, 1},
+        {"daemon",  required_argument, NULL, 'D'},
+        {"lookup",  required_argument, NULL, 'K'},
+        {"publish", required_argument, NULL, 'P'},
+        {"attach",  required_argument, NULL, 'A'},
+        {"diff",    required_argument, NULL, 'X'},
+        {"patch",   no_argument,       &patch_flag, 1},
+        {"delta",   required_argument, NULL, 'T'},
+        {"apply-delta", required_argument, NULL, 'Q'},
+        {"reconcile", required_argument, NULL, 'R'},
+        {"merge3",  required_argument, NULL, '3'},
+        {"sources", required_argument, NULL, 'U'},
+        {"block",   required_argument, NULL, 'G'},
+        {"base",    required_argument, NULL, 'B'},
+        {"materialize", required_argument, NULL, 'Z'},
+        {"journal", no_argument,       &journal_flag, 1},
+        {"fsync",   required_argument, NULL, 'Y'},
+        {"compact", no_argument,       &compact_flag, 1},
+        {"dedup",   no_argument,       &dedup_flag, 1},
+        {"sort",    no_argument,       &sort_flag, 1},
+        {"max-memory", required_argument, NULL, 'E'},
+        {"compile", required_argument, NULL, 'C'},
+        {"fingerprint", no_argument,   &fingerprint_flag, 1},
+        {"level",   required_argument, NULL, 'N'},
+        {"metrics-textfile", required_argument, NULL, 'M'},
+        {"log-json", required_argument, NULL, 'J'},
+        {NULL,      0,                 NULL, 0  }
+    };
+    // clang-format on
+
+    stats.start_ns = stats_now();
+    filter_init(&filter);
+
+    /* First, we check for any set flags. */
+    while (1) {
+        c = getopt_long(argc, argv, options, long_options, NULL);
+        if (c == -1) {
+            break;
+        } else if (c == '?') {
+            handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+        } else if (c == 'f') {
+            hosts_file_path = optarg;
+        } else if (c == 'S') {
+            if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                stats_format = STATS_FORMAT_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_format = STATS_FORMAT_JSON;
+            } else {
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+        } else if (c == 'D') {
+            daemon_socket = optarg;
+        } else if (c == 'K') {
+            lookup_path = optarg;
+        } else if (c == 'P') {
+            publish_name = optarg;
+        } else if (c == 'A') {
+            attach_name = optarg;
+        } else if (c == 'X') {
+            /* The second file is the next argument. */
+            if (optind >= argc) {
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+            diff_old = optarg;
+            diff_new = argv[optind++];
+        } else if (c == 'T') {
+            /* The second file is the next argument. */
+            if (optind >= argc) {
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+            delta_old = optarg;
+            delta_new = argv[optind++];
+        } else if (c == 'Q') {
+            delta_path = optarg;
+        } else if (c == '3') {
+            /* The other two files are the next arguments. */
+            if (optind + 1 >= argc) {
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+            merge_paths[0] = optarg;
+            merge_paths[1] = argv[optind++];
+            merge_paths[2] = argv[optind++];
+        } else if (c == 'N') {
+            leveled = 1;
+            if ((fingerprint_level = (unsigned int)parse_count(optarg)) > MERKLE_DEPTH) {
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+        } else if (c == 'Y') {
+            if (strcmp(optarg, "always") == 0) {
+                journal_sync = JOURNAL_SYNC_ALWAYS;
+            } else if (strcmp(optarg, "never") == 0) {
+                journal_sync = JOURNAL_SYNC_NEVER;
+            } else {
+                fprintf(stderr, PROGRAM_NAME ": Unknown fsync policy '%s'.\n", optarg);
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+        } else if (c == 'R') {
+            reconcile_path = optarg;
+        } else if (c == 'G') {
+            block_name = optarg;
+        } else if (c == 'B') {
+            base_path = optarg;
+        } else if (c == 'Z') {
+            materialize_path = optarg;
+        } else if (c == 'C') {
+            compile_path = optarg;
+        } else if (c == 'U') {
+            sources_directory = optarg;
+            editing = 1;
+        } else if (c == 'M') {
+            metrics_textfile = optarg;
+        } else if (c == 'E') {
+            if ((max_memory = parse_size(optarg)) < EXTERNAL_MIN_MEMORY) {
+                fprintf(stderr, PROGRAM_NAME ": --max-memory must be at least 1M.\n");
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+        } else if (c == 'F') {
+            if ((output_formats = export_format_parse_list(optarg)) == 0) {
+                fprintf(stderr, PROGRAM_NAME ": Unknown format in '%s'.\n", optarg);
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+            export_format = export_format_parse(optarg);
+        } else if (c == 'o') {
+            output_prefix = optarg;
+        } else if (c == 'O') {
+            scan.offset = parse_count(optarg);
+            paginate_flag = 1;
+        } else if (c == 'L') {
+            scan.limit = parse_count(optarg);
+            paginate_flag = 1;
+        } else if (c == 'W') {
+            if (filter_compile(&filter, optarg) != 0) {
+                fprintf(stderr, PROGRAM_NAME ": Invalid filter '%s'.\n", optarg);
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+            scan.filter = &filter;
+            paginate_flag = 1;
+        } else if (c == 'a' || c == 'r' || c == 'i' || c == 'd') {
+            editing = 1;
+            bulk |= c == 'i' || c == 'd';
+            single |= c == 'a' || c == 'r';
+            removing |= c == 'r';
+        } else if (c == 'l') {
+            listing = 1;
+        } else if (c == 'J') {
+            log_json_path = optarg;
+        }
+    };
+
+    /* Deduplicating and sorting rewrite the whole file, like imports do. */
+    if (dedup_flag || sort_flag) {
+        editing = 1;
+        bulk = 1;
+    }
+
+    /* Only files can take more than one format. */
+    if (output_formats && !output_prefix && export_format == EXPORT_FORMAT_NONE) {
+        fprintf(stderr, PROGRAM_NAME ": Multiple formats require --output.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* A page of the hosts file can be listed, but never written back. */
+    if (paginate_flag && (editing || compact_flag)) {
+        fprintf(stderr, PROGRAM_NAME ": --where, --offset and --limit only apply to listings.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Only single edits are worth journaling. */
+    if (journal_flag && bulk) {
+        fprintf(stderr, PROGRAM_NAME ": --journal only applies to --add, --remove and --sources.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Overlays take single edits only, and exist to avoid loading the base. */
+    if (base_path && (bulk || journal_flag || compact_flag || sources_directory || reconcile_path || paginate_flag || output_prefix)) {
+        fprintf(stderr, PROGRAM_NAME ": --base only applies to --add, --remove, --list, --lookup and --materialize.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if (max_memory && (!bulk || single || listing || compact_flag || sources_directory || reconcile_path || base_path || lookup_path || output_prefix || paginate_flag)) {
+        fprintf(stderr, PROGRAM_NAME ": --max-memory only applies to --import, --delete, --dedup and --sort.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if ((publish_name && !daemon_socket) || (attach_name && !lookup_path)) {
+        fprintf(stderr, PROGRAM_NAME ": --publish requires --daemon, --attach requires --lookup.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if (block_name && !reconcile_path) {
+        fprintf(stderr, PROGRAM_NAME ": --block requires --reconcile.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if (materialize_path && !base_path) {
+        fprintf(stderr, PROGRAM_NAME ": --materialize requires --base.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if (leveled && !fingerprint_flag) {
+        fprintf(stderr, PROGRAM_NAME ": --level requires --fingerprint.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Syncing sources records their state, so it can't be tried out. */
+    if (sources_directory && dry_run_flag) {
+        fprintf(stderr, PROGRAM_NAME ": --sources can't be combined with --dry-run.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Reconciling replaces every other edit. */
+    if (reconcile_path && (editing || paginate_flag)) {
+        fprintf(stderr, PROGRAM_NAME ": --reconcile can't be combined with edits.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Like reconciling, applying a delta replaces every other edit. */
+    if (delta_path && (editing || paginate_flag || reconcile_path || base_path)) {
+        fprintf(stderr, PROGRAM_NAME ": --apply-delta can't be combined with edits, --reconcile or --base.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* Compiling reads the hosts file as it is. */
+    if (compile_path && (editing || paginate_flag || base_path)) {
+        fprintf(stderr, PROGRAM_NAME ": --compile can't be combined with edits or --base.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /* The daemon loads and owns the hosts file itself. */
+    if (daemon_socket) {
+        daemon_run(daemon_socket, metrics_textfile, publish_name);
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Counters are only worth opening when they will be reported. */
+    if (perf_counters_flag) {
+        stats_format = stats_format == STATS_FORMAT_NONE ? STATS_FORMAT_TEXT : stats_format;
+        perf_open();
+    }
+
+    /* Comparisons don't involve the hosts file itself. */
+    if (diff_old) {
+        diff_files(diff_old, diff_new, patch_flag ? DIFF_FORMAT_PATCH : DIFF_FORMAT_SUMMARY, STDOUT_FILENO);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Deltas are binary, meant to be redirected to a file. */
+    if (delta_old) {
+        diff_delta(delta_old, delta_new, STDOUT_FILENO);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Merges only involve the files given, conflicts are reported on stderr. */
+    if (merge_paths[0]) {
+        missing = diff_merge3(merge_paths[0], merge_paths[1], merge_paths[2], STDOUT_FILENO, STDERR_FILENO);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return missing ? ERROR_CODE_MERGE_CONFLICT : ERROR_CODE_SUCCESS;
+    }
+
+    /* Fingerprints come from a scan, or the tree cached next to the file. */
+    if (fingerprint_flag) {
+        tree = hf_malloc(sizeof(struct merkle_tree));
+        merkle_build(tree, hosts_file_path, 1);
+        if (merkle_write_level(tree, fingerprint_level, STDOUT_FILENO) != 0) {
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+        free(tree);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Lookup files are built from a scan, the hosts file is left alone. */
+    if (compile_path) {
+        stats_operation("compile");
+        compile_file(hosts_file_path, compile_path);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Desired states and deltas are applied to the file, not its entries. */
+    if (reconcile_path || delta_path) {
+        stats_operation(delta_path ? "apply-delta" : "reconcile");
+        if (!dry_run_flag) {
+            lock = journal_lock(hosts_file_path);
+        }
+        if (journal_waiting(hosts_file_path)) {
+            journal_unlock(hosts_file_path, lock);
+            fprintf(stderr, PROGRAM_NAME ": Commit the journal with --compact before using %s.\n", delta_path ? "--apply-delta" : "--reconcile");
+            handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+        }
+        if (delta_path) {
+            if ((code = diff_apply_delta(hosts_file_path, delta_path, &lines, &fingerprint)) != ERROR_CODE_SUCCESS) {
+                journal_unlock(hosts_file_path, lock);
+                handle_error(code);
+            }
+        } else if (block_name) {
+            block_reconcile(hosts_file_path, block_name, reconcile_path, log_json_path ? &lines : NULL, log_json_path ? &fingerprint : NULL);
+        } else {
+            diff_reconcile(hosts_file_path, reconcile_path, &lines, &fingerprint);
+        }
+        journal_unlock(hosts_file_path, lock);
+        if (log_json_path && stats_log_json(log_json_path, hosts_file_path, &lines, fingerprint) != 0) {
+            fprintf(stderr, PROGRAM_NAME ": Could not append to %s.\n", log_json_path);
+        }
+        stats_report(stderr, stats_format);
+        perf_close();
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Overlays resolve against the base through its index, without loading it. */
+    if (base_path) {
+        overlay_base_open(&base, base_path);
+        if (editing && !dry_run_flag) {
+            lock = journal_lock(hosts_file_path);
+            if ((tmp = open(hosts_file_path, O_WRONLY | O_CREAT, 0644)) < 0) {
+                handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+            }
+            close(tmp);
+        }
+        hosts_file = hosts_file_init(hosts_file_path);
+
+        optind = 1;
+        while ((c = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+            if (c == 'a') {
+                stats_operation("add");
+                domain = strtok(optarg, "@");
+                ip = strtok(NULL, "@");
+                if (domain == NULL || ip == NULL) {
+                    journal_unlock(hosts_file_path, lock);
+                    handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+                }
+                overlay_add(&hosts_file, hf_strdup(ip), hf_strdup(domain));
+                modified_flag = 1;
+            } else if (c == 'r') {
+                stats_operation("remove");
+                if ((code = overlay_remove(&hosts_file, &base, optarg)) != ERROR_CODE_SUCCESS) {
+                    journal_unlock(hosts_file_path, lock);
+                    handle_error(code);
+                }
+                modified_flag = 1;
+            } else if (c == 'l') {
+                listing = 1;
+            }
+        }
+        if (modified_flag) {
+            hosts_file_write(&hosts_file);
+        }
+        journal_unlock(hosts_file_path, lock);
+
+        missing = 0;
+        if (lookup_path) {
+            stats_operation("lookup");
+            if (!(names = strcmp(lookup_path, "-") == 0 ? stdin : fopen(lookup_path, "r"))) {
+                handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+            }
+            missing = overlay_lookup(&hosts_file, &base, names, STDOUT_FILENO);
+            fclose(names);
+        }
+        if (listing) {
+            stats_operation("list");
+            overlay_write(&hosts_file, &base, STDOUT_FILENO);
+        }
+        if (materialize_path) {
+            stats_operation("materialize");
+            overlay_materialize(&hosts_file, &base, materialize_path);
+        }
+
+        hosts_file_free(&hosts_file);
+        overlay_base_close(&base);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return missing ? ERROR_CODE_ENTRY_DOES_NOT_EXIST : ERROR_CODE_SUCCESS;
+    }
+
+    /* Batch lookups answer from their own scan of the hosts file. */
+    if (lookup_path) {
+        if (!(names = strcmp(lookup_path, "-") == 0 ? stdin : fopen(lookup_path, "r"))) {
+            handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+        }
+        missing = attach_name ? shared_lookup_batch(attach_name, names, STDOUT_FILENO) : lookup_batch(hosts_file_path, names, STDOUT_FILENO);
+        fclose(names);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return missing ? ERROR_CODE_ENTRY_DOES_NOT_EXIST : ERROR_CODE_SUCCESS;
+    }
+
+    /* Within a memory budget, bulk edits stream through sorted runs instead of loading any file. */
+    if (max_memory) {
+        if (!dry_run_flag) {
+            lock = journal_lock(hosts_file_path);
+            if (journal_waiting(hosts_file_path)) {
+                journal_unlock(hosts_file_path, lock);
+                fprintf(stderr, PROGRAM_NAME ": Commit the journal with --compact before using --max-memory.\n");
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+        }
+
+        operations = hf_malloc(sizeof(struct external_operation) * argc);
+        optind = 1;
+        while ((c = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+            if (c == 'i' || c == 'd') {
+                stats_operation(c == 'i' ? "import" : "delete");
+                operations[operation_count].operation = c;
+                operations[operation_count++].path = optarg;
+            }
+        }
+        if (dedup_flag) {
+            stats_operation("dedup");
+        }
+        if (sort_flag) {
+            stats_operation("sort");
+        }
+
+        external_apply(hosts_file_path, operations, operation_count, dedup_flag, sort_flag, max_memory, &lines, &fingerprint);
+        journal_unlock(hosts_file_path, lock);
+        if (log_json_path && stats_log_json(log_json_path, hosts_file_path, &lines, fingerprint) != 0) {
+            fprintf(stderr, PROGRAM_NAME ": Could not append to %s.\n", log_json_path);
+        }
+        free(operations);
+        stats_report(stderr, stats_format);
+        perf_close();
+        return ERROR_CODE_SUCCESS;
+    }
+
+    /* Writers take turns through a lock next to the hosts file. */
+    journaled = editing && !bulk && !dry_run_flag;
+
+    /* Single edits are appended to the journal; whoever writes next commits them. */
+    if (journaled) {
+        /*
+         * Removals fail on missing entries, so they are checked in turn before
+         * anything is appended. The copy they are checked on is kept for the
+         * commit, as the hosts file can't change while the lock is held.
+         */
+        if (removing) {
+            lock = journal_lock(hosts_file_path);
+            hosts_file = hosts_file_init(hosts_file_path);
+            journal_replay(hosts_file_path, &hosts_file);
+            touched = stats.entries_touched;
+            optind = 1;
+            while ((c = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+                if (c == 'a' && (domain = strchr(optarg, '@'))) {
+                    hosts_file_add(&hosts_file, hf_strdup(domain + 1), hf_strndup(optarg, domain - optarg));
+                } else if (c == 'r' && !hosts_file_discard(&hosts_file, optarg, IP_KIND_NONE)) {
+                    journal_unlock(hosts_file_path, lock);
+                    handle_error(ERROR_CODE_ENTRY_DOES_NOT_EXIST);
+                }
+            }
+
+            /* Only the appends below count. */
+            stats.entries_touched = touched;
+        }
+
+        /* Sources share their state between runs, so syncing them waits for the lock. */
+        if (sources_directory) {
+            stats_operation("sources");
+            if (lock < 0) {
+                lock = journal_lock(hosts_file_path);
+            }
+            if ((appends = sources_sync(hosts_file_path, sources_directory, journal_flag ? journal_sync : JOURNAL_SYNC_NEVER, &appended))) {
+                journal_size = (unsigned long long)appended.st_size;
+            }
+        }
+
+        optind = 1;
+        while ((c = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
+            if (c == 'a') {
+                stats_operation("add");
+                domain = strtok(optarg, "@");
+                ip = strtok(NULL, "@");
+                if (domain == NULL || ip == NULL) {
+                    handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+                }
+                parse_ip_address(ip);
+                journal_size = journal_append(hosts_file_path, JOURNAL_ADD, domain, ip, journal_flag ? journal_sync : JOURNAL_SYNC_NEVER, &appended);
+                ++appends;
+            } else if (c == 'r') {
+                stats_operation("remove");
+                journal_size = journal_append(hosts_file_path, JOURNAL_REMOVE, optarg, NULL, journal_flag ? journal_sync : JOURNAL_SYNC_NEVER, &appended);
+                ++appends;
+            }
+        }
+
+        /* In journal mode, edits stay there until the journal grows too large. */
+        if (journal_flag && journal_size < JOURNAL_COMPACT_SIZE && !compact_flag) {
+            journal_unlock(hosts_file_path, lock);
+            if (removing) {
+                hosts_file_free(&hosts_file);
+            }
+            if (log_json_path && stats_log_json(log_json_path, hosts_file_path, NULL, 0) != 0) {
+                fprintf(stderr, PROGRAM_NAME ": Could not append to %s.\n", log_json_path);
+            }
+            stats_report(stderr, stats_format);
+            perf_close();
+            return ERROR_CODE_SUCCESS;
+        }
+
+        /* Another writer may have committed these edits along with its own meanwhile. */
+        if (lock < 0) {
+            lock = journal_lock(hosts_file_path);
+        }
+        if (!journal_flag && !compact_flag && (!appends || !journal_pending(hosts_file_path, &appended))) {
+            stats.write_skipped = 1;
+            journal_unlock(hosts_file_path, lock);
+            if (removing) {
+                hosts_file_free(&hosts_file);
+            }
+            if (log_json_path && stats_log_json(log_json_path, hosts_file_path, NULL, 0) != 0) {
+                fprintf(stderr, PROGRAM_NAME ": Could not append to %s.\n", log_json_path);
+            }
+            stats_report(stderr, stats_format);
+            perf_close();
+            return ERROR_CODE_SUCCESS;
+        }
+        modified_flag = 1;
+    } else if ((editing || compact_flag) && !dry_run_flag) {
+        lock = journal_lock(hosts_file_path);
+    }
+
+    /* A page is cut while parsing, before journaled edits could be replayed onto it. */
+    if (paginate_flag && journal_waiting(hosts_file_path)) {
+        fprintf(stderr, PROGRAM_NAME ": Commit the journal with --compact before using --where, --offset or --limit.\n");
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    /*
+     * The writer whose turn it is takes every pending edit along. Replaying
+     * is idempotent, so the copy removals were checked on takes them again.
+     */
+    if (!journaled || !removing) {
+        hosts_file = paginate_flag ? hosts_file_parse(hosts_file_path, &scan) : hosts_file_init(hosts_file_path);
+    }
+    if (lock >= 0) {
+        journal_take(hosts_file_path, &hosts_file);
+    } else if (!paginate_flag) {
+        journal_replay(hosts_file_path, &hosts_file);
+    }
+    if (compact_flag) {
+        stats_operation("compact");
+        modified_flag = 1;
+    }
+
+    /* Reset the getopt_long function internally. */
+    optind = 1;
+
+    /* Secondly, we go over the arguments. */
+    break_free = 0;
+    while (!break_free) {
+        switch (getopt_long(argc, argv, options, long_options, NULL)) {
+            case -1:
+                break_free = 1;
+                break;
+
+            case 'a':
+                if (journaled) {
+                    break;
+                }
+                stats_phase_begin("add");
+                stats_operation("add");
+                domain = strtok(optarg, "@");
+                ip = strtok(NULL, "@");
+                if (domain == NULL || ip == NULL) {
+                    handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+                }
+                hosts_file_add(&hosts_file, hf_strdup(ip), hf_strdup(domain));
+                stats_phase_end();
+                modified_flag = 1;
+                break;
+
+            case 'l':
+                stats_operation("list");
+                // TODO: The list option should not be used with other args
+                /* Temporarily set the dry run flag to print to the console. */
+                tmp = dry_run_flag;
+                dry_run_flag = 1;
+                hosts_file_write(&hosts_file);
+                dry_run_flag = tmp;
+                break;
+
+            case 'r':
+                if (journaled) {
+                    break;
+                }
+                stats_phase_begin("remove");
+                stats_operation("remove");
+                hosts_file_remove(&hosts_file, optarg, IP_KIND_NONE);
+                stats_phase_end();
+                modified_flag = 1;
+                break;
+
+            case 'i':
+                stats_phase_begin("import");
+                stats_operation("import");
+                other = hosts_file_init(optarg);
+                hosts_file_merge(&hosts_file, &other);
+                hosts_file_free(&other);
+                stats_phase_end();
+                modified_flag = 1;
+                break;
+
+            case 'd':
+                stats_phase_begin("delete");
+                stats_operation("delete");
+                other = hosts_file_init(optarg);
+                hosts_file_delete(&hosts_file, &other);
+                hosts_file_free(&other);
+                stats_phase_end();
+                modified_flag = 1;
+                break;
+
+            case 'V':
+                printf("Version %s\n", PROGRAM_VERSION);
+                return ERROR_CODE_SUCCESS;
+
+            case 'h':
+                printf("%s", help_message);
+                return ERROR_CODE_SUCCESS;
+
+            case 0:
+            default:
+                break;
+        }
+    }
+
+    /* Deduplication and sorting apply to the outcome of every other edit. */
+    if (dedup_flag) {
+        stats_operation("dedup");
+        hosts_file_dedup(&hosts_file);
+        modified_flag = 1;
+    }
+    if (sort_flag) {
+        stats_operation("sort");
+        hosts_file_sort(&hosts_file);
+        modified_flag = 1;
+    }
+
+    /* No argument given; just write the hostsfile to stdout. */
+    if (argc == 1) {
+        dry_run_flag = 1;
+        hosts_file_write(&hosts_file);
+    }
+
+    /* If the hostsfile is modified, write it to file. */
+    else if (modified_flag) {
+        hosts_file_write(&hosts_file);
+
+        /* The edits taken are part of what was just written. */
+        if (lock >= 0) {
+            journal_commit(hosts_file_path);
+        }
+    }
+    journal_unlock(hosts_file_path, lock);
+
+    /* Read-only commands skip the write by definition. */
+    if (!modified_flag) {
+        stats.write_skipped = 1;
+    }
+
+    /* Exports reflect the hosts file after all changes. */
+    if (output_prefix) {
+        stats_operation("output");
+        export_files(&hosts_file, output_formats ? output_formats : 1u << EXPORT_FORMAT_HOSTS, output_prefix);
+    }
+
+    if (log_json_path && stats_log_json(log_json_path, hosts_file_path, &hosts_file.source_lines, hosts_file.source_fingerprint) != 0) {
+        fprintf(stderr, PROGRAM_NAME ": Could not append to %s.\n", log_json_path);
+    }
+
+    /* Free memory. Debatable whether this is good practice. */
+    stats_phase_begin("free");
+    hosts_file_free(&hosts_file);
+    stats_phase_end();
+    stats_report(stderr, stats_format);
+    perf_close();
+
+    /* Success! */
+    return ERROR_CODE_SUCCESS;
+}
@@ -0,0 +1,337 @@
+/*
+ * Merkle trees over the entries of a hosts file.
+ *
+ * Entries are normalized first: domains are lowercased and lose a trailing
+ * dot, addresses are brought into their canonical textual form. Each entry is
+ * hashed, and the hashes are bucketed by their leading bits and sorted, so
+ * neither the order of the lines nor comments, formatting or duplicates
+ * affect the result. Leaves hash the sorted entry hashes of their bucket,
+ * inner nodes the hashes of their children.
+ *
+ * Nodes that differ between two files point at the buckets holding the
+ * differing entries: comparing level 1 narrows drift down to a sixteenth of
+ * the entries, level 2 to a 256th and so on.
+ *
+ * Building the tree means reading the whole file, so it is cached next to it
+ * and reused for as long as the file is unchanged.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "merkle.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Identifies the file a cached tree belongs to. */
+struct merkle_sidecar {
+    char magic[4];
+    uint32_t version;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t modified_seconds;
+    int64_t modified_nanoseconds;
+    uint64_t entries;
+};
+
+/* The entry hashes collected while scanning. */
+struct merkle_hashes {
+    uint64_t * hashes;
+    size_t count;
+    size_t capacity;
+};
+
+static inline unsigned int merkle_level_offset(unsigned int level)
+{
+    return ((1u << (MERKLE_FANOUT_BITS * level)) - 1) / (MERKLE_FANOUT - 1);
+}
+
+/**
+ * Hashes the normalized form of an entry: the lowercase domain without
+ * trailing dot, a tab and the canonical address. Addresses inet_pton doesn't
+ * understand, e.g. those with a port, are taken as they are.
+ * @param token The entry.
+ * @return 64-bit hash.
+ */
+static uint64_t merkle_hash_entry(const struct hosts_file_token * token)
+{
+    char buffer[256], address[INET6_ADDRSTRLEN];
+    unsigned char binary[16];
+    size_t length = token->domain_length, n;
+    struct fingerprint fp;
+    int family;
+
+    if (length > 1 && token->domain[length - 1] == '.') {
+        --length;
+    }
+
+    fingerprint_init(&fp);
+    for (size_t i = 0; i < length; i += n) {
+        n = length - i < sizeof(buffer) ? length - i : sizeof(buffer);
+        for (size_t j = 0; j < n; ++j) {
+            buffer[j] = (char)(token->domain[i + j] >= 'A' && token->domain[i + j] <= 'Z' ? token->domain[i + j] + 'a' - 'A' : token->domain[i + j]);
+        }
+        fingerprint_update(&fp, buffer, n);
+    }
+    fingerprint_update(&fp, "\t", 1);
+
+    if (token->ip_length < sizeof(address)) {
+        memcpy(address, token->ip, token->ip_length);
+        address[token->ip_length] = '\0';
+        family = memchr(address, ':', token->ip_length) ? AF_INET6 : AF_INET;
+        if (inet_pton(family, address, binary) == 1 && inet_ntop(family, binary, address, sizeof(address))) {
+            fingerprint_update(&fp, address, strlen(address));
+            return fingerprint_final(&fp);
+        }
+    }
+
+    fingerprint_update(&fp, token->ip, token->ip_length);
+    return fingerprint_final(&fp);
+}
+
+static int merkle_collect(void * context, const struct hosts_file_token * token, unsigned long long line)
+{
+    struct merkle_hashes * h = context;
+
+    (void)line;
+    if (h->count == h->capacity) {
+        h->capacity = h->capacity ? h->capacity * 2 : 4096;
+        h->hashes = hf_realloc(h->hashes, sizeof(uint64_t) * h->capacity);
+    }
+    h->hashes[h->count++] = merkle_hash_entry(token);
+
+    return 0;
+}
+
+/* Feeds a hash in little-endian order, so trees compare across machines. */
+static void merkle_update(struct fingerprint * fp, uint64_t hash)
+{
+    unsigned char bytes[8];
+
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = (unsigned char)(hash >> (8 * i));
+    }
+    fingerprint_update(fp, bytes, sizeof(bytes));
+}
+
+static int merkle_compare(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Computes the tree from the entry hashes. A counting sort places every hash
+ * in its leaf, after which the leaves are small enough to sort on their own.
+ * @param tree The tree to fill in.
+ * @param h The entry hashes.
+ */
+static void merkle_compute(struct merkle_tree * tree, const struct merkle_hashes * h)
+{
+    const unsigned int shift = 64 - MERKLE_FANOUT_BITS * MERKLE_DEPTH;
+    unsigned int * offsets = hf_calloc(MERKLE_LEAVES + 1, sizeof(unsigned int));
+    uint64_t * sorted = hf_malloc(sizeof(uint64_t) * (h->count ? h->count : 1));
+    unsigned int * fill = hf_calloc(MERKLE_LEAVES, sizeof(unsigned int));
+    unsigned int leaf, first, count, level, parent;
+    struct fingerprint fp;
+    uint64_t * bucket;
+
+    stats_phase_begin("sort");
+    for (size_t i = 0; i < h->count; ++i) {
+        ++offsets[(h->hashes[i] >> shift) + 1];
+    }
+    for (unsigned int i = 0; i < MERKLE_LEAVES; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+    for (size_t i = 0; i < h->count; ++i) {
+        leaf = (unsigned int)(h->hashes[i] >> shift);
+        sorted[offsets[leaf] + fill[leaf]++] = h->hashes[i];
+    }
+    stats_phase_end();
+
+    stats_phase_begin("tree");
+    first = merkle_level_offset(MERKLE_DEPTH);
+    for (leaf = 0; leaf < MERKLE_LEAVES; ++leaf) {
+        bucket = sorted + offsets[leaf];
+        count = offsets[leaf + 1] - offsets[leaf];
+        qsort(bucket, count, sizeof(uint64_t), merkle_compare);
+
+        /* Identical entries count once. */
+        fingerprint_init(&fp);
+        for (unsigned int i = 0; i < count; ++i) {
+            if (i == 0 || bucket[i] != bucket[i - 1]) {
+                merkle_update(&fp, bucket[i]);
+            }
+        }
+        tree->nodes[first + leaf] = fingerprint_final(&fp);
+    }
+
+    for (level = MERKLE_DEPTH; level-- > 0;) {
+        first = merkle_level_offset(level);
+        for (parent = 0; parent < 1u << (MERKLE_FANOUT_BITS * level); ++parent) {
+            fingerprint_init(&fp);
+            for (unsigned int child = 0; child < MERKLE_FANOUT; ++child) {
+                merkle_update(&fp, tree->nodes[merkle_level_offset(level + 1) + parent * MERKLE_FANOUT + child]);
+            }
+            tree->nodes[first + parent] = fingerprint_final(&fp);
+        }
+    }
+    tree->entries = h->count;
+    stats_phase_end();
+
+    free(offsets);
+    free(sorted);
+    free(fill);
+}
+
+static void merkle_sidecar_describe(struct merkle_sidecar * sidecar, const struct stat * st)
+{
+    memset(sidecar, 0, sizeof(*sidecar));
+    memcpy(sidecar->magic, "HFMK", 4);
+    sidecar->version = MERKLE_SIDECAR_VERSION;
+    sidecar->device = (uint64_t)st->st_dev;
+    sidecar->inode = (uint64_t)st->st_ino;
+    sidecar->size = (uint64_t)st->st_size;
+#ifdef __APPLE__
+    sidecar->modified_seconds = (int64_t)st->st_mtimespec.tv_sec;
+    sidecar->modified_nanoseconds = (int64_t)st->st_mtimespec.tv_nsec;
+#else
+    sidecar->modified_seconds = (int64_t)st->st_mtim.tv_sec;
+    sidecar->modified_nanoseconds = (int64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Loads the cached tree of a file, if it describes the file as it is now.
+ * @param tree Receives the tree.
+ * @param path Path of the sidecar.
+ * @param expected Description of the hosts file.
+ * @return Zero if the cached tree was loaded.
+ */
+static int merkle_sidecar_load(struct merkle_tree * tree, const char * path, const struct merkle_sidecar * expected)
+{
+    struct merkle_sidecar found;
+    int fd = open(path, O_RDONLY), result = -1;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (read(fd, &found, sizeof(found)) == sizeof(found) && memcmp(&found, expected, offsetof(struct merkle_sidecar, entries)) == 0 && read(fd, tree->nodes, sizeof(tree->nodes)) == sizeof(tree->nodes)) {
+        tree->entries = found.entries;
+        stats.bytes_read += sizeof(found) + sizeof(tree->nodes);
+        result = 0;
+    }
+
+    close(fd);
+    return result;
+}
+
+/**
+ * Caches a tree next to its file. The sidecar is renamed into place, so
+ * concurrent readers never see half of it. Failing is fine, e.g. when the
+ * directory isn't writable; the tree is then computed every time.
+ * @param tree The tree.
+ * @param path Path of the sidecar.
+ * @param sidecar Description of the hosts file.
+ */
+static void merkle_sidecar_store(const struct merkle_tree * tree, const char * path, struct merkle_sidecar * sidecar)
+{
+    char temporary[PATH_MAX + 16];
+    struct writer w;
+    int fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    if ((fd = mkstemp(temporary)) < 0) {
+        return;
+    }
+
+    sidecar->entries = tree->entries;
+    writer_init(&w, fd, 0);
+    writer_bytes(&w, sidecar, sizeof(*sidecar));
+    writer_bytes(&w, tree->nodes, sizeof(tree->nodes));
+    if (writer_close(&w) != 0 || fchmod(fd, 0644) != 0 || rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+    close(fd);
+}
+
+/**
+ * Computes the tree of a hosts file, or takes it from the sidecar when the
+ * file hasn't changed since it was cached.
+ * @param tree Receives the tree.
+ * @param pathname Path of the hosts file.
+ * @param store Whether a computed tree is cached; not for files that are
+ * merely read, or that are about to change.
+ */
+void merkle_build(struct merkle_tree * tree, char * pathname, int store)
+{
+    char sidecar_path[PATH_MAX];
+    struct merkle_hashes h = { 0 };
+    struct merkle_sidecar sidecar;
+    struct stat st;
+    int cacheable;
+
+    stats_phase_begin("fingerprint");
+    if (stat(pathname, &st) != 0) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+    merkle_sidecar_describe(&sidecar, &st);
+    cacheable = snprintf(sidecar_path, sizeof(sidecar_path), "%s" MERKLE_SIDECAR_SUFFIX, pathname) < (int)sizeof(sidecar_path);
+
+    if (!cacheable || merkle_sidecar_load(tree, sidecar_path, &sidecar) != 0) {
+        hosts_file_visit(pathname, merkle_collect, &h);
+        merkle_compute(tree, &h);
+        free(h.hashes);
+        if (cacheable && store) {
+            merkle_sidecar_store(tree, sidecar_path, &sidecar);
+        }
+    }
+    stats_phase_end();
+}
+
+/**
+ * Writes the nodes of a level, one per line. The root is written as is;
+ * other nodes are preceded by the hexadecimal prefix of the entry hashes
+ * they cover.
+ * @param tree The tree.
+ * @param level Level to write, up to MERKLE_DEPTH.
+ * @param out Target file descriptor.
+ * @return Zero if all output was written.
+ */
+int merkle_write_level(const struct merkle_tree * tree, unsigned int level, int out)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned int first = merkle_level_offset(level);
+    struct writer w;
+
+    writer_init(&w, out, 0);
+    for (unsigned int node = 0; node < 1u << (MERKLE_FANOUT_BITS * level); ++node) {
+        for (unsigned int digit = level; digit-- > 0;) {
+            writer_char(&w, hex[(node >> (MERKLE_FANOUT_BITS * digit)) & (MERKLE_FANOUT - 1)]);
+        }
+        if (level) {
+            writer_char(&w, '\t');
+        }
+        writer_hex64(&w, tree->nodes[first + node]);
+        writer_char(&w, '\n');
+    }
+    stats.bytes_written += w.flushed + w.length;
+
+    return writer_close(&w);
+}
@@ -0,0 +1,39 @@
+/*
+ * Merkle trees over the entries of a hosts file, to tell whether two files
+ * hold the same entries and, if not, where they differ.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+
+/*
+ * Every level splits the buckets of the one above in MERKLE_FANOUT, by the
+ * next bits of the entry hashes. The root is level 0, the leaves are level
+ * MERKLE_DEPTH and cover MERKLE_LEAVES buckets. Nodes are listed by their
+ * hexadecimal prefix, so a level takes four bits.
+ */
+#define MERKLE_FANOUT_BITS 4
+#define MERKLE_FANOUT (1u << MERKLE_FANOUT_BITS)
+#define MERKLE_DEPTH 4
+#define MERKLE_LEAVES (1u << (MERKLE_FANOUT_BITS * MERKLE_DEPTH))
+#define MERKLE_NODES ((MERKLE_LEAVES * MERKLE_FANOUT - 1) / (MERKLE_FANOUT - 1))
+
+/* Appended to the path of a hosts file to name its cached tree. */
+#define MERKLE_SIDECAR_SUFFIX ".hf-merkle"
+#define MERKLE_SIDECAR_VERSION 1
+
+/* All nodes, level by level; level l starts at (MERKLE_FANOUT^l - 1) / 15. */
+struct merkle_tree {
+    uint64_t nodes[MERKLE_NODES];
+    unsigned long long entries;
+};
+
+void merkle_build(struct merkle_tree * tree, char * pathname, int store);
+int merkle_write_level(const struct merkle_tree * tree, unsigned int level, int out);
+
+#endif
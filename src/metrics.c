@@ -0,0 +1,168 @@
+/*
+ * Lock-free operation metrics of the daemon, exposed in the Prometheus text
+ * format.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "metrics.h"
+#include "hostsfile.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Exported histogram buckets are powers of two, from 1us up to ~17s. */
+#define METRICS_EXPOSED_MIN_SHIFT 10
+#define METRICS_EXPOSED_MAX_SHIFT 34
+
+struct metrics metrics;
+
+static const char * metrics_names[METRICS_OPERATIONS] = {
+    "lookup",
+    "add",
+    "remove",
+    "flush",
+    "reload",
+};
+
+/**
+ * Maps a value onto its log-linear bucket.
+ * @param ns Latency in nanoseconds.
+ * @return Bucket index below METRICS_BUCKETS.
+ */
+static unsigned int metrics_bucket(unsigned long long ns)
+{
+    unsigned int msb;
+
+    if (ns < METRICS_SUB_BUCKETS) {
+        return (unsigned int)ns;
+    }
+
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS
+        + (unsigned int)((ns >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+/**
+ * The smallest value that no longer fits a bucket.
+ * @param bucket Bucket index.
+ * @return Exclusive upper bound in nanoseconds.
+ */
+static unsigned long long metrics_bucket_limit(unsigned int bucket)
+{
+    unsigned int octave = bucket / METRICS_SUB_BUCKETS, sub = bucket % METRICS_SUB_BUCKETS;
+
+    if (octave == 0) {
+        return bucket + 1;
+    }
+
+    /* Saturate the very last bucket rather than overflowing. */
+    if (octave + METRICS_SUB_BITS - 1 >= 63) {
+        return ULLONG_MAX;
+    }
+
+    return (unsigned long long)(METRICS_SUB_BUCKETS + sub + 1) << (octave - 1);
+}
+
+/**
+ * Records a single operation. Safe to call from any thread.
+ * @param operation The operation that finished.
+ * @param ns How long it took.
+ * @param failed Non-zero if it didn't succeed.
+ */
+void metrics_record(enum metrics_operation operation, unsigned long long ns, int failed)
+{
+    struct metrics_histogram * histogram = &metrics.latency[operation];
+
+    atomic_fetch_add_explicit(&histogram->buckets[metrics_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum_ns, ns, memory_order_relaxed);
+    if (failed) {
+        atomic_fetch_add_explicit(&metrics.errors[operation], 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Writes all metrics in the Prometheus text exposition format, version 0.0.4.
+ * Values are read without locking; a scrape may observe a recording halfway.
+ * @param file Target stream.
+ */
+void metrics_expose(FILE * file)
+{
+    struct metrics_histogram * histogram;
+    unsigned long long cumulative;
+    unsigned int bucket;
+
+    fprintf(file, "# HELP hf_operations_total Operations handled by the daemon.\n");
+    fprintf(file, "# TYPE hf_operations_total counter\n");
+    for (int op = 0; op < METRICS_OPERATIONS; ++op) {
+        fprintf(file, "hf_operations_total{op=\"%s\"} %llu\n", metrics_names[op], atomic_load(&metrics.latency[op].count));
+    }
+
+    fprintf(file, "# HELP hf_operation_errors_total Operations that failed.\n");
+    fprintf(file, "# TYPE hf_operation_errors_total counter\n");
+    for (int op = 0; op < METRICS_OPERATIONS; ++op) {
+        fprintf(file, "hf_operation_errors_total{op=\"%s\"} %llu\n", metrics_names[op], atomic_load(&metrics.errors[op]));
+    }
+
+    fprintf(file, "# HELP hf_operation_duration_seconds Latency of daemon operations.\n");
+    fprintf(file, "# TYPE hf_operation_duration_seconds histogram\n");
+    for (int op = 0; op < METRICS_OPERATIONS; ++op) {
+        histogram = &metrics.latency[op];
+        cumulative = 0;
+        bucket = 0;
+        for (int shift = METRICS_EXPOSED_MIN_SHIFT; shift <= METRICS_EXPOSED_MAX_SHIFT; ++shift) {
+            while (bucket < METRICS_BUCKETS && metrics_bucket_limit(bucket) <= (1ULL << shift)) {
+                cumulative += atomic_load_explicit(&histogram->buckets[bucket++], memory_order_relaxed);
+            }
+            fprintf(file, "hf_operation_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n",
+                metrics_names[op], (double)(1ULL << shift) / 1e9, cumulative);
+        }
+        fprintf(file, "hf_operation_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", metrics_names[op], atomic_load(&histogram->count));
+        fprintf(file, "hf_operation_duration_seconds_sum{op=\"%s\"} %.9f\n", metrics_names[op], atomic_load(&histogram->sum_ns) / 1e9);
+        fprintf(file, "hf_operation_duration_seconds_count{op=\"%s\"} %llu\n", metrics_names[op], atomic_load(&histogram->count));
+    }
+
+    fprintf(file, "# HELP hf_index_entries Entries in the in-memory hosts file.\n");
+    fprintf(file, "# TYPE hf_index_entries gauge\n");
+    fprintf(file, "hf_index_entries %llu\n", atomic_load(&metrics.index_entries));
+    fprintf(file, "# HELP hf_index_slots Slots allocated by the domain index.\n");
+    fprintf(file, "# TYPE hf_index_slots gauge\n");
+    fprintf(file, "hf_index_slots %llu\n", atomic_load(&metrics.index_slots));
+    fprintf(file, "# HELP hf_file_bytes Size of the hosts file at the last load or flush.\n");
+    fprintf(file, "# TYPE hf_file_bytes gauge\n");
+    fprintf(file, "hf_file_bytes %llu\n", atomic_load(&metrics.file_bytes));
+    fprintf(file, "# HELP hf_last_flush_timestamp_seconds Unix time of the last successful flush.\n");
+    fprintf(file, "# TYPE hf_last_flush_timestamp_seconds gauge\n");
+    fprintf(file, "hf_last_flush_timestamp_seconds %llu\n", atomic_load(&metrics.last_flush_seconds));
+    fprintf(file, "# HELP hf_start_timestamp_seconds Unix time the daemon started.\n");
+    fprintf(file, "# TYPE hf_start_timestamp_seconds gauge\n");
+    fprintf(file, "hf_start_timestamp_seconds %llu\n", atomic_load(&metrics.start_seconds));
+}
+
+/**
+ * Writes the metrics for node_exporter's textfile collector. The file is
+ * renamed into place, so the collector never reads a partial file.
+ * @param path Target path, should end in .prom.
+ * @return Zero on success.
+ */
+int metrics_write_textfile(const char * path)
+{
+    char temporary[PATH_MAX];
+    FILE * file;
+
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, (int)getpid());
+    if (!(file = fopen(temporary, "w"))) {
+        return -1;
+    }
+
+    metrics_expose(file);
+    if (fclose(file) != 0 || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Lock-free operation metrics of the daemon, exposed in the Prometheus text
+ * format.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+ * Latencies are kept in log-linear (HDR style) buckets: every power of two
+ * of nanoseconds is split in METRICS_SUB_BUCKETS linear sub-buckets, which
+ * bounds the relative error to 25% over the whole range of 64-bit values.
+ */
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS (64 * METRICS_SUB_BUCKETS)
+
+/* Operations served by the daemon. */
+enum metrics_operation {
+    METRICS_LOOKUP,
+    METRICS_ADD,
+    METRICS_REMOVE,
+    METRICS_FLUSH,
+    METRICS_RELOAD,
+    METRICS_OPERATIONS,
+};
+
+struct metrics_histogram {
+    atomic_ullong buckets[METRICS_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum_ns;
+};
+
+struct metrics {
+    struct metrics_histogram latency[METRICS_OPERATIONS];
+    atomic_ullong errors[METRICS_OPERATIONS];
+    atomic_ullong index_entries;
+    atomic_ullong index_slots;
+    atomic_ullong file_bytes;
+    atomic_ullong last_flush_seconds;
+    atomic_ullong start_seconds;
+};
+
+extern struct metrics metrics;
+
+void metrics_record(enum metrics_operation operation, unsigned long long ns, int failed);
+void metrics_expose(FILE * file);
+int metrics_write_textfile(const char * path);
+
+#endif
@@ -0,0 +1,624 @@
+/*
+ * Overlays on top of a shared base file.
+ *
+ * The overlay is an ordinary hosts file holding the local entries. Its
+ * entries replace those of the base with the same domain and address family,
+ * and removing a domain that comes from the base leaves a tombstone comment
+ * in the overlay. Lookups resolve against the overlay first and fall back to
+ * the index of the base, so neither the base nor the combination is ever
+ * parsed as a whole.
+ *
+ * The combined hosts file is only written on demand: the overlay, followed
+ * by the base with its replaced and removed lines left out. The index knows
+ * where those lines are, so the base is copied in ranges between them by
+ * hosts_file_copy.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "overlay.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Entries of a domain looked up without allocating. */
+#define OVERLAY_FEW_MATCHES 16
+
+/* Identifies the base an index belongs to; the slots follow. */
+struct overlay_index_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t modified_seconds;
+    int64_t modified_nanoseconds;
+    uint64_t slot_count;
+    uint64_t entries;
+};
+
+/* A line of the base to be left out of the combination. */
+struct overlay_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct overlay_ranges {
+    struct overlay_range * ranges;
+    size_t count;
+    size_t capacity;
+};
+
+/* Called for every line of the base holding a domain. */
+typedef void (*overlay_visitor)(void * context, const struct hosts_file_token * token, const struct overlay_slot * slot);
+
+static inline uint32_t overlay_hash(const char * domain, size_t length)
+{
+    return (uint32_t)fingerprint_bytes(domain, length);
+}
+
+/**
+ * Tokenizes a line of the base. The tokenizer needs the line to end, which
+ * the last line of a file may not; that one is copied.
+ * @param base The base.
+ * @param offset Start of the line.
+ * @param length Length of the line, including its newline if any.
+ * @param token Receives the fields.
+ * @param copy Receives the copy to be freed, if one was made.
+ * @return Non-zero if the line holds an entry.
+ */
+static int overlay_tokenize(const struct overlay_base * base, uint64_t offset, uint64_t length, struct hosts_file_token * token, char ** copy)
+{
+    *copy = NULL;
+    if (base->data[offset + length - 1] == '\n') {
+        return hosts_file_tokenize(base->data + offset, token);
+    }
+
+    *copy = hf_strndup(base->data + offset, length);
+    return hosts_file_tokenize(*copy, token);
+}
+
+static enum ip_kind overlay_kind(const struct hosts_file_token * token)
+{
+    char address[INET6_ADDRSTRLEN + 8];
+
+    if (token->ip_length >= sizeof(address)) {
+        return IP_KIND_NONE;
+    }
+    memcpy(address, token->ip, token->ip_length);
+    address[token->ip_length] = '\0';
+
+    return ip_address_kind(address);
+}
+
+static void overlay_describe(struct overlay_index_header * header, const struct stat * st)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "HFBI", 4);
+    header->version = OVERLAY_INDEX_VERSION;
+    header->device = (uint64_t)st->st_dev;
+    header->inode = (uint64_t)st->st_ino;
+    header->size = (uint64_t)st->st_size;
+#ifdef __APPLE__
+    header->modified_seconds = (int64_t)st->st_mtimespec.tv_sec;
+    header->modified_nanoseconds = (int64_t)st->st_mtimespec.tv_nsec;
+#else
+    header->modified_seconds = (int64_t)st->st_mtim.tv_sec;
+    header->modified_nanoseconds = (int64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Maps the cached index of the base, if it describes the base as it is now.
+ * @param base The base.
+ * @param path Path of the index.
+ * @param expected Description of the base.
+ * @return Zero if the index was mapped.
+ */
+static int overlay_index_load(struct overlay_base * base, const char * path, const struct overlay_index_header * expected)
+{
+    const struct overlay_index_header * header;
+    struct stat st;
+    void * map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header) || (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    header = map;
+    if (memcmp(header, expected, offsetof(struct overlay_index_header, slot_count)) != 0 || header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 || sizeof(*header) + header->slot_count * sizeof(struct overlay_slot) != (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+
+    base->index_map = map;
+    base->index_size = (size_t)st.st_size;
+    base->slots = (const struct overlay_slot *)(header + 1);
+    base->slot_count = header->slot_count;
+    return 0;
+}
+
+/**
+ * Indexes the lines of the base and caches the index next to it. Failing to
+ * cache is fine, e.g. when the base lives on a read-only share.
+ * @param base The base.
+ * @param path Path of the index.
+ * @param header Description of the base.
+ */
+static void overlay_index_build(struct overlay_base * base, const char * path, struct overlay_index_header * header)
+{
+    char temporary[PATH_MAX + 16];
+    struct hosts_file_token token;
+    struct overlay_slot * slots;
+    struct writer w;
+    uint64_t lines = 1, offset, length, mask, i;
+    const char * end;
+    char * copy;
+    int fd;
+
+    stats_phase_begin("index");
+    for (offset = 0; offset < base->size && (end = memchr(base->data + offset, '\n', base->size - offset)); offset = end - base->data + 1) {
+        ++lines;
+    }
+    for (header->slot_count = 1024; header->slot_count < lines * 2; header->slot_count *= 2) {
+    }
+    slots = hf_calloc(header->slot_count, sizeof(struct overlay_slot));
+    mask = header->slot_count - 1;
+
+    for (offset = 0; offset < base->size; offset += length) {
+        end = memchr(base->data + offset, '\n', base->size - offset);
+        length = end ? (uint64_t)(end - base->data) + 1 - offset : base->size - offset;
+        copy = NULL;
+        if (length > UINT32_MAX || !overlay_tokenize(base, offset, length, &token, &copy)) {
+            free(copy);
+            continue;
+        }
+        ++stats.entries_parsed;
+        ++header->entries;
+        for (i = overlay_hash(token.domain, token.domain_length) & mask; slots[i].length; i = (i + 1) & mask) {
+        }
+        slots[i].offset = offset;
+        slots[i].hash = overlay_hash(token.domain, token.domain_length);
+        slots[i].length = (uint32_t)length;
+        free(copy);
+    }
+    stats.bytes_read += base->size;
+
+    base->built = slots;
+    base->slots = slots;
+    base->slot_count = header->slot_count;
+
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    if ((fd = mkstemp(temporary)) >= 0) {
+        writer_init(&w, fd, 0);
+        writer_bytes(&w, header, sizeof(*header));
+        writer_bytes(&w, slots, header->slot_count * sizeof(struct overlay_slot));
+        if (writer_close(&w) != 0 || fchmod(fd, 0644) != 0 || rename(temporary, path) != 0) {
+            unlink(temporary);
+        }
+        close(fd);
+    }
+    stats_phase_end();
+}
+
+/**
+ * Maps a base file and its index, building the index if it isn't cached.
+ * @param base Receives the base.
+ * @param path Path of the base file.
+ */
+void overlay_base_open(struct overlay_base * base, const char * path)
+{
+    char index_path[PATH_MAX];
+    struct overlay_index_header header;
+    struct stat st;
+    void * map = NULL;
+
+    memset(base, 0, sizeof(*base));
+    if ((base->fd = open(path, O_RDONLY)) < 0 || fstat(base->fd, &st) != 0) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+    if (st.st_size && (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, base->fd, 0)) == MAP_FAILED) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    base->data = map;
+    base->size = (size_t)st.st_size;
+
+    overlay_describe(&header, &st);
+    if (snprintf(index_path, sizeof(index_path), "%s" OVERLAY_INDEX_SUFFIX, path) >= (int)sizeof(index_path)) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if (overlay_index_load(base, index_path, &header) != 0) {
+        overlay_index_build(base, index_path, &header);
+    }
+}
+
+void overlay_base_close(struct overlay_base * base)
+{
+    if (base->data) {
+        munmap((void *)base->data, base->size);
+    }
+    if (base->index_map) {
+        munmap(base->index_map, base->index_size);
+    }
+    free(base->built);
+    close(base->fd);
+    memset(base, 0, sizeof(*base));
+}
+
+/**
+ * Visits the lines of the base holding a domain, in no particular order.
+ * @param base The base.
+ * @param domain The domain.
+ * @param visitor Called for every line.
+ * @param context Passed to the visitor.
+ * @return The amount of lines.
+ */
+static unsigned int overlay_base_find(const struct overlay_base * base, const char * domain, overlay_visitor visitor, void * context)
+{
+    size_t length = strlen(domain);
+    uint32_t hash = overlay_hash(domain, length);
+    uint64_t mask = base->slot_count - 1, i;
+    struct hosts_file_token token;
+    unsigned int found = 0;
+    char * copy;
+
+    for (i = hash & mask; base->slots[i].length; i = (i + 1) & mask) {
+        ++stats.index_probes;
+        if (base->slots[i].hash != hash) {
+            continue;
+        }
+        if (overlay_tokenize(base, base->slots[i].offset, base->slots[i].length, &token, &copy) && token.domain_length == length
+            && memcmp(token.domain, domain, length) == 0) {
+            ++found;
+            if (visitor) {
+                visitor(context, &token, &base->slots[i]);
+            }
+        }
+        free(copy);
+    }
+    ++stats.index_lookups;
+
+    return found;
+}
+
+/* Domain of a tombstone, or NULL if the entry isn't one. */
+static const char * overlay_tombstone(const struct hosts_file_entry * entry, size_t * length)
+{
+    const char * domain;
+
+    if (entry->type != UNION_COMMENT || strncmp(entry->value.comment, OVERLAY_TOMBSTONE, strlen(OVERLAY_TOMBSTONE)) != 0) {
+        return NULL;
+    }
+    domain = entry->value.comment + strlen(OVERLAY_TOMBSTONE);
+    *length = strcspn(domain, " \t\r\n");
+
+    return domain;
+}
+
+/**
+ * Finds the tombstone of a domain. Overlays are small, so they are searched
+ * linearly.
+ * @param overlay The overlay.
+ * @param domain The domain.
+ * @return Position of the tombstone, or the size of the overlay if there is none.
+ */
+static unsigned int overlay_find_tombstone(const struct hosts_file * overlay, const char * domain)
+{
+    const char * found;
+    size_t length, domain_length = strlen(domain);
+    unsigned int i;
+
+    for (i = 0; i < overlay->index; ++i) {
+        if ((found = overlay_tombstone(&overlay->entries[i], &length)) && length == domain_length && memcmp(found, domain, length) == 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/**
+ * Adds an entry to the overlay, lifting a tombstone of its domain.
+ * @param overlay The overlay.
+ * @param ip The address, taken over by the overlay.
+ * @param domain The domain, taken over by the overlay.
+ */
+void overlay_add(struct hosts_file * overlay, char * ip, char * domain)
+{
+    unsigned int tombstone = overlay_find_tombstone(overlay, domain);
+
+    if (tombstone < overlay->index) {
+        free(overlay->entries[tombstone].value.comment);
+        overlay->entries[tombstone].type = UNION_EMPTY;
+    }
+    hosts_file_add(overlay, ip, domain);
+}
+
+/**
+ * Removes a domain: its entries in the overlay, and those in the base by a
+ * tombstone.
+ * @param overlay The overlay.
+ * @param base The base.
+ * @param domain The domain.
+ * @return ERROR_CODE_SUCCESS, or ERROR_CODE_ENTRY_DOES_NOT_EXIST if neither
+ * has the domain.
+ */
+enum error_code overlay_remove(struct hosts_file * overlay, const struct overlay_base * base, const char * domain)
+{
+    unsigned int removed = hosts_file_discard(overlay, domain, IP_KIND_NONE);
+    size_t length = strlen(domain);
+    char * tombstone;
+
+    if (overlay_find_tombstone(overlay, domain) == overlay->index && overlay_base_find(base, domain, NULL, NULL)) {
+        tombstone = hf_malloc(strlen(OVERLAY_TOMBSTONE) + length + 2);
+        memcpy(tombstone, OVERLAY_TOMBSTONE, strlen(OVERLAY_TOMBSTONE));
+        memcpy(tombstone + strlen(OVERLAY_TOMBSTONE), domain, length);
+        strcpy(tombstone + strlen(OVERLAY_TOMBSTONE) + length, "\n");
+        hosts_file_comment(overlay, tombstone);
+    } else if (!removed) {
+        return ERROR_CODE_ENTRY_DOES_NOT_EXIST;
+    }
+
+    return ERROR_CODE_SUCCESS;
+}
+
+/* What the overlay has for a domain: the address families it replaces. */
+static unsigned int overlay_shadows(struct hosts_file * overlay, const char * domain)
+{
+    unsigned int few[OVERLAY_FEW_MATCHES], *matches = few, found, shadowed = 0;
+
+    if (overlay_find_tombstone(overlay, domain) < overlay->index) {
+        return 1u << IP_KIND_IPv4 | 1u << IP_KIND_IPv6;
+    }
+
+    /* An overlay file may repeat a domain any number of times. */
+    if ((found = hosts_file_find(overlay, domain, few, OVERLAY_FEW_MATCHES)) > OVERLAY_FEW_MATCHES) {
+        matches = hf_malloc(sizeof(unsigned int) * found);
+        hosts_file_find(overlay, domain, matches, found);
+    }
+    for (unsigned int i = 0; i < found; ++i) {
+        shadowed |= 1u << overlay->entries[matches[i]].value.map.kind;
+    }
+    if (matches != few) {
+        free(matches);
+    }
+
+    return shadowed;
+}
+
+/* Collects the lines of the base that the overlay replaces. */
+struct overlay_shadowing {
+    struct overlay_ranges * ranges;
+    unsigned int kinds;
+};
+
+static void overlay_push(struct overlay_ranges * r, const struct overlay_slot * slot)
+{
+    if (r->count == r->capacity) {
+        r->capacity = r->capacity ? r->capacity * 2 : 64;
+        r->ranges = hf_realloc(r->ranges, r->capacity * sizeof(struct overlay_range));
+    }
+    r->ranges[r->count].offset = slot->offset;
+    r->ranges[r->count].length = slot->length;
+    ++r->count;
+}
+
+static void overlay_collect(void * context, const struct hosts_file_token * token, const struct overlay_slot * slot)
+{
+    struct overlay_shadowing * s = context;
+
+    if (s->kinds & 1u << overlay_kind(token)) {
+        overlay_push(s->ranges, slot);
+    }
+}
+
+static int overlay_compare(const void * a, const void * b)
+{
+    const struct overlay_range *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int overlay_compare_positions(const void * a, const void * b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes the combination of the overlay and its base: the overlay without its
+ * tombstones, then the base without the lines the overlay replaces or removes.
+ * @param overlay The overlay.
+ * @param base The base.
+ * @param out Target file descriptor.
+ */
+void overlay_write(struct hosts_file * overlay, const struct overlay_base * base, int out)
+{
+    struct overlay_ranges ranges = { 0 };
+    struct overlay_shadowing shadowing = { &ranges, 0 };
+    struct hosts_file_entry * entry;
+    const char * domain;
+    uint64_t offset = 0;
+    struct writer w;
+    size_t length;
+    char * name;
+
+    stats_phase_begin("overlay");
+    writer_init(&w, out, 0);
+    for (unsigned int i = 0; i < overlay->index; ++i) {
+        entry = &overlay->entries[i];
+        if (entry->type == UNION_ELEMENT) {
+            writer_string(&w, entry->value.map.ip);
+            writer_char(&w, '\t');
+            writer_string(&w, entry->value.map.domain);
+            writer_char(&w, '\n');
+        } else if (entry->type == UNION_COMMENT && !overlay_tombstone(entry, &length)) {
+            /* The base follows, so every line ends. */
+            writer_string(&w, entry->value.comment);
+            if (entry->value.comment[strcspn(entry->value.comment, "\n")] != '\n') {
+                writer_char(&w, '\n');
+            }
+        }
+    }
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+
+    /* Entries replace their address family, tombstones the whole domain. */
+    for (unsigned int i = 0; i < overlay->index; ++i) {
+        entry = &overlay->entries[i];
+        if (entry->type == UNION_ELEMENT) {
+            shadowing.kinds = 1u << entry->value.map.kind;
+            overlay_base_find(base, entry->value.map.domain, overlay_collect, &shadowing);
+        } else if ((domain = overlay_tombstone(entry, &length))) {
+            name = hf_strndup(domain, length);
+            shadowing.kinds = 1u << IP_KIND_IPv4 | 1u << IP_KIND_IPv6;
+            overlay_base_find(base, name, overlay_collect, &shadowing);
+            free(name);
+        }
+    }
+
+    qsort(ranges.ranges, ranges.count, sizeof(struct overlay_range), overlay_compare);
+    for (size_t i = 0; i < ranges.count; ++i) {
+        if (ranges.ranges[i].offset >= offset) {
+            if (hosts_file_copy(out, base->fd, (off_t)offset, ranges.ranges[i].offset - offset) != 0) {
+                handle_error(ERROR_CODE_WRITE_FAILED);
+            }
+            offset = ranges.ranges[i].offset + ranges.ranges[i].length;
+        }
+    }
+    if (hosts_file_copy(out, base->fd, (off_t)offset, base->size - offset) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats_phase_end();
+
+    free(ranges.ranges);
+}
+
+/**
+ * Writes the combination of the overlay and its base to a file, which is
+ * replaced atomically.
+ * @param overlay The overlay.
+ * @param base The base.
+ * @param path The file.
+ */
+void overlay_materialize(struct hosts_file * overlay, const struct overlay_base * base, const char * path)
+{
+    char temporary[PATH_MAX + 16];
+    int fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    if ((fd = mkstemp(temporary)) < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+    }
+
+    overlay_write(overlay, base, fd);
+    if (fsync(fd) != 0 || fchmod(fd, 0644) != 0 || rename(temporary, path) != 0) {
+        unlink(temporary);
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    close(fd);
+}
+
+/* Collects the lines of the base answering a lookup, unless the overlay replaces them. */
+static void overlay_answer(void * context, const struct hosts_file_token * token, const struct overlay_slot * slot)
+{
+    struct overlay_shadowing * s = context;
+
+    if (!(s->kinds & 1u << overlay_kind(token))) {
+        overlay_push(s->ranges, slot);
+    }
+}
+
+/**
+ * Resolves names, one per line, against the overlay and its base, and
+ * writes the answers like lookup_batch.
+ * @param overlay The overlay.
+ * @param base The base.
+ * @param names Input stream.
+ * @param out Target file descriptor.
+ * @return The amount of names that were not found.
+ */
+unsigned int overlay_lookup(struct hosts_file * overlay, const struct overlay_base * base, FILE * names, int out)
+{
+    struct overlay_ranges ranges = { 0 };
+    struct overlay_shadowing shadowing = { &ranges, 0 };
+    unsigned int capacity = 16, found, missing = 0;
+    unsigned int * matches = hf_malloc(sizeof(unsigned int) * capacity);
+    size_t line_capacity = 0, length;
+    struct hosts_file_token token;
+    char *line = NULL, *name, *copy;
+    struct writer w;
+    int answered;
+
+    stats_phase_begin("lookup");
+    hosts_file_index(overlay);
+    writer_init(&w, out, 0);
+    while (getline(&line, &line_capacity, names) != -1) {
+        name = line + strspn(line, " \t");
+        if (!(length = strcspn(name, " \t\r\n"))) {
+            continue;
+        }
+        name[length] = '\0';
+        writer_bytes(&w, name, length);
+        writer_char(&w, '\t');
+        answered = 0;
+
+        /* The overlay answers first, in its own order. */
+        while ((found = hosts_file_find(overlay, name, matches, capacity)) > capacity) {
+            capacity = found;
+            matches = hf_realloc(matches, sizeof(unsigned int) * capacity);
+        }
+        qsort(matches, found, sizeof(unsigned int), overlay_compare_positions);
+        for (unsigned int i = 0; i < found; ++i) {
+            writer_string(&w, answered++ ? " " : "");
+            writer_string(&w, overlay->entries[matches[i]].value.map.ip);
+        }
+
+        /* The base fills in what the overlay doesn't replace, in file order. */
+        ranges.count = 0;
+        shadowing.kinds = overlay_shadows(overlay, name);
+        overlay_base_find(base, name, overlay_answer, &shadowing);
+        qsort(ranges.ranges, ranges.count, sizeof(struct overlay_range), overlay_compare);
+        for (size_t i = 0; i < ranges.count; ++i) {
+            if (overlay_tokenize(base, ranges.ranges[i].offset, ranges.ranges[i].length, &token, &copy)) {
+                writer_string(&w, answered++ ? " " : "");
+                writer_bytes(&w, token.ip, token.ip_length);
+            }
+            free(copy);
+        }
+
+        if (!answered) {
+            writer_string(&w, "NOTFOUND");
+            ++missing;
+        }
+        writer_char(&w, '\n');
+    }
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats_phase_end();
+
+    free(line);
+    free(matches);
+    free(ranges.ranges);
+    return missing;
+}
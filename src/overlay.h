@@ -0,0 +1,55 @@
+/*
+ * Overlays: a small hosts file of local changes on top of a large base file
+ * which is shared, never modified and never loaded into memory.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include "hostsfile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Appended to the path of a base file to name its cached index. */
+#define OVERLAY_INDEX_SUFFIX ".hf-index"
+#define OVERLAY_INDEX_VERSION 1
+
+/* Comment by which an overlay removes a domain of its base. */
+#define OVERLAY_TOMBSTONE "# hf:unset "
+
+/* A line of the base holding an entry; free when its length is zero. */
+struct overlay_slot {
+    uint64_t offset;
+    uint32_t hash;
+    uint32_t length;
+};
+
+/*
+ * The base file and an open addressing index over the domains of its lines,
+ * both mapped. The index is cached next to the base; when that isn't
+ * possible it is built in memory instead.
+ */
+struct overlay_base {
+    int fd;
+    const char * data;
+    size_t size;
+    const struct overlay_slot * slots;
+    uint64_t slot_count;
+    void * index_map;
+    size_t index_size;
+    struct overlay_slot * built;
+};
+
+void overlay_base_open(struct overlay_base * base, const char * path);
+void overlay_base_close(struct overlay_base * base);
+void overlay_add(struct hosts_file * overlay, char * ip, char * domain);
+enum error_code overlay_remove(struct hosts_file * overlay, const struct overlay_base * base, const char * domain);
+unsigned int overlay_lookup(struct hosts_file * overlay, const struct overlay_base * base, FILE * names, int out);
+void overlay_write(struct hosts_file * overlay, const struct overlay_base * base, int out);
+void overlay_materialize(struct hosts_file * overlay, const struct overlay_base * base, const char * path);
+
+#endif
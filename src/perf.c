@@ -0,0 +1,166 @@
+/*
+ * Hardware performance counters around program phases, for --perf-counters.
+ *
+ * All counters share a single perf_event_open group, so they are scheduled
+ * onto the PMU together and one read() returns a consistent snapshot. When
+ * the kernel multiplexes the group, values are scaled by the fraction of
+ * time it was actually running.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "perf.h"
+#include "hostsfile.h"
+
+#include <string.h>
+
+const char * perf_counter_names[PERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "branch_misses",
+    "l1d_misses",
+    "llc_misses",
+};
+
+int perf_enabled = 0;
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int perf_fds[PERF_COUNTERS] = { -1, -1, -1, -1, -1 };
+static unsigned long long perf_ids[PERF_COUNTERS];
+
+/**
+ * Opens a single counter as part of the group.
+ * @param type PERF_TYPE_* of the event.
+ * @param config Event specific configuration.
+ * @param leader File descriptor of the group leader, or -1 for the leader.
+ * @return The file descriptor, or -1 when the event is not available.
+ */
+static int perf_open_event(unsigned int type, unsigned long long config, int leader)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+/**
+ * Opens the counter group and starts counting.
+ * @return Non-zero on success. On failure a warning is printed once and
+ * perf_read keeps returning PERF_UNAVAILABLE.
+ */
+int perf_open(void)
+{
+    // clang-format off
+    static const struct {
+        unsigned int type;
+        unsigned long long config;
+    } events[PERF_COUNTERS] = {
+        [PERF_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        [PERF_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        [PERF_L1D_MISSES]    = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                                                     | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                                     | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        [PERF_LLC_MISSES]    = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+    // clang-format on
+
+    perf_fds[PERF_CYCLES] = perf_open_event(events[PERF_CYCLES].type, events[PERF_CYCLES].config, -1);
+    if (perf_fds[PERF_CYCLES] < 0) {
+        fprintf(stderr, PROGRAM_NAME ": Hardware counters are unavailable (%s), continuing without them.\n", strerror(errno));
+        return 0;
+    }
+
+    /* Members that fail to open are left out; the rest is still useful. */
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        if (i != PERF_CYCLES) {
+            perf_fds[i] = perf_open_event(events[i].type, events[i].config, perf_fds[PERF_CYCLES]);
+        }
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_ID, &perf_ids[i]);
+        }
+    }
+
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perf_enabled = 1;
+
+    return 1;
+}
+
+/**
+ * Takes a snapshot of all counters since perf_open.
+ * @param values Output, PERF_UNAVAILABLE for counters that aren't available.
+ */
+void perf_read(unsigned long long values[PERF_COUNTERS])
+{
+    unsigned long long buffer[3 + 2 * PERF_COUNTERS];
+    double scale;
+
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        values[i] = PERF_UNAVAILABLE;
+    }
+
+    if (!perf_enabled || read(perf_fds[PERF_CYCLES], buffer, sizeof(buffer)) <= 0) {
+        return;
+    }
+
+    /* Layout: nr, time_enabled, time_running, then nr pairs of value and id. */
+    scale = buffer[2] ? (double)buffer[1] / buffer[2] : 1;
+    for (unsigned long long n = 0; n < buffer[0] && n < PERF_COUNTERS; ++n) {
+        for (int i = 0; i < PERF_COUNTERS; ++i) {
+            if (perf_fds[i] >= 0 && perf_ids[i] == buffer[4 + 2 * n]) {
+                values[i] = (unsigned long long)(buffer[3 + 2 * n] * scale);
+            }
+        }
+    }
+}
+
+void perf_close(void)
+{
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        if (perf_fds[i] >= 0) {
+            close(perf_fds[i]);
+            perf_fds[i] = -1;
+        }
+    }
+
+    perf_enabled = 0;
+}
+
+#else
+
+int perf_open(void)
+{
+    fprintf(stderr, PROGRAM_NAME ": Hardware counters are only supported on Linux, continuing without them.\n");
+    return 0;
+}
+
+void perf_read(unsigned long long values[PERF_COUNTERS])
+{
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        values[i] = PERF_UNAVAILABLE;
+    }
+}
+
+void perf_close(void)
+{
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Hardware performance counters around program phases, for --perf-counters.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+/* The counters that are requested, in reporting order. */
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_COUNTERS,
+};
+
+/* Reported in place of a counter the machine doesn't provide. */
+#define PERF_UNAVAILABLE (~0ULL)
+
+extern const char * perf_counter_names[PERF_COUNTERS];
+
+/* Non-zero once perf_open managed to open at least the cycle counter. */
+extern int perf_enabled;
+
+int perf_open(void);
+void perf_read(unsigned long long values[PERF_COUNTERS]);
+void perf_close(void);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * Reader of the files written by `hf compile`: a minimal perfect hash over
+ * the domains of a hosts file, with their addresses in binary. This header
+ * is self-contained, so that other programs can copy it and look domains up
+ * in an mmap'ed file without building anything at load.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef PHF_H
+#define PHF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Layout, all integers little-endian and every section aligned to 8 bytes:
+ *
+ *     header   magic "HFPHF\0\0\0", u32 version, u32 header size, u64 seed,
+ *              u32 key count, u32 table size, u32 bucket count, u32 zero,
+ *              then u64 offset and u64 size of each section below
+ *     pilots   u16 per bucket
+ *     remap    u32 per table position past the key count
+ *     slots    per key: u64 hash, u32 domain offset, u32 value offset
+ *     values   per key: u8 count, then per address u8 family (4 or 6)
+ *              followed by 4 or 16 bytes
+ *     strings  the domains, NUL terminated
+ *
+ * Domains are normalized: lowercase, without trailing dot. A domain hashes
+ * to a bucket, and the pilot of its bucket to a position in a table slightly
+ * larger than the amount of keys; positions past the keys are remapped to
+ * the free ones before them. A lookup reads the pilot, maybe the remap, and
+ * the slot, whose hash and domain confirm that the domain is there at all.
+ */
+#define PHF_MAGIC "HFPHF\0\0\0"
+#define PHF_VERSION 1
+#define PHF_HEADER_SIZE 120
+#define PHF_SLOT_SIZE 16
+#define PHF_SECTIONS 5
+
+/* Sections, in file order. */
+enum phf_section {
+    PHF_PILOTS,
+    PHF_REMAP,
+    PHF_SLOTS,
+    PHF_VALUES,
+    PHF_STRINGS,
+};
+
+/* An opened file. */
+struct phf {
+    const unsigned char * data;
+    uint64_t seed;
+    uint32_t key_count;
+    uint32_t table_size;
+    uint32_t bucket_count;
+    const unsigned char * sections[PHF_SECTIONS];
+    uint64_t sizes[PHF_SECTIONS];
+};
+
+/* An address of a domain. */
+struct phf_address {
+    int family;
+    unsigned char bytes[16];
+};
+
+static inline uint32_t phf_u32(const unsigned char * p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t phf_u64(const unsigned char * p)
+{
+    return (uint64_t)phf_u32(p) | (uint64_t)phf_u32(p + 4) << 32;
+}
+
+static inline uint64_t phf_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static inline unsigned char phf_lower(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? (unsigned char)(c + 'a' - 'A') : c;
+}
+
+/* Length of a domain once normalized. */
+static inline size_t phf_length(const char * domain, size_t length)
+{
+    return length > 1 && domain[length - 1] == '.' ? length - 1 : length;
+}
+
+/* Hashes a domain of normalized length as if it were lowercase. */
+static inline uint64_t phf_hash(const char * domain, size_t length, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ seed;
+
+    for (size_t i = 0; i < length; ++i) {
+        h = (h ^ phf_lower((unsigned char)domain[i])) * 0x100000001b3ull;
+    }
+
+    return phf_mix(h);
+}
+
+static inline uint32_t phf_bucket(uint64_t hash, uint32_t bucket_count)
+{
+    return (uint32_t)(((hash >> 32) * bucket_count) >> 32);
+}
+
+static inline uint32_t phf_position(uint64_t hash, uint16_t pilot, uint64_t seed, uint32_t table_size)
+{
+    return (uint32_t)((phf_mix(hash) ^ phf_mix(seed + pilot + 1)) % table_size);
+}
+
+/**
+ * Opens a file that is in memory, typically mmap'ed.
+ * @param f Receives the file.
+ * @param data Its contents, which must stay around.
+ * @param size Its size.
+ * @return Zero, or -1 if it isn't a valid file of this version.
+ */
+static inline int phf_open(struct phf * f, const void * data, size_t size)
+{
+    const unsigned char * bytes = (const unsigned char *)data;
+    uint64_t offset, length, needed[PHF_SECTIONS];
+
+    if (size < PHF_HEADER_SIZE || memcmp(bytes, PHF_MAGIC, 8) != 0 || phf_u32(bytes + 8) != PHF_VERSION || phf_u32(bytes + 12) != PHF_HEADER_SIZE) {
+        return -1;
+    }
+    f->data = bytes;
+    f->seed = phf_u64(bytes + 16);
+    f->key_count = phf_u32(bytes + 24);
+    f->table_size = phf_u32(bytes + 28);
+    f->bucket_count = phf_u32(bytes + 32);
+    if (f->table_size < f->key_count || (f->key_count && !f->bucket_count)) {
+        return -1;
+    }
+
+    needed[PHF_PILOTS] = (uint64_t)f->bucket_count * 2;
+    needed[PHF_REMAP] = (uint64_t)(f->table_size - f->key_count) * 4;
+    needed[PHF_SLOTS] = (uint64_t)f->key_count * PHF_SLOT_SIZE;
+    needed[PHF_VALUES] = 0;
+    needed[PHF_STRINGS] = 0;
+    for (int i = 0; i < PHF_SECTIONS; ++i) {
+        offset = phf_u64(bytes + 40 + 16 * i);
+        length = phf_u64(bytes + 48 + 16 * i);
+        if (offset > size || length > size - offset || length < needed[i]) {
+            return -1;
+        }
+        f->sections[i] = bytes + offset;
+        f->sizes[i] = length;
+    }
+
+    return 0;
+}
+
+/**
+ * Looks up a domain.
+ * @param f The file.
+ * @param domain The domain, in any case, with or without trailing dot.
+ * @param length Length of the domain.
+ * @param addresses Receives its addresses; may be NULL.
+ * @param max Capacity of addresses.
+ * @return The amount of addresses of the domain, which may exceed max, or
+ * zero if it isn't in the file.
+ */
+static inline unsigned int phf_lookup(const struct phf * f, const char * domain, size_t length, struct phf_address * addresses, unsigned int max)
+{
+    const unsigned char *slot, *key, *value, *end;
+    uint64_t hash, domain_offset, value_offset;
+    const unsigned char * pilot;
+    uint32_t position;
+    unsigned int count, i;
+    size_t normalized = phf_length(domain, length);
+
+    if (!f->key_count) {
+        return 0;
+    }
+
+    hash = phf_hash(domain, normalized, f->seed);
+    pilot = f->sections[PHF_PILOTS] + 2 * (uint64_t)phf_bucket(hash, f->bucket_count);
+    position = phf_position(hash, (uint16_t)(pilot[0] | pilot[1] << 8), f->seed, f->table_size);
+    if (position >= f->key_count) {
+        position = phf_u32(f->sections[PHF_REMAP] + 4 * (uint64_t)(position - f->key_count));
+        if (position >= f->key_count) {
+            return 0;
+        }
+    }
+
+    slot = f->sections[PHF_SLOTS] + (uint64_t)position * PHF_SLOT_SIZE;
+    domain_offset = phf_u32(slot + 8);
+    value_offset = phf_u32(slot + 12);
+    if (phf_u64(slot) != hash || domain_offset + normalized >= f->sizes[PHF_STRINGS] || value_offset >= f->sizes[PHF_VALUES]) {
+        return 0;
+    }
+    key = f->sections[PHF_STRINGS] + domain_offset;
+    for (i = 0; i < normalized; ++i) {
+        if (key[i] != phf_lower((unsigned char)domain[i])) {
+            return 0;
+        }
+    }
+    if (key[normalized] != '\0') {
+        return 0;
+    }
+
+    value = f->sections[PHF_VALUES] + value_offset;
+    end = f->sections[PHF_VALUES] + f->sizes[PHF_VALUES];
+    count = *value++;
+    for (i = 0; i < count && i < max && addresses; ++i) {
+        if (value >= end || (*value != 4 && *value != 6) || (size_t)(end - value) < (*value == 4 ? 5u : 17u)) {
+            return 0;
+        }
+        addresses[i].family = *value;
+        memcpy(addresses[i].bytes, value + 1, *value == 4 ? 4 : 16);
+        value += *value == 4 ? 5 : 17;
+    }
+
+    return count;
+}
+
+#endif
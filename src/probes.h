@@ -0,0 +1,48 @@
+/*
+ * USDT tracepoints under the "hf" provider, see scripts/bpftrace.
+ *
+ * When sys/sdt.h is available every probe compiles to a single nop plus an
+ * ELF note describing its arguments, so they cost nothing until a tracer
+ * attaches. Without it they compile to nothing at all; their arguments are
+ * only referenced, so variables kept for probes don't trigger warnings.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(hf, name)
+#define PROBE1(name, a) DTRACE_PROBE1(hf, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(hf, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(hf, name, a, b, c)
+
+#else
+
+#define PROBE(name) \
+    do {            \
+    } while (0)
+#define PROBE1(name, a) \
+    do {                \
+        (void)(a);      \
+    } while (0)
+#define PROBE2(name, a, b) \
+    do {                   \
+        (void)(a);         \
+        (void)(b);         \
+    } while (0)
+#define PROBE3(name, a, b, c) \
+    do {                      \
+        (void)(a);            \
+        (void)(b);            \
+        (void)(c);            \
+    } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,464 @@
+/*
+ * Shared index.
+ *
+ * The daemon keeps its index in a POSIX shared memory segment, refreshed
+ * whenever the entries change, so that one copy serves every process on the
+ * machine. Readers map the segment read-only and never take a lock: the
+ * sequence numbers of the two copies of the index tell them whether what
+ * they read is consistent (see shared.h). Everything read from the segment
+ * is checked against its size first, so a reader racing the publisher gets
+ * a retry rather than a fault.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "shared.h"
+#include "hostsfile.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARED_INITIAL_SLOTS 64
+#define SHARED_FREE UINT32_MAX
+
+static unsigned int shared_hash(const char * domain, size_t length)
+{
+    unsigned int hash = 2166136261u;
+
+    while (length--) {
+        hash = (hash ^ (unsigned char)*domain++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Opens a segment by name; a leading slash is added when missing.
+ * @param name Name of the segment.
+ * @param flags Flags for shm_open.
+ * @return The file descriptor, or -1 with errno set.
+ */
+static int shared_open(const char * name, int flags)
+{
+    char path[NAME_MAX + 1];
+
+    if (snprintf(path, sizeof(path), "%s%s", *name == '/' ? "" : "/", name) >= (int)sizeof(path) || strchr(path + 1, '/')) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+
+    return shm_open(path, flags, 0644);
+}
+
+static size_t shared_round(size_t size)
+{
+    return (size + SHARED_HEADER_SIZE - 1) / SHARED_HEADER_SIZE * SHARED_HEADER_SIZE;
+}
+
+/**
+ * (Re)maps the whole of the segment being published.
+ * @param segment The segment.
+ * @param size Its size.
+ */
+static void shared_publish_map(struct shared_segment * segment, size_t size)
+{
+    if (segment->map) {
+        munmap(segment->map, segment->size);
+    }
+    if ((segment->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0)) == MAP_FAILED) {
+        handle_error(ERROR_CODE_MEM_ALLOCATION);
+    }
+    segment->size = size;
+}
+
+/**
+ * Opens a segment for publishing, creating it if needed. An existing segment
+ * is taken over, so that readers attached to it keep receiving updates when
+ * the daemon restarts.
+ * @param segment Receives the segment.
+ * @param name Name of the segment, e.g. /hf-index.
+ */
+void shared_publish_open(struct shared_segment * segment, const char * name)
+{
+    struct shared_header * header;
+    struct stat st;
+
+    segment->map = NULL;
+    if ((segment->fd = shared_open(name, O_RDWR | O_CREAT)) < 0 || fstat(segment->fd, &st) != 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    if ((size_t)st.st_size >= SHARED_HEADER_SIZE) {
+        shared_publish_map(segment, (size_t)st.st_size);
+        header = (struct shared_header *)segment->map;
+        if (memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic)) == 0 && header->version == SHARED_VERSION && atomic_load(&header->size) == (size_t)st.st_size) {
+            /* A publish that was cut short left its copy odd; start even. */
+            for (unsigned int h = 0; h < 2; ++h) {
+                header->halves[h].sequence += header->halves[h].sequence & 1;
+            }
+            return;
+        }
+    }
+
+    /* A new segment, or one of another version, starts out empty. */
+    if (ftruncate(segment->fd, SHARED_HEADER_SIZE) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    shared_publish_map(segment, SHARED_HEADER_SIZE);
+    header = (struct shared_header *)segment->map;
+    memset(header, 0, sizeof(*header));
+    header->version = SHARED_VERSION;
+    header->header_size = sizeof(*header);
+    atomic_store(&header->size, SHARED_HEADER_SIZE);
+    memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+}
+
+/**
+ * Writes the index of a hosts file to the inactive copy, then makes that
+ * copy active.
+ * @param segment The segment.
+ * @param f The hosts file; only read.
+ */
+void shared_publish(struct shared_segment * segment, struct hosts_file * f)
+{
+    struct shared_header * header = (struct shared_header *)segment->map;
+    struct shared_half *half, *other;
+    struct shared_table * table;
+    struct shared_slot * slots;
+    struct shared_entry * entries;
+    struct map * map;
+    unsigned char * strings;
+    uint64_t entry_count = 0, slot_count = SHARED_INITIAL_SLOTS, strings_size = 0, offset, generation, sequence;
+    unsigned int mask, i, h;
+    size_t needed, capacity, size, domain_length, ip_length;
+
+    stats_phase_begin("publish");
+    for (unsigned int j = 0; j < f->index; ++j) {
+        if (f->entries[j].type == UNION_ELEMENT) {
+            map = &f->entries[j].value.map;
+            ++entry_count;
+            strings_size += strlen(map->domain) + strlen(map->ip) + 2;
+        }
+    }
+    while (slot_count < entry_count * 2) {
+        slot_count *= 2;
+    }
+    needed = sizeof(struct shared_table) + slot_count * sizeof(struct shared_slot) + entry_count * sizeof(struct shared_entry) + strings_size;
+
+    h = !atomic_load(&header->active);
+    half = &header->halves[h];
+    generation = atomic_load(&header->generation) + 1;
+    /* Odd while writing, whatever an earlier, interrupted publish left. */
+    sequence = atomic_load_explicit(&half->sequence, memory_order_relaxed) | 1;
+    atomic_store_explicit(&half->sequence, sequence, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    /*
+     * An outgrown copy moves in front of the other one if there is room,
+     * behind it otherwise, where the segment grows if needed.
+     */
+    if (needed > half->capacity) {
+        other = &header->halves[!h];
+        capacity = shared_round(needed + needed / 2);
+        if (other->capacity && other->offset - SHARED_HEADER_SIZE >= capacity) {
+            offset = SHARED_HEADER_SIZE;
+            capacity = other->offset - SHARED_HEADER_SIZE;
+        } else {
+            offset = other->capacity ? other->offset + other->capacity : SHARED_HEADER_SIZE;
+            size = MAX(segment->size, offset + capacity);
+            if (size > segment->size) {
+                if (ftruncate(segment->fd, (off_t)size) != 0) {
+                    handle_error(ERROR_CODE_WRITE_FAILED);
+                }
+                shared_publish_map(segment, size);
+                header = (struct shared_header *)segment->map;
+                half = &header->halves[h];
+                atomic_store(&header->size, size);
+            }
+            capacity = segment->size - offset;
+        }
+        half->offset = offset;
+        half->capacity = capacity;
+    }
+
+    table = (struct shared_table *)(segment->map + half->offset);
+    slots = (struct shared_slot *)(table + 1);
+    entries = (struct shared_entry *)(slots + slot_count);
+    strings = (unsigned char *)(entries + entry_count);
+    table->entry_count = entry_count;
+    table->slot_count = slot_count;
+    table->strings_size = strings_size;
+    table->generation = generation;
+    memset(slots, 0xff, slot_count * sizeof(struct shared_slot));
+
+    mask = (unsigned int)(slot_count - 1);
+    offset = 0;
+    entry_count = 0;
+    for (unsigned int j = 0; j < f->index; ++j) {
+        if (f->entries[j].type != UNION_ELEMENT) {
+            continue;
+        }
+        map = &f->entries[j].value.map;
+        domain_length = strlen(map->domain);
+        ip_length = strlen(map->ip);
+        memcpy(strings + offset, map->domain, domain_length + 1);
+        memcpy(strings + offset + domain_length + 1, map->ip, ip_length + 1);
+        entries[entry_count].offset = offset;
+        entries[entry_count].domain_length = (uint32_t)domain_length;
+        entries[entry_count].ip_length = (uint16_t)ip_length;
+        entries[entry_count].kind = (uint8_t)map->kind;
+        entries[entry_count].reserved = 0;
+        offset += domain_length + ip_length + 2;
+
+        i = shared_hash(map->domain, domain_length) & mask;
+        while (slots[i].entry != SHARED_FREE) {
+            i = (i + 1) & mask;
+        }
+        slots[i].entry = (uint32_t)entry_count;
+        slots[i].hash = shared_hash(map->domain, domain_length);
+        ++entry_count;
+    }
+
+    half->generation = generation;
+    atomic_store_explicit(&half->sequence, sequence + 1, memory_order_release);
+    atomic_store_explicit(&header->active, h, memory_order_release);
+    atomic_store_explicit(&header->generation, generation, memory_order_release);
+    stats_phase_end();
+}
+
+/**
+ * Stops publishing. The segment stays, so attached readers keep answering
+ * from the last index and a restarted daemon picks it up again.
+ * @param segment The segment.
+ */
+void shared_publish_close(struct shared_segment * segment)
+{
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    segment->map = NULL;
+}
+
+/**
+ * Maps as much of a segment as there is now.
+ * @param view The attachment.
+ */
+static void shared_remap(struct shared_view * view)
+{
+    struct stat st;
+
+    if (fstat(view->fd, &st) != 0) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    if (view->map) {
+        munmap((void *)view->map, view->size);
+    }
+    if ((view->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, view->fd, 0)) == MAP_FAILED) {
+        handle_error(ERROR_CODE_MEM_ALLOCATION);
+    }
+    view->size = (size_t)st.st_size;
+}
+
+/**
+ * Attaches to a published index, read-only.
+ * @param view Receives the attachment.
+ * @param name Name of the segment.
+ */
+void shared_attach(struct shared_view * view, const char * name)
+{
+    const struct shared_header * header;
+
+    view->map = NULL;
+    if ((view->fd = shared_open(name, O_RDONLY)) < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+    shared_remap(view);
+
+    header = (const struct shared_header *)view->map;
+    if (view->size < SHARED_HEADER_SIZE || memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic)) != 0 || header->version != SHARED_VERSION) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+}
+
+void shared_detach(struct shared_view * view)
+{
+    munmap((void *)view->map, view->size);
+    close(view->fd);
+    view->map = NULL;
+}
+
+static int shared_compare(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Looks a domain up in a copy of the index, which may be changing meanwhile.
+ * @param data The copy.
+ * @param capacity Space of the copy.
+ * @param domain The domain.
+ * @param answers Receives the addresses.
+ * @return The amount of addresses, or -1 if the copy doesn't make sense.
+ */
+static int shared_probe(const unsigned char * data, uint64_t capacity, const char * domain, struct writer * answers)
+{
+    const struct shared_table * table = (const struct shared_table *)data;
+    const struct shared_slot * slots;
+    const struct shared_entry *entries, *entry;
+    const unsigned char * strings;
+    uint32_t matches[SHARED_MAX_MATCHES];
+    uint64_t slot_count = table->slot_count, entry_count = table->entry_count, strings_size = table->strings_size;
+    size_t length = strlen(domain);
+    unsigned int hash = shared_hash(domain, length), found = 0;
+
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) || entry_count > UINT32_MAX || slot_count > capacity / sizeof(struct shared_slot) || entry_count > capacity / sizeof(struct shared_entry) || sizeof(struct shared_table) + slot_count * sizeof(struct shared_slot) + entry_count * sizeof(struct shared_entry) + strings_size > capacity) {
+        return -1;
+    }
+    slots = (const struct shared_slot *)(table + 1);
+    entries = (const struct shared_entry *)(slots + slot_count);
+    strings = (const unsigned char *)(entries + entry_count);
+
+    for (uint64_t i = hash & (slot_count - 1), probes = 0; slots[i].entry != SHARED_FREE; i = (i + 1) & (slot_count - 1)) {
+        if (++probes > slot_count || slots[i].entry >= entry_count) {
+            return -1;
+        }
+        entry = &entries[slots[i].entry];
+        if (slots[i].hash != hash || entry->domain_length != length) {
+            continue;
+        }
+        if (entry->offset > strings_size || strings_size - entry->offset < (uint64_t)entry->domain_length + entry->ip_length + 2) {
+            return -1;
+        }
+        if (memcmp(strings + entry->offset, domain, length) == 0 && found < SHARED_MAX_MATCHES) {
+            matches[found++] = slots[i].entry;
+        }
+    }
+
+    /* Probe order is arbitrary, answers follow the file. */
+    qsort(matches, found, sizeof(uint32_t), shared_compare);
+    for (unsigned int i = 0; i < found; ++i) {
+        entry = &entries[matches[i]];
+        if (i) {
+            writer_char(answers, ' ');
+        }
+        writer_bytes(answers, strings + entry->offset + entry->domain_length + 1, entry->ip_length);
+    }
+
+    return (int)found;
+}
+
+/**
+ * Looks a domain up in a published index, without locking.
+ * @param view The attachment.
+ * @param domain The domain.
+ * @param answers Receives the addresses, separated by spaces, after what it
+ * already holds.
+ * @param generation Receives the generation of the index that answered; may
+ * be NULL.
+ * @return The amount of addresses.
+ */
+unsigned int shared_lookup(struct shared_view * view, const char * domain, struct writer * answers, uint64_t * generation)
+{
+    const struct shared_header * header;
+    const struct shared_half * half;
+    size_t start = answers->length;
+    uint64_t sequence, offset, capacity, current = 0;
+    int found;
+
+    while (1) {
+        header = (const struct shared_header *)view->map;
+        if (atomic_load_explicit(&header->size, memory_order_acquire) > view->size) {
+            shared_remap(view);
+            continue;
+        }
+
+        half = &header->halves[atomic_load_explicit(&header->active, memory_order_acquire) & 1];
+        sequence = atomic_load_explicit(&half->sequence, memory_order_acquire);
+        offset = half->offset;
+        capacity = half->capacity;
+
+        /* Nothing was published yet. */
+        if (sequence == 0) {
+            return 0;
+        }
+
+        found = -1;
+        answers->length = start;
+        if (!(sequence & 1) && offset >= SHARED_HEADER_SIZE && offset <= view->size && capacity <= view->size - offset && capacity >= sizeof(struct shared_table)) {
+            found = shared_probe(view->map + offset, capacity, domain, answers);
+            current = ((const struct shared_table *)(view->map + offset))->generation;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (found >= 0 && atomic_load_explicit(&half->sequence, memory_order_relaxed) == sequence) {
+            break;
+        }
+        sched_yield();
+    }
+
+    if (generation) {
+        *generation = current;
+    }
+
+    return (unsigned int)found;
+}
+
+/**
+ * Resolves a list of names against a published index, answering like
+ * lookup_batch.
+ * @param name Name of the segment.
+ * @param names One name per line.
+ * @param out Target file descriptor.
+ * @return The amount of names that were not found.
+ */
+unsigned int shared_lookup_batch(const char * name, FILE * names, int out)
+{
+    struct shared_view view;
+    struct writer w, answers;
+    size_t capacity = 0, length;
+    char *line = NULL, *domain;
+    unsigned int missing = 0;
+
+    stats_phase_begin("lookup");
+    shared_attach(&view, name);
+    writer_init(&w, out, 0);
+    writer_init(&answers, -1, 0);
+    while (getline(&line, &capacity, names) != -1) {
+        domain = line + strspn(line, " \t");
+        length = strcspn(domain, " \t\r\n");
+        if (!length) {
+            continue;
+        }
+        domain[length] = '\0';
+        writer_bytes(&w, domain, length);
+        writer_char(&w, '\t');
+        answers.length = 0;
+        if (shared_lookup(&view, domain, &answers, NULL)) {
+            writer_bytes(&w, answers.buffer, answers.length);
+        } else {
+            writer_string(&w, "NOTFOUND");
+            ++missing;
+        }
+        writer_char(&w, '\n');
+    }
+    if (writer_close(&w) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+
+    writer_close(&answers);
+    free(line);
+    shared_detach(&view);
+    stats_phase_end();
+
+    return missing;
+}
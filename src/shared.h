@@ -0,0 +1,106 @@
+/*
+ * Shared index: the daemon publishes its domain index in a POSIX shared
+ * memory segment, which any local process can attach to read-only and look
+ * domains up in without loading the hosts file itself.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SHARED_MAGIC "hfshare"
+#define SHARED_VERSION 1
+
+/* Room for the header; the tables start on the next page. */
+#define SHARED_HEADER_SIZE 4096
+
+/* Upper bound of addresses returned by a single lookup. */
+#define SHARED_MAX_MATCHES 64
+
+/*
+ * The segment holds two copies of the index, of which one is active. The
+ * publisher only ever rewrites the inactive one, then makes it active, so
+ * readers are never held up. Each copy has a sequence number which is odd
+ * while it is being written: a reader that finds it changed after reading
+ * (because it was still on a copy that got reused) simply reads again.
+ * Copies are moved around the other one when they outgrow their space; the
+ * segment only grows, as shrinking it would fault readers.
+ */
+struct shared_half {
+    _Atomic uint64_t sequence;
+    uint64_t offset;
+    uint64_t capacity;
+    uint64_t generation;
+};
+
+struct shared_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    _Atomic uint32_t active;
+    uint32_t reserved;
+    _Atomic uint64_t generation;
+    _Atomic uint64_t size;
+    struct shared_half halves[2];
+};
+
+/*
+ * A copy of the index: an open addressing table of slot_count slots, which
+ * is a power of two, over entry_count entries, followed by their strings.
+ * Entries keep the order of the hosts file.
+ */
+struct shared_table {
+    uint64_t entry_count;
+    uint64_t slot_count;
+    uint64_t strings_size;
+    uint64_t generation;
+};
+
+/* A slot of the table; free when its entry is UINT32_MAX. */
+struct shared_slot {
+    uint32_t entry;
+    uint32_t hash;
+};
+
+/* Both strings are null-terminated, the address follows the domain. */
+struct shared_entry {
+    uint64_t offset;
+    uint32_t domain_length;
+    uint16_t ip_length;
+    uint8_t kind;
+    uint8_t reserved;
+};
+
+/* The publishing side of a segment. */
+struct shared_segment {
+    int fd;
+    unsigned char * map;
+    size_t size;
+};
+
+/* A read-only attachment to a segment; to be used by one thread at a time. */
+struct shared_view {
+    int fd;
+    const unsigned char * map;
+    size_t size;
+};
+
+struct hosts_file;
+struct writer;
+
+void shared_publish_open(struct shared_segment * segment, const char * name);
+void shared_publish(struct shared_segment * segment, struct hosts_file * f);
+void shared_publish_close(struct shared_segment * segment);
+void shared_attach(struct shared_view * view, const char * name);
+unsigned int shared_lookup(struct shared_view * view, const char * domain, struct writer * answers, uint64_t * generation);
+void shared_detach(struct shared_view * view);
+unsigned int shared_lookup_batch(const char * name, FILE * names, int out);
+
+#endif
@@ -0,0 +1,780 @@
+/*
+ * Hosts files assembled from a directory of sources.
+ *
+ * Every regular file in the directory is a source, parsed like a hosts
+ * file. The state of the last synchronization is kept in a directory next to
+ * the hosts file:
+ *
+ *   - the manifest describes every source: its name, the status of its file
+ *     and a fingerprint of what it contributed;
+ *   - a list per source holds its entries, sorted by key;
+ *   - the index maps the key of every entry to a bitmap of the sources that
+ *     contribute it.
+ *
+ * A source whose file is unchanged isn't read. One that changed is parsed
+ * and compared with its previous list, so only its own entries are visited:
+ * setting or clearing its bit tells, for each of them, whether the entry
+ * appears, disappears or is now taken from another source. Removing a source
+ * is the same comparison against an empty list. The resulting edits are
+ * appended to the journal, from which they reach the hosts file like any
+ * other edit.
+ *
+ * Entries are keyed by domain and address family, like hosts_file_add, and
+ * keys are 64-bit hashes of those. When sources disagree about an entry, the
+ * one whose name sorts last wins, as is common for .d directories.
+ *
+ * The index is updated in place. It is marked dirty meanwhile, and its
+ * generation must match that of the manifest, which is replaced last; any
+ * interruption makes the next run rebuild it from the lists. Edits are
+ * journaled before any state is replaced, and replaying them is idempotent,
+ * so an interrupted run is completed by the next.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "sources.h"
+#include "fingerprint.h"
+#include "hostsfile.h"
+#include "stats.h"
+#include "writer.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Generation of an index that is being updated. */
+#define SOURCES_DIRTY UINT64_MAX
+
+/* A source as of the last synchronization; free when its name is empty. */
+struct sources_source {
+    char name[NAME_MAX + 1];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t modified_seconds;
+    int64_t modified_nanoseconds;
+    uint64_t entries;
+    uint64_t fingerprint;
+};
+
+struct sources_manifest {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+    struct sources_source sources[SOURCES_MAX];
+};
+
+/* The index file is this header followed by its slots. */
+struct sources_index_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+    uint64_t slot_count;
+    uint64_t used;
+};
+
+/* Keys are never removed; an empty bitmap means no source has the entry. */
+struct sources_slot {
+    uint64_t key;
+    uint64_t sources;
+};
+
+struct sources_index {
+    struct sources_index_header * header;
+    struct sources_slot * slots;
+    size_t map_size;
+};
+
+/* An entry of a source. The domain and address follow each other at offset. */
+struct sources_record {
+    uint64_t key;
+    uint32_t offset;
+    uint16_t domain_length;
+    uint16_t ip_length;
+};
+
+/* A list file is this header followed by the records and their text. */
+struct sources_list_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    uint64_t fingerprint;
+    uint64_t string_size;
+};
+
+/* The entries of a source, either parsed or mapped from its list file. */
+struct sources_list {
+    struct sources_record * records;
+    char * strings;
+    size_t count;
+    size_t capacity;
+    size_t string_size;
+    size_t string_capacity;
+    uint64_t fingerprint;
+    void * map;
+    size_t map_size;
+};
+
+struct sources_state {
+    char directory[PATH_MAX];
+    struct sources_manifest manifest;
+    struct sources_list current[SOURCES_MAX];
+    uint64_t loaded;
+    struct sources_index index;
+    struct journal_batch batch;
+};
+
+static void sources_path(char * path, const char * directory, const char * name)
+{
+    if (snprintf(path, PATH_MAX, "%s/%s", directory, name) >= PATH_MAX) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+}
+
+static void sources_list_path(char * path, const struct sources_state * state, unsigned int source)
+{
+    char name[8];
+
+    snprintf(name, sizeof(name), "%u", source);
+    sources_path(path, state->directory, name);
+}
+
+static uint64_t sources_key(const char * domain, size_t length, enum ip_kind kind)
+{
+    struct fingerprint fp;
+    unsigned char family = (unsigned char)kind;
+    uint64_t key;
+
+    fingerprint_init(&fp);
+    fingerprint_update(&fp, domain, length);
+    fingerprint_update(&fp, &family, 1);
+    key = fingerprint_final(&fp);
+
+    /* Zero marks free slots. */
+    return key ? key : 1;
+}
+
+static void sources_describe(struct sources_source * source, const struct stat * st)
+{
+    source->device = (uint64_t)st->st_dev;
+    source->inode = (uint64_t)st->st_ino;
+    source->size = (uint64_t)st->st_size;
+#ifdef __APPLE__
+    source->modified_seconds = (int64_t)st->st_mtimespec.tv_sec;
+    source->modified_nanoseconds = (int64_t)st->st_mtimespec.tv_nsec;
+#else
+    source->modified_seconds = (int64_t)st->st_mtim.tv_sec;
+    source->modified_nanoseconds = (int64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Writes a state file in up to three parts. The file is renamed into place,
+ * so it is either replaced entirely or not at all.
+ * @param path The file.
+ */
+static void sources_store(const char * path, const void * a, size_t a_length, const void * b, size_t b_length, const void * c, size_t c_length)
+{
+    char temporary[PATH_MAX + 16];
+    struct writer w;
+    int fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    if ((fd = mkstemp(temporary)) < 0) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+    }
+
+    writer_init(&w, fd, 0);
+    writer_bytes(&w, a, a_length);
+    writer_bytes(&w, b, b_length);
+    writer_bytes(&w, c, c_length);
+    if (writer_close(&w) != 0 || fchmod(fd, 0644) != 0 || rename(temporary, path) != 0) {
+        unlink(temporary);
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    close(fd);
+}
+
+static int sources_collect(void * context, const struct hosts_file_token * token, unsigned long long line)
+{
+    struct sources_list * list = context;
+    struct sources_record * record;
+    char address[INET6_ADDRSTRLEN + 8];
+    enum ip_kind kind;
+
+    (void)line;
+    if (token->ip_length >= sizeof(address) || token->domain_length > 0xffff) {
+        return 0;
+    }
+    memcpy(address, token->ip, token->ip_length);
+    address[token->ip_length] = '\0';
+    if ((kind = ip_address_kind(address)) == IP_KIND_NONE) {
+        return 0;
+    }
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->records = hf_realloc(list->records, list->capacity * sizeof(struct sources_record));
+    }
+    if (list->string_size + token->domain_length + token->ip_length > list->string_capacity) {
+        list->string_capacity = list->string_capacity ? list->string_capacity * 2 : 1 << 16;
+        list->string_capacity += token->domain_length + token->ip_length;
+        list->strings = hf_realloc(list->strings, list->string_capacity);
+    }
+
+    record = &list->records[list->count++];
+    record->key = sources_key(token->domain, token->domain_length, kind);
+    record->offset = (uint32_t)list->string_size;
+    record->domain_length = (uint16_t)token->domain_length;
+    record->ip_length = (uint16_t)token->ip_length;
+    memcpy(list->strings + list->string_size, token->domain, token->domain_length);
+    memcpy(list->strings + list->string_size + token->domain_length, token->ip, token->ip_length);
+    list->string_size += token->domain_length + token->ip_length;
+
+    return 0;
+}
+
+/* Orders by key, then by position in the file. */
+static int sources_compare(const void * a, const void * b)
+{
+    const struct sources_record *x = a, *y = b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * Parses a source into a sorted list. Of the entries sharing a key, the last
+ * one is kept, as when adding them to a hosts file one after the other.
+ * @param list Receives the entries.
+ * @param path Path of the source.
+ */
+static void sources_parse(struct sources_list * list, char * path)
+{
+    struct fingerprint fp;
+    size_t kept = 0;
+
+    memset(list, 0, sizeof(*list));
+    hosts_file_visit(path, sources_collect, list);
+    if (list->string_size > UINT32_MAX) {
+        handle_error(ERROR_CODE_INVALID_FILE);
+    }
+    qsort(list->records, list->count, sizeof(struct sources_record), sources_compare);
+
+    fingerprint_init(&fp);
+    for (size_t i = 0; i < list->count; ++i) {
+        if (i + 1 < list->count && list->records[i + 1].key == list->records[i].key) {
+            continue;
+        }
+        list->records[kept] = list->records[i];
+        fingerprint_update(&fp, &list->records[kept].key, sizeof(uint64_t));
+        fingerprint_update(&fp, list->strings + list->records[kept].offset, list->records[kept].domain_length + list->records[kept].ip_length);
+        ++kept;
+    }
+    list->count = kept;
+    list->fingerprint = fingerprint_final(&fp);
+}
+
+static void sources_list_free(struct sources_list * list)
+{
+    if (list->map) {
+        munmap(list->map, list->map_size);
+    } else {
+        free(list->records);
+        free(list->strings);
+    }
+    memset(list, 0, sizeof(*list));
+}
+
+/**
+ * Maps the list of a source as of the last synchronization, on first use.
+ * A missing or damaged list is empty.
+ * @param state The state.
+ * @param source The source.
+ * @return The list.
+ */
+static struct sources_list * sources_current(struct sources_state * state, unsigned int source)
+{
+    struct sources_list * list = &state->current[source];
+    struct sources_list_header * header;
+    char path[PATH_MAX];
+    struct stat st;
+    void * map;
+    int fd;
+
+    if (state->loaded & 1ull << source) {
+        return list;
+    }
+    state->loaded |= 1ull << source;
+    memset(list, 0, sizeof(*list));
+
+    sources_list_path(path, state, source);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return list;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct sources_list_header) || (map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return list;
+    }
+    close(fd);
+
+    header = map;
+    if (memcmp(header->magic, "HFSL", 4) != 0 || header->version != SOURCES_VERSION || header->count > ((size_t)st.st_size - sizeof(*header)) / sizeof(struct sources_record) || sizeof(*header) + header->count * sizeof(struct sources_record) + header->string_size != (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return list;
+    }
+
+    list->map = map;
+    list->map_size = (size_t)st.st_size;
+    list->records = (struct sources_record *)(header + 1);
+    list->strings = (char *)(list->records + header->count);
+    list->count = header->count;
+    list->string_size = header->string_size;
+    list->fingerprint = header->fingerprint;
+    stats.bytes_read += list->map_size;
+
+    return list;
+}
+
+static const struct sources_record * sources_list_find(const struct sources_list * list, uint64_t key)
+{
+    size_t low = 0, high = list->count, middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (list->records[middle].key < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low < list->count && list->records[low].key == key ? &list->records[low] : NULL;
+}
+
+static void sources_list_store(const struct sources_state * state, unsigned int source, const struct sources_list * list)
+{
+    struct sources_list_header header = { 0 };
+    char path[PATH_MAX];
+
+    memcpy(header.magic, "HFSL", 4);
+    header.version = SOURCES_VERSION;
+    header.count = list->count;
+    header.fingerprint = list->fingerprint;
+    header.string_size = list->string_size;
+    sources_list_path(path, state, source);
+    sources_store(path, &header, sizeof(header), list->records, list->count * sizeof(struct sources_record), list->strings, list->string_size);
+    stats.bytes_written += sizeof(header) + list->count * sizeof(struct sources_record) + list->string_size;
+}
+
+static void sources_manifest_load(struct sources_state * state)
+{
+    struct sources_manifest * manifest = &state->manifest;
+    char path[PATH_MAX];
+    int fd;
+
+    sources_path(path, state->directory, "manifest");
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        if (read(fd, manifest, sizeof(*manifest)) == sizeof(*manifest) && memcmp(manifest->magic, "HFSM", 4) == 0 && manifest->version == SOURCES_VERSION) {
+            stats.bytes_read += sizeof(*manifest);
+            close(fd);
+            return;
+        }
+        close(fd);
+    }
+
+    memset(manifest, 0, sizeof(*manifest));
+    memcpy(manifest->magic, "HFSM", 4);
+    manifest->version = SOURCES_VERSION;
+}
+
+static void sources_manifest_store(const struct sources_state * state)
+{
+    char path[PATH_MAX];
+
+    sources_path(path, state->directory, "manifest");
+    sources_store(path, &state->manifest, sizeof(state->manifest), NULL, 0, NULL, 0);
+}
+
+static void sources_index_close(struct sources_index * index)
+{
+    if (index->header) {
+        munmap(index->header, index->map_size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+/**
+ * Maps the index for reading and writing.
+ * @param state The state.
+ * @return Zero if the index is present and matches the manifest.
+ */
+static int sources_index_open(struct sources_state * state)
+{
+    struct sources_index * index = &state->index;
+    struct sources_index_header * header;
+    char path[PATH_MAX];
+    struct stat st;
+    void * map;
+    int fd;
+
+    sources_path(path, state->directory, "index");
+    if ((fd = open(path, O_RDWR)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct sources_index_header) || (map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    header = map;
+    index->header = header;
+    index->slots = (struct sources_slot *)(header + 1);
+    index->map_size = (size_t)st.st_size;
+    if (memcmp(header->magic, "HFSI", 4) != 0 || header->version != SOURCES_VERSION || header->generation != state->manifest.generation || header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0 || sizeof(*header) + header->slot_count * sizeof(struct sources_slot) != index->map_size) {
+        sources_index_close(index);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the slot of a key, claiming a free one if it isn't indexed yet.
+ * @param header The index.
+ * @param slots Its slots.
+ * @param key The key.
+ * @return The slot.
+ */
+static struct sources_slot * sources_index_slot(struct sources_index_header * header, struct sources_slot * slots, uint64_t key)
+{
+    uint64_t mask = header->slot_count - 1, i;
+
+    for (i = key & mask; slots[i].key != 0 && slots[i].key != key; i = (i + 1) & mask) {
+    }
+    if (slots[i].key == 0) {
+        slots[i].key = key;
+        ++header->used;
+    }
+
+    return &slots[i];
+}
+
+/**
+ * Builds the index anew from the lists, sized for the entries to come.
+ * @param state The state.
+ * @param incoming The amount of entries that may be added.
+ */
+static void sources_index_rebuild(struct sources_state * state, size_t incoming)
+{
+    struct sources_index_header header = { 0 };
+    struct sources_slot * slots;
+    struct sources_list * list;
+    char path[PATH_MAX];
+    size_t entries = incoming;
+
+    stats_phase_begin("index");
+    for (unsigned int s = 0; s < SOURCES_MAX; ++s) {
+        if (state->manifest.sources[s].name[0]) {
+            entries += sources_current(state, s)->count;
+        }
+    }
+
+    memcpy(header.magic, "HFSI", 4);
+    header.version = SOURCES_VERSION;
+    header.generation = state->manifest.generation;
+    for (header.slot_count = 1024; header.slot_count < entries * 2; header.slot_count *= 2) {
+    }
+    slots = hf_calloc(header.slot_count, sizeof(struct sources_slot));
+
+    for (unsigned int s = 0; s < SOURCES_MAX; ++s) {
+        if (!state->manifest.sources[s].name[0]) {
+            continue;
+        }
+        list = sources_current(state, s);
+        for (size_t i = 0; i < list->count; ++i) {
+            sources_index_slot(&header, slots, list->records[i].key)->sources |= 1ull << s;
+        }
+    }
+
+    sources_index_close(&state->index);
+    sources_path(path, state->directory, "index");
+    sources_store(path, &header, sizeof(header), slots, header.slot_count * sizeof(struct sources_slot), NULL, 0);
+    stats.bytes_written += sizeof(header) + header.slot_count * sizeof(struct sources_slot);
+    free(slots);
+    if (sources_index_open(state) != 0) {
+        handle_error(ERROR_CODE_WRITE_FAILED);
+    }
+    stats_phase_end();
+}
+
+/* Of the sources in a bitmap, the one whose name sorts last. */
+static unsigned int sources_winner(const struct sources_state * state, uint64_t sources)
+{
+    unsigned int winner = SOURCES_MAX, s;
+
+    for (; sources; sources &= sources - 1) {
+        s = (unsigned int)__builtin_ctzll(sources);
+        if (winner == SOURCES_MAX || strcmp(state->manifest.sources[s].name, state->manifest.sources[winner].name) > 0) {
+            winner = s;
+        }
+    }
+
+    return winner;
+}
+
+static void sources_emit(struct sources_state * state, enum journal_operation operation, const struct sources_list * list, const struct sources_record * record)
+{
+    const char * text = list->strings + record->offset;
+
+    journal_batch_add(&state->batch, operation, text, record->domain_length, text + record->domain_length, record->ip_length);
+}
+
+/**
+ * Replaces the entries of a source, journaling the resulting edits. Only the
+ * entries of the old and new lists are visited.
+ * @param state The state.
+ * @param source The source.
+ * @param fresh Its new entries, which the state takes over.
+ */
+static void sources_apply(struct sources_state * state, unsigned int source, struct sources_list * fresh)
+{
+    struct sources_list * old = sources_current(state, source);
+    const struct sources_record *o, *n, *w;
+    struct sources_slot * slot;
+    uint64_t bit = 1ull << source, before;
+    unsigned int winner;
+    size_t i = 0, j = 0;
+
+    while (i < old->count || j < fresh->count) {
+        o = i < old->count ? &old->records[i] : NULL;
+        n = j < fresh->count ? &fresh->records[j] : NULL;
+        if (o && n && o->key == n->key) {
+            ++i;
+            ++j;
+            if (o->domain_length == n->domain_length && o->ip_length == n->ip_length && memcmp(old->strings + o->offset, fresh->strings + n->offset, o->domain_length + o->ip_length) == 0) {
+                continue;
+            }
+        } else if (o && (!n || o->key < n->key)) {
+            n = NULL;
+            ++i;
+        } else {
+            o = NULL;
+            ++j;
+        }
+
+        slot = sources_index_slot(state->index.header, state->index.slots, n ? n->key : o->key);
+        before = slot->sources;
+        slot->sources = n ? before | bit : before & ~bit;
+
+        if (!slot->sources) {
+            sources_emit(state, JOURNAL_REMOVE, old, o);
+        } else if ((winner = sources_winner(state, slot->sources)) == source) {
+            sources_emit(state, JOURNAL_ADD, fresh, n);
+        } else if ((before & bit) && sources_winner(state, before) == source) {
+            /* The entry falls back to the next source in line. */
+            if ((w = sources_list_find(sources_current(state, winner), slot->key))) {
+                sources_emit(state, JOURNAL_ADD, &state->current[winner], w);
+            }
+        }
+    }
+
+    sources_list_free(old);
+    *old = *fresh;
+    memset(fresh, 0, sizeof(*fresh));
+}
+
+static int sources_compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Lists the sources in a directory: its regular files, except hidden ones.
+ * @param directory The directory.
+ * @param count Receives the amount of sources.
+ * @return Their names, sorted.
+ */
+static char ** sources_scan(const char * directory, size_t * count)
+{
+    char path[PATH_MAX];
+    char ** names = NULL;
+    size_t capacity = 0;
+    struct dirent * entry;
+    struct stat st;
+    DIR * dir;
+
+    if (!(dir = opendir(directory))) {
+        handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+    }
+
+    *count = 0;
+    while ((entry = readdir(dir))) {
+        sources_path(path, directory, entry->d_name);
+        if (entry->d_name[0] == '.' || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            names = hf_realloc(names, capacity * sizeof(char *));
+        }
+        names[(*count)++] = hf_strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, *count, sizeof(char *), sources_compare_names);
+    return names;
+}
+
+/**
+ * Brings the entries of a hosts file in line with a directory of sources.
+ * Sources that didn't change since the last run aren't read; for the others,
+ * the entries they added, changed or dropped are appended to the journal of
+ * the hosts file. The caller must hold the lock of the hosts file.
+ * @param hosts_path Path of the hosts file.
+ * @param directory The directory of sources.
+ * @param sync Whether to wait for the edits to reach the disk.
+ * @param appended Receives the status of the journal if edits were appended.
+ * @return The amount of edits appended.
+ */
+unsigned long long sources_sync(const char * hosts_path, const char * directory, enum journal_sync sync, struct stat * appended)
+{
+    struct sources_state * state = hf_calloc(1, sizeof(struct sources_state));
+    struct sources_list * fresh = hf_calloc(SOURCES_MAX, sizeof(struct sources_list));
+    struct sources_source *source, seen;
+    uint64_t changed = 0, removed = 0, present = 0, added = 0;
+    unsigned long long edits;
+    size_t count, incoming = 0;
+    char path[PATH_MAX];
+    char ** names;
+    int touched = 0;
+    unsigned int s;
+    struct stat st;
+
+    stats_phase_begin("sources");
+    if (snprintf(state->directory, PATH_MAX, "%s" SOURCES_STATE_SUFFIX, hosts_path) >= PATH_MAX) {
+        handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+    }
+    if (mkdir(state->directory, 0755) != 0 && errno != EEXIST) {
+        handle_error(errno == EACCES || errno == EPERM ? ERROR_CODE_FORBIDDEN : ERROR_CODE_WRITE_FAILED);
+    }
+    sources_manifest_load(state);
+    names = sources_scan(directory, &count);
+
+    /* Match the files with the sources known, parsing those that changed. */
+    for (size_t i = 0; i < count; ++i) {
+        for (s = 0; s < SOURCES_MAX && strcmp(state->manifest.sources[s].name, names[i]) != 0; ++s) {
+        }
+        if (s == SOURCES_MAX) {
+            for (s = 0; s < SOURCES_MAX && state->manifest.sources[s].name[0]; ++s) {
+            }
+            if (s == SOURCES_MAX) {
+                fprintf(stderr, PROGRAM_NAME ": At most %d sources are supported.\n", SOURCES_MAX);
+                handle_error(ERROR_CODE_INVALID_ARGUMENTS);
+            }
+            memset(&state->manifest.sources[s], 0, sizeof(struct sources_source));
+            strcpy(state->manifest.sources[s].name, names[i]);
+            state->loaded |= 1ull << s;
+            added |= 1ull << s;
+        }
+        present |= 1ull << s;
+        source = &state->manifest.sources[s];
+
+        sources_path(path, directory, names[i]);
+        if (stat(path, &st) != 0) {
+            handle_error(errno == EACCES ? ERROR_CODE_FORBIDDEN : ERROR_CODE_FILE_NOT_FOUND);
+        }
+        seen = *source;
+        sources_describe(&seen, &st);
+        if (!(added & 1ull << s) && memcmp(&seen, source, sizeof(seen)) == 0) {
+            continue;
+        }
+
+        sources_parse(&fresh[s], path);
+        *source = seen;
+        touched = 1;
+        if (!(added & 1ull << s) && fresh[s].fingerprint == source->fingerprint && fresh[s].count == source->entries) {
+            sources_list_free(&fresh[s]);
+            continue;
+        }
+        changed |= 1ull << s;
+        incoming += fresh[s].count;
+    }
+    for (s = 0; s < SOURCES_MAX; ++s) {
+        if (state->manifest.sources[s].name[0] && !(present & 1ull << s)) {
+            removed |= 1ull << s;
+        }
+    }
+    changed |= removed;
+
+    if (!changed) {
+        if (touched) {
+            sources_manifest_store(state);
+        }
+        edits = 0;
+    } else {
+        if (sources_index_open(state) != 0 || (state->index.header->used + incoming) * 4 > state->index.header->slot_count * 3) {
+            sources_index_rebuild(state, incoming);
+        }
+
+        /* Any interruption from here on makes the next run rebuild the index. */
+        state->index.header->generation = SOURCES_DIRTY;
+        for (s = 0; s < SOURCES_MAX; ++s) {
+            if (changed & 1ull << s) {
+                sources_apply(state, s, &fresh[s]);
+            }
+        }
+        edits = state->batch.records;
+        if (edits) {
+            journal_append_batch(hosts_path, &state->batch, sync, appended);
+        }
+
+        stats_phase_begin("state");
+        for (s = 0; s < SOURCES_MAX; ++s) {
+            source = &state->manifest.sources[s];
+            if (removed & 1ull << s) {
+                sources_list_path(path, state, s);
+                unlink(path);
+                memset(source, 0, sizeof(*source));
+            } else if (changed & 1ull << s) {
+                sources_list_store(state, s, &state->current[s]);
+                source->entries = state->current[s].count;
+                source->fingerprint = state->current[s].fingerprint;
+            }
+        }
+        state->index.header->generation = ++state->manifest.generation;
+        if (msync(state->index.header, state->index.map_size, MS_SYNC) != 0) {
+            handle_error(ERROR_CODE_WRITE_FAILED);
+        }
+        sources_manifest_store(state);
+        stats_phase_end();
+    }
+    stats_phase_end();
+
+    for (s = 0; s < SOURCES_MAX; ++s) {
+        sources_list_free(&state->current[s]);
+        sources_list_free(&fresh[s]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        free(names[i]);
+    }
+    free(names);
+    free(state->batch.data);
+    sources_index_close(&state->index);
+    free(fresh);
+    free(state);
+
+    return edits;
+}
@@ -0,0 +1,25 @@
+/*
+ * Hosts files assembled from a directory of sources, tracking which sources
+ * contributed each entry so a change to one source is applied on its own.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef SOURCES_H
+#define SOURCES_H
+
+#include "journal.h"
+
+/* Appended to the path of a hosts file to name the directory of its state. */
+#define SOURCES_STATE_SUFFIX ".hf-sources"
+#define SOURCES_VERSION 1
+
+/* Provenance is a bitmap per entry, which bounds the amount of sources. */
+#define SOURCES_MAX 64
+
+struct stat;
+
+unsigned long long sources_sync(const char * hosts_path, const char * directory, enum journal_sync sync, struct stat * appended);
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * Instrumentation of a single hf invocation, reported by --stats.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "stats.h"
+#include "hostsfile.h"
+#include "writer.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+struct stats stats;
+
+unsigned long long stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Opens a new phase, nested in the one that is currently running.
+ * @param name Static string identifying the phase.
+ */
+void stats_phase_begin(const char * name)
+{
+    struct stats_phase * phase;
+    int index = -1;
+
+    if (stats.phase_count < STATS_MAX_PHASES && stats.depth < STATS_MAX_DEPTH) {
+        index = (int)stats.phase_count++;
+        phase = &stats.phases[index];
+        phase->name = name;
+        phase->depth = stats.depth;
+        phase->entries = stats.entries_parsed + stats.entries_touched;
+        perf_read(phase->counters);
+        phase->start_ns = stats_now();
+    }
+
+    /* Dropped phases still take a level, so begin and end stay balanced. */
+    if (stats.depth < STATS_MAX_DEPTH) {
+        stats.open[stats.depth] = index;
+    }
+    ++stats.depth;
+}
+
+/**
+ * Closes the innermost running phase.
+ */
+void stats_phase_end(void)
+{
+    unsigned long long now = stats_now(), counters[PERF_COUNTERS];
+    struct stats_phase * phase;
+
+    if (stats.depth == 0) {
+        return;
+    }
+
+    if (--stats.depth >= STATS_MAX_DEPTH || stats.open[stats.depth] < 0) {
+        return;
+    }
+
+    phase = &stats.phases[stats.open[stats.depth]];
+    phase->duration_ns = now - phase->start_ns;
+    phase->entries = stats.entries_parsed + stats.entries_touched - phase->entries;
+    perf_read(counters);
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        phase->counters[i] = counters[i] == PERF_UNAVAILABLE ? PERF_UNAVAILABLE : counters[i] - phase->counters[i];
+    }
+}
+
+/**
+ * Records that an operation was requested, in command line order.
+ * @param name Static string identifying the operation.
+ */
+void stats_operation(const char * name)
+{
+    if (stats.operation_count < STATS_MAX_OPERATIONS) {
+        stats.operations[stats.operation_count++] = name;
+    }
+}
+
+/**
+ * Peak resident set size in bytes; getrusage reports kilobytes on Linux
+ * but bytes on macOS.
+ */
+static unsigned long long stats_peak_rss(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+
+#ifdef __APPLE__
+    return (unsigned long long)usage.ru_maxrss;
+#else
+    return (unsigned long long)usage.ru_maxrss * 1024;
+#endif
+}
+
+/**
+ * Writes the hardware counters of a phase as a human readable suffix. Misses
+ * are related to the entries of the phase itself, if it had any.
+ * @param file Target stream.
+ * @param phase A phase that has ended.
+ */
+static void stats_report_counters_text(FILE * file, struct stats_phase * phase)
+{
+    unsigned long long * c = phase->counters;
+
+    if (c[PERF_CYCLES] != PERF_UNAVAILABLE && c[PERF_INSTRUCTIONS] != PERF_UNAVAILABLE && c[PERF_CYCLES]) {
+        fprintf(file, "  ipc %5.2f", (double)c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+    }
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        if (c[i] == PERF_UNAVAILABLE) {
+            fprintf(file, "  %s n/a", perf_counter_names[i]);
+        } else if (i >= PERF_BRANCH_MISSES && phase->entries) {
+            fprintf(file, "  %s %llu (%.3f/entry)", perf_counter_names[i], c[i], (double)c[i] / phase->entries);
+        } else {
+            fprintf(file, "  %s %llu", perf_counter_names[i], c[i]);
+        }
+    }
+}
+
+static void stats_report_counters_json(FILE * file, struct stats_phase * phase)
+{
+    unsigned long long * c = phase->counters;
+
+    fprintf(file, ",\"counters\":{");
+    for (int i = 0; i < PERF_COUNTERS; ++i) {
+        if (c[i] == PERF_UNAVAILABLE) {
+            fprintf(file, "%s\"%s\":null", i ? "," : "", perf_counter_names[i]);
+        } else {
+            fprintf(file, "%s\"%s\":%llu", i ? "," : "", perf_counter_names[i], c[i]);
+        }
+    }
+    if (c[PERF_CYCLES] != PERF_UNAVAILABLE && c[PERF_INSTRUCTIONS] != PERF_UNAVAILABLE && c[PERF_CYCLES]) {
+        fprintf(file, ",\"ipc\":%.3f", (double)c[PERF_INSTRUCTIONS] / c[PERF_CYCLES]);
+    }
+    fprintf(file, "}");
+}
+
+/**
+ * Writes all counters and phases to a stream.
+ * @param file Target stream, usually stderr.
+ * @param format Either human readable text or a single line of JSON.
+ */
+void stats_report(FILE * file, enum stats_format format)
+{
+    unsigned long long allocs = atomic_load(&hf_alloc_stats.count);
+    unsigned long long alloc_bytes = atomic_load(&hf_alloc_stats.bytes);
+    double probes = stats.index_lookups ? (double)stats.index_probes / stats.index_lookups : 0;
+
+    while (stats.depth) {
+        stats_phase_end();
+    }
+
+    switch (format) {
+        case STATS_FORMAT_NONE:
+            break;
+
+        case STATS_FORMAT_TEXT:
+            fprintf(file, isatty(fileno(file)) ? BOLD("STATS\n") : "STATS\n");
+            for (unsigned int i = 0; i < stats.phase_count; ++i) {
+                fprintf(file, "\t%*s%-*s%12.3f ms", 2 * stats.phases[i].depth, "", 16 - 2 * stats.phases[i].depth,
+                    stats.phases[i].name, stats.phases[i].duration_ns / 1e6);
+                if (perf_enabled) {
+                    stats_report_counters_text(file, &stats.phases[i]);
+                }
+                fprintf(file, "\n");
+            }
+            fprintf(file, "\t%-16s%12llu\n", "bytes read", stats.bytes_read);
+            fprintf(file, "\t%-16s%12llu\n", "bytes written", stats.bytes_written);
+            fprintf(file, "\t%-16s%12llu\n", "entries parsed", stats.entries_parsed);
+            fprintf(file, "\t%-16s%12llu\n", "entries touched", stats.entries_touched);
+            fprintf(file, "\t%-16s%12llu\n", "allocations", allocs);
+            fprintf(file, "\t%-16s%12llu\n", "allocated bytes", alloc_bytes);
+            fprintf(file, "\t%-16s%12llu\n", "index lookups", stats.index_lookups);
+            fprintf(file, "\t%-16s%12.2f\n", "probes/lookup", probes);
+            fprintf(file, "\t%-16s%12llu\n", "longest probe", stats.index_max_probe);
+            fprintf(file, "\t%-16s%12llu\n", "index rebuilds", stats.index_rebuilds);
+            fprintf(file, "\t%-16s%12llu\n", "peak rss", stats_peak_rss());
+            break;
+
+        case STATS_FORMAT_JSON:
+            fprintf(file, "{\"phases\":[");
+            for (unsigned int i = 0; i < stats.phase_count; ++i) {
+                fprintf(file, "%s{\"name\":\"%s\",\"depth\":%u,\"ns\":%llu", i ? "," : "",
+                    stats.phases[i].name, stats.phases[i].depth, stats.phases[i].duration_ns);
+                if (perf_enabled) {
+                    stats_report_counters_json(file, &stats.phases[i]);
+                }
+                fprintf(file, "}");
+            }
+            fprintf(file, "],\"bytes_read\":%llu,\"bytes_written\":%llu,\"entries_parsed\":%llu,\"entries_touched\":%llu,"
+                          "\"allocations\":%llu,\"allocated_bytes\":%llu,"
+                          "\"index\":{\"lookups\":%llu,\"probes\":%llu,\"max_probe\":%llu,\"rebuilds\":%llu},"
+                          "\"peak_rss_bytes\":%llu}\n",
+                stats.bytes_read, stats.bytes_written, stats.entries_parsed, stats.entries_touched, allocs, alloc_bytes,
+                stats.index_lookups, stats.index_probes, stats.index_max_probe, stats.index_rebuilds, stats_peak_rss());
+            break;
+
+        default:
+            handle_error(ERROR_CODE_NON_EXHAUSTIVE_CASE);
+    }
+}
+
+/**
+ * Appends a single NDJSON record describing this invocation to a log. The
+ * record is built in one buffer and handed over in a single write(2), so
+ * concurrent invocations appending to the same log don't interleave.
+ * @param path The log, created if it doesn't exist yet.
+ * @param hosts_file Path of the hosts file that was operated on.
+ * @param lines Amount of lines in the hosts file afterwards, or NULL when they
+ * aren't known, as after journaled edits; both fields are left out then.
+ * @param fingerprint Fingerprint of the hosts file contents afterwards.
+ * @return Zero on success.
+ */
+int stats_log_json(const char * path, const char * hosts_file, const unsigned int * lines, uint64_t fingerprint)
+{
+    char hostname[HOST_NAME_MAX + 1] = "";
+    struct writer w;
+    int fd;
+
+    while (stats.depth) {
+        stats_phase_end();
+    }
+
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+        return -1;
+    }
+
+    gethostname(hostname, sizeof(hostname) - 1);
+    writer_init(&w, fd, 0);
+    writer_string(&w, "{\"time\":");
+    writer_unsigned(&w, (unsigned long long)time(NULL));
+    writer_string(&w, ",\"host\":");
+    writer_json_string(&w, hostname);
+    writer_string(&w, ",\"pid\":");
+    writer_unsigned(&w, (unsigned long long)getpid());
+    writer_string(&w, ",\"file\":");
+    writer_json_string(&w, hosts_file);
+    writer_string(&w, ",\"operations\":[");
+    for (unsigned int i = 0; i < stats.operation_count; ++i) {
+        if (i) {
+            writer_char(&w, ',');
+        }
+        writer_json_string(&w, stats.operations[i]);
+    }
+    writer_char(&w, ']');
+    if (lines) {
+        writer_string(&w, ",\"lines\":");
+        writer_unsigned(&w, *lines);
+    }
+    writer_string(&w, ",\"entries_touched\":");
+    writer_unsigned(&w, stats.entries_touched);
+    writer_string(&w, ",\"bytes_read\":");
+    writer_unsigned(&w, stats.bytes_read);
+    writer_string(&w, ",\"bytes_written\":");
+    writer_unsigned(&w, stats.bytes_written);
+    writer_string(&w, stats.write_skipped ? ",\"write_skipped\":true" : ",\"write_skipped\":false");
+    if (lines) {
+        writer_string(&w, ",\"fingerprint\":\"");
+        writer_hex64(&w, fingerprint);
+        writer_char(&w, '"');
+    }
+    writer_string(&w, ",\"duration_ns\":");
+    writer_unsigned(&w, stats_now() - stats.start_ns);
+    writer_string(&w, ",\"phases\":[");
+    for (unsigned int i = 0; i < stats.phase_count; ++i) {
+        writer_string(&w, i ? ",{\"name\":" : "{\"name\":");
+        writer_json_string(&w, stats.phases[i].name);
+        writer_string(&w, ",\"depth\":");
+        writer_unsigned(&w, stats.phases[i].depth);
+        writer_string(&w, ",\"ns\":");
+        writer_unsigned(&w, stats.phases[i].duration_ns);
+        writer_char(&w, '}');
+    }
+    writer_string(&w, "]}\n");
+
+    if (writer_close(&w) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return close(fd);
+}
@@ -0,0 +1,72 @@
+/*
+ * Instrumentation of a single hf invocation, reported by --stats.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "perf.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Upper bound of recorded phases; later phases are silently dropped. */
+#define STATS_MAX_PHASES 64
+#define STATS_MAX_DEPTH 8
+#define STATS_MAX_OPERATIONS 32
+
+/* How the report is rendered. */
+enum stats_format {
+    STATS_FORMAT_NONE,
+    STATS_FORMAT_TEXT,
+    STATS_FORMAT_JSON,
+};
+
+/*
+ * A named, timed region of the program. Phases nest, a parent's figures
+ * include those of its children. Counters and entries hold the snapshot at
+ * the start while the phase runs, and the difference once it has ended.
+ * Entries are those parsed or touched by the phase.
+ */
+struct stats_phase {
+    const char * name;
+    unsigned int depth;
+    unsigned long long start_ns;
+    unsigned long long duration_ns;
+    unsigned long long counters[PERF_COUNTERS];
+    unsigned long long entries;
+};
+
+/* Counters are updated unconditionally; they are cheap and rarely touched. */
+struct stats {
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long entries_parsed;
+    unsigned long long index_lookups;
+    unsigned long long index_probes;
+    unsigned long long index_max_probe;
+    unsigned long long index_rebuilds;
+    unsigned long long entries_touched;
+    int write_skipped;
+    unsigned long long start_ns;
+    const char * operations[STATS_MAX_OPERATIONS];
+    unsigned int operation_count;
+    struct stats_phase phases[STATS_MAX_PHASES];
+    unsigned int phase_count;
+    int open[STATS_MAX_DEPTH];
+    unsigned int depth;
+};
+
+extern struct stats stats;
+
+unsigned long long stats_now(void);
+void stats_phase_begin(const char * name);
+void stats_phase_end(void);
+void stats_operation(const char * name);
+void stats_report(FILE * file, enum stats_format format);
+int stats_log_json(const char * path, const char * hosts_file, const unsigned int * lines, uint64_t fingerprint);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Buffered output with hand-rolled formatting, used instead of stdio where
+ * output volume matters.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#include "writer.h"
+#include "hostsfile.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Prepares a writer.
+ * @param w The writer.
+ * @param fd Target file descriptor, or -1 to collect the output in memory.
+ * @param capacity Initial buffer size.
+ */
+void writer_init(struct writer * w, int fd, size_t capacity)
+{
+    w->fd = fd;
+    w->capacity = capacity ? capacity : WRITER_BUFFER_SIZE;
+    w->buffer = hf_malloc(w->capacity);
+    w->length = 0;
+    w->flushed = 0;
+    w->failed = 0;
+}
+
+/**
+ * Hands the buffer to the kernel, retrying on short writes.
+ * @param w The writer.
+ * @return Zero on success. Failures are sticky.
+ */
+int writer_flush(struct writer * w)
+{
+    const char * cursor = w->buffer;
+    ssize_t written;
+
+    if (w->fd < 0) {
+        return w->failed;
+    }
+
+    while (w->length && !w->failed) {
+        if ((written = write(w->fd, cursor, w->length)) < 0) {
+            if (errno != EINTR) {
+                w->failed = 1;
+            }
+            continue;
+        }
+        cursor += written;
+        w->length -= written;
+        w->flushed += written;
+    }
+
+    w->length = 0;
+    return w->failed;
+}
+
+/**
+ * Makes room for a given amount of bytes.
+ * @param w The writer.
+ * @param length The amount of bytes that will be appended.
+ */
+static void writer_reserve(struct writer * w, size_t length)
+{
+    if (w->length + length <= w->capacity) {
+        return;
+    }
+
+    if (w->fd >= 0) {
+        writer_flush(w);
+        if (length <= w->capacity) {
+            return;
+        }
+    }
+
+    while (w->length + length > w->capacity) {
+        w->capacity *= 2;
+    }
+    w->buffer = hf_realloc(w->buffer, w->capacity);
+}
+
+void writer_bytes(struct writer * w, const void * data, size_t length)
+{
+    writer_reserve(w, length);
+    memcpy(w->buffer + w->length, data, length);
+    w->length += length;
+}
+
+void writer_string(struct writer * w, const char * string)
+{
+    writer_bytes(w, string, strlen(string));
+}
+
+void writer_char(struct writer * w, char c)
+{
+    writer_reserve(w, 1);
+    w->buffer[w->length++] = c;
+}
+
+void writer_repeat(struct writer * w, char c, size_t count)
+{
+    writer_reserve(w, count);
+    memset(w->buffer + w->length, c, count);
+    w->length += count;
+}
+
+void writer_unsigned(struct writer * w, unsigned long long value)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    writer_reserve(w, n);
+    while (n) {
+        w->buffer[w->length++] = digits[--n];
+    }
+}
+
+void writer_hex64(struct writer * w, uint64_t value)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    writer_reserve(w, 16);
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        w->buffer[w->length++] = hex[(value >> shift) & 0xf];
+    }
+}
+
+/**
+ * Writes bytes as a quoted JSON string. Runs of characters that need no
+ * escaping are copied in one go.
+ * @param w The writer.
+ * @param string The bytes, assumed to be UTF-8.
+ * @param length Amount of bytes.
+ */
+void writer_json_bytes(struct writer * w, const char * string, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char * run = string, *end = string + length;
+    unsigned char c;
+
+    writer_char(w, '"');
+    for (;; ++string) {
+        c = string < end ? (unsigned char)*string : '\0';
+        if (string < end && c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        writer_bytes(w, run, string - run);
+        run = string + 1;
+        if (string == end) {
+            break;
+        } else if (c == '"' || c == '\\') {
+            writer_char(w, '\\');
+            writer_char(w, (char)c);
+        } else if (c == '\n') {
+            writer_bytes(w, "\\n", 2);
+        } else if (c == '\t') {
+            writer_bytes(w, "\\t", 2);
+        } else if (c == '\r') {
+            writer_bytes(w, "\\r", 2);
+        } else {
+            writer_bytes(w, "\\u00", 4);
+            writer_char(w, hex[c >> 4]);
+            writer_char(w, hex[c & 0xf]);
+        }
+    }
+    writer_char(w, '"');
+}
+
+/**
+ * Writes a string as a quoted JSON string.
+ * @param w The writer.
+ * @param string Null-terminated string, assumed to be UTF-8.
+ */
+void writer_json_string(struct writer * w, const char * string)
+{
+    writer_json_bytes(w, string, strlen(string));
+}
+
+/**
+ * Writes a CSV field as described by RFC 4180: quoted only when it contains
+ * a separator, quote or line break, with quotes doubled.
+ * @param w The writer.
+ * @param string Null-terminated field.
+ */
+void writer_csv_string(struct writer * w, const char * string)
+{
+    const char * quote;
+
+    if (string[strcspn(string, ",\"\r\n")] == '\0') {
+        writer_string(w, string);
+        return;
+    }
+
+    writer_char(w, '"');
+    while ((quote = strchr(string, '"'))) {
+        writer_bytes(w, string, quote - string + 1);
+        writer_char(w, '"');
+        string = quote + 1;
+    }
+    writer_string(w, string);
+    writer_char(w, '"');
+}
+
+void writer_u32le(struct writer * w, uint32_t value)
+{
+    writer_reserve(w, 4);
+    for (int i = 0; i < 4; ++i) {
+        w->buffer[w->length++] = (char)(value >> (8 * i));
+    }
+}
+
+/**
+ * Flushes and releases the buffer. Memory backed writers must take their
+ * buffer before closing.
+ * @param w The writer.
+ * @return Zero if all output was written.
+ */
+int writer_close(struct writer * w)
+{
+    int failed = writer_flush(w);
+
+    free(w->buffer);
+    w->buffer = NULL;
+    w->length = 0;
+    w->capacity = 0;
+
+    return failed;
+}
@@ -0,0 +1,46 @@
+/*
+ * Buffered output with hand-rolled formatting, used instead of stdio where
+ * output volume matters.
+ *
+ * Copyright (C) 2022 Jens Pots.
+ * License: AGPL-3.0-only.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default buffer size of file backed writers. */
+#define WRITER_BUFFER_SIZE (1 << 16)
+
+/*
+ * Writes into a buffer which is handed to write(2) whenever it fills up.
+ * A writer without file descriptor keeps everything in memory instead, the
+ * buffer then holds the complete output once done.
+ */
+struct writer {
+    int fd;
+    char * buffer;
+    size_t length;
+    size_t capacity;
+    unsigned long long flushed;
+    int failed;
+};
+
+void writer_init(struct writer * w, int fd, size_t capacity);
+void writer_bytes(struct writer * w, const void * data, size_t length);
+void writer_string(struct writer * w, const char * string);
+void writer_char(struct writer * w, char c);
+void writer_repeat(struct writer * w, char c, size_t count);
+void writer_unsigned(struct writer * w, unsigned long long value);
+void writer_hex64(struct writer * w, uint64_t value);
+void writer_json_bytes(struct writer * w, const char * string, size_t length);
+void writer_json_string(struct writer * w, const char * string);
+void writer_csv_string(struct writer * w, const char * string);
+void writer_u32le(struct writer * w, uint32_t value);
+int writer_flush(struct writer * w);
+int writer_close(struct writer * w);
+
+#endif